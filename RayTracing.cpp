@@ -3,6 +3,7 @@
 
 #include "argsparser.h"
 #include "camera.h"
+#include "image_writer.h"
 #include "material.h"
 #include "msg_queue.h"
 #include "perf_timer.h"
@@ -15,6 +16,7 @@
 #include "vector_cuda.h"
 
 #include <assert.h>
+#include <random>
 #include <stdint.h>
 #include <stdio.h>
 #include <thread>
@@ -77,11 +79,28 @@ int main( int argc, char** argv )
         filename = args.getCmdOption( "-f" );
     }
 
+    image_format_t format = imageFormatFromFilename( filename.c_str() );
+    if ( format == IMAGE_FORMAT_UNKNOWN ) {
+        printf( "Error: unknown image format [%s]; use .ppm or .pfm\n", filename.c_str() );
+        return -1;
+    }
+
     if ( args.cmdOptionExists( "-i" ) ) {
         ispc = true;
         cuda = false;
     }
 
+    // PFM is the linear per-pixel means, which only the CPU and wavefront renderers accumulate
+    if ( format == IMAGE_FORMAT_PFM && ( cuda || ispc ) ) {
+        printf( "Error: the %s renderer can't write .pfm; use .ppm\n", cuda ? "CUDA" : "ISPC" );
+        return -1;
+    }
+
+    bvh_builder_t builder = BVH_BUILDER_SAH;
+    if ( args.cmdOptionExists( "-l" ) ) {
+        builder = BVH_BUILDER_LBVH;
+    }
+
     int maxBounce = MAX_RAY_DEPTH;
     if ( args.cmdOptionExists( "-m" ) ) {
         const std::string& arg = args.getCmdOption( "-m" );
@@ -93,6 +112,14 @@ int main( int argc, char** argv )
         recursive = true;
     }
 
+    // Unbuffered (direct) image output, written once the render is done instead of streamed tile by tile
+    uint32_t writeFlags = 0;
+    bool     streaming  = true;
+    if ( args.cmdOptionExists( "-u" ) ) {
+        writeFlags |= IMAGE_WRITE_DIRECT;
+        streaming = false;
+    }
+
     int numThreads = std::thread::hardware_concurrency() - 1;
     if ( args.cmdOptionExists( "-t" ) ) {
         const std::string& arg = args.getCmdOption( "-t" );
@@ -105,6 +132,121 @@ int main( int argc, char** argv )
         preferredDevice        = std::stoi( arg );
     }
 
+    // Without -s every run draws a different seed; it's logged so the render can be reproduced
+    uint32_t seed = std::random_device()();
+    if ( args.cmdOptionExists( "-s" ) ) {
+        const std::string& arg = args.getCmdOption( "-s" );
+        seed                   = (uint32_t)std::stoul( arg );
+    }
+
+    thread_pool_mode_t poolMode = THREAD_POOL_SHARED_QUEUE;
+    if ( args.cmdOptionExists( "-w" ) ) {
+        poolMode = THREAD_POOL_WORK_STEALING;
+    }
+
+    tone_map_t toneMap = TONE_MAP_GAMMA;
+    if ( args.cmdOptionExists( "--tone-map" ) ) {
+        const std::string& arg = args.getCmdOption( "--tone-map" );
+        if ( !toneMapFromName( arg.c_str(), &toneMap ) ) {
+            printf( "Error: unknown tone map [%s]; use gamma or aces\n", arg.c_str() );
+            return -1;
+        }
+        if ( cuda || ispc ) {
+            printf( "WARN: --tone-map only applies to the CPU renderer\n" );
+        }
+    }
+
+    // Progressive rendering: -a becomes the target spp, reached a pass at a time unless the time budget runs out first
+    uint32_t timeBudgetMs = 0;
+    uint32_t passSamples  = 0;
+    if ( args.cmdOptionExists( "--time-budget" ) ) {
+        const std::string& arg = args.getCmdOption( "--time-budget" );
+        timeBudgetMs           = (uint32_t)std::stoul( arg );
+        passSamples            = 1;
+    }
+    if ( args.cmdOptionExists( "--pass-samples" ) ) {
+        const std::string& arg = args.getCmdOption( "--pass-samples" );
+        passSamples            = (uint32_t)std::stoul( arg );
+    }
+
+    // Adaptive sampling: after the first pass, only pixels whose 95% confidence interval is wider than this
+    // fraction of their mean luminance get more samples, up to -a
+    float adaptiveThreshold = 0.0f;
+    if ( args.cmdOptionExists( "--adaptive" ) ) {
+        const std::string& arg = args.getCmdOption( "--adaptive" );
+        adaptiveThreshold      = std::stof( arg );
+        if ( !args.cmdOptionExists( "--pass-samples" ) ) {
+            passSamples = 4;
+        }
+    }
+
+    if ( ( timeBudgetMs || passSamples || adaptiveThreshold > 0.0f ) && ( cuda || ispc ) ) {
+        printf( "WARN: --time-budget, --pass-samples and --adaptive only apply to the CPU renderer\n" );
+    }
+
+    // Russian roulette: after this many bounces, paths continue with probability set by their throughput
+    uint32_t rouletteDepth = 0;
+    if ( args.cmdOptionExists( "--roulette" ) ) {
+        const std::string& arg = args.getCmdOption( "--roulette" );
+        rouletteDepth          = (uint32_t)std::stoul( arg );
+    }
+
+    // Wavefront CPU renderer: rays are traced a bounce at a time in queues instead of a path at a time
+    bool wavefront = false;
+    if ( args.cmdOptionExists( "--wavefront" ) ) {
+        wavefront = true;
+        if ( cuda || ispc ) {
+            printf( "WARN: --wavefront only applies to the CPU renderer\n" );
+        }
+        if ( recursive || timeBudgetMs || passSamples || adaptiveThreshold > 0.0f ) {
+            printf( "WARN: the wavefront renderer ignores -r, --time-budget, --pass-samples and --adaptive\n" );
+        }
+    }
+
+    // Wavefront only: bin secondary rays by direction octant and origin before intersecting them
+    bool sortRays = false;
+    if ( args.cmdOptionExists( "--sort-rays" ) ) {
+        sortRays = true;
+        if ( !wavefront ) {
+            printf( "WARN: --sort-rays only applies to the wavefront renderer\n" );
+        }
+    }
+
+    // ISPC only: trace the gang's camera rays together as a packet
+    bool packets = false;
+    if ( args.cmdOptionExists( "--packets" ) ) {
+        packets = true;
+        if ( !ispc ) {
+            printf( "WARN: --packets only applies to the ISPC renderer\n" );
+        }
+    }
+
+    // ISPC only: render each block's scanlines as ISPC tasks on the thread pool
+    bool ispcTasks = false;
+    if ( args.cmdOptionExists( "--ispc-tasks" ) ) {
+        ispcTasks = true;
+        if ( !ispc ) {
+            printf( "WARN: --ispc-tasks only applies to the ISPC renderer\n" );
+        }
+    }
+
+    // Trace the BVH with hand-written SSE4.2/AVX2/AVX-512 kernels; auto picks the widest the host supports
+    simd_isa_t simdIsa = SIMD_ISA_NONE;
+    if ( args.cmdOptionExists( "--simd" ) ) {
+        const std::string& arg = args.getCmdOption( "--simd" );
+        if ( !simdIsaFromName( arg.c_str(), &simdIsa ) ) {
+            printf( "Error: unknown SIMD ISA [%s]; use auto, sse4, avx2 or avx512\n", arg.c_str() );
+            return -1;
+        }
+        if ( simdIsa > simdDetectIsa() ) {
+            printf( "WARN: this host doesn't support %s; using %s\n", simdIsaName( simdIsa ), simdIsaName( simdDetectIsa() ) );
+            simdIsa = simdDetectIsa();
+        }
+        if ( cuda || ispc || wavefront ) {
+            printf( "WARN: --simd only applies to the CPU renderer\n" );
+        }
+    }
+
     bool enableValidation = false;
     if ( args.cmdOptionExists( "-v" ) ) {
         enableValidation = true;
@@ -113,6 +255,8 @@ int main( int argc, char** argv )
     //
     // Define the scene and camera
     //
+    printf( "Seed %u\n", seed );
+    randomSeed( seed, 0, 0 );
     Scene* scene = _randomScene();
 
     vector3 origin( 13, 2, 3 );
@@ -129,7 +273,7 @@ int main( int argc, char** argv )
 
     //
     // Allocate frame buffer
-    // TODO: floating point instead of 8-bit RGB
+    // The CPU renderer accumulates samples in float and resolves them into this 8-bit RGB buffer
     //
     uint32_t* frameBuffer = nullptr;
     if ( cuda ) {
@@ -138,45 +282,66 @@ int main( int argc, char** argv )
         frameBuffer = new uint32_t[ ROWS * COLS ];
     }
 
-    //
-    // Open file to save image
-    //
-    FILE*   file = nullptr;
-    errno_t err  = fopen_s( &file, filename.c_str(), "w" );
-    if ( !file || err != 0 ) {
-        printf( "Error: failed to open [%s] for writing errno %d.\n", filename.c_str(), err );
-        return -1;
+    // PFM is written from the float samples, so they have to outlive the render
+    accumulation_buffer_t* accumulation = nullptr;
+    if ( format == IMAGE_FORMAT_PFM ) {
+        accumulation = accumulationBufferCreate( COLS, ROWS, adaptiveThreshold > 0.0f ? ACCUMULATION_VARIANCE : 0 );
     }
 
+    // Open the output up front, so a bad path fails before the render rather than after it
+    tile_writer_t* tileWriter = nullptr;
+    if ( streaming ) {
+        tileWriter = tileWriterCreate( filename.c_str(), format, frameBuffer, COLS, ROWS, accumulation );
+        if ( !tileWriter ) {
+            printf( "Error: failed to create [%s]\n", filename.c_str() );
+            return -1;
+        }
+    }
+
+    render_options_t options;
+    options.num_aa_samples    = aaSamples;
+    options.max_ray_depth     = maxBounce;
+    options.numThreads        = numThreads;
+    options.blockSize         = blockSize;
+    options.debug             = debug;
+    options.recursive         = recursive;
+    options.builder           = builder;
+    options.seed              = seed;
+    options.poolMode          = poolMode;
+    options.tileWriter        = tileWriter;
+    options.accumulation      = accumulation;
+    options.toneMap           = toneMap;
+    options.timeBudgetMs      = timeBudgetMs;
+    options.passSamples       = passSamples;
+    options.adaptiveThreshold = adaptiveThreshold;
+    options.rouletteDepth     = rouletteDepth;
+    options.simdIsa           = simdIsa;
+    options.sortRays          = sortRays;
+    options.packets           = packets;
+    options.tasks             = ispcTasks;
+
     if ( cuda ) {
-        renderSceneCUDA( *scene, camera, ROWS, COLS, frameBuffer, aaSamples, maxBounce, numThreads, blockSize, debug, recursive );
+        renderSceneCUDA( *scene, camera, ROWS, COLS, frameBuffer, options );
     } else if ( ispc ) {
-        renderSceneISPC( *scene, camera, ROWS, COLS, frameBuffer, aaSamples, maxBounce, numThreads, blockSize, debug, recursive );
+        renderSceneISPC( *scene, camera, ROWS, COLS, frameBuffer, options );
+    } else if ( wavefront ) {
+        renderSceneWavefront( *scene, camera, ROWS, COLS, frameBuffer, options );
     } else {
-        renderScene( *scene, camera, ROWS, COLS, frameBuffer, aaSamples, maxBounce, numThreads, blockSize, debug, recursive );
+        renderScene( *scene, camera, ROWS, COLS, frameBuffer, options );
     }
 
     //
-    // Save image
+    // Save image; when streaming, only the tiles still in flight are left to write
     //
-    fprintf( file, "P3\n" );
-    fprintf( file, "%d %d\n", COLS, ROWS );
-    fprintf( file, "255\n" );
-
-    for ( uint32_t y = 0; y < ROWS; y++ ) {
-        for ( uint32_t x = 0; x < COLS; x++ ) {
-            uint32_t rgb = frameBuffer[ y * COLS + x ];
-            uint8_t  _r  = ( uint8_t )( ( rgb & 0xFF000000 ) >> 24 );
-            uint8_t  _g  = ( uint8_t )( ( rgb & 0x00FF0000 ) >> 16 );
-            uint8_t  _b  = ( uint8_t )( ( rgb & 0x0000FF00 ) >> 8 );
-
-            fprintf( file, "%d %d %d\n", _r, _g, _b );
-        }
+    PerfTimer writeTimer;
+    result    writeResult = streaming ? tileWriterDestroy( tileWriter ) : imageWrite( filename.c_str(), format, frameBuffer, COLS, ROWS, writeFlags, accumulation );
+    if ( writeResult != R_OK ) {
+        printf( "Error: failed to write [%s]\n", filename.c_str() );
+    } else {
+        printf( "Wrote %s (%s) in %f ms\n", filename.c_str(), imageFormatName( format ), writeTimer.ElapsedNanoseconds() / 1000000.0 );
     }
 
-    fflush( file );
-    fclose( file );
-
+    accumulationBufferDestroy( accumulation );
     delete scene;
 
     if ( cuda ) {
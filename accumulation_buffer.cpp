@@ -0,0 +1,246 @@
+#include "accumulation_buffer.h"
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define ACCUMULATION_SSE2
+#include <emmintrin.h>
+#endif
+
+
+namespace pk
+{
+
+//
+// Private types and data
+//
+
+// ACES filmic curve, Krzysztof Narkowicz's fit: x * ( a * x + b ) / ( x * ( c * x + d ) + e )
+static const float ACES_A = 2.51f;
+static const float ACES_B = 0.03f;
+static const float ACES_C = 2.43f;
+static const float ACES_D = 0.59f;
+static const float ACES_E = 0.14f;
+
+// Floor for the mean in the relative error, so near-black pixels aren't sampled forever chasing noise nobody can see
+static const float ERROR_MIN_LUMINANCE = 0.05f;
+
+// The original renderer quantized with 255.99 * color in double precision; keep it so images don't shift
+static const double QUANTIZE_SCALE = 255.99;
+
+
+static void _resolveRow( const float* src, uint32_t* dst, uint32_t count, tone_map_t toneMap );
+
+
+//
+// Public
+//
+
+accumulation_buffer_t* accumulationBufferCreate( uint32_t cols, uint32_t rows, uint32_t flags )
+{
+    if ( cols == 0 || rows == 0 )
+        return nullptr;
+
+    accumulation_buffer_t* buffer = new accumulation_buffer_t;
+    buffer->pixels                = new float[ (size_t)cols * rows * 4 ]();
+    buffer->luminanceSquares      = ( flags & ACCUMULATION_VARIANCE ) ? new float[ (size_t)cols * rows ]() : nullptr;
+    buffer->cols                  = cols;
+    buffer->rows                  = rows;
+
+    return buffer;
+}
+
+
+void accumulationBufferDestroy( accumulation_buffer_t* buffer )
+{
+    if ( !buffer )
+        return;
+
+    delete[] buffer->pixels;
+    delete[] buffer->luminanceSquares;
+    delete buffer;
+}
+
+
+void accumulationBufferClear( accumulation_buffer_t* buffer )
+{
+    assert( buffer );
+
+    memset( buffer->pixels, 0, (size_t)buffer->cols * buffer->rows * 4 * sizeof( float ) );
+    if ( buffer->luminanceSquares ) {
+        memset( buffer->luminanceSquares, 0, (size_t)buffer->cols * buffer->rows * sizeof( float ) );
+    }
+}
+
+
+result accumulationBufferMerge( accumulation_buffer_t* dst, const accumulation_buffer_t* src )
+{
+    if ( !dst || !src || dst->cols != src->cols || dst->rows != src->rows )
+        return R_INVALID_ARG;
+
+    // Sums and counts add alike, so this is a straight element-wise add
+    size_t count = (size_t)dst->cols * dst->rows * 4;
+    for ( size_t i = 0; i < count; i++ ) {
+        dst->pixels[ i ] += src->pixels[ i ];
+    }
+
+    if ( dst->luminanceSquares && src->luminanceSquares ) {
+        for ( size_t i = 0; i < (size_t)dst->cols * dst->rows; i++ ) {
+            dst->luminanceSquares[ i ] += src->luminanceSquares[ i ];
+        }
+    }
+
+    return R_OK;
+}
+
+
+float accumulationBufferRelativeError( const accumulation_buffer_t* buffer, uint32_t x, uint32_t y )
+{
+    assert( buffer );
+
+    size_t       i = (size_t)y * buffer->cols + x;
+    const float* p = &buffer->pixels[ i * 4 ];
+    float        n = p[ 3 ];
+    if ( !buffer->luminanceSquares || n < 2.0f )
+        return FLT_MAX;
+
+    // Unbiased sample variance from the running sums; clamp the rounding error that can push it below zero
+    float mean     = luminance( p[ 0 ], p[ 1 ], p[ 2 ] ) / n;
+    float variance = ( buffer->luminanceSquares[ i ] - n * mean * mean ) / ( n - 1.0f );
+    variance       = variance > 0.0f ? variance : 0.0f;
+
+    return 1.96f * sqrtf( variance / n ) / ( mean > ERROR_MIN_LUMINANCE ? mean : ERROR_MIN_LUMINANCE );
+}
+
+
+void accumulationBufferResolve( const accumulation_buffer_t* buffer, uint32_t* framebuffer, tone_map_t toneMap, uint32_t x, uint32_t y, uint32_t width, uint32_t height )
+{
+    assert( buffer );
+    assert( framebuffer );
+
+    if ( x >= buffer->cols || y >= buffer->rows )
+        return;
+
+    width  = x + width > buffer->cols ? buffer->cols - x : width;
+    height = y + height > buffer->rows ? buffer->rows - y : height;
+
+    for ( uint32_t row = y; row < y + height; row++ ) {
+        size_t offset = (size_t)row * buffer->cols + x;
+        _resolveRow( &buffer->pixels[ offset * 4 ], &framebuffer[ offset ], width, toneMap );
+    }
+}
+
+
+bool toneMapFromName( const char* name, tone_map_t* p_toneMap )
+{
+    assert( p_toneMap );
+
+    if ( !name )
+        return false;
+
+    if ( strcmp( name, "gamma" ) == 0 ) {
+        *p_toneMap = TONE_MAP_GAMMA;
+        return true;
+    }
+    if ( strcmp( name, "aces" ) == 0 ) {
+        *p_toneMap = TONE_MAP_ACES;
+        return true;
+    }
+
+    return false;
+}
+
+
+const char* toneMapName( tone_map_t toneMap )
+{
+    switch ( toneMap ) {
+        case TONE_MAP_GAMMA:
+            return "gamma";
+        case TONE_MAP_ACES:
+            return "aces";
+        default:
+            return "unknown";
+    }
+}
+
+
+//
+// Private implementation
+//
+
+#ifdef ACCUMULATION_SSE2
+
+// One RGBA pixel per vector: scale by 1 / count, tone map, clamp, gamma, and quantize r, g, b to 0xRRGGBB00
+static void _resolveRow( const float* src, uint32_t* dst, uint32_t count, tone_map_t toneMap )
+{
+    const __m128  zero     = _mm_setzero_ps();
+    const __m128  one      = _mm_set1_ps( 1.0f );
+    const __m128  rgbMask  = _mm_castsi128_ps( _mm_set_epi32( 0, -1, -1, -1 ) );
+    const __m128d quantize = _mm_set1_pd( QUANTIZE_SCALE );
+
+    for ( uint32_t i = 0; i < count; i++ ) {
+        __m128 p = _mm_loadu_ps( &src[ i * 4 ] );
+        __m128 n = _mm_shuffle_ps( p, p, _MM_SHUFFLE( 3, 3, 3, 3 ) );
+
+        // Multiply by the reciprocal like vector3::operator/=; pixels with no samples (0 * inf) are masked to black
+        __m128 c = _mm_mul_ps( p, _mm_div_ps( one, n ) );
+        c        = _mm_and_ps( c, _mm_and_ps( rgbMask, _mm_cmpgt_ps( n, zero ) ) );
+
+        if ( toneMap == TONE_MAP_ACES ) {
+            __m128 num = _mm_mul_ps( c, _mm_add_ps( _mm_mul_ps( c, _mm_set1_ps( ACES_A ) ), _mm_set1_ps( ACES_B ) ) );
+            __m128 den = _mm_add_ps( _mm_mul_ps( c, _mm_add_ps( _mm_mul_ps( c, _mm_set1_ps( ACES_C ) ), _mm_set1_ps( ACES_D ) ) ), _mm_set1_ps( ACES_E ) );
+            c          = _mm_div_ps( num, den );
+        }
+
+        c = _mm_sqrt_ps( _mm_min_ps( _mm_max_ps( c, zero ), one ) );
+
+        // r, g in the low pair and b, 0 in the high pair, widened to double for the quantize
+        __m128i lo = _mm_cvttpd_epi32( _mm_mul_pd( _mm_cvtps_pd( c ), quantize ) );
+        __m128i hi = _mm_cvttpd_epi32( _mm_mul_pd( _mm_cvtps_pd( _mm_movehl_ps( c, c ) ), quantize ) );
+        __m128i v  = _mm_unpacklo_epi64( lo, hi );
+
+        // Narrow to bytes r, g, b, 0 in memory order, then swap to the framebuffer's 0xRRGGBB00
+        v            = _mm_packs_epi32( v, v );
+        v            = _mm_packus_epi16( v, v );
+        uint32_t rgb = (uint32_t)_mm_cvtsi128_si32( v );
+        dst[ i ]     = ( rgb << 24 ) | ( ( rgb & 0x0000FF00 ) << 8 ) | ( ( rgb & 0x00FF0000 ) >> 8 );
+    }
+}
+
+#else
+
+static float _toneMap( float c, tone_map_t toneMap )
+{
+    if ( toneMap == TONE_MAP_ACES ) {
+        c = ( c * ( ACES_A * c + ACES_B ) ) / ( c * ( ACES_C * c + ACES_D ) + ACES_E );
+    }
+
+    c = c < 0.0f ? 0.0f : ( c > 1.0f ? 1.0f : c );
+
+    return sqrtf( c );
+}
+
+
+static void _resolveRow( const float* src, uint32_t* dst, uint32_t count, tone_map_t toneMap )
+{
+    for ( uint32_t i = 0; i < count; i++ ) {
+        const float* p = &src[ i * 4 ];
+        if ( p[ 3 ] <= 0.0f ) {
+            dst[ i ] = 0;
+            continue;
+        }
+
+        float    k   = 1.0f / p[ 3 ];
+        uint8_t  _r  = ( uint8_t )( QUANTIZE_SCALE * _toneMap( p[ 0 ] * k, toneMap ) );
+        uint8_t  _g  = ( uint8_t )( QUANTIZE_SCALE * _toneMap( p[ 1 ] * k, toneMap ) );
+        uint8_t  _b  = ( uint8_t )( QUANTIZE_SCALE * _toneMap( p[ 2 ] * k, toneMap ) );
+        dst[ i ]     = ( (uint32_t)_r << 24 ) | ( (uint32_t)_g << 16 ) | ( (uint32_t)_b << 8 );
+    }
+}
+
+#endif
+
+} // namespace pk
@@ -0,0 +1,87 @@
+#pragma once
+
+//
+// Floating point accumulation buffer.
+//
+// Each pixel is RGBA32F: the running sums of r, g and b over every sample taken so far, and the sample count in a.
+// Samples can be added a pass at a time, and two buffers rendered separately can be merged, without losing
+// precision to the 8-bit framebuffer. Resolving divides by the count, tone maps, and quantizes a region into
+// the 0xRRGGBB00 framebuffer; it's SSE2-vectorized, one pixel per vector.
+//
+// With ACCUMULATION_VARIANCE each pixel also sums its samples' squared luminance, which gives a running variance and
+// so a confidence interval for the pixel's mean. Adaptive sampling uses it to stop sampling pixels that have converged.
+//
+
+#include "result.h"
+
+#include <stdint.h>
+
+namespace pk
+{
+
+typedef enum {
+    TONE_MAP_GAMMA = 0, // clamp and gamma 2.0 (sqrt); the renderer's original output
+    TONE_MAP_ACES  = 1, // ACES filmic curve (Narkowicz fit), then gamma 2.0
+} tone_map_t;
+
+
+#define ACCUMULATION_VARIANCE 0x1
+
+
+typedef struct _accumulation_buffer {
+    float*   pixels;           // cols * rows * 4 floats: r, g, b sums and the sample count
+    float*   luminanceSquares; // cols * rows sums of squared sample luminance; only with ACCUMULATION_VARIANCE
+    uint32_t cols;
+    uint32_t rows;
+} accumulation_buffer_t;
+
+
+inline float luminance( float r, float g, float b )
+{
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+}
+
+
+accumulation_buffer_t* accumulationBufferCreate( uint32_t cols, uint32_t rows, uint32_t flags = 0 );
+void                   accumulationBufferDestroy( accumulation_buffer_t* buffer );
+void                   accumulationBufferClear( accumulation_buffer_t* buffer );
+
+// Add sampleCount samples whose colors sum to (r, g, b) and whose squared luminances sum to luminanceSquares.
+// Pixels belong to one tile, so no two threads add to the same pixel.
+inline void accumulationBufferAdd( accumulation_buffer_t* buffer, uint32_t x, uint32_t y, float r, float g, float b, uint32_t sampleCount, float luminanceSquares = 0.0f )
+{
+    size_t i = (size_t)y * buffer->cols + x;
+    float* p = &buffer->pixels[ i * 4 ];
+    p[ 0 ] += r;
+    p[ 1 ] += g;
+    p[ 2 ] += b;
+    p[ 3 ] += (float)sampleCount;
+
+    if ( buffer->luminanceSquares ) {
+        buffer->luminanceSquares[ i ] += luminanceSquares;
+    }
+}
+
+
+inline uint32_t accumulationBufferSampleCount( const accumulation_buffer_t* buffer, uint32_t x, uint32_t y )
+{
+    return (uint32_t)buffer->pixels[ ( (size_t)y * buffer->cols + x ) * 4 + 3 ];
+}
+
+// Half-width of the pixel's 95% confidence interval over its mean luminance. Needs ACCUMULATION_VARIANCE
+// and at least two samples; returns FLT_MAX otherwise.
+float accumulationBufferRelativeError( const accumulation_buffer_t* buffer, uint32_t x, uint32_t y );
+
+// dst += src; both buffers must be the same size
+result accumulationBufferMerge( accumulation_buffer_t* dst, const accumulation_buffer_t* src );
+
+// Resolve a region (clipped to the image) into framebuffer, which is cols * rows. Pixels without samples resolve to black.
+void accumulationBufferResolve( const accumulation_buffer_t* buffer, uint32_t* framebuffer, tone_map_t toneMap, uint32_t x, uint32_t y, uint32_t width, uint32_t height );
+
+// --tone-map argument: "gamma" or "aces"; returns false if unrecognized
+bool        toneMapFromName( const char* name, tone_map_t* p_toneMap );
+const char* toneMapName( tone_map_t toneMap );
+
+void benchmarkAccumulationResolve();
+
+} // namespace pk
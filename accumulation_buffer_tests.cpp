@@ -0,0 +1,95 @@
+#include "accumulation_buffer.h"
+#include "perf_timer.h"
+#include "utils.h"
+#include "vector_cuda.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+namespace pk
+{
+
+//
+// Benchmark the resolve pass against the renderer's original per-pixel average, gamma and quantize.
+// The gamma resolve must reproduce the original framebuffer exactly.
+//
+
+static const uint32_t BENCHMARK_ROUNDS = 10;
+
+
+// What _renderJob did before the accumulation buffer
+static uint32_t _legacyResolve( const float* p )
+{
+    vector3 color( p[ 0 ], p[ 1 ], p[ 2 ] );
+    color /= p[ 3 ];
+    color = vector3( sqrt( color.r() ), sqrt( color.g() ), sqrt( color.b() ) );
+
+    uint8_t _r = ( uint8_t )( 255.99 * color.x );
+    uint8_t _g = ( uint8_t )( 255.99 * color.y );
+    uint8_t _b = ( uint8_t )( 255.99 * color.z );
+
+    return ( (uint32_t)_r << 24 ) | ( (uint32_t)_g << 16 ) | ( (uint32_t)_b << 8 );
+}
+
+
+void benchmarkAccumulationResolve()
+{
+    const uint32_t sizes[][ 2 ] = { { 2000, 1000 }, { 3840, 2160 } };
+
+    printf( "%-13s %12s %12s %12s %10s\n", "size", "legacy ms", "gamma ms", "aces ms", "mismatch" );
+
+    for ( int s = 0; s < ARRAY_SIZE( sizes ); s++ ) {
+        uint32_t               cols        = sizes[ s ][ 0 ];
+        uint32_t               rows        = sizes[ s ][ 1 ];
+        accumulation_buffer_t* buffer      = accumulationBufferCreate( cols, rows );
+        uint32_t*              legacy      = new uint32_t[ cols * rows ];
+        uint32_t*              framebuffer = new uint32_t[ cols * rows ];
+
+        // Sample sums in [0, count], like colors in [0, 1] summed over 1..64 samples
+        randomSeed( 1, 0, 0 );
+        for ( uint32_t i = 0; i < cols * rows; i++ ) {
+            float samples = float( 1 + ( i * 2654435761u >> 26 ) );
+            accumulationBufferAdd( buffer, i % cols, i / cols, random() * samples, random() * samples, random() * samples, (uint32_t)samples );
+        }
+
+        PerfTimer legacyTimer;
+        for ( uint32_t r = 0; r < BENCHMARK_ROUNDS; r++ ) {
+            for ( uint32_t i = 0; i < cols * rows; i++ ) {
+                legacy[ i ] = _legacyResolve( &buffer->pixels[ i * 4 ] );
+            }
+        }
+        double legacyMs = legacyTimer.ElapsedNanoseconds() / 1000000.0 / BENCHMARK_ROUNDS;
+
+        PerfTimer acesTimer;
+        for ( uint32_t r = 0; r < BENCHMARK_ROUNDS; r++ ) {
+            accumulationBufferResolve( buffer, framebuffer, TONE_MAP_ACES, 0, 0, cols, rows );
+        }
+        double acesMs = acesTimer.ElapsedNanoseconds() / 1000000.0 / BENCHMARK_ROUNDS;
+
+        PerfTimer gammaTimer;
+        for ( uint32_t r = 0; r < BENCHMARK_ROUNDS; r++ ) {
+            accumulationBufferResolve( buffer, framebuffer, TONE_MAP_GAMMA, 0, 0, cols, rows );
+        }
+        double gammaMs = gammaTimer.ElapsedNanoseconds() / 1000000.0 / BENCHMARK_ROUNDS;
+
+        uint32_t mismatches = 0;
+        for ( uint32_t i = 0; i < cols * rows; i++ ) {
+            if ( legacy[ i ] != framebuffer[ i ] ) {
+                mismatches++;
+            }
+        }
+
+        printf( "%5u x %-5u %12.2f %12.2f %12.2f %10u\n", cols, rows, legacyMs, gammaMs, acesMs, mismatches );
+        assert( mismatches == 0 );
+
+        delete[] framebuffer;
+        delete[] legacy;
+        accumulationBufferDestroy( buffer );
+    }
+}
+
+
+} // namespace pk
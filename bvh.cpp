@@ -0,0 +1,840 @@
+#include "bvh.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace pk
+{
+
+static const uint32_t BVH_NUM_BINS       = 16;
+static const uint32_t BVH_MAX_LEAF_SIZE  = 4;
+static const uint32_t BVH_BALANCED_DEPTH = BVH_MAX_DEPTH - 32; // below this, split at the median so any 32-bit count fits
+static const float    BVH_TRAVERSAL_COST = 1.0f;
+static const float    BVH_INTERSECT_COST = 1.0f;
+
+static const uint32_t LBVH_MORTON_BITS  = 21; // per axis; 63-bit codes
+static const uint32_t LBVH_MIN_JOB_SIZE  = 4096;
+
+
+typedef struct _bvh_prim {
+    aabb_t   bounds;
+    float    centroid[ 3 ];
+    uint32_t index;
+} bvh_prim_t;
+
+
+typedef struct _bvh_bin {
+    aabb_t   bounds;
+    uint32_t count;
+} bvh_bin_t;
+
+
+typedef struct _bvh_range {
+    uint32_t first;
+    uint32_t count;
+} bvh_range_t;
+
+
+typedef struct _lbvh_key {
+    uint64_t code;
+    uint32_t index;
+
+    bool operator<( const _lbvh_key& rhs ) const { return code < rhs.code; }
+} lbvh_key_t;
+
+
+typedef struct _lbvh_build {
+    const bvh_prim_t* prims;
+    lbvh_key_t*       keys;
+    lbvh_key_t*       scratch;
+    bvh_node_t*       nodes;
+    aabb_t            centroidBounds;
+    uint32_t          numPrims;
+    uint32_t          spawnDepth;
+} lbvh_build_t;
+
+
+// One job: a chunk to encode and sort, a pair of runs to merge, or a subtree to emit
+typedef struct _lbvh_job {
+    lbvh_build_t* build;
+    uint32_t      first;
+    uint32_t      count;
+    uint32_t      mid;
+    uint32_t      nodeIndex;
+    uint32_t      depth;
+    uint32_t      maxDepth;
+} lbvh_job_t;
+
+
+static uint32_t _buildRecursive( std::vector<bvh_node_t>& nodes, bvh_prim_t* prims, uint32_t first, uint32_t count, uint32_t depth, uint32_t* maxDepth );
+static uint32_t _lbvhBuild( const bvh_prim_t* prims, uint32_t numPrims, thread_pool_t pool, bvh_node_t* nodes, uint32_t* order );
+static bool     _lbvhSortJob( void* context, uint32_t tid );
+static bool     _lbvhMergeJob( void* context, uint32_t tid );
+static bool     _lbvhEmitJob( void* context, uint32_t tid );
+static void     _lbvhEmit( lbvh_build_t* b, uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth, uint32_t* maxDepth, std::vector<lbvh_job_t>* spawned );
+static void     _lbvhRefit( lbvh_build_t* b, uint32_t nodeIndex, uint32_t depth );
+static void     _lbvhRunJobs( thread_pool_t pool, jobFunction function, lbvh_job_t* jobs, size_t numJobs );
+static uint64_t _mortonExpand( uint64_t v );
+static uint32_t _clz64( uint64_t v );
+static void     _subtreeRanges( const bvh_t* bvh, uint32_t nodeIndex, bvh_range_t* ranges );
+static uint32_t _collapseRecursive( const bvh_t* bvh, const bvh_range_t* ranges, uint32_t nodeIndex, uint32_t maxLeafSize, std::vector<bvh_wide_node_t>& nodes, uint32_t depth, uint32_t* maxDepth );
+static void     _aabbEmpty( aabb_t* box );
+static void     _aabbGrow( aabb_t* box, const aabb_t& other );
+static void     _aabbGrow( aabb_t* box, const float point[ 3 ] );
+static float    _aabbArea( const aabb_t& box );
+static bool     _aabbHit( const aabb_t& box, const vector3& origin, const vector3& invDirection, float min, float max );
+
+
+bvh_t* bvhCreate( sphere_t* spheres, uint32_t numSpheres, bvh_builder_t builder, thread_pool_t pool )
+{
+    assert( spheres );
+    assert( numSpheres );
+
+    bvh_prim_t* prims = new bvh_prim_t[ numSpheres ];
+    for ( uint32_t i = 0; i < numSpheres; i++ ) {
+        const sphere_t& s = spheres[ i ];
+
+        prims[ i ].bounds.min[ 0 ] = s.center.x - s.radius;
+        prims[ i ].bounds.min[ 1 ] = s.center.y - s.radius;
+        prims[ i ].bounds.min[ 2 ] = s.center.z - s.radius;
+        prims[ i ].bounds.max[ 0 ] = s.center.x + s.radius;
+        prims[ i ].bounds.max[ 1 ] = s.center.y + s.radius;
+        prims[ i ].bounds.max[ 2 ] = s.center.z + s.radius;
+        prims[ i ].centroid[ 0 ]   = s.center.x;
+        prims[ i ].centroid[ 1 ]   = s.center.y;
+        prims[ i ].centroid[ 2 ]   = s.center.z;
+        prims[ i ].index           = i;
+    }
+
+    bvh_t*    bvh   = new bvh_t;
+    uint32_t* order = new uint32_t[ numSpheres ];
+
+    if ( builder == BVH_BUILDER_LBVH ) {
+        // One sphere per leaf, so the node count is known up front
+        bvh->numNodes = 2 * numSpheres - 1;
+        bvh->nodes    = new bvh_node_t[ bvh->numNodes ];
+        bvh->depth    = _lbvhBuild( prims, numSpheres, pool, bvh->nodes, order );
+    } else {
+        std::vector<bvh_node_t> nodes;
+        nodes.reserve( 2 * numSpheres );
+
+        uint32_t maxDepth = 0;
+        _buildRecursive( nodes, prims, 0, numSpheres, 1, &maxDepth );
+
+        bvh->numNodes = (uint32_t)nodes.size();
+        bvh->nodes    = new bvh_node_t[ bvh->numNodes ];
+        bvh->depth    = maxDepth;
+        std::copy( nodes.begin(), nodes.end(), bvh->nodes );
+
+        for ( uint32_t i = 0; i < numSpheres; i++ ) {
+            order[ i ] = prims[ i ].index;
+        }
+    }
+
+    // Reorder the spheres so each leaf references a contiguous range
+    sphere_t* sorted = new sphere_t[ numSpheres ];
+    for ( uint32_t i = 0; i < numSpheres; i++ ) {
+        sorted[ i ] = spheres[ order[ i ] ];
+    }
+    for ( uint32_t i = 0; i < numSpheres; i++ ) {
+        spheres[ i ] = sorted[ i ];
+    }
+    delete[] sorted;
+    delete[] order;
+    delete[] prims;
+
+    bvh->spheres    = spheres;
+    bvh->numSpheres = numSpheres;
+
+    assert( bvh->depth <= BVH_MAX_DEPTH );
+
+    return bvh;
+}
+
+
+void bvhDestroy( bvh_t* bvh )
+{
+    if ( !bvh )
+        return;
+
+    delete[] bvh->nodes;
+    delete bvh;
+}
+
+
+bool bvhHit( const bvh_t* bvh, const ray& r, float min, float max, hit_info* p_hit )
+{
+    assert( bvh );
+    assert( p_hit );
+
+    vector3 invDirection( 1.0f / r.direction.x, 1.0f / r.direction.y, 1.0f / r.direction.z );
+    bool    negative[ 3 ] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+
+    uint32_t stack[ BVH_MAX_DEPTH ];
+    uint32_t stackSize    = 0;
+    uint32_t nodeIndex    = 0;
+    float    closestSoFar = max;
+    bool     rval         = false;
+
+    while ( true ) {
+        const bvh_node_t& node = bvh->nodes[ nodeIndex ];
+
+        if ( _aabbHit( node.bounds, r.origin, invDirection, min, closestSoFar ) ) {
+            if ( node.count > 0 ) {
+                for ( uint32_t i = node.offset; i < node.offset + node.count; i++ ) {
+                    // sphereHit() only writes p_hit on a closer hit, so no temporary is needed
+                    if ( sphereHit( bvh->spheres[ i ], r, min, closestSoFar, p_hit ) ) {
+                        rval         = true;
+                        closestSoFar = p_hit->distance;
+                    }
+                }
+
+                if ( stackSize == 0 )
+                    break;
+                nodeIndex = stack[ --stackSize ];
+            } else {
+                // Visit the near child first, so closestSoFar shrinks early and culls the far child
+                if ( negative[ node.axis ] ) {
+                    stack[ stackSize++ ] = nodeIndex + 1;
+                    nodeIndex            = node.offset;
+                } else {
+                    stack[ stackSize++ ] = node.offset;
+                    nodeIndex            = nodeIndex + 1;
+                }
+            }
+        } else {
+            if ( stackSize == 0 )
+                break;
+            nodeIndex = stack[ --stackSize ];
+        }
+    }
+
+    return rval;
+}
+
+
+bvh_wide_t* bvhCreateWide( const bvh_t* bvh, uint32_t maxLeafSize )
+{
+    assert( bvh );
+    assert( maxLeafSize >= BVH_MAX_LEAF_SIZE );
+
+    // Every subtree of the binary BVH covers a contiguous range of spheres, so small subtrees collapse to a single leaf
+    bvh_range_t* ranges = new bvh_range_t[ bvh->numNodes ];
+    _subtreeRanges( bvh, 0, ranges );
+
+    std::vector<bvh_wide_node_t> nodes;
+    nodes.reserve( bvh->numNodes / ( BVH_WIDTH / 2 ) + 1 );
+
+    uint32_t maxDepth = 0;
+    _collapseRecursive( bvh, ranges, 0, maxLeafSize, nodes, 1, &maxDepth );
+    delete[] ranges;
+
+    bvh_wide_t* wide = new bvh_wide_t;
+    wide->numNodes   = (uint32_t)nodes.size();
+    wide->nodes      = new bvh_wide_node_t[ wide->numNodes ];
+    wide->depth      = maxDepth;
+    std::copy( nodes.begin(), nodes.end(), wide->nodes );
+
+    assert( wide->depth <= BVH_MAX_DEPTH );
+
+    return wide;
+}
+
+
+void bvhDestroyWide( bvh_wide_t* bvh )
+{
+    if ( !bvh )
+        return;
+
+    delete[] bvh->nodes;
+    delete bvh;
+}
+
+
+const char* bvhBuilderName( bvh_builder_t builder )
+{
+    switch ( builder ) {
+        case BVH_BUILDER_SAH:
+            return "SAH";
+        case BVH_BUILDER_LBVH:
+            return "LBVH";
+        default:
+            return "unknown";
+    }
+}
+
+
+//
+// Private implementation
+//
+
+static uint32_t _buildRecursive( std::vector<bvh_node_t>& nodes, bvh_prim_t* prims, uint32_t first, uint32_t count, uint32_t depth, uint32_t* maxDepth )
+{
+    uint32_t nodeIndex = (uint32_t)nodes.size();
+    nodes.push_back( bvh_node_t() );
+
+    *maxDepth = std::max( *maxDepth, depth );
+
+    aabb_t bounds;
+    aabb_t centroidBounds;
+    _aabbEmpty( &bounds );
+    _aabbEmpty( &centroidBounds );
+    for ( uint32_t i = first; i < first + count; i++ ) {
+        _aabbGrow( &bounds, prims[ i ].bounds );
+        _aabbGrow( &centroidBounds, prims[ i ].centroid );
+    }
+
+    nodes[ nodeIndex ].bounds = bounds;
+
+    if ( count == 1 ) {
+        nodes[ nodeIndex ].offset = first;
+        nodes[ nodeIndex ].count  = (uint16_t)count;
+        nodes[ nodeIndex ].axis   = 0;
+        return nodeIndex;
+    }
+
+    // Evaluate SAH at the bin boundaries along all three axes
+    float    leafCost  = BVH_INTERSECT_COST * count;
+    float    bestCost  = FLT_MAX;
+    int      bestAxis  = -1;
+    uint32_t bestSplit = 0;
+    float    area      = _aabbArea( bounds );
+
+    for ( int axis = 0; axis < 3; axis++ ) {
+        float extent = centroidBounds.max[ axis ] - centroidBounds.min[ axis ];
+        if ( extent <= 0.0f )
+            continue;
+
+        bvh_bin_t bins[ BVH_NUM_BINS ];
+        for ( uint32_t b = 0; b < BVH_NUM_BINS; b++ ) {
+            _aabbEmpty( &bins[ b ].bounds );
+            bins[ b ].count = 0;
+        }
+
+        float scale = BVH_NUM_BINS / extent;
+        for ( uint32_t i = first; i < first + count; i++ ) {
+            uint32_t b = std::min( BVH_NUM_BINS - 1, (uint32_t)( ( prims[ i ].centroid[ axis ] - centroidBounds.min[ axis ] ) * scale ) );
+            bins[ b ].count++;
+            _aabbGrow( &bins[ b ].bounds, prims[ i ].bounds );
+        }
+
+        // Sweep right-to-left to accumulate the right-hand areas, then left-to-right to evaluate each split
+        float    rightArea[ BVH_NUM_BINS ];
+        uint32_t rightCount[ BVH_NUM_BINS ];
+        aabb_t   accum;
+        uint32_t accumCount = 0;
+        _aabbEmpty( &accum );
+        for ( uint32_t b = BVH_NUM_BINS - 1; b > 0; b-- ) {
+            _aabbGrow( &accum, bins[ b ].bounds );
+            accumCount += bins[ b ].count;
+            rightArea[ b ]  = accumCount ? _aabbArea( accum ) : 0.0f;
+            rightCount[ b ] = accumCount;
+        }
+
+        _aabbEmpty( &accum );
+        accumCount = 0;
+        for ( uint32_t b = 0; b < BVH_NUM_BINS - 1; b++ ) {
+            _aabbGrow( &accum, bins[ b ].bounds );
+            accumCount += bins[ b ].count;
+
+            if ( accumCount == 0 || rightCount[ b + 1 ] == 0 )
+                continue;
+
+            float cost = BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * ( _aabbArea( accum ) * accumCount + rightArea[ b + 1 ] * rightCount[ b + 1 ] ) / area;
+            if ( cost < bestCost ) {
+                bestCost  = cost;
+                bestAxis  = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    if ( count <= BVH_MAX_LEAF_SIZE && ( bestAxis < 0 || bestCost >= leafCost ) ) {
+        nodes[ nodeIndex ].offset = first;
+        nodes[ nodeIndex ].count  = (uint16_t)count;
+        nodes[ nodeIndex ].axis   = 0;
+        return nodeIndex;
+    }
+
+    uint32_t mid;
+    if ( depth >= BVH_BALANCED_DEPTH ) {
+        // Lopsided splits have eaten most of the depth budget, e.g. many spheres at nearly one point; halve by count
+        // along the widest centroid axis, so this subtree is at most 32 levels deeper whatever SAH would pick
+        int axis = 0;
+        for ( int a = 1; a < 3; a++ ) {
+            if ( centroidBounds.max[ a ] - centroidBounds.min[ a ] > centroidBounds.max[ axis ] - centroidBounds.min[ axis ] )
+                axis = a;
+        }
+
+        bestAxis = axis;
+        mid      = first + count / 2;
+        std::nth_element( prims + first, prims + mid, prims + first + count, [ = ]( const bvh_prim_t& a, const bvh_prim_t& b ) {
+            return a.centroid[ axis ] < b.centroid[ axis ];
+        } );
+    } else if ( bestAxis >= 0 ) {
+        int   axis  = bestAxis;
+        float min   = centroidBounds.min[ axis ];
+        float scale = BVH_NUM_BINS / ( centroidBounds.max[ axis ] - min );
+
+        bvh_prim_t* pivot = std::partition( prims + first, prims + first + count, [ = ]( const bvh_prim_t& p ) {
+            uint32_t b = std::min( BVH_NUM_BINS - 1, (uint32_t)( ( p.centroid[ axis ] - min ) * scale ) );
+            return b <= bestSplit;
+        } );
+        mid = (uint32_t)( pivot - prims );
+    } else {
+        // All centroids coincide; SAH can't separate them, so split by count
+        bestAxis = 0;
+        mid      = first + count / 2;
+    }
+
+    nodes[ nodeIndex ].axis  = (uint16_t)bestAxis;
+    nodes[ nodeIndex ].count = 0;
+
+    _buildRecursive( nodes, prims, first, mid - first, depth + 1, maxDepth );
+    uint32_t right = _buildRecursive( nodes, prims, mid, first + count - mid, depth + 1, maxDepth );
+
+    // NOTE: nodes may have been reallocated by the recursive calls; don't hold a reference across them
+    nodes[ nodeIndex ].offset = right;
+
+    return nodeIndex;
+}
+
+
+//
+// LBVH: encode + sort chunks in parallel, merge sorted runs pairwise in parallel,
+// then split the sorted keys at the highest differing Morton bit.
+// The top of the tree is emitted serially and its subtrees are emitted as parallel jobs.
+//
+// With one sphere per leaf a subtree over n spheres has exactly 2n - 1 nodes,
+// so every node's depth-first index is known without synchronizing between jobs.
+//
+
+static uint32_t _lbvhBuild( const bvh_prim_t* prims, uint32_t numPrims, thread_pool_t pool, bvh_node_t* nodes, uint32_t* order )
+{
+    lbvh_build_t b;
+    b.prims    = prims;
+    b.keys     = new lbvh_key_t[ numPrims ];
+    b.scratch  = new lbvh_key_t[ numPrims ];
+    b.nodes    = nodes;
+    b.numPrims = numPrims;
+
+    _aabbEmpty( &b.centroidBounds );
+    for ( uint32_t i = 0; i < numPrims; i++ ) {
+        _aabbGrow( &b.centroidBounds, prims[ i ].centroid );
+    }
+
+    uint32_t numChunks = std::max( 1u, std::thread::hardware_concurrency() * 2 );
+    numChunks          = std::min( numChunks, ( numPrims + LBVH_MIN_JOB_SIZE - 1 ) / LBVH_MIN_JOB_SIZE );
+    numChunks          = std::max( numChunks, 1u );
+
+    // Sort phase: Morton-encode and sort each chunk
+    std::vector<lbvh_job_t> jobs( numChunks );
+    uint32_t                chunkSize = ( numPrims + numChunks - 1 ) / numChunks;
+    for ( uint32_t i = 0; i < numChunks; i++ ) {
+        jobs[ i ].build = &b;
+        jobs[ i ].first = i * chunkSize;
+        jobs[ i ].count = std::min( chunkSize, numPrims - jobs[ i ].first );
+    }
+    _lbvhRunJobs( pool, _lbvhSortJob, jobs.data(), jobs.size() );
+
+    // Merge sorted runs pairwise until one run remains
+    for ( uint32_t width = chunkSize; width < numPrims; width *= 2 ) {
+        jobs.clear();
+        for ( uint32_t first = 0; first < numPrims; first += 2 * width ) {
+            lbvh_job_t job;
+            job.build = &b;
+            job.first = first;
+            job.mid   = std::min( first + width, numPrims );
+            job.count = std::min( 2 * width, numPrims - first );
+            jobs.push_back( job );
+        }
+        _lbvhRunJobs( pool, _lbvhMergeJob, jobs.data(), jobs.size() );
+        std::swap( b.keys, b.scratch );
+    }
+
+    // Emit phase: spawn roughly two subtrees per chunk
+    b.spawnDepth = 1;
+    while ( ( 1u << b.spawnDepth ) < 2 * numChunks ) {
+        b.spawnDepth++;
+    }
+
+    std::vector<lbvh_job_t> spawned;
+    uint32_t                maxDepth = 0;
+    _lbvhEmit( &b, 0, 0, numPrims, 0, &maxDepth, numChunks > 1 ? &spawned : nullptr );
+    _lbvhRunJobs( pool, _lbvhEmitJob, spawned.data(), spawned.size() );
+
+    for ( const lbvh_job_t& job : spawned ) {
+        maxDepth = std::max( maxDepth, job.maxDepth );
+    }
+
+    // The spawned subtrees are complete; fill in the bounds of the nodes above them
+    if ( numChunks > 1 )
+        _lbvhRefit( &b, 0, 0 );
+
+    for ( uint32_t i = 0; i < numPrims; i++ ) {
+        order[ i ] = b.keys[ i ].index;
+    }
+
+    delete[] b.keys;
+    delete[] b.scratch;
+
+    // Depth is counted from 0 here, from 1 by the SAH builder
+    return maxDepth + 1;
+}
+
+
+static bool _lbvhSortJob( void* context, uint32_t tid )
+{
+    UNUSED( tid );
+
+    lbvh_job_t*   job = (lbvh_job_t*)context;
+    lbvh_build_t* b   = job->build;
+
+    const aabb_t& bounds = b->centroidBounds;
+    float         scale[ 3 ];
+    for ( int axis = 0; axis < 3; axis++ ) {
+        float extent  = bounds.max[ axis ] - bounds.min[ axis ];
+        scale[ axis ] = extent > 0.0f ? float( ( 1u << LBVH_MORTON_BITS ) - 1 ) / extent : 0.0f;
+    }
+
+    for ( uint32_t i = job->first; i < job->first + job->count; i++ ) {
+        const float* c = b->prims[ i ].centroid;
+        uint64_t     x = ( uint64_t )( ( c[ 0 ] - bounds.min[ 0 ] ) * scale[ 0 ] );
+        uint64_t     y = ( uint64_t )( ( c[ 1 ] - bounds.min[ 1 ] ) * scale[ 1 ] );
+        uint64_t     z = ( uint64_t )( ( c[ 2 ] - bounds.min[ 2 ] ) * scale[ 2 ] );
+
+        b->keys[ i ].code  = ( _mortonExpand( x ) << 2 ) | ( _mortonExpand( y ) << 1 ) | _mortonExpand( z );
+        b->keys[ i ].index = i;
+    }
+
+    std::sort( b->keys + job->first, b->keys + job->first + job->count );
+
+    return true;
+}
+
+
+static bool _lbvhMergeJob( void* context, uint32_t tid )
+{
+    UNUSED( tid );
+
+    lbvh_job_t*   job = (lbvh_job_t*)context;
+    lbvh_build_t* b   = job->build;
+
+    std::merge( b->keys + job->first, b->keys + job->mid, b->keys + job->mid, b->keys + job->first + job->count, b->scratch + job->first );
+
+    return true;
+}
+
+
+static bool _lbvhEmitJob( void* context, uint32_t tid )
+{
+    UNUSED( tid );
+
+    lbvh_job_t* job = (lbvh_job_t*)context;
+
+    job->maxDepth = 0;
+    _lbvhEmit( job->build, job->nodeIndex, job->first, job->count, job->depth, &job->maxDepth, nullptr );
+
+    return true;
+}
+
+
+static void _lbvhEmit( lbvh_build_t* b, uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth, uint32_t* maxDepth, std::vector<lbvh_job_t>* spawned )
+{
+    bvh_node_t& node = b->nodes[ nodeIndex ];
+
+    *maxDepth = std::max( *maxDepth, depth );
+
+    if ( count == 1 ) {
+        node.bounds = b->prims[ b->keys[ first ].index ].bounds;
+        node.offset = first;
+        node.count  = 1;
+        node.axis   = 0;
+        return;
+    }
+
+    // Hand the rest of this subtree to a job; its bounds are filled in by _lbvhRefit() afterwards
+    if ( spawned && depth == b->spawnDepth ) {
+        lbvh_job_t job;
+        job.build     = b;
+        job.first     = first;
+        job.count     = count;
+        job.nodeIndex = nodeIndex;
+        job.depth     = depth;
+        job.maxDepth  = depth;
+        spawned->push_back( job );
+        return;
+    }
+
+    // Split where the highest differing bit of the range's Morton codes flips
+    uint32_t last      = first + count - 1;
+    uint64_t firstCode = b->keys[ first ].code;
+    uint64_t lastCode  = b->keys[ last ].code;
+    uint32_t split;
+
+    if ( firstCode == lastCode || depth + 1 >= BVH_BALANCED_DEPTH ) {
+        // No bit to split on, or the depth budget is nearly spent (LBVH counts depth from 0): halve the sorted range
+        split = first + count / 2 - 1;
+    } else {
+        uint32_t prefix = _clz64( firstCode ^ lastCode );
+        uint32_t step   = count - 1;
+        split           = first;
+
+        do {
+            step              = ( step + 1 ) >> 1;
+            uint32_t newSplit = split + step;
+            if ( newSplit < last && _clz64( firstCode ^ b->keys[ newSplit ].code ) > prefix ) {
+                split = newSplit;
+            }
+        } while ( step > 1 );
+    }
+
+    uint32_t leftCount = split - first + 1;
+    uint32_t left      = nodeIndex + 1;
+    uint32_t right     = nodeIndex + 2 * leftCount;
+
+    // The Morton code interleaves x, y, z from the high bit down
+    node.offset = right;
+    node.count  = 0;
+    node.axis   = firstCode == lastCode ? 0 : (uint16_t)( ( _clz64( firstCode ^ lastCode ) - 1 ) % 3 );
+
+    _lbvhEmit( b, left, first, leftCount, depth + 1, maxDepth, spawned );
+    _lbvhEmit( b, right, split + 1, count - leftCount, depth + 1, maxDepth, spawned );
+
+    if ( !spawned ) {
+        _aabbEmpty( &node.bounds );
+        _aabbGrow( &node.bounds, b->nodes[ left ].bounds );
+        _aabbGrow( &node.bounds, b->nodes[ right ].bounds );
+    }
+}
+
+
+static void _lbvhRefit( lbvh_build_t* b, uint32_t nodeIndex, uint32_t depth )
+{
+    bvh_node_t& node = b->nodes[ nodeIndex ];
+
+    if ( node.count > 0 || depth == b->spawnDepth )
+        return;
+
+    _lbvhRefit( b, nodeIndex + 1, depth + 1 );
+    _lbvhRefit( b, node.offset, depth + 1 );
+
+    _aabbEmpty( &node.bounds );
+    _aabbGrow( &node.bounds, b->nodes[ nodeIndex + 1 ].bounds );
+    _aabbGrow( &node.bounds, b->nodes[ node.offset ].bounds );
+}
+
+
+static void _lbvhRunJobs( thread_pool_t pool, jobFunction function, lbvh_job_t* jobs, size_t numJobs )
+{
+    // A single job isn't worth the round trip through the queue
+    if ( pool == INVALID_THREAD_POOL || numJobs == 1 ) {
+        for ( size_t i = 0; i < numJobs; i++ ) {
+            function( &jobs[ i ], 0 );
+        }
+        return;
+    }
+
+    std::vector<Invokable> invokables( numJobs );
+    for ( size_t i = 0; i < numJobs; i++ ) {
+        invokables[ i ] = Function( function, &jobs[ i ] );
+    }
+
+    job_group_t group = threadPoolSubmitJobs( invokables.data(), numJobs, pool );
+    threadPoolWaitForJobs( group, INFINITE_TIMEOUT, pool );
+}
+
+
+// Spread the low 21 bits of v so there are two zero bits between each
+static uint64_t _mortonExpand( uint64_t v )
+{
+    v &= 0x1fffff;
+    v = ( v | v << 32 ) & 0x1f00000000ffffull;
+    v = ( v | v << 16 ) & 0x1f0000ff0000ffull;
+    v = ( v | v << 8 ) & 0x100f00f00f00f00full;
+    v = ( v | v << 4 ) & 0x10c30c30c30c30c3ull;
+    v = ( v | v << 2 ) & 0x1249249249249249ull;
+
+    return v;
+}
+
+
+// 64 for 0: the emit search compares codes that may be duplicates
+static uint32_t _clz64( uint64_t v )
+{
+    if ( v == 0 )
+        return 64;
+
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64( &index, v );
+    return 63 - index;
+#else
+    return (uint32_t)__builtin_clzll( v );
+#endif
+}
+
+
+static void _subtreeRanges( const bvh_t* bvh, uint32_t nodeIndex, bvh_range_t* ranges )
+{
+    const bvh_node_t& node = bvh->nodes[ nodeIndex ];
+
+    if ( node.count > 0 ) {
+        ranges[ nodeIndex ].first = node.offset;
+        ranges[ nodeIndex ].count = node.count;
+        return;
+    }
+
+    _subtreeRanges( bvh, nodeIndex + 1, ranges );
+    _subtreeRanges( bvh, node.offset, ranges );
+
+    ranges[ nodeIndex ].first = ranges[ nodeIndex + 1 ].first;
+    ranges[ nodeIndex ].count = ranges[ nodeIndex + 1 ].count + ranges[ node.offset ].count;
+}
+
+
+static uint32_t _collapseRecursive( const bvh_t* bvh, const bvh_range_t* ranges, uint32_t nodeIndex, uint32_t maxLeafSize, std::vector<bvh_wide_node_t>& nodes, uint32_t depth, uint32_t* maxDepth )
+{
+    uint32_t wideIndex = (uint32_t)nodes.size();
+    nodes.push_back( bvh_wide_node_t() );
+
+    *maxDepth = std::max( *maxDepth, depth );
+
+    // Pull grandchildren up into this node: repeatedly open the largest child that is too big to be a leaf
+    uint32_t children[ BVH_WIDTH ];
+    uint32_t numChildren = 0;
+
+    const bvh_node_t& root = bvh->nodes[ nodeIndex ];
+    if ( root.count > 0 || ranges[ nodeIndex ].count <= maxLeafSize ) {
+        children[ numChildren++ ] = nodeIndex;
+    } else {
+        children[ numChildren++ ] = nodeIndex + 1;
+        children[ numChildren++ ] = root.offset;
+    }
+
+    while ( numChildren < BVH_WIDTH ) {
+        int   best     = -1;
+        float bestArea = -1.0f;
+        for ( uint32_t i = 0; i < numChildren; i++ ) {
+            const bvh_node_t& child = bvh->nodes[ children[ i ] ];
+            if ( child.count > 0 || ranges[ children[ i ] ].count <= maxLeafSize )
+                continue;
+
+            float area = _aabbArea( child.bounds );
+            if ( area > bestArea ) {
+                bestArea = area;
+                best     = (int)i;
+            }
+        }
+
+        if ( best < 0 )
+            break;
+
+        uint32_t opened           = children[ best ];
+        children[ best ]          = opened + 1;
+        children[ numChildren++ ] = bvh->nodes[ opened ].offset;
+    }
+
+    for ( uint32_t i = 0; i < BVH_WIDTH; i++ ) {
+        bvh_wide_node_t& wide = nodes[ wideIndex ];
+
+        if ( i >= numChildren ) {
+            wide.min_x[ i ] = wide.min_y[ i ] = wide.min_z[ i ] = FLT_MAX;
+            wide.max_x[ i ] = wide.max_y[ i ] = wide.max_z[ i ] = -FLT_MAX;
+            wide.child[ i ] = -1;
+            wide.count[ i ] = 0;
+            continue;
+        }
+
+        const bvh_node_t& child = bvh->nodes[ children[ i ] ];
+        wide.min_x[ i ]         = child.bounds.min[ 0 ];
+        wide.min_y[ i ]         = child.bounds.min[ 1 ];
+        wide.min_z[ i ]         = child.bounds.min[ 2 ];
+        wide.max_x[ i ]         = child.bounds.max[ 0 ];
+        wide.max_y[ i ]         = child.bounds.max[ 1 ];
+        wide.max_z[ i ]         = child.bounds.max[ 2 ];
+
+        if ( child.count > 0 || ranges[ children[ i ] ].count <= maxLeafSize ) {
+            wide.child[ i ] = (int32_t)ranges[ children[ i ] ].first;
+            wide.count[ i ] = ranges[ children[ i ] ].count;
+        } else {
+            // NOTE: nodes may be reallocated by the recursive call; don't hold a reference across it
+            int32_t childIndex            = (int32_t)_collapseRecursive( bvh, ranges, children[ i ], maxLeafSize, nodes, depth + 1, maxDepth );
+            nodes[ wideIndex ].child[ i ] = childIndex;
+            nodes[ wideIndex ].count[ i ] = 0;
+        }
+    }
+
+    return wideIndex;
+}
+
+
+static void _aabbEmpty( aabb_t* box )
+{
+    for ( int i = 0; i < 3; i++ ) {
+        box->min[ i ] = FLT_MAX;
+        box->max[ i ] = -FLT_MAX;
+    }
+}
+
+
+static void _aabbGrow( aabb_t* box, const aabb_t& other )
+{
+    for ( int i = 0; i < 3; i++ ) {
+        box->min[ i ] = std::min( box->min[ i ], other.min[ i ] );
+        box->max[ i ] = std::max( box->max[ i ], other.max[ i ] );
+    }
+}
+
+
+static void _aabbGrow( aabb_t* box, const float point[ 3 ] )
+{
+    for ( int i = 0; i < 3; i++ ) {
+        box->min[ i ] = std::min( box->min[ i ], point[ i ] );
+        box->max[ i ] = std::max( box->max[ i ], point[ i ] );
+    }
+}
+
+
+static float _aabbArea( const aabb_t& box )
+{
+    float dx = box.max[ 0 ] - box.min[ 0 ];
+    float dy = box.max[ 1 ] - box.min[ 1 ];
+    float dz = box.max[ 2 ] - box.min[ 2 ];
+
+    return 2.0f * ( dx * dy + dy * dz + dz * dx );
+}
+
+
+// Slab test; conservative, so rounding never culls a box the ray touches
+static bool _aabbHit( const aabb_t& box, const vector3& origin, const vector3& invDirection, float min, float max )
+{
+    float t0 = ( box.min[ 0 ] - origin.x ) * invDirection.x;
+    float t1 = ( box.max[ 0 ] - origin.x ) * invDirection.x;
+    min      = std::max( min, std::min( t0, t1 ) );
+    max      = std::min( max, std::max( t0, t1 ) * BVH_SLAB_PAD );
+
+    t0  = ( box.min[ 1 ] - origin.y ) * invDirection.y;
+    t1  = ( box.max[ 1 ] - origin.y ) * invDirection.y;
+    min = std::max( min, std::min( t0, t1 ) );
+    max = std::min( max, std::max( t0, t1 ) * BVH_SLAB_PAD );
+
+    t0  = ( box.min[ 2 ] - origin.z ) * invDirection.z;
+    t1  = ( box.max[ 2 ] - origin.z ) * invDirection.z;
+    min = std::max( min, std::min( t0, t1 ) );
+    max = std::min( max, std::max( t0, t1 ) * BVH_SLAB_PAD );
+
+    return min <= max;
+}
+
+} // namespace pk
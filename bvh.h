@@ -0,0 +1,105 @@
+#pragma once
+
+//
+// Bounding Volume Hierarchy over the flattened sphere_t array.
+//
+// Two builders:
+// BVH_BUILDER_SAH:  top-down binned Surface Area Heuristic; slower to build, faster to traverse.
+// BVH_BUILDER_LBVH: linear BVH; spheres sorted by 63-bit Morton code and the hierarchy emitted in parallel
+//                   on the thread pool. Use it when build latency matters more than traversal speed.
+//
+// Either builder reorders the sphere array in place so every leaf references a contiguous range of spheres.
+//
+
+#include "material.h"
+#include "ray.h"
+#include "sphere.h"
+#include "thread_pool.h"
+
+#include <float.h>
+#include <stdint.h>
+
+namespace pk
+{
+
+typedef enum {
+    BVH_BUILDER_SAH  = 0,
+    BVH_BUILDER_LBVH = 1,
+} bvh_builder_t;
+
+
+typedef struct _aabb {
+    float min[ 3 ];
+    float max[ 3 ];
+} aabb_t;
+
+
+// Each slab distance is ( bound - origin ) * invDirection, three roundings; growing the far distance by 2 * gamma( 3 )
+// (PBRT's bound) keeps a box the ray only just touches from rounding to a miss. Every backend's slab test MUST use it.
+static const float BVH_SLAB_GAMMA3 = ( 3.0f * FLT_EPSILON * 0.5f ) / ( 1.0f - 3.0f * FLT_EPSILON * 0.5f );
+static const float BVH_SLAB_PAD    = 1.0f + 2.0f * BVH_SLAB_GAMMA3;
+
+
+// 32 bytes; two nodes per cache line
+typedef struct _bvh_node {
+    aabb_t   bounds;
+    uint32_t offset; // leaf: index of first sphere; interior: index of second child (first child is always this + 1)
+    uint16_t count;  // leaf: number of spheres; interior: 0
+    uint16_t axis;   // interior: split axis, used to visit the nearest child first
+} bvh_node_t;
+
+
+typedef struct _bvh {
+    bvh_node_t*     nodes;
+    uint32_t        numNodes;
+    uint32_t        depth;
+    const sphere_t* spheres;
+    uint32_t        numSpheres;
+} bvh_t;
+
+
+//
+// Wide BVH for the SIMD backends, collapsed from the binary BVH.
+// Each node stores its children's bounds as SoA, so a single vector op tests all of them against one ray.
+// Layout MUST match bvh_wide_node_t in raytracer.ispc.
+//
+
+#define BVH_MAX_DEPTH 128 // both builders stay within it, and collapsing never deepens a tree
+#define BVH_WIDTH 8
+
+// Traversal pushes at most BVH_WIDTH - 1 siblings per level
+#define BVH_WIDE_STACK_SIZE ( BVH_MAX_DEPTH * ( BVH_WIDTH - 1 ) + 1 )
+
+typedef struct _bvh_wide_node {
+    float    min_x[ BVH_WIDTH ];
+    float    min_y[ BVH_WIDTH ];
+    float    min_z[ BVH_WIDTH ];
+    float    max_x[ BVH_WIDTH ];
+    float    max_y[ BVH_WIDTH ];
+    float    max_z[ BVH_WIDTH ];
+    int32_t  child[ BVH_WIDTH ]; // leaf: index of first sphere; interior: index of child node; empty slot: -1
+    uint32_t count[ BVH_WIDTH ]; // leaf: number of spheres (<= the build's maxLeafSize); interior or empty: 0
+} bvh_wide_node_t;
+
+
+typedef struct _bvh_wide {
+    bvh_wide_node_t* nodes;
+    uint32_t         numNodes;
+    uint32_t         depth;
+} bvh_wide_t;
+
+
+// LBVH runs its jobs on pool; pass INVALID_THREAD_POOL to build on the calling thread
+bvh_t* bvhCreate( sphere_t* spheres, uint32_t numSpheres, bvh_builder_t builder = BVH_BUILDER_SAH, thread_pool_t pool = DEFAULT_THREAD_POOL );
+void   bvhDestroy( bvh_t* bvh );
+bool   bvhHit( const bvh_t* bvh, const ray& r, float min, float max, hit_info* p_hit );
+
+// Subtrees of up to maxLeafSize spheres collapse into one leaf; the ISPC renderer's leaf test assumes BVH_WIDTH
+bvh_wide_t* bvhCreateWide( const bvh_t* bvh, uint32_t maxLeafSize = BVH_WIDTH );
+void        bvhDestroyWide( bvh_wide_t* bvh );
+
+const char* bvhBuilderName( bvh_builder_t builder );
+
+void benchmarkBVH();
+
+} // namespace pk
@@ -0,0 +1,684 @@
+#include "bvh_simd.h"
+
+#include <assert.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ ) || defined( _M_X64 ) || defined( _M_IX86 )
+#define BVH_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// MSVC compiles any intrinsic anywhere; GCC and Clang need each kernel function marked with the ISA it uses
+#if defined( BVH_SIMD_X86 ) && !defined( _MSC_VER )
+#define SIMD_TARGET( isa ) __attribute__( ( target( isa ) ) )
+#else
+#define SIMD_TARGET( isa )
+#endif
+
+// AVX-512F implies FMA, and GCC would fuse the sphere test's multiplies and adds, so hits would round differently
+// from sphereHit(); MSVC never contracts intrinsics
+#if defined( BVH_SIMD_X86 ) && defined( __GNUC__ ) && !defined( __clang__ )
+#pragma GCC optimize( "fp-contract=off" )
+#endif
+
+
+namespace pk
+{
+
+//
+// Private types and data
+//
+
+// Packed leaves start on a multiple of this many floats: one AVX-512 vector, a 64-byte cache line
+static const uint32_t SIMD_LEAF_ALIGNMENT = 16;
+
+static const uint32_t SIMD_AVX512_LEAF_SIZE = 16;
+
+
+static void _finishHit( const bvh_simd_t* bvh, const ray& r, uint32_t slot, float t, hit_info* p_hit );
+
+#ifdef BVH_SIMD_X86
+static void     _cpuid( int leaf, int subleaf, uint32_t regs[ 4 ] );
+static uint64_t _readXcr0();
+static uint32_t _lowestBit( uint32_t bits );
+static bool     _hitSSE42( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit );
+static bool     _hitAVX2( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit );
+static bool     _hitAVX512( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit );
+#endif
+
+
+//
+// Public
+//
+
+simd_isa_t simdDetectIsa()
+{
+#ifdef BVH_SIMD_X86
+    uint32_t regs[ 4 ];
+    _cpuid( 0, 0, regs );
+    uint32_t maxLeaf = regs[ 0 ];
+
+    _cpuid( 1, 0, regs );
+    bool sse42   = ( regs[ 2 ] & ( 1u << 20 ) ) != 0;
+    bool osxsave = ( regs[ 2 ] & ( 1u << 27 ) ) != 0;
+    bool avx     = ( regs[ 2 ] & ( 1u << 28 ) ) != 0;
+
+    bool avx2    = false;
+    bool avx512f = false;
+    if ( maxLeaf >= 7 ) {
+        _cpuid( 7, 0, regs );
+        avx2    = ( regs[ 1 ] & ( 1u << 5 ) ) != 0;
+        avx512f = ( regs[ 1 ] & ( 1u << 16 ) ) != 0;
+    }
+
+    // The OS must save the wider registers on context switches: XMM and YMM state, plus the AVX-512 opmask and ZMM state
+    uint64_t xcr0 = osxsave ? _readXcr0() : 0;
+    bool     ymm  = ( xcr0 & 0x06 ) == 0x06;
+    bool     zmm  = ( xcr0 & 0xE6 ) == 0xE6;
+
+    if ( avx512f && avx2 && zmm )
+        return SIMD_ISA_AVX512;
+    if ( avx2 && avx && ymm )
+        return SIMD_ISA_AVX2;
+    if ( sse42 )
+        return SIMD_ISA_SSE42;
+#endif
+
+    return SIMD_ISA_NONE;
+}
+
+
+bool simdIsaFromName( const char* name, simd_isa_t* p_isa )
+{
+    assert( p_isa );
+
+    if ( !name )
+        return false;
+
+    if ( strcmp( name, "auto" ) == 0 ) {
+        *p_isa = simdDetectIsa();
+        return true;
+    }
+    if ( strcmp( name, "sse4" ) == 0 ) {
+        *p_isa = SIMD_ISA_SSE42;
+        return true;
+    }
+    if ( strcmp( name, "avx2" ) == 0 ) {
+        *p_isa = SIMD_ISA_AVX2;
+        return true;
+    }
+    if ( strcmp( name, "avx512" ) == 0 ) {
+        *p_isa = SIMD_ISA_AVX512;
+        return true;
+    }
+
+    return false;
+}
+
+
+const char* simdIsaName( simd_isa_t isa )
+{
+    switch ( isa ) {
+        case SIMD_ISA_NONE:
+            return "scalar";
+        case SIMD_ISA_SSE42:
+            return "SSE4.2";
+        case SIMD_ISA_AVX2:
+            return "AVX2";
+        case SIMD_ISA_AVX512:
+            return "AVX-512";
+        default:
+            return "unknown";
+    }
+}
+
+
+bvh_simd_t* bvhSimdCreate( const bvh_t* bvh, simd_isa_t isa )
+{
+    assert( bvh );
+
+    // Each ISA's host also runs the narrower ones
+    if ( isa == SIMD_ISA_NONE || isa > simdDetectIsa() )
+        return nullptr;
+
+#ifdef BVH_SIMD_X86
+    uint32_t    leafSize = isa == SIMD_ISA_AVX512 ? SIMD_AVX512_LEAF_SIZE : BVH_WIDTH;
+    bvh_wide_t* wide     = bvhCreateWide( bvh, leafSize );
+
+    // Pack every leaf's spheres at an aligned offset, so leaf tests only make aligned loads
+    uint32_t numSlots = 0;
+    for ( uint32_t n = 0; n < wide->numNodes; n++ ) {
+        for ( uint32_t c = 0; c < BVH_WIDTH; c++ ) {
+            uint32_t count = wide->nodes[ n ].count[ c ];
+            numSlots += ( count + SIMD_LEAF_ALIGNMENT - 1 ) / SIMD_LEAF_ALIGNMENT * SIMD_LEAF_ALIGNMENT;
+        }
+    }
+
+    bvh_simd_t* simd = new bvh_simd_t;
+    simd->numNodes   = wide->numNodes;
+    simd->depth      = wide->depth;
+    simd->numSlots   = numSlots;
+    simd->isa        = isa;
+    simd->leafSize   = leafSize;
+    simd->nodes      = (bvh_wide_node_t*)_mm_malloc( wide->numNodes * sizeof( bvh_wide_node_t ), 64 );
+    simd->center_x   = (float*)_mm_malloc( numSlots * sizeof( float ), 64 );
+    simd->center_y   = (float*)_mm_malloc( numSlots * sizeof( float ), 64 );
+    simd->center_z   = (float*)_mm_malloc( numSlots * sizeof( float ), 64 );
+    simd->radius     = (float*)_mm_malloc( numSlots * sizeof( float ), 64 );
+    simd->materialID = (uint32_t*)_mm_malloc( numSlots * sizeof( uint32_t ), 64 );
+
+    // Padding lanes are masked off by the leaf's count, but keep them finite
+    memset( simd->center_x, 0, numSlots * sizeof( float ) );
+    memset( simd->center_y, 0, numSlots * sizeof( float ) );
+    memset( simd->center_z, 0, numSlots * sizeof( float ) );
+    memset( simd->radius, 0, numSlots * sizeof( float ) );
+    memset( simd->materialID, 0, numSlots * sizeof( uint32_t ) );
+
+    uint32_t slot = 0;
+    for ( uint32_t n = 0; n < wide->numNodes; n++ ) {
+        bvh_wide_node_t* node = &simd->nodes[ n ];
+        *node                 = wide->nodes[ n ];
+
+        for ( uint32_t c = 0; c < BVH_WIDTH; c++ ) {
+            uint32_t count = node->count[ c ];
+            if ( count == 0 )
+                continue;
+
+            for ( uint32_t i = 0; i < count; i++ ) {
+                const sphere_t& sphere        = bvh->spheres[ node->child[ c ] + i ];
+                simd->center_x[ slot + i ]   = sphere.center.x;
+                simd->center_y[ slot + i ]   = sphere.center.y;
+                simd->center_z[ slot + i ]   = sphere.center.z;
+                simd->radius[ slot + i ]     = sphere.radius;
+                simd->materialID[ slot + i ] = sphere.materialID;
+            }
+
+            node->child[ c ] = (int32_t)slot;
+            slot += ( count + SIMD_LEAF_ALIGNMENT - 1 ) / SIMD_LEAF_ALIGNMENT * SIMD_LEAF_ALIGNMENT;
+        }
+    }
+    assert( slot == numSlots );
+
+    bvhDestroyWide( wide );
+
+    switch ( isa ) {
+        case SIMD_ISA_SSE42:
+            simd->hit = _hitSSE42;
+            break;
+        case SIMD_ISA_AVX2:
+            simd->hit = _hitAVX2;
+            break;
+        default:
+            simd->hit = _hitAVX512;
+            break;
+    }
+
+    return simd;
+#else
+    return nullptr;
+#endif
+}
+
+
+void bvhSimdDestroy( bvh_simd_t* bvh )
+{
+    if ( !bvh )
+        return;
+
+#ifdef BVH_SIMD_X86
+    _mm_free( bvh->nodes );
+    _mm_free( bvh->center_x );
+    _mm_free( bvh->center_y );
+    _mm_free( bvh->center_z );
+    _mm_free( bvh->radius );
+    _mm_free( bvh->materialID );
+#endif
+    delete bvh;
+}
+
+
+//
+// Private implementation
+//
+
+// Point and normal of the closest hit, computed exactly as sphereHit() does
+static void _finishHit( const bvh_simd_t* bvh, const ray& r, uint32_t slot, float t, hit_info* p_hit )
+{
+    vector3 center( bvh->center_x[ slot ], bvh->center_y[ slot ], bvh->center_z[ slot ] );
+
+    p_hit->distance   = t;
+    p_hit->point      = r.point( t );
+    p_hit->normal     = ( p_hit->point - center ) / bvh->radius[ slot ];
+    p_hit->materialID = bvh->materialID[ slot ];
+}
+
+#ifdef BVH_SIMD_X86
+
+static void _cpuid( int leaf, int subleaf, uint32_t regs[ 4 ] )
+{
+#ifdef _MSC_VER
+    int info[ 4 ];
+    __cpuidex( info, leaf, subleaf );
+    for ( int i = 0; i < 4; i++ ) {
+        regs[ i ] = (uint32_t)info[ i ];
+    }
+#else
+    __cpuid_count( leaf, subleaf, regs[ 0 ], regs[ 1 ], regs[ 2 ], regs[ 3 ] );
+#endif
+}
+
+
+static uint64_t _readXcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv( 0 );
+#else
+    uint32_t eax, edx;
+    __asm__ __volatile__( "xgetbv" : "=a"( eax ), "=d"( edx ) : "c"( 0 ) );
+    return ( (uint64_t)edx << 32 ) | eax;
+#endif
+}
+
+
+static uint32_t _lowestBit( uint32_t bits )
+{
+    assert( bits );
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward( &index, bits );
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctz( bits );
+#endif
+}
+
+
+//
+// Traversal, shared by every ISA: the same nearest-first, leaves-immediately order as the ISPC renderer's _bvhHit.
+// KERNEL supplies the ray's broadcast state, the eight-child slab test, and the leaf test.
+//
+
+template<class KERNEL>
+static inline bool _traverse( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit )
+{
+    typename KERNEL::ray_t kr;
+    KERNEL::setup( r, min, &kr );
+
+    int32_t  stack[ BVH_WIDE_STACK_SIZE ];
+    float    stackDistance[ BVH_WIDE_STACK_SIZE ];
+    uint32_t stackSize = 1;
+    float    closest   = max;
+    int32_t  closestID = -1;
+
+    stack[ 0 ]         = 0;
+    stackDistance[ 0 ] = min;
+
+    while ( stackSize > 0 ) {
+        stackSize--;
+
+        // Skip nodes that a closer hit has culled since they were pushed
+        if ( stackDistance[ stackSize ] > closest )
+            continue;
+
+        const bvh_wide_node_t* node = &bvh->nodes[ stack[ stackSize ] ];
+
+        float childDistance[ BVH_WIDTH ];
+        KERNEL::nodeDistances( kr, node, closest, childDistance );
+
+        // Order the hit children nearest first
+        uint32_t order[ BVH_WIDTH ];
+        uint32_t numHits = 0;
+        for ( uint32_t c = 0; c < BVH_WIDTH; c++ ) {
+            if ( childDistance[ c ] == FLT_MAX )
+                continue;
+
+            uint32_t j = numHits++;
+            while ( j > 0 && childDistance[ order[ j - 1 ] ] > childDistance[ c ] ) {
+                order[ j ] = order[ j - 1 ];
+                j--;
+            }
+            order[ j ] = c;
+        }
+
+        // Intersect leaves immediately so closest shrinks; push interior children far-to-near
+        uint32_t interior[ BVH_WIDTH ];
+        uint32_t numInterior = 0;
+        for ( uint32_t i = 0; i < numHits; i++ ) {
+            uint32_t c = order[ i ];
+            if ( childDistance[ c ] > closest )
+                continue;
+
+            if ( node->count[ c ] > 0 ) {
+                KERNEL::leafHit( kr, bvh, (uint32_t)node->child[ c ], node->count[ c ], &closest, &closestID );
+            } else {
+                interior[ numInterior++ ] = c;
+            }
+        }
+
+        for ( uint32_t i = numInterior; i > 0; i-- ) {
+            stack[ stackSize ]         = node->child[ interior[ i - 1 ] ];
+            stackDistance[ stackSize ] = childDistance[ interior[ i - 1 ] ];
+            stackSize++;
+        }
+    }
+
+    if ( closestID < 0 )
+        return false;
+
+    _finishHit( bvh, r, (uint32_t)closestID, closest, p_hit );
+    return true;
+}
+
+
+//
+// SSE4.2: children and spheres four at a time
+//
+
+struct _kernel_sse42 {
+    typedef struct {
+        __m128 ox, oy, oz;
+        __m128 dx, dy, dz;
+        __m128 ix, iy, iz;
+        __m128 min;
+        __m128 a;
+    } ray_t;
+
+    SIMD_TARGET( "sse4.2" ) static inline void setup( const ray& r, float min, ray_t* kr )
+    {
+        kr->ox  = _mm_set1_ps( r.origin.x );
+        kr->oy  = _mm_set1_ps( r.origin.y );
+        kr->oz  = _mm_set1_ps( r.origin.z );
+        kr->dx  = _mm_set1_ps( r.direction.x );
+        kr->dy  = _mm_set1_ps( r.direction.y );
+        kr->dz  = _mm_set1_ps( r.direction.z );
+        kr->ix  = _mm_set1_ps( 1.0f / r.direction.x );
+        kr->iy  = _mm_set1_ps( 1.0f / r.direction.y );
+        kr->iz  = _mm_set1_ps( 1.0f / r.direction.z );
+        kr->min = _mm_set1_ps( min );
+        kr->a   = _mm_set1_ps( r.direction.dot( r.direction ) );
+    }
+
+    SIMD_TARGET( "sse4.2" ) static inline void nodeDistances( const ray_t& kr, const bvh_wide_node_t* node, float closest, float* p_distance )
+    {
+        const __m128 far  = _mm_set1_ps( closest );
+        const __m128 pad  = _mm_set1_ps( BVH_SLAB_PAD );
+        const __m128 none = _mm_set1_ps( FLT_MAX );
+
+        for ( uint32_t c = 0; c < BVH_WIDTH; c += 4 ) {
+            __m128 t0    = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node->min_x[ c ] ), kr.ox ), kr.ix );
+            __m128 t1    = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node->max_x[ c ] ), kr.ox ), kr.ix );
+            __m128 tNear = _mm_max_ps( kr.min, _mm_min_ps( t0, t1 ) );
+            __m128 tFar  = _mm_min_ps( far, _mm_mul_ps( _mm_max_ps( t0, t1 ), pad ) );
+
+            t0    = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node->min_y[ c ] ), kr.oy ), kr.iy );
+            t1    = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node->max_y[ c ] ), kr.oy ), kr.iy );
+            tNear = _mm_max_ps( tNear, _mm_min_ps( t0, t1 ) );
+            tFar  = _mm_min_ps( tFar, _mm_mul_ps( _mm_max_ps( t0, t1 ), pad ) );
+
+            t0    = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node->min_z[ c ] ), kr.oz ), kr.iz );
+            t1    = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node->max_z[ c ] ), kr.oz ), kr.iz );
+            tNear = _mm_max_ps( tNear, _mm_min_ps( t0, t1 ) );
+            tFar  = _mm_min_ps( tFar, _mm_mul_ps( _mm_max_ps( t0, t1 ), pad ) );
+
+            __m128 used = _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_load_si128( (const __m128i*)&node->child[ c ] ), _mm_set1_epi32( -1 ) ) );
+            __m128 hit  = _mm_and_ps( used, _mm_cmple_ps( tNear, tFar ) );
+            _mm_storeu_ps( &p_distance[ c ], _mm_blendv_ps( none, tNear, hit ) );
+        }
+    }
+
+    SIMD_TARGET( "sse4.2" ) static inline void leafHit( const ray_t& kr, const bvh_simd_t* bvh, uint32_t first, uint32_t count, float* p_closest, int32_t* p_closestID )
+    {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 sign = _mm_set1_ps( -0.0f );
+        const __m128 none = _mm_set1_ps( FLT_MAX );
+
+        for ( uint32_t j = 0; j < count; j += 4 ) {
+            uint32_t i    = first + j;
+            __m128   live = _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_set1_epi32( (int32_t)( count - j ) ), _mm_set_epi32( 3, 2, 1, 0 ) ) );
+
+            // Same operations, in the same order, as sphereHit()
+            __m128 ocx = _mm_sub_ps( kr.ox, _mm_load_ps( &bvh->center_x[ i ] ) );
+            __m128 ocy = _mm_sub_ps( kr.oy, _mm_load_ps( &bvh->center_y[ i ] ) );
+            __m128 ocz = _mm_sub_ps( kr.oz, _mm_load_ps( &bvh->center_z[ i ] ) );
+            __m128 rad = _mm_load_ps( &bvh->radius[ i ] );
+            __m128 b   = _mm_add_ps( _mm_add_ps( _mm_mul_ps( ocx, kr.dx ), _mm_mul_ps( ocy, kr.dy ) ), _mm_mul_ps( ocz, kr.dz ) );
+            __m128 c   = _mm_sub_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( ocx, ocx ), _mm_mul_ps( ocy, ocy ) ), _mm_mul_ps( ocz, ocz ) ), _mm_mul_ps( rad, rad ) );
+            __m128 d   = _mm_sub_ps( _mm_mul_ps( b, b ), _mm_mul_ps( kr.a, c ) );
+
+            __m128 valid = _mm_and_ps( live, _mm_cmpgt_ps( d, zero ) );
+            if ( _mm_movemask_ps( valid ) == 0 )
+                continue;
+
+            __m128 closest = _mm_set1_ps( *p_closest );
+            __m128 root    = _mm_sqrt_ps( d );
+            __m128 nb      = _mm_xor_ps( b, sign );
+            __m128 t1      = _mm_div_ps( _mm_sub_ps( nb, root ), kr.a );
+            __m128 t2      = _mm_div_ps( _mm_add_ps( nb, root ), kr.a );
+            __m128 ok1     = _mm_and_ps( _mm_cmplt_ps( t1, closest ), _mm_cmpgt_ps( t1, kr.min ) );
+            __m128 ok2     = _mm_and_ps( _mm_cmplt_ps( t2, closest ), _mm_cmpgt_ps( t2, kr.min ) );
+            __m128 ok      = _mm_and_ps( valid, _mm_or_ps( ok1, ok2 ) );
+            __m128 t       = _mm_blendv_ps( none, _mm_blendv_ps( t2, t1, ok1 ), ok );
+
+            // Closest-hit reduction: the minimum across lanes, and the first lane holding it
+            __m128 m = _mm_min_ps( t, _mm_shuffle_ps( t, t, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+            m        = _mm_min_ps( m, _mm_shuffle_ps( m, m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+
+            uint32_t bits = (uint32_t)_mm_movemask_ps( _mm_and_ps( ok, _mm_cmpeq_ps( t, m ) ) );
+            if ( bits ) {
+                *p_closest   = _mm_cvtss_f32( m );
+                *p_closestID = (int32_t)( i + _lowestBit( bits ) );
+            }
+        }
+    }
+};
+
+
+//
+// AVX2: all eight children in one vector, spheres eight at a time
+//
+
+struct _kernel_avx2 {
+    typedef struct {
+        __m256 ox, oy, oz;
+        __m256 dx, dy, dz;
+        __m256 ix, iy, iz;
+        __m256 min;
+        __m256 a;
+    } ray_t;
+
+    SIMD_TARGET( "avx2" ) static inline void setup( const ray& r, float min, ray_t* kr )
+    {
+        kr->ox  = _mm256_set1_ps( r.origin.x );
+        kr->oy  = _mm256_set1_ps( r.origin.y );
+        kr->oz  = _mm256_set1_ps( r.origin.z );
+        kr->dx  = _mm256_set1_ps( r.direction.x );
+        kr->dy  = _mm256_set1_ps( r.direction.y );
+        kr->dz  = _mm256_set1_ps( r.direction.z );
+        kr->ix  = _mm256_set1_ps( 1.0f / r.direction.x );
+        kr->iy  = _mm256_set1_ps( 1.0f / r.direction.y );
+        kr->iz  = _mm256_set1_ps( 1.0f / r.direction.z );
+        kr->min = _mm256_set1_ps( min );
+        kr->a   = _mm256_set1_ps( r.direction.dot( r.direction ) );
+    }
+
+    SIMD_TARGET( "avx2" ) static inline void nodeDistances( const ray_t& kr, const bvh_wide_node_t* node, float closest, float* p_distance )
+    {
+        const __m256 pad = _mm256_set1_ps( BVH_SLAB_PAD );
+
+        __m256 t0    = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node->min_x ), kr.ox ), kr.ix );
+        __m256 t1    = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node->max_x ), kr.ox ), kr.ix );
+        __m256 tNear = _mm256_max_ps( kr.min, _mm256_min_ps( t0, t1 ) );
+        __m256 tFar  = _mm256_min_ps( _mm256_set1_ps( closest ), _mm256_mul_ps( _mm256_max_ps( t0, t1 ), pad ) );
+
+        t0    = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node->min_y ), kr.oy ), kr.iy );
+        t1    = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node->max_y ), kr.oy ), kr.iy );
+        tNear = _mm256_max_ps( tNear, _mm256_min_ps( t0, t1 ) );
+        tFar  = _mm256_min_ps( tFar, _mm256_mul_ps( _mm256_max_ps( t0, t1 ), pad ) );
+
+        t0    = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node->min_z ), kr.oz ), kr.iz );
+        t1    = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node->max_z ), kr.oz ), kr.iz );
+        tNear = _mm256_max_ps( tNear, _mm256_min_ps( t0, t1 ) );
+        tFar  = _mm256_min_ps( tFar, _mm256_mul_ps( _mm256_max_ps( t0, t1 ), pad ) );
+
+        __m256 used = _mm256_castsi256_ps( _mm256_cmpgt_epi32( _mm256_load_si256( (const __m256i*)node->child ), _mm256_set1_epi32( -1 ) ) );
+        __m256 hit  = _mm256_and_ps( used, _mm256_cmp_ps( tNear, tFar, _CMP_LE_OQ ) );
+        _mm256_storeu_ps( p_distance, _mm256_blendv_ps( _mm256_set1_ps( FLT_MAX ), tNear, hit ) );
+    }
+
+    SIMD_TARGET( "avx2" ) static inline void leafHit( const ray_t& kr, const bvh_simd_t* bvh, uint32_t first, uint32_t count, float* p_closest, int32_t* p_closestID )
+    {
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 sign = _mm256_set1_ps( -0.0f );
+        const __m256 none = _mm256_set1_ps( FLT_MAX );
+
+        for ( uint32_t j = 0; j < count; j += 8 ) {
+            uint32_t i    = first + j;
+            __m256   live = _mm256_castsi256_ps( _mm256_cmpgt_epi32( _mm256_set1_epi32( (int32_t)( count - j ) ), _mm256_set_epi32( 7, 6, 5, 4, 3, 2, 1, 0 ) ) );
+
+            // Same operations, in the same order, as sphereHit()
+            __m256 ocx = _mm256_sub_ps( kr.ox, _mm256_load_ps( &bvh->center_x[ i ] ) );
+            __m256 ocy = _mm256_sub_ps( kr.oy, _mm256_load_ps( &bvh->center_y[ i ] ) );
+            __m256 ocz = _mm256_sub_ps( kr.oz, _mm256_load_ps( &bvh->center_z[ i ] ) );
+            __m256 rad = _mm256_load_ps( &bvh->radius[ i ] );
+            __m256 b   = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ocx, kr.dx ), _mm256_mul_ps( ocy, kr.dy ) ), _mm256_mul_ps( ocz, kr.dz ) );
+            __m256 c   = _mm256_sub_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ocx, ocx ), _mm256_mul_ps( ocy, ocy ) ), _mm256_mul_ps( ocz, ocz ) ), _mm256_mul_ps( rad, rad ) );
+            __m256 d   = _mm256_sub_ps( _mm256_mul_ps( b, b ), _mm256_mul_ps( kr.a, c ) );
+
+            __m256 valid = _mm256_and_ps( live, _mm256_cmp_ps( d, zero, _CMP_GT_OQ ) );
+            if ( _mm256_movemask_ps( valid ) == 0 )
+                continue;
+
+            __m256 closest = _mm256_set1_ps( *p_closest );
+            __m256 root    = _mm256_sqrt_ps( d );
+            __m256 nb      = _mm256_xor_ps( b, sign );
+            __m256 t1      = _mm256_div_ps( _mm256_sub_ps( nb, root ), kr.a );
+            __m256 t2      = _mm256_div_ps( _mm256_add_ps( nb, root ), kr.a );
+            __m256 ok1     = _mm256_and_ps( _mm256_cmp_ps( t1, closest, _CMP_LT_OQ ), _mm256_cmp_ps( t1, kr.min, _CMP_GT_OQ ) );
+            __m256 ok2     = _mm256_and_ps( _mm256_cmp_ps( t2, closest, _CMP_LT_OQ ), _mm256_cmp_ps( t2, kr.min, _CMP_GT_OQ ) );
+            __m256 ok      = _mm256_and_ps( valid, _mm256_or_ps( ok1, ok2 ) );
+            __m256 t       = _mm256_blendv_ps( none, _mm256_blendv_ps( t2, t1, ok1 ), ok );
+
+            // Closest-hit reduction: the minimum across lanes, and the first lane holding it
+            __m256 m = _mm256_min_ps( t, _mm256_permute2f128_ps( t, t, 0x01 ) );
+            m        = _mm256_min_ps( m, _mm256_shuffle_ps( m, m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+            m        = _mm256_min_ps( m, _mm256_shuffle_ps( m, m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+
+            uint32_t bits = (uint32_t)_mm256_movemask_ps( _mm256_and_ps( ok, _mm256_cmp_ps( t, m, _CMP_EQ_OQ ) ) );
+            if ( bits ) {
+                *p_closest   = _mm_cvtss_f32( _mm256_castps256_ps128( m ) );
+                *p_closestID = (int32_t)( i + _lowestBit( bits ) );
+            }
+        }
+    }
+};
+
+
+//
+// AVX-512: children as AVX2 (a node only has eight), spheres sixteen at a time with mask registers
+//
+
+struct _kernel_avx512 {
+    typedef struct {
+        _kernel_avx2::ray_t node;
+        __m512              ox, oy, oz;
+        __m512              dx, dy, dz;
+        __m512              min;
+        __m512              a;
+    } ray_t;
+
+    SIMD_TARGET( "avx512f" ) static inline void setup( const ray& r, float min, ray_t* kr )
+    {
+        _kernel_avx2::setup( r, min, &kr->node );
+
+        kr->ox  = _mm512_set1_ps( r.origin.x );
+        kr->oy  = _mm512_set1_ps( r.origin.y );
+        kr->oz  = _mm512_set1_ps( r.origin.z );
+        kr->dx  = _mm512_set1_ps( r.direction.x );
+        kr->dy  = _mm512_set1_ps( r.direction.y );
+        kr->dz  = _mm512_set1_ps( r.direction.z );
+        kr->min = _mm512_set1_ps( min );
+        kr->a   = _mm512_set1_ps( r.direction.dot( r.direction ) );
+    }
+
+    SIMD_TARGET( "avx512f" ) static inline void nodeDistances( const ray_t& kr, const bvh_wide_node_t* node, float closest, float* p_distance )
+    {
+        _kernel_avx2::nodeDistances( kr.node, node, closest, p_distance );
+    }
+
+    SIMD_TARGET( "avx512f" ) static inline void leafHit( const ray_t& kr, const bvh_simd_t* bvh, uint32_t first, uint32_t count, float* p_closest, int32_t* p_closestID )
+    {
+        const __m512 zero = _mm512_setzero_ps();
+        const __m512 none = _mm512_set1_ps( FLT_MAX );
+
+        for ( uint32_t j = 0; j < count; j += 16 ) {
+            uint32_t  i    = first + j;
+            // Same operations, in the same order, as sphereHit()
+            __mmask16 live = count - j >= 16 ? (__mmask16)0xFFFF : (__mmask16)( ( 1u << ( count - j ) ) - 1 );
+
+            __m512 ocx = _mm512_sub_ps( kr.ox, _mm512_load_ps( &bvh->center_x[ i ] ) );
+            __m512 ocy = _mm512_sub_ps( kr.oy, _mm512_load_ps( &bvh->center_y[ i ] ) );
+            __m512 ocz = _mm512_sub_ps( kr.oz, _mm512_load_ps( &bvh->center_z[ i ] ) );
+            __m512 rad = _mm512_load_ps( &bvh->radius[ i ] );
+            __m512 b   = _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( ocx, kr.dx ), _mm512_mul_ps( ocy, kr.dy ) ), _mm512_mul_ps( ocz, kr.dz ) );
+            __m512 c   = _mm512_sub_ps( _mm512_add_ps( _mm512_add_ps( _mm512_mul_ps( ocx, ocx ), _mm512_mul_ps( ocy, ocy ) ), _mm512_mul_ps( ocz, ocz ) ), _mm512_mul_ps( rad, rad ) );
+            __m512 d   = _mm512_sub_ps( _mm512_mul_ps( b, b ), _mm512_mul_ps( kr.a, c ) );
+
+            __mmask16 valid = _mm512_mask_cmp_ps_mask( live, d, zero, _CMP_GT_OQ );
+            if ( valid == 0 )
+                continue;
+
+            __m512    closest = _mm512_set1_ps( *p_closest );
+            __m512    root    = _mm512_sqrt_ps( d );
+            __m512    nb      = _mm512_sub_ps( zero, b );
+            __m512    t1      = _mm512_div_ps( _mm512_sub_ps( nb, root ), kr.a );
+            __m512    t2      = _mm512_div_ps( _mm512_add_ps( nb, root ), kr.a );
+            __mmask16 ok1     = _mm512_mask_cmp_ps_mask( _mm512_mask_cmp_ps_mask( valid, t1, closest, _CMP_LT_OQ ), t1, kr.min, _CMP_GT_OQ );
+            __mmask16 ok2     = _mm512_mask_cmp_ps_mask( _mm512_mask_cmp_ps_mask( valid, t2, closest, _CMP_LT_OQ ), t2, kr.min, _CMP_GT_OQ );
+            __mmask16 ok      = ok1 | ok2;
+            if ( ok == 0 )
+                continue;
+
+            __m512 t = _mm512_mask_blend_ps( ok, none, _mm512_mask_blend_ps( ok1, t2, t1 ) );
+
+            // Closest-hit reduction: the minimum across lanes, and the first lane holding it
+            __m512 m = _mm512_min_ps( t, _mm512_shuffle_f32x4( t, t, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+            m        = _mm512_min_ps( m, _mm512_shuffle_f32x4( m, m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+            m        = _mm512_min_ps( m, _mm512_shuffle_ps( m, m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+            m        = _mm512_min_ps( m, _mm512_shuffle_ps( m, m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+
+            uint32_t bits = (uint32_t)_mm512_mask_cmp_ps_mask( ok, t, m, _CMP_EQ_OQ );
+            *p_closest    = _mm_cvtss_f32( _mm512_castps512_ps128( m ) );
+            *p_closestID  = (int32_t)( i + _lowestBit( bits ) );
+        }
+    }
+};
+
+
+SIMD_TARGET( "sse4.2" ) static bool _hitSSE42( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit )
+{
+    return _traverse<_kernel_sse42>( bvh, r, min, max, p_hit );
+}
+
+
+SIMD_TARGET( "avx2" ) static bool _hitAVX2( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit )
+{
+    return _traverse<_kernel_avx2>( bvh, r, min, max, p_hit );
+}
+
+
+SIMD_TARGET( "avx512f" ) static bool _hitAVX512( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit )
+{
+    return _traverse<_kernel_avx512>( bvh, r, min, max, p_hit );
+}
+
+#endif // BVH_SIMD_X86
+
+} // namespace pk
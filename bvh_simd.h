@@ -0,0 +1,72 @@
+#pragma once
+
+//
+// Native SIMD ray traversal: the wide BVH traced with SSE4.2, AVX2 or AVX-512 intrinsics, picked at runtime.
+//
+// One ray is tested against all eight children of a wide node at once (two SSE vectors, one AVX vector), and
+// against up to 8 (SSE4.2, AVX2) or 16 (AVX-512) spheres of a leaf at once, with a masked closest-hit reduction
+// across the lanes. Spheres are transposed into 64-byte aligned SoA arrays, and each leaf starts on a vector
+// boundary so every load is aligned.
+//
+// This gives the CPU renderer SIMD without the ISPC toolchain, and a baseline to hold ISPC codegen against.
+// Each sphere test rounds exactly like sphereHit(), so hits match bvhHit() apart from exact ties and the odd grazing
+// ray that bvhHit() culls with a single sphere's box.
+//
+
+#include "bvh.h"
+#include "material.h"
+#include "ray.h"
+
+#include <stdint.h>
+
+namespace pk
+{
+
+typedef enum {
+    SIMD_ISA_NONE   = 0, // scalar bvhHit()
+    SIMD_ISA_SSE42  = 1,
+    SIMD_ISA_AVX2   = 2,
+    SIMD_ISA_AVX512 = 3, // AVX-512F
+} simd_isa_t;
+
+
+typedef struct _bvh_simd bvh_simd_t;
+
+typedef bool ( *simdHitFunction )( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit );
+
+
+typedef struct _bvh_simd {
+    bvh_wide_node_t* nodes; // the wide BVH, with leaves pointing into the packed spheres below
+    uint32_t         numNodes;
+    uint32_t         depth;
+    float*           center_x; // packed spheres; each leaf starts on a 16-float boundary
+    float*           center_y;
+    float*           center_z;
+    float*           radius;
+    uint32_t*        materialID;
+    uint32_t         numSlots;
+    simd_isa_t       isa;
+    uint32_t         leafSize; // spheres per leaf; one vector's worth except on SSE4.2
+    simdHitFunction  hit;
+} bvh_simd_t;
+
+
+// The best ISA both the CPU and the OS support; SIMD_ISA_NONE off x86
+simd_isa_t simdDetectIsa();
+
+// --simd argument: "auto" (detect), "sse4", "avx2" or "avx512"; returns false if unrecognized
+bool        simdIsaFromName( const char* name, simd_isa_t* p_isa );
+const char* simdIsaName( simd_isa_t isa );
+
+// Fails (nullptr) if isa is SIMD_ISA_NONE or the host can't run it
+bvh_simd_t* bvhSimdCreate( const bvh_t* bvh, simd_isa_t isa );
+void        bvhSimdDestroy( bvh_simd_t* bvh );
+
+inline bool bvhSimdHit( const bvh_simd_t* bvh, const ray& r, float min, float max, hit_info* p_hit )
+{
+    return bvh->hit( bvh, r, min, max, p_hit );
+}
+
+void benchmarkBVHSimd();
+
+} // namespace pk
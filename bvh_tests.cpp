@@ -0,0 +1,384 @@
+#include "bvh.h"
+#include "bvh_simd.h"
+#include "perf_timer.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <thread>
+
+
+namespace pk
+{
+
+//
+// Benchmark BVH builders: build time, tree shape and traversal rate for SAH vs LBVH over increasing scene sizes.
+// Both trees are traced with the same rays. Every ray they disagree on, and a sample of the rest, is checked against
+// brute force; a difference is only a bug if exact arithmetic rules out sphereHit() rounding as its cause.
+//
+
+static const uint32_t BENCHMARK_NUM_RAYS      = 1 << 18;
+static const uint32_t BENCHMARK_NUM_CHECKED   = 256;   // rays checked against brute force even when the trees agree
+static const float    BENCHMARK_TOLERANCE     = 1e-4f; // relative, on hit distance
+static const double   BENCHMARK_ROUNDING_ULPS = 16.0;  // sphereHit()'s discriminant error, in FLT_EPSILON * |oc|^2
+static const uint32_t BENCHMARK_NUM_GRAZING   = 1024;  // rays that skim a sphere where it touches its bounding box
+
+typedef enum {
+    HIT_CHECK_MATCH,    // same hit as brute force, or both miss
+    HIT_CHECK_ROUNDING, // differs only where the ray grazes a sphere, within sphereHit()'s rounding
+    HIT_CHECK_WRONG,    // a traversal bug
+} hit_check_t;
+
+
+static void _randomSpheres( sphere_t* spheres, uint32_t numSpheres )
+{
+    // Keep density roughly constant as the scene grows
+    float extent = 10.0f * cbrtf( (float)numSpheres );
+
+    for ( uint32_t i = 0; i < numSpheres; i++ ) {
+        spheres[ i ].center     = vector3( extent * ( random() - 0.5f ), extent * ( random() - 0.5f ), extent * ( random() - 0.5f ) );
+        spheres[ i ].radius     = 0.2f + random();
+        spheres[ i ].materialID = 0;
+    }
+}
+
+
+// Rays through the point where a random sphere touches one face of its bounding box, tangent to the sphere there but
+// for a tilt of a few ulps. They lie almost in the face plane, so every slab test on that face is decided by rounding.
+static void _grazingRays( const sphere_t* spheres, uint32_t numSpheres, float extent, ray* rays, uint32_t numRays )
+{
+    for ( uint32_t i = 0; i < numRays; i++ ) {
+        const sphere_t& sphere = spheres[ std::min( (uint32_t)( random() * numSpheres ), numSpheres - 1 ) ];
+        int             axis   = std::min( (int)( random() * 3.0f ), 2 );
+        float           side   = random() < 0.5f ? -1.0f : 1.0f;
+
+        vector3 normal( axis == 0 ? side : 0.0f, axis == 1 ? side : 0.0f, axis == 2 ? side : 0.0f );
+        vector3 touch     = sphere.center + normal * sphere.radius;
+        vector3 direction = randomInUnitSphere();
+        direction         = direction - normal * ( direction.dot( normal ) - ( random() - 0.5f ) * 8.0f * FLT_EPSILON );
+
+        rays[ i ] = ray( touch - direction.normalized() * extent * 2.0f, direction );
+    }
+}
+
+
+static double _traceRays( const bvh_t* bvh, const ray* rays, hit_info* hits, uint32_t numRays, uint32_t* numHits )
+{
+    PerfTimer timer;
+
+    *numHits = 0;
+    for ( uint32_t i = 0; i < numRays; i++ ) {
+        if ( bvhHit( bvh, rays[ i ], 0.001f, FLT_MAX, &hits[ i ] ) ) {
+            ( *numHits )++;
+        } else {
+            hits[ i ].distance = -1.0f;
+        }
+    }
+
+    return timer.ElapsedSeconds();
+}
+
+
+static bool _sameHit( float a, float b )
+{
+    if ( a < 0.0f || b < 0.0f )
+        return a < 0.0f && b < 0.0f;
+
+    return fabsf( a - b ) <= BENCHMARK_TOLERANCE * std::max( a, b );
+}
+
+
+// Nearest hit over every sphere, as the trees should find it
+static bool _bruteForceHit( const sphere_t* spheres, uint32_t numSpheres, const ray& r, hit_info* p_hit )
+{
+    float closest = FLT_MAX;
+    bool  hit     = false;
+
+    for ( uint32_t i = 0; i < numSpheres; i++ ) {
+        if ( sphereHit( spheres[ i ], r, 0.001f, closest, p_hit ) ) {
+            closest = p_hit->distance;
+            hit     = true;
+        }
+    }
+
+    return hit;
+}
+
+
+// Where the ray is inside the sphere, in double precision, with radius^2 grown (margin 1) or shrunk (margin -1) by
+// sphereHit()'s rounding band. Measures the closest approach directly rather than through b * b - a * c, which cancels
+// when the origin is far from the sphere: in radius^2 units its float error is a few FLT_EPSILON * |oc|^2, and within
+// that band of the surface float and exact arithmetic can disagree on whether, and where, the ray hits.
+static bool _exactHit( const sphere_t& sphere, const ray& r, double margin, double* p_enter, double* p_exit )
+{
+    double ox = (double)r.origin.x - sphere.center.x;
+    double oy = (double)r.origin.y - sphere.center.y;
+    double oz = (double)r.origin.z - sphere.center.z;
+    double dx = r.direction.x;
+    double dy = r.direction.y;
+    double dz = r.direction.z;
+
+    double a  = dx * dx + dy * dy + dz * dz;
+    double tc = -( ox * dx + oy * dy + oz * dz ) / a;
+    double px = ox + tc * dx;
+    double py = oy + tc * dy;
+    double pz = oz + tc * dz;
+
+    double band   = BENCHMARK_ROUNDING_ULPS * FLT_EPSILON * ( ox * ox + oy * oy + oz * oz );
+    double inside = (double)sphere.radius * sphere.radius - ( px * px + py * py + pz * pz ) + margin * band;
+    if ( inside < 0.0 )
+        return false;
+
+    double half = sqrt( inside / a );
+    *p_enter    = tc - half;
+    *p_exit     = tc + half;
+
+    // sphereHit() takes the far side when the near one is behind min
+    if ( *p_enter <= 0.001 ) {
+        *p_enter = *p_exit;
+    }
+
+    return *p_exit > 0.001;
+}
+
+
+static hit_check_t _checkHit( const sphere_t* spheres, uint32_t numSpheres, const ray& r, float distance )
+{
+    hit_info ref;
+    float    refDistance = _bruteForceHit( spheres, numSpheres, r, &ref ) ? ref.distance : -1.0f;
+
+    if ( _sameHit( distance, refDistance ) )
+        return HIT_CHECK_MATCH;
+
+    double nearest   = distance < 0.0f ? DBL_MAX : distance * ( 1.0 - BENCHMARK_TOLERANCE );
+    bool   explained = distance < 0.0f; // a miss needs no sphere to account for it
+
+    for ( uint32_t i = 0; i < numSpheres; i++ ) {
+        double enter, exit;
+
+        // Skipped a sphere the ray enters, rounding or not, before the tree's hit
+        if ( _exactHit( spheres[ i ], r, -1.0, &enter, &exit ) && enter < nearest )
+            return HIT_CHECK_WRONG;
+
+        // The tree's hit has to be on a sphere the ray at least grazes
+        if ( !explained && _exactHit( spheres[ i ], r, 1.0, &enter, &exit ) && distance >= enter * ( 1.0 - BENCHMARK_TOLERANCE ) &&
+             distance <= exit * ( 1.0 + BENCHMARK_TOLERANCE ) )
+            explained = true;
+    }
+
+    return explained ? HIT_CHECK_ROUNDING : HIT_CHECK_WRONG;
+}
+
+
+void benchmarkBVH()
+{
+    const uint32_t sizes[]    = { 1000, 10000, 100000, 1000000 };
+    int            numThreads = std::thread::hardware_concurrency() - 1;
+
+    thread_pool_t tp = threadPoolCreate( numThreads );
+
+    ray*      rays     = new ray[ BENCHMARK_NUM_RAYS ];
+    hit_info* sahHits  = new hit_info[ BENCHMARK_NUM_RAYS ];
+    hit_info* lbvhHits = new hit_info[ BENCHMARK_NUM_RAYS ];
+
+    printf( "%10s %6s %12s %10s %6s %12s\n", "spheres", "build", "build ms", "nodes", "depth", "Mrays/s" );
+
+    for ( int s = 0; s < ARRAY_SIZE( sizes ); s++ ) {
+        uint32_t  numSpheres = sizes[ s ];
+        sphere_t* spheres    = new sphere_t[ numSpheres ];
+        sphere_t* copy       = new sphere_t[ numSpheres ];
+
+        _randomSpheres( spheres, numSpheres );
+        for ( uint32_t i = 0; i < numSpheres; i++ ) {
+            copy[ i ] = spheres[ i ];
+        }
+
+        // Rays from outside the scene aimed at random points inside it
+        float extent = 10.0f * cbrtf( (float)numSpheres );
+        for ( uint32_t i = 0; i < BENCHMARK_NUM_RAYS; i++ ) {
+            vector3 origin = randomInUnitSphere() * extent * 2.0f;
+            vector3 target( extent * ( random() - 0.5f ), extent * ( random() - 0.5f ), extent * ( random() - 0.5f ) );
+
+            rays[ i ] = ray( origin, target - origin );
+        }
+
+        PerfTimer timer;
+        bvh_t*    sah      = bvhCreate( spheres, numSpheres, BVH_BUILDER_SAH, tp );
+        double    sahBuild = timer.ElapsedNanoseconds() / 1e6;
+
+        timer.Reset();
+        bvh_t* lbvh      = bvhCreate( copy, numSpheres, BVH_BUILDER_LBVH, tp );
+        double lbvhBuild = timer.ElapsedNanoseconds() / 1e6;
+
+        uint32_t sahHitCount  = 0;
+        uint32_t lbvhHitCount = 0;
+        double   sahTrace     = _traceRays( sah, rays, sahHits, BENCHMARK_NUM_RAYS, &sahHitCount );
+        double   lbvhTrace    = _traceRays( lbvh, rays, lbvhHits, BENCHMARK_NUM_RAYS, &lbvhHitCount );
+
+        // Builders order the spheres differently, so compare distances rather than sphere indices
+        uint32_t checked  = 0;
+        uint32_t rounding = 0;
+        uint32_t wrong    = 0;
+        for ( uint32_t i = 0; i < BENCHMARK_NUM_RAYS; i++ ) {
+            if ( i >= BENCHMARK_NUM_CHECKED && _sameHit( sahHits[ i ].distance, lbvhHits[ i ].distance ) )
+                continue;
+
+            hit_check_t checks[] = {
+                _checkHit( spheres, numSpheres, rays[ i ], sahHits[ i ].distance ),
+                _checkHit( spheres, numSpheres, rays[ i ], lbvhHits[ i ].distance ),
+            };
+
+            checked++;
+            for ( int c = 0; c < ARRAY_SIZE( checks ); c++ ) {
+                rounding += checks[ c ] == HIT_CHECK_ROUNDING ? 1 : 0;
+                wrong    += checks[ c ] == HIT_CHECK_WRONG ? 1 : 0;
+            }
+        }
+
+        printf( "%10u %6s %12f %10u %6u %12f\n", numSpheres, bvhBuilderName( BVH_BUILDER_SAH ), sahBuild, sah->numNodes, sah->depth, BENCHMARK_NUM_RAYS / sahTrace / 1000000.0 );
+        printf( "%10u %6s %12f %10u %6u %12f\n", numSpheres, bvhBuilderName( BVH_BUILDER_LBVH ), lbvhBuild, lbvh->numNodes, lbvh->depth, BENCHMARK_NUM_RAYS / lbvhTrace / 1000000.0 );
+        printf( "%10s %u rays checked against brute force, %u sphereHit() rounding differences\n", "", checked, rounding );
+
+        if ( wrong ) {
+            printf( "ERROR: %u wrong hits in %u checked rays (%u vs %u hits)\n", wrong, checked, sahHitCount, lbvhHitCount );
+        }
+        assert( wrong == 0 );
+
+        bvhDestroy( sah );
+        bvhDestroy( lbvh );
+        delete[] spheres;
+        delete[] copy;
+    }
+
+    threadPoolDestroy( tp );
+
+    delete[] rays;
+    delete[] sahHits;
+    delete[] lbvhHits;
+}
+
+
+//
+// Benchmark the intrinsics traversal against scalar bvhHit() on the same rays, for every ISA the host runs.
+// Rays the two disagree on, and a sample of the rest, are checked against brute force like benchmarkBVH() does,
+// along with a set of rays that graze spheres exactly where the slab tests are closest to rounding to a miss.
+//
+
+static double _traceRaysSimd( const bvh_simd_t* bvh, const ray* rays, hit_info* hits, uint32_t numRays, uint32_t* numHits )
+{
+    PerfTimer timer;
+
+    *numHits = 0;
+    for ( uint32_t i = 0; i < numRays; i++ ) {
+        if ( bvhSimdHit( bvh, rays[ i ], 0.001f, FLT_MAX, &hits[ i ] ) ) {
+            ( *numHits )++;
+        } else {
+            hits[ i ].distance = -1.0f;
+        }
+    }
+
+    return timer.ElapsedSeconds();
+}
+
+
+void benchmarkBVHSimd()
+{
+    const uint32_t   sizes[] = { 1000, 10000, 100000, 1000000 };
+    const simd_isa_t isas[]  = { SIMD_ISA_SSE42, SIMD_ISA_AVX2, SIMD_ISA_AVX512 };
+
+    ray*      rays       = new ray[ BENCHMARK_NUM_RAYS ];
+    hit_info* scalarHits = new hit_info[ BENCHMARK_NUM_RAYS ];
+    hit_info* simdHits   = new hit_info[ BENCHMARK_NUM_RAYS ];
+    ray*      grazing    = new ray[ BENCHMARK_NUM_GRAZING ];
+
+    printf( "Host SIMD: %s\n", simdIsaName( simdDetectIsa() ) );
+    printf( "%10s %8s %6s %10s %12s %10s\n", "spheres", "isa", "leaf", "nodes", "Mrays/s", "speedup" );
+
+    for ( int s = 0; s < ARRAY_SIZE( sizes ); s++ ) {
+        uint32_t  numSpheres = sizes[ s ];
+        sphere_t* spheres    = new sphere_t[ numSpheres ];
+
+        _randomSpheres( spheres, numSpheres );
+
+        float extent = 10.0f * cbrtf( (float)numSpheres );
+        for ( uint32_t i = 0; i < BENCHMARK_NUM_RAYS; i++ ) {
+            vector3 origin = randomInUnitSphere() * extent * 2.0f;
+            vector3 target( extent * ( random() - 0.5f ), extent * ( random() - 0.5f ), extent * ( random() - 0.5f ) );
+
+            rays[ i ] = ray( origin, target - origin );
+        }
+        _grazingRays( spheres, numSpheres, extent, grazing, BENCHMARK_NUM_GRAZING );
+
+        bvh_t* bvh = bvhCreate( spheres, numSpheres );
+
+        uint32_t  scalarHitCount = 0;
+        PerfTimer timer;
+        _traceRays( bvh, rays, scalarHits, BENCHMARK_NUM_RAYS, &scalarHitCount );
+        double scalarTrace = timer.ElapsedSeconds();
+
+        printf( "%10u %8s %6s %10u %12f %10s\n", numSpheres, simdIsaName( SIMD_ISA_NONE ), "-", bvh->numNodes, BENCHMARK_NUM_RAYS / scalarTrace / 1000000.0, "1.00x" );
+
+        for ( int i = 0; i < ARRAY_SIZE( isas ); i++ ) {
+            bvh_simd_t* simd = bvhSimdCreate( bvh, isas[ i ] );
+            if ( !simd ) {
+                printf( "%10u %8s (not supported by this host)\n", numSpheres, simdIsaName( isas[ i ] ) );
+                continue;
+            }
+
+            uint32_t simdHitCount = 0;
+            double   simdTrace    = _traceRaysSimd( simd, rays, simdHits, BENCHMARK_NUM_RAYS, &simdHitCount );
+
+            uint32_t checked  = 0;
+            uint32_t rounding = 0;
+            uint32_t wrong    = 0;
+            for ( uint32_t r = 0; r < BENCHMARK_NUM_RAYS; r++ ) {
+                if ( r >= BENCHMARK_NUM_CHECKED && _sameHit( scalarHits[ r ].distance, simdHits[ r ].distance ) )
+                    continue;
+
+                hit_check_t check = _checkHit( spheres, numSpheres, rays[ r ], simdHits[ r ].distance );
+
+                checked++;
+                rounding += check == HIT_CHECK_ROUNDING ? 1 : 0;
+                wrong    += check == HIT_CHECK_WRONG ? 1 : 0;
+            }
+
+            // Every grazing ray is checked, whether or not the scalar traversal agrees
+            for ( uint32_t r = 0; r < BENCHMARK_NUM_GRAZING; r++ ) {
+                hit_info    hit;
+                hit_check_t check = _checkHit( spheres, numSpheres, grazing[ r ], bvhSimdHit( simd, grazing[ r ], 0.001f, FLT_MAX, &hit ) ? hit.distance : -1.0f );
+
+                checked++;
+                rounding += check == HIT_CHECK_ROUNDING ? 1 : 0;
+                wrong    += check == HIT_CHECK_WRONG ? 1 : 0;
+            }
+
+            char speedup[ 16 ];
+            snprintf( speedup, sizeof( speedup ), "%.2fx", scalarTrace / simdTrace );
+            printf( "%10u %8s %6u %10u %12f %10s", numSpheres, simdIsaName( simd->isa ), simd->leafSize, simd->numNodes, BENCHMARK_NUM_RAYS / simdTrace / 1000000.0, speedup );
+            printf( rounding ? " (%u of %u checked rays differ by sphereHit() rounding)\n" : "\n", rounding, checked );
+
+            if ( wrong ) {
+                printf( "ERROR: %u of %u checked rays wrong (%u vs %u hits)\n", wrong, checked, scalarHitCount, simdHitCount );
+            }
+            assert( wrong == 0 );
+
+            bvhSimdDestroy( simd );
+        }
+
+        bvhDestroy( bvh );
+        delete[] spheres;
+    }
+
+    delete[] rays;
+    delete[] scalarHits;
+    delete[] simdHits;
+    delete[] grazing;
+}
+
+
+} // namespace pk
@@ -0,0 +1,73 @@
+#include "futex.h"
+
+#include <thread>
+
+#if defined( _WIN32 )
+#include <windows.h>
+#pragma comment( lib, "Synchronization.lib" )
+#elif defined( __linux__ )
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace pk
+{
+
+static_assert( sizeof( std::atomic<uint32_t> ) == sizeof( uint32_t ), "futex words must be plain 32-bit integers" );
+
+
+//
+// Public
+//
+
+bool futexWait( std::atomic<uint32_t>* word, uint32_t expected, uint32_t timeout_ms )
+{
+#if defined( _WIN32 )
+    DWORD timeout = timeout_ms == FUTEX_INFINITE ? INFINITE : (DWORD)timeout_ms;
+    if ( !WaitOnAddress( (volatile VOID*)word, &expected, sizeof( expected ), timeout ) ) {
+        return GetLastError() != ERROR_TIMEOUT;
+    }
+    return true;
+#elif defined( __linux__ )
+    struct timespec  ts;
+    struct timespec* p_ts = nullptr;
+    if ( timeout_ms != FUTEX_INFINITE ) {
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000L;
+        p_ts       = &ts;
+    }
+
+    if ( syscall( SYS_futex, (uint32_t*)word, FUTEX_WAIT_PRIVATE, expected, p_ts, nullptr, 0 ) != 0 ) {
+        return errno != ETIMEDOUT;
+    }
+    return true;
+#else
+    std::this_thread::yield();
+    return true;
+#endif
+}
+
+
+void futexWakeOne( std::atomic<uint32_t>* word )
+{
+#if defined( _WIN32 )
+    WakeByAddressSingle( (PVOID)word );
+#elif defined( __linux__ )
+    syscall( SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0 );
+#endif
+}
+
+
+void futexWakeAll( std::atomic<uint32_t>* word )
+{
+#if defined( _WIN32 )
+    WakeByAddressAll( (PVOID)word );
+#elif defined( __linux__ )
+    syscall( SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0 );
+#endif
+}
+
+} // namespace pk
@@ -0,0 +1,24 @@
+#pragma once
+
+//
+// Wait on and wake a 32-bit atomic, the way a futex does: a waiter sleeps in the kernel only while the word still
+// holds the value it expects, so a wake between checking a condition and sleeping on it is never lost.
+// Linux uses futex(2), Windows WaitOnAddress(); anything else yields and returns, which callers treat as a spurious
+// wake.
+//
+
+#include <atomic>
+#include <stdint.h>
+
+namespace pk
+{
+
+#define FUTEX_INFINITE ( uint32_t( -1 ) )
+
+// Sleep while *word == expected, until a wake or timeout_ms passes. May return early; callers re-check their
+// condition and wait again. False only on timeout.
+bool futexWait( std::atomic<uint32_t>* word, uint32_t expected, uint32_t timeout_ms = FUTEX_INFINITE );
+void futexWakeOne( std::atomic<uint32_t>* word );
+void futexWakeAll( std::atomic<uint32_t>* word );
+
+} // namespace pk
@@ -0,0 +1,701 @@
+#include "image_writer.h"
+
+#include "perf_timer.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <ctype.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#undef R_OK // access() mode from unistd.h; shadows pk::R_OK
+#endif
+
+
+namespace pk
+{
+
+//
+// Private types and data
+//
+
+static const size_t WRITER_ALIGNMENT     = 4096;        // O_DIRECT wants sector-aligned buffers, offsets and sizes
+static const size_t WRITER_STAGING_BYTES = 1024 * 1024; // rows are batched up to this much per write
+
+typedef struct _image_writer {
+#ifdef _WIN32
+    HANDLE file;
+#else
+    int fd;
+#endif
+    bool     direct;
+    uint8_t* buffer; // staging buffer, WRITER_ALIGNMENT aligned
+    size_t   capacity;
+    size_t   used;
+    uint64_t size; // logical file size; with direct I/O the last write is padded and truncated back to this
+
+    _image_writer() :
+#ifdef _WIN32
+        file( INVALID_HANDLE_VALUE ),
+#else
+        fd( -1 ),
+#endif
+        direct( false ),
+        buffer( nullptr ),
+        capacity( 0 ),
+        used( 0 ),
+        size( 0 )
+    {
+    }
+} _image_writer_t;
+
+
+// A finished tile waiting for the writer thread, already clipped to the image
+typedef struct _tile {
+    uint32_t      x;
+    uint32_t      y;
+    uint32_t      width;
+    uint32_t      height;
+    struct _tile* next;
+} _tile_t;
+
+struct _tile_writer {
+    image_format_t               format;
+    const uint32_t*              framebuffer;
+    const accumulation_buffer_t* accumulation;
+    uint32_t        cols;
+    uint32_t        rows;
+    size_t          headerBytes;
+    size_t          rowBytes;
+    uint64_t        size;
+    uint8_t*        map;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    // Render threads push onto pending with a CAS; the writer thread takes the whole list with one exchange
+    std::atomic<_tile_t*>   pending;
+    std::atomic<bool>       sleeping;
+    std::atomic<bool>       closing;
+    std::mutex              mutex;
+    std::condition_variable wake;
+    std::thread             thread;
+
+    // Writer thread only
+    uint32_t tilesWritten;
+    double   writeMs;
+
+    _tile_writer() :
+        format( IMAGE_FORMAT_UNKNOWN ),
+        framebuffer( nullptr ),
+        accumulation( nullptr ),
+        cols( 0 ),
+        rows( 0 ),
+        headerBytes( 0 ),
+        rowBytes( 0 ),
+        size( 0 ),
+        map( nullptr ),
+#ifdef _WIN32
+        file( INVALID_HANDLE_VALUE ),
+        mapping( nullptr ),
+#else
+        fd( -1 ),
+#endif
+        pending( nullptr ),
+        sleeping( false ),
+        closing( false ),
+        tilesWritten( 0 ),
+        writeMs( 0.0 )
+    {
+    }
+};
+
+
+static bool     _hasSource( image_format_t format, const uint32_t* framebuffer, const accumulation_buffer_t* accumulation, uint32_t cols, uint32_t rows );
+static size_t   _formatHeader( char* header, size_t size, image_format_t format, uint32_t cols, uint32_t rows );
+static size_t   _pixelBytes( image_format_t format );
+static void     _encodeRow( const uint32_t* src, uint32_t count, uint8_t* dst );
+static void     _encodeLinearRow( const float* src, uint32_t count, uint8_t* dst );
+static result   _mapFile( tile_writer_t* writer, const char* filename );
+static void     _unmapFile( tile_writer_t* writer );
+static void     _tileWriterThread( tile_writer_t* writer );
+static void     _writeTile( tile_writer_t* writer, const _tile_t* tile );
+static result   _writeP3( const char* filename, const uint32_t* framebuffer, uint32_t cols, uint32_t rows );
+static result   _writerOpen( _image_writer_t* w, const char* filename, size_t rowBytes, bool direct );
+static uint8_t* _writerReserve( _image_writer_t* w, size_t bytes );
+static result   _writerFlush( _image_writer_t* w, bool final );
+static result   _writerClose( _image_writer_t* w );
+static bool     _writeAll( _image_writer_t* w, const uint8_t* data, size_t bytes );
+static void*    _alignedAlloc( size_t bytes );
+static void     _alignedFree( void* p );
+
+
+//
+// Public
+//
+
+image_format_t imageFormatFromFilename( const char* filename )
+{
+    if ( !filename )
+        return IMAGE_FORMAT_UNKNOWN;
+
+    const char* dot = strrchr( filename, '.' );
+    if ( !dot )
+        return IMAGE_FORMAT_UNKNOWN;
+
+    char ext[ 8 ] = {};
+    for ( int i = 0; i < ARRAY_SIZE( ext ) - 1 && dot[ i + 1 ]; i++ ) {
+        ext[ i ] = (char)tolower( dot[ i + 1 ] );
+    }
+
+    if ( strcmp( ext, "ppm" ) == 0 )
+        return IMAGE_FORMAT_P6;
+    if ( strcmp( ext, "pfm" ) == 0 )
+        return IMAGE_FORMAT_PFM;
+
+    return IMAGE_FORMAT_UNKNOWN;
+}
+
+
+const char* imageFormatName( image_format_t format )
+{
+    switch ( format ) {
+        case IMAGE_FORMAT_P3:
+            return "P3";
+        case IMAGE_FORMAT_P6:
+            return "P6";
+        case IMAGE_FORMAT_PFM:
+            return "PFM";
+        default:
+            return "unknown";
+    }
+}
+
+
+result imageWrite( const char* filename, image_format_t format, const uint32_t* framebuffer, uint32_t cols, uint32_t rows, uint32_t flags, const accumulation_buffer_t* accumulation )
+{
+    if ( !filename || !_hasSource( format, framebuffer, accumulation, cols, rows ) )
+        return R_INVALID_ARG;
+
+    if ( format == IMAGE_FORMAT_P3 )
+        return _writeP3( filename, framebuffer, cols, rows );
+
+    if ( format != IMAGE_FORMAT_P6 && format != IMAGE_FORMAT_PFM )
+        return R_INVALID_ARG;
+
+    size_t          rowBytes = cols * _pixelBytes( format );
+    _image_writer_t w;
+
+    result rval = _writerOpen( &w, filename, rowBytes, ( flags & IMAGE_WRITE_DIRECT ) != 0 );
+    if ( rval != R_OK )
+        return rval;
+
+    char   header[ 64 ];
+    size_t headerBytes = _formatHeader( header, sizeof( header ), format, cols, rows );
+    memcpy( _writerReserve( &w, headerBytes ), header, headerBytes );
+
+    for ( uint32_t y = 0; y < rows && rval == R_OK; y++ ) {
+        uint8_t* dst = _writerReserve( &w, rowBytes );
+        if ( !dst ) {
+            rval = R_FAIL;
+            break;
+        }
+
+        if ( format == IMAGE_FORMAT_P6 ) {
+            _encodeRow( &framebuffer[ y * cols ], cols, dst );
+        } else {
+            // PFM rows run bottom to top
+            _encodeLinearRow( &accumulation->pixels[ (size_t)( rows - 1 - y ) * cols * 4 ], cols, dst );
+        }
+    }
+
+    result closeRval = _writerClose( &w );
+
+    return rval != R_OK ? rval : closeRval;
+}
+
+
+tile_writer_t* tileWriterCreate( const char* filename, image_format_t format, const uint32_t* framebuffer, uint32_t cols, uint32_t rows, const accumulation_buffer_t* accumulation )
+{
+    if ( !filename || !_hasSource( format, framebuffer, accumulation, cols, rows ) )
+        return nullptr;
+
+    // P3 rows vary in length, so a pixel has no fixed offset to write a tile to
+    if ( format != IMAGE_FORMAT_P6 && format != IMAGE_FORMAT_PFM )
+        return nullptr;
+
+    tile_writer_t* writer = new tile_writer_t;
+    writer->format        = format;
+    writer->framebuffer   = framebuffer;
+    writer->accumulation  = accumulation;
+    writer->cols          = cols;
+    writer->rows          = rows;
+
+    char header[ 64 ];
+    writer->headerBytes = _formatHeader( header, sizeof( header ), format, cols, rows );
+    writer->rowBytes    = cols * _pixelBytes( format );
+    writer->size        = writer->headerBytes + (uint64_t)writer->rowBytes * rows;
+
+    if ( _mapFile( writer, filename ) != R_OK ) {
+        delete writer;
+        return nullptr;
+    }
+
+    // The file is zero-filled, i.e. black, until tiles land
+    memcpy( writer->map, header, writer->headerBytes );
+
+    writer->thread = std::thread( _tileWriterThread, writer );
+
+    return writer;
+}
+
+
+void tileWriterSubmit( tile_writer_t* writer, uint32_t x, uint32_t y, uint32_t width, uint32_t height )
+{
+    if ( !writer || x >= writer->cols || y >= writer->rows )
+        return;
+
+    _tile_t* tile = new _tile_t;
+    tile->x       = x;
+    tile->y       = y;
+    tile->width   = x + width > writer->cols ? writer->cols - x : width;
+    tile->height  = y + height > writer->rows ? writer->rows - y : height;
+    tile->next    = writer->pending.load( std::memory_order_relaxed );
+
+    // The CAS publishes this thread's framebuffer writes to the writer thread along with the tile
+    while ( !writer->pending.compare_exchange_weak( tile->next, tile, std::memory_order_seq_cst, std::memory_order_relaxed ) ) {
+    }
+
+    // Pairs with the writer setting sleeping before it re-checks pending
+    if ( writer->sleeping.load( std::memory_order_seq_cst ) ) {
+        std::lock_guard<std::mutex> lock( writer->mutex );
+        writer->wake.notify_one();
+    }
+}
+
+
+result tileWriterDestroy( tile_writer_t* writer )
+{
+    if ( !writer )
+        return R_INVALID_ARG;
+
+    {
+        std::lock_guard<std::mutex> lock( writer->mutex );
+        writer->closing.store( true, std::memory_order_seq_cst );
+        writer->wake.notify_one();
+    }
+    writer->thread.join();
+
+    printf( "Tile writer: %u tiles, %f ms writing\n", writer->tilesWritten, writer->writeMs );
+
+    _unmapFile( writer );
+    delete writer;
+
+    return R_OK;
+}
+
+
+//
+// Private implementation
+//
+
+static bool _hasSource( image_format_t format, const uint32_t* framebuffer, const accumulation_buffer_t* accumulation, uint32_t cols, uint32_t rows )
+{
+    if ( cols == 0 || rows == 0 )
+        return false;
+
+    if ( format == IMAGE_FORMAT_PFM )
+        return accumulation && accumulation->cols == cols && accumulation->rows == rows;
+
+    return framebuffer != nullptr;
+}
+
+
+// PFM's negative scale marks the floats as little-endian
+static size_t _formatHeader( char* header, size_t size, image_format_t format, uint32_t cols, uint32_t rows )
+{
+    int bytes = snprintf( header, size, "%s\n%u %u\n%s\n", format == IMAGE_FORMAT_PFM ? "PF" : "P6", cols, rows, format == IMAGE_FORMAT_PFM ? "-1.0" : "255" );
+
+    return bytes > 0 ? (size_t)bytes : 0;
+}
+
+
+static size_t _pixelBytes( image_format_t format )
+{
+    return format == IMAGE_FORMAT_PFM ? 3 * sizeof( float ) : 3;
+}
+
+
+static void _encodeRow( const uint32_t* src, uint32_t count, uint8_t* dst )
+{
+    for ( uint32_t x = 0; x < count; x++ ) {
+        uint32_t rgb = src[ x ];
+        dst[ 0 ]     = ( uint8_t )( ( rgb & 0xFF000000 ) >> 24 );
+        dst[ 1 ]     = ( uint8_t )( ( rgb & 0x00FF0000 ) >> 16 );
+        dst[ 2 ]     = ( uint8_t )( ( rgb & 0x0000FF00 ) >> 8 );
+        dst += 3;
+    }
+}
+
+
+// src is accumulation buffer pixels, whose color sums over their sample count are the linear means; pixels without
+// samples are black. Written in host byte order, which the header declares little-endian. memcpy since a tile's
+// offset in the file isn't float aligned.
+static void _encodeLinearRow( const float* src, uint32_t count, uint8_t* dst )
+{
+    for ( uint32_t x = 0; x < count; x++ ) {
+        float n      = src[ 3 ] > 0.0f ? src[ 3 ] : 1.0f;
+        float f[ 3 ] = { src[ 0 ] / n, src[ 1 ] / n, src[ 2 ] / n };
+        memcpy( dst, f, sizeof( f ) );
+        src += 4;
+        dst += sizeof( f );
+    }
+}
+
+
+static result _mapFile( tile_writer_t* writer, const char* filename )
+{
+#ifdef _WIN32
+    writer->file = CreateFileA( filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr );
+    if ( writer->file == INVALID_HANDLE_VALUE ) {
+        printf( "Error: failed to open [%s] for writing error %d.\n", filename, (int)GetLastError() );
+        return R_FAIL;
+    }
+
+    // Mapping at full size extends the file; the new pages read as zero
+    writer->mapping = CreateFileMappingA( writer->file, nullptr, PAGE_READWRITE, (DWORD)( writer->size >> 32 ), (DWORD)writer->size, nullptr );
+    if ( writer->mapping ) {
+        writer->map = (uint8_t*)MapViewOfFile( writer->mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)writer->size );
+    }
+    if ( !writer->map ) {
+        printf( "Error: failed to map [%s] error %d.\n", filename, (int)GetLastError() );
+        _unmapFile( writer );
+        return R_FAIL;
+    }
+#else
+    writer->fd = open( filename, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if ( writer->fd < 0 ) {
+        printf( "Error: failed to open [%s] for writing errno %d.\n", filename, errno );
+        return R_FAIL;
+    }
+
+    if ( ftruncate( writer->fd, (off_t)writer->size ) != 0 ) {
+        printf( "Error: failed to size [%s] errno %d.\n", filename, errno );
+        _unmapFile( writer );
+        return R_FAIL;
+    }
+
+    void* map = mmap( nullptr, (size_t)writer->size, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd, 0 );
+    if ( map == MAP_FAILED ) {
+        printf( "Error: failed to map [%s] errno %d.\n", filename, errno );
+        _unmapFile( writer );
+        return R_FAIL;
+    }
+    writer->map = (uint8_t*)map;
+#endif
+
+    return R_OK;
+}
+
+
+// Stores to a shared mapping land in the OS page cache, which writes them back even if the process dies
+static void _unmapFile( tile_writer_t* writer )
+{
+#ifdef _WIN32
+    if ( writer->map ) {
+        UnmapViewOfFile( writer->map );
+    }
+    if ( writer->mapping ) {
+        CloseHandle( writer->mapping );
+    }
+    if ( writer->file != INVALID_HANDLE_VALUE ) {
+        CloseHandle( writer->file );
+    }
+    writer->mapping = nullptr;
+    writer->file    = INVALID_HANDLE_VALUE;
+#else
+    if ( writer->map ) {
+        munmap( writer->map, (size_t)writer->size );
+    }
+    if ( writer->fd >= 0 ) {
+        close( writer->fd );
+    }
+    writer->fd = -1;
+#endif
+    writer->map = nullptr;
+}
+
+
+static void _tileWriterThread( tile_writer_t* writer )
+{
+    for ( ;; ) {
+        _tile_t* tile = writer->pending.exchange( nullptr, std::memory_order_seq_cst );
+
+        if ( !tile ) {
+            // Destroy only closes once rendering is done, so an empty list after closing means nothing is left
+            if ( writer->closing.load( std::memory_order_seq_cst ) )
+                break;
+
+            std::unique_lock<std::mutex> lock( writer->mutex );
+            writer->sleeping.store( true, std::memory_order_seq_cst );
+            writer->wake.wait( lock, [writer] { return writer->pending.load( std::memory_order_seq_cst ) != nullptr || writer->closing.load( std::memory_order_seq_cst ); } );
+            writer->sleeping.store( false, std::memory_order_relaxed );
+            continue;
+        }
+
+        PerfTimer timer;
+        while ( tile ) {
+            _tile_t* next = tile->next;
+            _writeTile( writer, tile );
+            delete tile;
+            tile = next;
+            writer->tilesWritten++;
+        }
+        writer->writeMs += timer.ElapsedNanoseconds() / 1000000.0;
+    }
+}
+
+
+static void _writeTile( tile_writer_t* writer, const _tile_t* tile )
+{
+    size_t pixelBytes = _pixelBytes( writer->format );
+
+    for ( uint32_t y = tile->y; y < tile->y + tile->height; y++ ) {
+        if ( writer->format == IMAGE_FORMAT_P6 ) {
+            uint8_t* dst = writer->map + writer->headerBytes + y * writer->rowBytes + tile->x * pixelBytes;
+            _encodeRow( &writer->framebuffer[ y * writer->cols + tile->x ], tile->width, dst );
+        } else {
+            // PFM rows run bottom to top
+            uint8_t* dst = writer->map + writer->headerBytes + ( writer->rows - 1 - y ) * writer->rowBytes + tile->x * pixelBytes;
+            _encodeLinearRow( &writer->accumulation->pixels[ ( (size_t)y * writer->cols + tile->x ) * 4 ], tile->width, dst );
+        }
+    }
+}
+
+
+// The original writer: one fprintf per pixel
+static result _writeP3( const char* filename, const uint32_t* framebuffer, uint32_t cols, uint32_t rows )
+{
+    FILE*   file = nullptr;
+    errno_t err  = fopen_s( &file, filename, "w" );
+    if ( !file || err != 0 ) {
+        printf( "Error: failed to open [%s] for writing errno %d.\n", filename, err );
+        return R_FAIL;
+    }
+
+    fprintf( file, "P3\n" );
+    fprintf( file, "%d %d\n", cols, rows );
+    fprintf( file, "255\n" );
+
+    for ( uint32_t y = 0; y < rows; y++ ) {
+        for ( uint32_t x = 0; x < cols; x++ ) {
+            uint32_t rgb = framebuffer[ y * cols + x ];
+            uint8_t  _r  = ( uint8_t )( ( rgb & 0xFF000000 ) >> 24 );
+            uint8_t  _g  = ( uint8_t )( ( rgb & 0x00FF0000 ) >> 16 );
+            uint8_t  _b  = ( uint8_t )( ( rgb & 0x0000FF00 ) >> 8 );
+
+            fprintf( file, "%d %d %d\n", _r, _g, _b );
+        }
+    }
+
+    fflush( file );
+    fclose( file );
+
+    return R_OK;
+}
+
+
+static result _writerOpen( _image_writer_t* w, const char* filename, size_t rowBytes, bool direct )
+{
+    // Room for a whole row on top of a sub-sector remainder left over from the previous direct write
+    size_t capacity = rowBytes + WRITER_ALIGNMENT > WRITER_STAGING_BYTES ? rowBytes + WRITER_ALIGNMENT : WRITER_STAGING_BYTES;
+    capacity        = ( capacity + WRITER_ALIGNMENT - 1 ) & ~( WRITER_ALIGNMENT - 1 );
+
+    w->buffer = (uint8_t*)_alignedAlloc( capacity );
+    if ( !w->buffer )
+        return R_FAIL;
+
+    w->capacity = capacity;
+    w->used     = 0;
+    w->size     = 0;
+    w->direct   = direct;
+
+#ifdef _WIN32
+    DWORD attributes = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+    if ( direct )
+        attributes |= FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
+
+    w->file = CreateFileA( filename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, attributes, nullptr );
+    if ( w->file == INVALID_HANDLE_VALUE ) {
+        printf( "Error: failed to open [%s] for writing error %d.\n", filename, (int)GetLastError() );
+        _alignedFree( w->buffer );
+        return R_FAIL;
+    }
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if ( direct ) {
+        w->fd = open( filename, flags | O_DIRECT, 0644 );
+
+        // Some file systems (e.g. tmpfs) refuse O_DIRECT; fall back to the page cache
+        if ( w->fd < 0 && errno == EINVAL ) {
+            printf( "WARN: O_DIRECT not supported for [%s]; using buffered I/O\n", filename );
+            w->direct = false;
+        }
+    }
+#else
+    w->direct = false;
+#endif
+    if ( w->fd < 0 ) {
+        w->fd = open( filename, flags, 0644 );
+    }
+
+    if ( w->fd < 0 ) {
+        printf( "Error: failed to open [%s] for writing errno %d.\n", filename, errno );
+        _alignedFree( w->buffer );
+        return R_FAIL;
+    }
+#endif
+
+    return R_OK;
+}
+
+
+// Space for bytes more bytes in the staging buffer, flushing it first if they don't fit
+static uint8_t* _writerReserve( _image_writer_t* w, size_t bytes )
+{
+    assert( bytes <= w->capacity - WRITER_ALIGNMENT );
+
+    if ( w->used + bytes > w->capacity ) {
+        if ( _writerFlush( w, false ) != R_OK )
+            return nullptr;
+    }
+
+    uint8_t* p = w->buffer + w->used;
+    w->used += bytes;
+    w->size += bytes;
+
+    return p;
+}
+
+
+static result _writerFlush( _image_writer_t* w, bool final )
+{
+    size_t bytes = w->used;
+
+    if ( w->direct ) {
+        if ( final ) {
+            // Pad the tail out to a whole sector; _writerClose() truncates the file back to size
+            size_t padded = ( bytes + WRITER_ALIGNMENT - 1 ) & ~( WRITER_ALIGNMENT - 1 );
+            memset( w->buffer + bytes, 0, padded - bytes );
+            bytes = padded;
+        } else {
+            // Only whole sectors; carry the remainder over to the next flush
+            bytes &= ~( WRITER_ALIGNMENT - 1 );
+        }
+    }
+
+    if ( bytes && !_writeAll( w, w->buffer, bytes ) )
+        return R_FAIL;
+
+    size_t remainder = w->used > bytes ? w->used - bytes : 0;
+    if ( remainder ) {
+        memmove( w->buffer, w->buffer + bytes, remainder );
+    }
+    w->used = remainder;
+
+    return R_OK;
+}
+
+
+static result _writerClose( _image_writer_t* w )
+{
+    result rval = _writerFlush( w, true );
+
+#ifdef _WIN32
+    if ( w->direct && rval == R_OK ) {
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG)w->size;
+        if ( !SetFilePointerEx( w->file, size, nullptr, FILE_BEGIN ) || !SetEndOfFile( w->file ) )
+            rval = R_FAIL;
+    }
+    CloseHandle( w->file );
+    w->file = INVALID_HANDLE_VALUE;
+#else
+    if ( w->direct && rval == R_OK ) {
+        if ( ftruncate( w->fd, (off_t)w->size ) != 0 )
+            rval = R_FAIL;
+    }
+    close( w->fd );
+    w->fd = -1;
+#endif
+
+    _alignedFree( w->buffer );
+    w->buffer = nullptr;
+
+    return rval;
+}
+
+
+static bool _writeAll( _image_writer_t* w, const uint8_t* data, size_t bytes )
+{
+    while ( bytes ) {
+#ifdef _WIN32
+        DWORD written = 0;
+        if ( !WriteFile( w->file, data, (DWORD)bytes, &written, nullptr ) || written == 0 ) {
+            printf( "Error: image write failed error %d\n", (int)GetLastError() );
+            return false;
+        }
+#else
+        ssize_t written = write( w->fd, data, bytes );
+        if ( written < 0 && errno == EINTR )
+            continue;
+        if ( written <= 0 ) {
+            printf( "Error: image write failed errno %d\n", errno );
+            return false;
+        }
+#endif
+        data += written;
+        bytes -= (size_t)written;
+    }
+
+    return true;
+}
+
+
+static void* _alignedAlloc( size_t bytes )
+{
+#ifdef _WIN32
+    return _aligned_malloc( bytes, WRITER_ALIGNMENT );
+#else
+    void* p = nullptr;
+    return posix_memalign( &p, WRITER_ALIGNMENT, bytes ) == 0 ? p : nullptr;
+#endif
+}
+
+
+static void _alignedFree( void* p )
+{
+#ifdef _WIN32
+    _aligned_free( p );
+#else
+    free( p );
+#endif
+}
+
+} // namespace pk
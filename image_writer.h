@@ -0,0 +1,60 @@
+#pragma once
+
+//
+// Write the 0xRRGGBB00 framebuffer to disk.
+//
+// IMAGE_FORMAT_P3:  ASCII PPM, one fprintf per pixel. Slow and large; kept for comparison.
+// IMAGE_FORMAT_P6:  binary 8-bit PPM.
+// IMAGE_FORMAT_PFM: binary float RGB (Portable Float Map): the linear, un-tone-mapped per-pixel means, taken from
+//                   the accumulation buffer rather than the 8-bit framebuffer.
+//
+// The binary formats are formatted a batch of whole rows at a time into a sector-aligned staging buffer,
+// which is handed to the OS with one write per batch. With IMAGE_WRITE_DIRECT the file is opened with
+// O_DIRECT (FILE_FLAG_NO_BUFFERING on Windows), so large images don't churn the page cache.
+//
+// The tile writer streams a render to disk while it is still running. P6 and PFM have a fixed header and fixed
+// row size, so every pixel has a known file offset: the file is created at full size and memory-mapped, and a
+// writer thread copies each finished tile straight to its final position. Render threads hand tiles over through
+// a lock-free list and never touch the file. The header goes out first and unrendered pixels stay black, so an
+// aborted render still leaves a valid, partial image behind.
+//
+
+#include "accumulation_buffer.h"
+#include "result.h"
+
+#include <stdint.h>
+
+namespace pk
+{
+
+typedef enum {
+    IMAGE_FORMAT_UNKNOWN = 0,
+    IMAGE_FORMAT_P3      = 1,
+    IMAGE_FORMAT_P6      = 2,
+    IMAGE_FORMAT_PFM     = 3,
+} image_format_t;
+
+
+#define IMAGE_WRITE_DIRECT 0x1
+
+
+typedef struct _tile_writer tile_writer_t;
+
+
+// .ppm: P6, .pfm: PFM; anything else is IMAGE_FORMAT_UNKNOWN
+image_format_t imageFormatFromFilename( const char* filename );
+const char*    imageFormatName( image_format_t format );
+// P3 and P6 are written from framebuffer, PFM from accumulation, which must be cols x rows
+result         imageWrite( const char* filename, image_format_t format, const uint32_t* framebuffer, uint32_t cols, uint32_t rows, uint32_t flags = 0, const accumulation_buffer_t* accumulation = nullptr );
+
+// framebuffer, or accumulation for PFM, must outlive the writer; P6 and PFM only
+tile_writer_t* tileWriterCreate( const char* filename, image_format_t format, const uint32_t* framebuffer, uint32_t cols, uint32_t rows, const accumulation_buffer_t* accumulation = nullptr );
+// Called from any thread once the tile's pixels are final; the tile is clipped to the image
+void           tileWriterSubmit( tile_writer_t* writer, uint32_t x, uint32_t y, uint32_t width, uint32_t height );
+// Writes any tiles still queued, then unmaps and closes the file
+result         tileWriterDestroy( tile_writer_t* writer );
+
+void benchmarkImageWriter();
+void testTileWriter();
+
+} // namespace pk
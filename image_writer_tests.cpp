@@ -0,0 +1,290 @@
+#include "image_writer.h"
+#include "perf_timer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+
+namespace pk
+{
+
+//
+// Benchmark image writers: the original ASCII P3 path against the buffered binary P6 and PFM writers,
+// with and without direct I/O, at the default resolution, 4K and 8K.
+// Every binary file is read back and compared byte for byte with its expected encoding, so a direct write whose
+// padded tail wasn't truncated away fails along with any encoding error.
+//
+
+static const char* BENCHMARK_FILENAME = "image_writer_benchmark.tmp";
+
+
+// The expected file, a row at a time: P6 bytes from framebuffer, or PFM's bottom-to-top linear means from accumulation
+static size_t _expectedHeader( image_format_t format, uint32_t cols, uint32_t rows, char* header, size_t size )
+{
+    int bytes = format == IMAGE_FORMAT_PFM ? snprintf( header, size, "PF\n%u %u\n-1.0\n", cols, rows ) : snprintf( header, size, "P6\n%u %u\n255\n", cols, rows );
+
+    return bytes > 0 ? (size_t)bytes : 0;
+}
+
+
+static void _expectedRow( image_format_t format, const uint32_t* framebuffer, const accumulation_buffer_t* accumulation, uint32_t cols, uint32_t rows, uint32_t fileRow, uint8_t* dst )
+{
+    for ( uint32_t x = 0; x < cols; x++ ) {
+        if ( format == IMAGE_FORMAT_PFM ) {
+            const float* p = &accumulation->pixels[ ( (size_t)( rows - 1 - fileRow ) * cols + x ) * 4 ];
+            float        n = p[ 3 ] > 0.0f ? p[ 3 ] : 1.0f;
+            float        f[ 3 ] = { p[ 0 ] / n, p[ 1 ] / n, p[ 2 ] / n };
+
+            memcpy( &dst[ x * sizeof( f ) ], f, sizeof( f ) );
+        } else {
+            uint32_t rgb     = framebuffer[ (size_t)fileRow * cols + x ];
+            dst[ x * 3 + 0 ] = ( uint8_t )( rgb >> 24 );
+            dst[ x * 3 + 1 ] = ( uint8_t )( rgb >> 16 );
+            dst[ x * 3 + 2 ] = ( uint8_t )( rgb >> 8 );
+        }
+    }
+}
+
+
+// True if filename holds exactly the expected image: same header, same rows, and nothing after them
+static bool _verifyImage( const char* filename, image_format_t format, const uint32_t* framebuffer, const accumulation_buffer_t* accumulation, uint32_t cols, uint32_t rows )
+{
+    FILE*   file = nullptr;
+    errno_t err  = fopen_s( &file, filename, "rb" );
+    if ( !file || err != 0 )
+        return false;
+
+    char   expectedHeader[ 64 ];
+    char   header[ 64 ];
+    size_t headerBytes = _expectedHeader( format, cols, rows, expectedHeader, sizeof( expectedHeader ) );
+    bool   same        = fread( header, 1, headerBytes, file ) == headerBytes && memcmp( header, expectedHeader, headerBytes ) == 0;
+
+    size_t   rowBytes = format == IMAGE_FORMAT_PFM ? cols * 3 * sizeof( float ) : cols * 3;
+    uint8_t* expected = new uint8_t[ rowBytes ];
+    uint8_t* row      = new uint8_t[ rowBytes ];
+
+    for ( uint32_t y = 0; y < rows && same; y++ ) {
+        _expectedRow( format, framebuffer, accumulation, cols, rows, y, expected );
+        same = fread( row, 1, rowBytes, file ) == rowBytes && memcmp( row, expected, rowBytes ) == 0;
+    }
+
+    if ( same ) {
+        same = fgetc( file ) == EOF;
+    }
+
+    delete[] expected;
+    delete[] row;
+    fclose( file );
+
+    return same;
+}
+
+
+static void _benchmarkWrite( const char* label, image_format_t format, uint32_t flags, const uint32_t* framebuffer, const accumulation_buffer_t* accumulation, uint32_t cols, uint32_t rows )
+{
+    PerfTimer timer;
+    result    rval = imageWrite( BENCHMARK_FILENAME, format, framebuffer, cols, rows, flags, accumulation );
+    double    ms   = timer.ElapsedNanoseconds() / 1000000.0;
+
+    struct stat st = {};
+    stat( BENCHMARK_FILENAME, &st );
+
+    // P3 is text, whose line endings depend on the platform
+    bool verified = rval == R_OK && ( format == IMAGE_FORMAT_P3 || _verifyImage( BENCHMARK_FILENAME, format, framebuffer, accumulation, cols, rows ) );
+    remove( BENCHMARK_FILENAME );
+
+    double mb = st.st_size / ( 1024.0 * 1024.0 );
+    printf( "%5u x %-5u %-10s %12.1f %10.1f %10.1f %s\n", cols, rows, label, ms, mb, mb / ( ms / 1000.0 ), rval != R_OK ? "FAILED" : verified ? "" : "MISMATCH" );
+    assert( verified );
+}
+
+
+void benchmarkImageWriter()
+{
+    const uint32_t sizes[][ 2 ] = { { 2000, 1000 }, { 3840, 2160 }, { 7680, 4320 } };
+
+    printf( "%-13s %-10s %12s %10s %10s\n", "size", "format", "ms", "MB", "MB/s" );
+
+    for ( int s = 0; s < ARRAY_SIZE( sizes ); s++ ) {
+        uint32_t               cols         = sizes[ s ][ 0 ];
+        uint32_t               rows         = sizes[ s ][ 1 ];
+        uint32_t*              framebuffer  = new uint32_t[ cols * rows ];
+        accumulation_buffer_t* accumulation = accumulationBufferCreate( cols, rows );
+
+        // A gradient, so P3 isn't flattered by short numbers. The float samples run past 1.0, and some pixels have none.
+        for ( uint32_t y = 0; y < rows; y++ ) {
+            for ( uint32_t x = 0; x < cols; x++ ) {
+                uint32_t r = x * 255 / cols;
+                uint32_t g = y * 255 / rows;
+                uint32_t b = ( x + y ) & 0xFF;
+
+                framebuffer[ y * cols + x ] = ( r << 24 ) | ( g << 16 ) | ( b << 8 );
+
+                uint32_t samples = ( x + y ) % 5;
+                accumulationBufferAdd( accumulation, x, y, samples * 4.0f * x / cols, samples * (float)y / rows, samples * b / 255.0f, samples );
+            }
+        }
+
+        _benchmarkWrite( "P3", IMAGE_FORMAT_P3, 0, framebuffer, nullptr, cols, rows );
+        _benchmarkWrite( "P6", IMAGE_FORMAT_P6, 0, framebuffer, nullptr, cols, rows );
+        _benchmarkWrite( "P6 direct", IMAGE_FORMAT_P6, IMAGE_WRITE_DIRECT, framebuffer, nullptr, cols, rows );
+        _benchmarkWrite( "PFM", IMAGE_FORMAT_PFM, 0, nullptr, accumulation, cols, rows );
+        _benchmarkWrite( "PFM direct", IMAGE_FORMAT_PFM, IMAGE_WRITE_DIRECT, nullptr, accumulation, cols, rows );
+
+        accumulationBufferDestroy( accumulation );
+        delete[] framebuffer;
+    }
+}
+
+
+//
+// Stream an image through the tile writer from several threads, each rendering and submitting its tiles in a
+// shuffled order, and check the file is byte for byte what imageWrite() makes of the finished buffers.
+// The image isn't a whole number of tiles, so the edge tiles are clipped.
+//
+
+static const char*    TILE_TEST_FILENAME  = "tile_writer_test.tmp";
+static const char*    TILE_TEST_REFERENCE = "tile_writer_reference.tmp";
+static const uint32_t TILE_TEST_COLS      = 1000;
+static const uint32_t TILE_TEST_ROWS      = 600;
+static const uint32_t TILE_TEST_SIZE      = 64;
+static const uint32_t TILE_TEST_THREADS   = 4;
+
+typedef struct _tile_test_context {
+    tile_writer_t*         writer;
+    uint32_t*              framebuffer;
+    accumulation_buffer_t* accumulation;
+    std::vector<uint32_t>  tiles; // indices into the grid of tiles, in submission order
+
+    _tile_test_context() :
+        writer( nullptr ),
+        framebuffer( nullptr ),
+        accumulation( nullptr )
+    {
+    }
+} tile_test_context_t;
+
+
+// Each thread fills in its own tiles' pixels right before submitting them, as a render thread would
+static void _tileTestThread( tile_test_context_t* ctx )
+{
+    uint32_t tileCols = ( TILE_TEST_COLS + TILE_TEST_SIZE - 1 ) / TILE_TEST_SIZE;
+
+    for ( uint32_t tile : ctx->tiles ) {
+        uint32_t x0 = ( tile % tileCols ) * TILE_TEST_SIZE;
+        uint32_t y0 = ( tile / tileCols ) * TILE_TEST_SIZE;
+
+        for ( uint32_t y = y0; y < y0 + TILE_TEST_SIZE && y < TILE_TEST_ROWS; y++ ) {
+            for ( uint32_t x = x0; x < x0 + TILE_TEST_SIZE && x < TILE_TEST_COLS; x++ ) {
+                uint32_t r = x * 255 / TILE_TEST_COLS;
+                uint32_t g = y * 255 / TILE_TEST_ROWS;
+                uint32_t b = ( tile * 37 ) & 0xFF;
+
+                ctx->framebuffer[ y * TILE_TEST_COLS + x ] = ( r << 24 ) | ( g << 16 ) | ( b << 8 );
+
+                uint32_t samples = ( x + y ) % 3 + 1;
+                accumulationBufferAdd( ctx->accumulation, x, y, samples * 2.0f * x / TILE_TEST_COLS, samples * (float)y / TILE_TEST_ROWS, samples * b / 255.0f, samples );
+            }
+        }
+
+        tileWriterSubmit( ctx->writer, x0, y0, TILE_TEST_SIZE, TILE_TEST_SIZE );
+    }
+}
+
+
+static bool _sameFiles( const char* a, const char* b )
+{
+    FILE* fa = nullptr;
+    FILE* fb = nullptr;
+    fopen_s( &fa, a, "rb" );
+    fopen_s( &fb, b, "rb" );
+
+    bool same = fa && fb;
+    while ( same ) {
+        uint8_t bufferA[ 4096 ];
+        uint8_t bufferB[ 4096 ];
+        size_t  bytesA = fread( bufferA, 1, sizeof( bufferA ), fa );
+        size_t  bytesB = fread( bufferB, 1, sizeof( bufferB ), fb );
+
+        same = bytesA == bytesB && memcmp( bufferA, bufferB, bytesA ) == 0;
+        if ( bytesA < sizeof( bufferA ) )
+            break;
+    }
+
+    if ( fa ) {
+        fclose( fa );
+    }
+    if ( fb ) {
+        fclose( fb );
+    }
+
+    return same;
+}
+
+
+void testTileWriter()
+{
+    const image_format_t formats[] = { IMAGE_FORMAT_P6, IMAGE_FORMAT_PFM };
+
+    uint32_t tileCols = ( TILE_TEST_COLS + TILE_TEST_SIZE - 1 ) / TILE_TEST_SIZE;
+    uint32_t tileRows = ( TILE_TEST_ROWS + TILE_TEST_SIZE - 1 ) / TILE_TEST_SIZE;
+    uint32_t numTiles = tileCols * tileRows;
+    uint32_t errors   = 0;
+
+    printf( "testTileWriter: %u x %u, %u tiles from %u threads\n", TILE_TEST_COLS, TILE_TEST_ROWS, numTiles, TILE_TEST_THREADS );
+
+    for ( int f = 0; f < ARRAY_SIZE( formats ); f++ ) {
+        uint32_t*              framebuffer  = new uint32_t[ TILE_TEST_COLS * TILE_TEST_ROWS ]();
+        accumulation_buffer_t* accumulation = accumulationBufferCreate( TILE_TEST_COLS, TILE_TEST_ROWS );
+        tile_writer_t*         writer       = tileWriterCreate( TILE_TEST_FILENAME, formats[ f ], framebuffer, TILE_TEST_COLS, TILE_TEST_ROWS, accumulation );
+        assert( writer );
+
+        // Deal a shuffled deck of tiles out to the threads, so neighbouring tiles land out of order and from different threads
+        std::vector<uint32_t> order( numTiles );
+        for ( uint32_t i = 0; i < numTiles; i++ ) {
+            order[ i ] = i;
+        }
+        std::shuffle( order.begin(), order.end(), std::mt19937( 1234 + f ) );
+
+        tile_test_context_t contexts[ TILE_TEST_THREADS ];
+        for ( uint32_t i = 0; i < numTiles; i++ ) {
+            contexts[ i % TILE_TEST_THREADS ].tiles.push_back( order[ i ] );
+        }
+
+        std::thread threads[ TILE_TEST_THREADS ];
+        for ( uint32_t t = 0; t < TILE_TEST_THREADS; t++ ) {
+            contexts[ t ].writer       = writer;
+            contexts[ t ].framebuffer  = framebuffer;
+            contexts[ t ].accumulation = accumulation;
+            threads[ t ]               = std::thread( _tileTestThread, &contexts[ t ] );
+        }
+        for ( uint32_t t = 0; t < TILE_TEST_THREADS; t++ ) {
+            threads[ t ].join();
+        }
+
+        result streamed  = tileWriterDestroy( writer );
+        result reference = imageWrite( TILE_TEST_REFERENCE, formats[ f ], framebuffer, TILE_TEST_COLS, TILE_TEST_ROWS, 0, accumulation );
+        bool   same      = streamed == R_OK && reference == R_OK && _sameFiles( TILE_TEST_FILENAME, TILE_TEST_REFERENCE );
+
+        printf( "testTileWriter: %s %s\n", imageFormatName( formats[ f ] ), same ? "matches imageWrite()" : "DIFFERS from imageWrite()" );
+        errors += same ? 0 : 1;
+
+        remove( TILE_TEST_FILENAME );
+        remove( TILE_TEST_REFERENCE );
+        accumulationBufferDestroy( accumulation );
+        delete[] framebuffer;
+    }
+
+    assert( errors == 0 );
+}
+
+
+} // namespace pk
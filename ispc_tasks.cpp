@@ -0,0 +1,218 @@
+#include "ispc_tasks.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <atomic>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+namespace pk
+{
+
+//
+// Private types and data
+//
+
+// The signature ISPC gives every task function
+typedef void ( *ispcTaskFunction )( void* data, int threadIndex, int threadCount, int taskIndex, int taskCount, int taskIndex0, int taskIndex1, int taskIndex2, int taskCount0, int taskCount1, int taskCount2 );
+
+
+// One launch statement: countx * county * countz calls of function, claimed by index from next
+typedef struct _ispc_launch {
+    ispcTaskFunction      function;
+    void*                 data;
+    int32_t               count[ 3 ];
+    uint32_t              total;
+    uint32_t              threadCount;
+    std::atomic<uint32_t> next;     // next task index to claim; runs past total once every task is claimed
+    std::atomic<uint32_t> finished; // tasks completed
+    std::atomic<uint32_t> refs;     // pool jobs not yet run plus the handle; the last to let go frees the launch
+
+    _ispc_launch() :
+        function( nullptr ),
+        data( nullptr ),
+        total( 0 ),
+        threadCount( 1 ),
+        next( 0 ),
+        finished( 0 ),
+        refs( 1 ) {}
+} _ispc_launch_t;
+
+
+// Everything a calling function launched and allocated since its last sync; ISPC keeps one per function
+typedef struct _ispc_handle {
+    std::vector<_ispc_launch_t*> launches;
+    std::vector<char*>           allocations;
+} _ispc_handle_t;
+
+
+static thread_pool_t s_pool       = INVALID_THREAD_POOL;
+static uint32_t      s_numThreads = 0;
+
+
+static _ispc_handle_t* _getHandle( void** handlePtr );
+static bool            _taskJob( void* context, uint32_t tid );
+static void            _runTasks( _ispc_launch_t* launch, uint32_t threadIndex );
+static void            _releaseLaunch( _ispc_launch_t* launch );
+
+
+//
+// Public
+//
+
+void ispcTasksSetThreadPool( thread_pool_t pool, uint32_t numThreads )
+{
+    assert( pool == INVALID_THREAD_POOL || numThreads > 0 );
+
+    s_pool       = pool;
+    s_numThreads = pool == INVALID_THREAD_POOL ? 0 : numThreads;
+}
+
+
+//
+// Private implementation
+//
+
+static _ispc_handle_t* _getHandle( void** handlePtr )
+{
+    assert( handlePtr );
+
+    if ( !*handlePtr ) {
+        *handlePtr = new _ispc_handle_t;
+    }
+
+    return (_ispc_handle_t*)*handlePtr;
+}
+
+
+static bool _taskJob( void* context, uint32_t tid )
+{
+    _ispc_launch_t* launch = (_ispc_launch_t*)context;
+
+    // Low 16 bits of tid are the worker's index in its pool
+    _runTasks( launch, tid & 0xFFFF );
+    _releaseLaunch( launch );
+
+    return true;
+}
+
+
+static void _runTasks( _ispc_launch_t* launch, uint32_t threadIndex )
+{
+    while ( true ) {
+        uint32_t i = launch->next.fetch_add( 1, std::memory_order_relaxed );
+        if ( i >= launch->total )
+            break;
+
+        int32_t x = (int32_t)i % launch->count[ 0 ];
+        int32_t y = (int32_t)i / launch->count[ 0 ] % launch->count[ 1 ];
+        int32_t z = (int32_t)i / ( launch->count[ 0 ] * launch->count[ 1 ] );
+
+        launch->function( launch->data, (int)threadIndex, (int)launch->threadCount, (int)i, (int)launch->total, x, y, z, launch->count[ 0 ], launch->count[ 1 ], launch->count[ 2 ] );
+
+        // Release, so the syncing thread sees everything the task wrote
+        launch->finished.fetch_add( 1, std::memory_order_release );
+    }
+}
+
+
+static void _releaseLaunch( _ispc_launch_t* launch )
+{
+    if ( launch->refs.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ) {
+        delete launch;
+    }
+}
+
+} // namespace pk
+
+
+using namespace pk;
+
+//
+// ISPC runtime entry points
+//
+
+void* ISPCAlloc( void** handlePtr, int64_t size, int32_t alignment )
+{
+    assert( alignment > 0 && ( alignment & ( alignment - 1 ) ) == 0 );
+
+    _ispc_handle_t* handle = _getHandle( handlePtr );
+
+    // Over-allocate and align by hand; ISPCSync() frees the raw pointer
+    char* raw = new char[ (size_t)size + alignment ];
+    handle->allocations.push_back( raw );
+
+    return (void*)( ( (uintptr_t)raw + alignment - 1 ) & ~(uintptr_t)( alignment - 1 ) );
+}
+
+
+void ISPCLaunch( void** handlePtr, void* f, void* data, int countx, int county, int countz )
+{
+    _ispc_handle_t* handle = _getHandle( handlePtr );
+
+    uint32_t total = (uint32_t)countx * (uint32_t)county * (uint32_t)countz;
+    if ( total == 0 )
+        return;
+
+    _ispc_launch_t* launch = new _ispc_launch_t;
+    launch->function       = (ispcTaskFunction)f;
+    launch->data           = data;
+    launch->count[ 0 ]     = countx;
+    launch->count[ 1 ]     = county;
+    launch->count[ 2 ]     = countz;
+    launch->total          = total;
+    handle->launches.push_back( launch );
+
+    if ( s_pool == INVALID_THREAD_POOL ) {
+        _runTasks( launch, 0 );
+        return;
+    }
+
+    // At most one job per worker; each job claims tasks until none are left, so a few jobs balance any number of
+    // tasks, and the launch never floods the queue that everything else is waiting in
+    uint32_t numJobs    = std::min( total, s_numThreads );
+    launch->threadCount = s_numThreads + 1;
+    launch->refs        = numJobs + 1;
+
+    std::vector<Invokable> jobs( numJobs, Function( _taskJob, launch ) );
+    job_group_t            group = threadPoolSubmitJobs( jobs.data(), numJobs, s_pool );
+
+    // ISPCSync() doesn't wait for the jobs, only for the tasks, so nobody waits for the group
+    if ( group == INVALID_JOB_GROUP ) {
+        launch->refs -= numJobs;
+    } else {
+        threadPoolReleaseJobs( group, s_pool );
+    }
+}
+
+
+void ISPCSync( void* h )
+{
+    _ispc_handle_t* handle = (_ispc_handle_t*)h;
+    if ( !handle )
+        return;
+
+    uint32_t threadIndex = s_pool == INVALID_THREAD_POOL ? 0 : threadPoolWorkerIndex( s_pool );
+    if ( threadIndex == INVALID_WORKER ) {
+        threadIndex = s_numThreads;
+    }
+
+    for ( _ispc_launch_t* launch : handle->launches ) {
+        // Run whatever no job has claimed yet, so this never waits on a job still sitting in the queue
+        _runTasks( launch, threadIndex );
+
+        // The rest are already running on other workers, and a task never waits on the queue either
+        while ( launch->finished.load( std::memory_order_acquire ) < launch->total ) {
+            std::this_thread::yield();
+        }
+
+        _releaseLaunch( launch );
+    }
+
+    for ( char* raw : handle->allocations ) {
+        delete[] raw;
+    }
+
+    delete handle;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+//
+// ISPC task system: the ISPCAlloc/ISPCLaunch/ISPCSync entry points that ISPC's launch and sync statements call,
+// implemented on the project's thread pool. Tasks launched from a kernel run on the same workers as the jobs that
+// launched them, and balance with the rest of the job queue instead of oversubscribing the CPU.
+//
+// A launch hands its tasks out from a shared counter: a few pool jobs claim them, and the thread that syncs claims
+// whatever is left before waiting. A worker that syncs therefore never waits for a queued job, so kernels can launch
+// and sync from inside pool jobs without deadlocking the pool.
+//
+
+#include "thread_pool.h"
+
+#include <stdint.h>
+
+namespace pk
+{
+
+// Run launched tasks on pool, which has numThreads workers. Pass INVALID_THREAD_POOL to run each launch's tasks
+// serially on the launching thread. Tasks see threadCount = numThreads + 1; threadIndex numThreads is a thread
+// from outside the pool syncing its own launch.
+void ispcTasksSetThreadPool( thread_pool_t pool, uint32_t numThreads );
+
+void testISPCTasks();
+
+} // namespace pk
+
+
+//
+// Called by ISPC-generated code; not for direct use
+//
+extern "C" {
+void* ISPCAlloc( void** handlePtr, int64_t size, int32_t alignment );
+void  ISPCLaunch( void** handlePtr, void* f, void* data, int countx, int county, int countz );
+void  ISPCSync( void* handle );
+}
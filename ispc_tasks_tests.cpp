@@ -0,0 +1,140 @@
+#include "ispc_tasks.h"
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+
+namespace pk
+{
+
+//
+// Test the ISPC task system the way ISPC-generated code drives it: kernels running in pool jobs launch tasks
+// (some of them launching tasks of their own), then sync. Every task must run exactly once, with in-range
+// indices, and no sync may deadlock the pool even when every worker is syncing at once.
+//
+
+static const uint32_t TEST_KERNELS     = 64;
+static const uint32_t TEST_TASKS_X     = 16;
+static const uint32_t TEST_TASKS_Y     = 4;
+static const uint32_t TEST_NESTED_TASK = 5; // this task index launches and syncs a launch of its own
+
+
+typedef struct {
+    std::atomic<uint32_t>* runs; // one per task
+    uint32_t               threadCount;
+    bool                   nested; // launched from a task; doesn't launch again
+    std::atomic<uint32_t>  badIndices;
+} test_kernel_t;
+
+
+static void _testTask( void* data, int threadIndex, int threadCount, int taskIndex, int taskCount, int taskIndex0, int taskIndex1, int taskIndex2, int taskCount0, int taskCount1, int taskCount2 );
+
+
+// What ISPC generates for "launch[ TEST_TASKS_X, TEST_TASKS_Y ] _testTask( kernel ); sync;"
+static void _launchAndSync( test_kernel_t* kernel )
+{
+    void* handle = nullptr;
+
+    test_kernel_t** args = (test_kernel_t**)ISPCAlloc( &handle, sizeof( test_kernel_t* ), 32 );
+    assert( ( (uintptr_t)args & 31 ) == 0 );
+    *args = kernel;
+
+    ISPCLaunch( &handle, (void*)_testTask, args, TEST_TASKS_X, TEST_TASKS_Y, 1 );
+    ISPCSync( handle );
+}
+
+
+static void _testTask( void* data, int threadIndex, int threadCount, int taskIndex, int taskCount, int taskIndex0, int taskIndex1, int taskIndex2, int taskCount0, int taskCount1, int taskCount2 )
+{
+    test_kernel_t* kernel = *(test_kernel_t**)data;
+
+    bool valid = threadIndex >= 0 && threadIndex < threadCount && (uint32_t)threadCount == kernel->threadCount;
+    valid      = valid && taskCount == TEST_TASKS_X * TEST_TASKS_Y && taskCount0 == TEST_TASKS_X && taskCount1 == TEST_TASKS_Y && taskCount2 == 1;
+    valid      = valid && taskIndex == taskIndex0 + taskIndex1 * TEST_TASKS_X && taskIndex2 == 0;
+    if ( !valid ) {
+        kernel->badIndices++;
+    }
+
+    kernel->runs[ taskIndex ]++;
+
+    if ( taskIndex == TEST_NESTED_TASK && !kernel->nested ) {
+        std::vector<std::atomic<uint32_t>> runs( TEST_TASKS_X * TEST_TASKS_Y );
+        test_kernel_t                       nested;
+        nested.runs        = runs.data();
+        nested.threadCount = kernel->threadCount;
+        nested.nested      = true;
+        nested.badIndices  = 0;
+
+        _launchAndSync( &nested );
+
+        for ( uint32_t i = 0; i < TEST_TASKS_X * TEST_TASKS_Y; i++ ) {
+            if ( runs[ i ] != 1 ) {
+                kernel->badIndices++;
+            }
+        }
+        kernel->badIndices += nested.badIndices;
+    }
+}
+
+
+static bool _kernelJob( void* context, uint32_t tid )
+{
+    _launchAndSync( (test_kernel_t*)context );
+    return true;
+}
+
+
+static void _testISPCTasks( thread_pool_mode_t mode )
+{
+    uint32_t      numThreads = std::max( 2u, std::thread::hardware_concurrency() );
+    thread_pool_t tp         = threadPoolCreate( numThreads, mode );
+
+    ispcTasksSetThreadPool( tp, numThreads );
+
+    std::vector<std::atomic<uint32_t>> runs( ( TEST_KERNELS + 1 ) * TEST_TASKS_X * TEST_TASKS_Y );
+    std::vector<test_kernel_t>         kernels( TEST_KERNELS + 1 );
+    std::vector<Invokable>             jobs;
+    for ( uint32_t k = 0; k <= TEST_KERNELS; k++ ) {
+        kernels[ k ].runs        = &runs[ k * TEST_TASKS_X * TEST_TASKS_Y ];
+        kernels[ k ].threadCount = numThreads + 1;
+        kernels[ k ].nested      = false;
+        kernels[ k ].badIndices  = 0;
+        if ( k < TEST_KERNELS ) {
+            jobs.push_back( Function( _kernelJob, &kernels[ k ] ) );
+        }
+    }
+
+    // Kernels on every worker at once, plus one on this thread from outside the pool
+    job_group_t group = threadPoolSubmitJobs( jobs.data(), jobs.size(), tp );
+    _launchAndSync( &kernels[ TEST_KERNELS ] );
+    threadPoolWaitForJobs( group, INFINITE_TIMEOUT, tp );
+
+    uint32_t errors = 0;
+    for ( uint32_t k = 0; k <= TEST_KERNELS; k++ ) {
+        errors += kernels[ k ].badIndices;
+        for ( uint32_t i = 0; i < TEST_TASKS_X * TEST_TASKS_Y; i++ ) {
+            errors += kernels[ k ].runs[ i ] != 1;
+        }
+    }
+
+    ispcTasksSetThreadPool( INVALID_THREAD_POOL, 0 );
+    threadPoolDestroy( tp );
+
+    printf( "testISPCTasks (%s): %u kernels x %u tasks, %u errors\n", threadPoolModeName( mode ), TEST_KERNELS + 1, TEST_TASKS_X * TEST_TASKS_Y, errors );
+    assert( errors == 0 );
+}
+
+
+void testISPCTasks()
+{
+    _testISPCTasks( THREAD_POOL_SHARED_QUEUE );
+    _testISPCTasks( THREAD_POOL_WORK_STEALING );
+}
+
+} // namespace pk
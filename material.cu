@@ -14,6 +14,9 @@ __host__ __device__ static bool _diffuseScatter( const material_t& d, const ray&
 __host__ __device__ static bool _metalScatter( const material_t& m, const ray& r, const hit_info& hit, vector3* attenuation, ray* scattered );
 __host__ __device__ static bool _glassScatter( const material_t& g, const ray& r, const hit_info& hit, vector3* attenuation, ray* scattered );
 
+// Russian roulette never keeps a path with certainty, so paths through glass (throughput 1) still end early
+static const float ROULETTE_MAX_SURVIVAL = 0.95f;
+
 __host__ __device__ bool materialScatter( const material_t& m, const ray& r, const hit_info& hit, vector3* attenuation, ray* scattered )
 {
     bool rval = false;
@@ -39,6 +42,31 @@ __host__ __device__ bool materialScatter( const material_t& m, const ray& r, con
     return rval;
 }
 
+
+// Survive with probability p and scale by 1 / p, so the expected contribution is unchanged while dim paths stop
+// paying for intersections. Every renderer draws from the current bounce's stream after the scatter.
+#pragma nv_exec_check_disable
+__host__ __device__ bool materialRoulette( vector3* p_throughput )
+{
+    float p = fmaxf( p_throughput->x, fmaxf( p_throughput->y, p_throughput->z ) );
+    p       = fminf( p, ROULETTE_MAX_SURVIVAL );
+
+    if ( random() >= p )
+        return false;
+
+    *p_throughput /= p;
+    return true;
+}
+
+
+__host__ __device__ vector3 materialBackground( const ray& r )
+{
+    vector3 unitDirection = r.direction.normalized();
+    float   t             = 0.5f * ( unitDirection.y + 1.0f );
+
+    return ( 1.0f - t ) * vector3( 1.0f, 1.0f, 1.0f ) + t * vector3( 0.5f, 0.7f, 1.0f );
+}
+
 //
 // Material implementations
 //
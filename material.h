@@ -3,6 +3,8 @@
 #include "ray.h"
 #include "vector_cuda.h"
 
+#include <stdint.h>
+
 namespace pk
 {
 
@@ -38,21 +40,27 @@ typedef struct _material {
 } material_t;
 
 
+// 32 bytes; the material is looked up by ID only once the closest hit is known
 typedef struct _hit {
-    float      distance;
-    vector3    point;
-    vector3    normal;
-    material_t material;
+    float    distance;
+    vector3  point;
+    vector3  normal;
+    uint32_t materialID; // index into the scene's material table
 
     __host__ __device__ _hit() :
         distance( 0.0f ),
         point( 0, 0, 0 ),
-        normal( 0, 0, 0 )
+        normal( 0, 0, 0 ),
+        materialID( 0 )
     {
     }
 } hit_info;
 
 
-__host__ __device__ bool materialScatter( const material_t& m, const ray& r, const hit_info& hit, vector3* attenuation, ray* scattered );
+__host__ __device__ bool    materialScatter( const material_t& m, const ray& r, const hit_info& hit, vector3* attenuation, ray* scattered );
+// Russian roulette on a path's throughput: false ends the path, true rescales the throughput to compensate
+__host__ __device__ bool    materialRoulette( vector3* p_throughput );
+// Sky color a ray that leaves the scene picks up
+__host__ __device__ vector3 materialBackground( const ray& r );
 
 } // namespace pk
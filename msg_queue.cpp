@@ -1,8 +1,10 @@
 #include "msg_queue.h"
 
+#include "futex.h"
 #include "perf_timer.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
@@ -10,16 +12,49 @@
 #include <cstdint>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 
 namespace pk
 {
 
-const int MAX_MSG_QUEUES = 5;
+const int MAX_MSG_QUEUES   = 5;
+const int SPSC_SPIN_COUNT = 64; // polls of an empty or full SPSC ring before sleeping on it
+
+// QUEUE_FLAG_SPSC: the receiver owns head and the sender owns tail. Each keeps a stale copy of the other side's index
+// and only re-reads the real one, from the other side's cache line, when the ring looks empty or full. One slot stays
+// empty so that full and empty look different. Padded so neither side's index shares a line with anything else.
+typedef struct _spsc_ring {
+    uint8_t               _pad0[ 64 ];
+    std::atomic<uint32_t> head;       // next slot to receive from
+    uint32_t              cachedTail; // the receiver's last look at tail
+    uint8_t               _pad1[ 64 - sizeof( std::atomic<uint32_t> ) - sizeof( uint32_t ) ];
+    std::atomic<uint32_t> tail;       // next slot to send into
+    uint32_t              cachedHead; // the sender's last look at head
+    uint8_t               _pad2[ 64 - sizeof( std::atomic<uint32_t> ) - sizeof( uint32_t ) ];
+
+    // Futex words, bumped only when the other side is asleep on them
+    std::atomic<uint32_t> receiveEvents;
+    std::atomic<uint32_t> receiverWaiting;
+    std::atomic<uint32_t> spaceEvents;
+    std::atomic<uint32_t> senderWaiting;
+
+    _spsc_ring() :
+        head( 0 ),
+        cachedTail( 0 ),
+        tail( 0 ),
+        cachedHead( 0 ),
+        receiveEvents( 0 ),
+        receiverWaiting( 0 ),
+        spaceEvents( 0 ),
+        senderWaiting( 0 ) {}
+} _spsc_ring_t;
 
 typedef struct _queue {
     std::mutex              mutex;
     std::condition_variable notification;
+    std::condition_variable space; // signaled when a receive frees a slot
     std::atomic<bool>       notified;
     size_t                  msg_size;
     uint32_t                length;
@@ -33,6 +68,9 @@ typedef struct _queue {
     std::condition_variable response;
     result                  response_rval;
 
+    uint32_t     flags;
+    _spsc_ring_t ring; // QUEUE_FLAG_SPSC only
+
     _queue() :
         head( nullptr ),
         tail( nullptr ),
@@ -41,7 +79,8 @@ typedef struct _queue {
         length( 0 ),
         used( 0 ),
         msgs( nullptr ),
-        response_rval( R_FAIL )
+        response_rval( R_FAIL ),
+        flags( QUEUE_FLAGS_NONE )
     {
     }
 } _queue_t;
@@ -55,8 +94,15 @@ static bool _queue_is_full( queue_t queue );
 static bool _queue_push_back( _queue_t* p_queue, const void* p_msg );
 static void _queue_pop_front( _queue_t* p_queue, void* p_msg );
 
+static size_t _spsc_push( _queue_t* p_queue, const uint8_t* msgs, size_t count );
+static size_t _spsc_pop( _queue_t* p_queue, uint8_t* p_msgs, size_t count );
+static size_t _spsc_used( _queue_t* p_queue );
+static void   _spsc_wake( std::atomic<uint32_t>* waiting, std::atomic<uint32_t>* events );
+static result _spsc_receive( _queue_t* p_queue, void* p_msg, unsigned int timeout_ms );
+static result _spsc_send_blocking( queue_t queue, _queue_t* p_queue, const void* msg, uint32_t timeout_ms );
+
 
-queue_t queue_create( size_t msg_size, uint32_t queue_length, void* queue_mem )
+queue_t queue_create( size_t msg_size, uint32_t queue_length, void* queue_mem, uint32_t flags )
 {
     assert( msg_size );
     assert( queue_length );
@@ -76,9 +122,15 @@ queue_t queue_create( size_t msg_size, uint32_t queue_length, void* queue_mem )
             p_queue->length   = queue_length;
             p_queue->used     = 0;
             p_queue->msgs     = (uint8_t*)queue_mem;
+            p_queue->flags    = flags;
 
             p_queue->head = p_queue->tail = p_queue->msgs;
 
+            p_queue->ring.head       = 0;
+            p_queue->ring.cachedTail = 0;
+            p_queue->ring.tail       = 0;
+            p_queue->ring.cachedHead = 0;
+
             handle = (queue_t)i;
             break;
         }
@@ -104,6 +156,7 @@ result queue_destroy( queue_t queue )
     p_queue->length   = 0;
     p_queue->used     = 0;
     p_queue->msgs     = nullptr;
+    p_queue->flags    = QUEUE_FLAGS_NONE;
 
     return R_OK;
 }
@@ -111,11 +164,22 @@ result queue_destroy( queue_t queue )
 
 result queue_send( queue_t queue, const void* msg )
 {
-    if ( !_valid( queue ) || _queue_is_full( queue ) )
+    if ( !_valid( queue ) )
         return R_FAIL;
 
     _queue_t* p_queue = &s_queues[ queue ];
 
+    if ( p_queue->flags & QUEUE_FLAG_SPSC ) {
+        if ( _spsc_push( p_queue, (const uint8_t*)msg, 1 ) == 0 )
+            return R_FAIL;
+
+        _spsc_wake( &p_queue->ring.receiverWaiting, &p_queue->ring.receiveEvents );
+        return R_OK;
+    }
+
+    if ( _queue_is_full( queue ) )
+        return R_FAIL;
+
     std::lock_guard<std::mutex> queue_lock( p_queue->mutex );
     _queue_push_back( p_queue, msg );
     p_queue->notified = true;
@@ -132,46 +196,89 @@ result queue_send_blocking( queue_t queue, const void* msg, uint32_t timeout_ms
 
     _queue_t* p_queue = &s_queues[ queue ];
 
+    if ( p_queue->flags & QUEUE_FLAG_SPSC )
+        return _spsc_send_blocking( queue, p_queue, msg, timeout_ms );
+
     PerfTimer timer;
-    result    rval = R_OK;
 
-    p_queue->mutex.lock();
+    std::unique_lock<std::mutex> queue_lock( p_queue->mutex );
     while ( !_queue_push_back( p_queue, msg ) ) {
-        // Block calling thread while queue is full; release lock so receiver can receive
-        p_queue->mutex.unlock();
-        delay( 10 );
-        if ( timer.ElapsedMilliseconds() >= timeout_ms ) {
-            rval = R_TIMEOUT;
-            break;
+        // Block calling thread while queue is full; waiting releases the lock so receiver can receive.
+        // Wake at least once a second to report a hang.
+        double elapsed = timer.ElapsedMilliseconds();
+        if ( elapsed >= timeout_ms )
+            return R_TIMEOUT;
+
+        std::chrono::milliseconds slice( (uint32_t)std::min<double>( timeout_ms - elapsed, 1000.0 ) );
+        if ( !p_queue->space.wait_for( queue_lock, slice, [ p_queue ]() { return p_queue->used < p_queue->length; } ) ) {
+            static unsigned int timeout_warning_ms = 1000;
+            if ( (unsigned int)timer.ElapsedMilliseconds() >= timeout_warning_ms ) {
+                printf( "queue_send_blocking(%d) hung for %d seconds\n", queue, (unsigned)timer.ElapsedSeconds() );
+                timeout_warning_ms *= 2;
+            }
         }
-
-        static unsigned int timeout_warning_ms = 1000;
-        if ( (unsigned int)timer.ElapsedMilliseconds() >= timeout_warning_ms ) {
-            printf( "queue_send_blocking(%d) hung for %d seconds\n", queue, (unsigned)timer.ElapsedSeconds() );
-            timeout_warning_ms *= 2;
-        }
-
-        p_queue->mutex.lock();
     };
     p_queue->notification.notify_one();
-    p_queue->mutex.unlock();
 
-    return rval;
+    return R_OK;
+}
+
+
+result queue_send_n( queue_t queue, const void* msgs, size_t count, size_t* p_sent )
+{
+    assert( msgs || count == 0 );
+    assert( p_sent );
+
+    *p_sent = 0;
+
+    if ( !_valid( queue ) )
+        return R_FAIL;
+
+    _queue_t*      p_queue = &s_queues[ queue ];
+    const uint8_t* p_msgs  = (const uint8_t*)msgs;
+
+    if ( p_queue->flags & QUEUE_FLAG_SPSC ) {
+        *p_sent = _spsc_push( p_queue, p_msgs, count );
+        if ( *p_sent > 0 ) {
+            _spsc_wake( &p_queue->ring.receiverWaiting, &p_queue->ring.receiveEvents );
+        }
+    } else {
+        std::lock_guard<std::mutex> queue_lock( p_queue->mutex );
+        while ( *p_sent < count && _queue_push_back( p_queue, p_msgs + *p_sent * p_queue->msg_size ) ) {
+            ( *p_sent )++;
+        }
+        if ( *p_sent > 0 ) {
+            p_queue->notified = true;
+            p_queue->notification.notify_one();
+        }
+    }
+
+    return *p_sent == count ? R_OK : R_FAIL;
 }
 
 
 result queue_send_and_wait_for_response( queue_t queue, const void* msg )
 {
-    if ( !_valid( queue ) || _queue_is_full( queue ) )
+    if ( !_valid( queue ) )
         return R_FAIL;
 
     _queue_t* p_queue = &s_queues[ queue ];
 
-    p_queue->mutex.lock();
-    _queue_push_back( p_queue, msg );
-    p_queue->notified = true;
-    p_queue->notification.notify_one();
-    p_queue->mutex.unlock();
+    if ( p_queue->flags & QUEUE_FLAG_SPSC ) {
+        if ( _spsc_push( p_queue, (const uint8_t*)msg, 1 ) == 0 )
+            return R_FAIL;
+
+        _spsc_wake( &p_queue->ring.receiverWaiting, &p_queue->ring.receiveEvents );
+    } else {
+        if ( _queue_is_full( queue ) )
+            return R_FAIL;
+
+        p_queue->mutex.lock();
+        _queue_push_back( p_queue, msg );
+        p_queue->notified = true;
+        p_queue->notification.notify_one();
+        p_queue->mutex.unlock();
+    }
 
     // Block on response
     std::unique_lock<std::mutex> response_lock( p_queue->response_mutex );
@@ -199,6 +306,9 @@ result queue_receive( queue_t queue, void* p_msg, size_t msg_size, unsigned int
     result    rval    = R_FAIL;
     _queue_t* p_queue = &s_queues[ queue ];
 
+    if ( p_queue->flags & QUEUE_FLAG_SPSC )
+        return _spsc_receive( p_queue, p_msg, timeout_ms );
+
     std::unique_lock<std::mutex> queue_lock( p_queue->mutex );
 
     std::chrono::milliseconds ms( timeout_ms );
@@ -217,7 +327,10 @@ result queue_receive( queue_t queue, void* p_msg, size_t msg_size, unsigned int
     if ( p_queue->notified || !_queue_is_empty( queue ) )
         rval = R_OK;
 
-    _queue_pop_front( p_queue, p_msg );
+    if ( !_queue_is_empty( queue ) ) {
+        _queue_pop_front( p_queue, p_msg );
+        p_queue->space.notify_one();
+    }
 
 Exit:
     p_queue->notified = false;
@@ -226,6 +339,41 @@ Exit:
 }
 
 
+result queue_receive_n( queue_t queue, void* p_msgs, size_t msg_size, size_t max_count, size_t* p_received )
+{
+    assert( p_msgs || max_count == 0 );
+    assert( p_received );
+
+    *p_received = 0;
+
+    if ( !_valid( queue ) )
+        return R_FAIL;
+
+    _queue_t* p_queue = &s_queues[ queue ];
+    uint8_t*  p_out   = (uint8_t*)p_msgs;
+    assert( msg_size == p_queue->msg_size );
+
+    if ( p_queue->flags & QUEUE_FLAG_SPSC ) {
+        *p_received = _spsc_pop( p_queue, p_out, max_count );
+        if ( *p_received > 0 ) {
+            _spsc_wake( &p_queue->ring.senderWaiting, &p_queue->ring.spaceEvents );
+        }
+    } else {
+        std::lock_guard<std::mutex> queue_lock( p_queue->mutex );
+        while ( *p_received < max_count && p_queue->used > 0 ) {
+            _queue_pop_front( p_queue, p_out + *p_received * msg_size );
+            ( *p_received )++;
+        }
+        if ( *p_received > 0 ) {
+            p_queue->notified = false;
+            p_queue->space.notify_one();
+        }
+    }
+
+    return *p_received > 0 ? R_OK : R_FAIL;
+}
+
+
 result queue_notify_sender( queue_t queue, result rval )
 {
     if ( !_valid( queue ) )
@@ -247,6 +395,13 @@ result queue_notify( queue_t queue )
 
     _queue_t* p_queue = &s_queues[ queue ];
 
+    if ( p_queue->flags & QUEUE_FLAG_SPSC ) {
+        p_queue->notified = true;
+        p_queue->ring.receiveEvents.fetch_add( 1, std::memory_order_seq_cst );
+        futexWakeOne( &p_queue->ring.receiveEvents );
+        return R_OK;
+    }
+
     std::lock_guard<std::mutex> queue_lock( p_queue->mutex );
     p_queue->notified = true;
     p_queue->notification.notify_one();
@@ -262,6 +417,10 @@ result queue_notify_all( queue_t queue )
 
     _queue_t* p_queue = &s_queues[ queue ];
 
+    // Only one receiver to wake
+    if ( p_queue->flags & QUEUE_FLAG_SPSC )
+        return queue_notify( queue );
+
     std::lock_guard<std::mutex> queue_lock( p_queue->mutex );
     p_queue->notification.notify_all();
 
@@ -276,6 +435,9 @@ size_t queue_size( queue_t queue )
 
     _queue_t* p_queue = &s_queues[ queue ];
 
+    if ( p_queue->flags & QUEUE_FLAG_SPSC )
+        return _spsc_used( p_queue );
+
     std::lock_guard<std::mutex> queue_lock( p_queue->mutex );
     return p_queue->used;
 }
@@ -319,6 +481,175 @@ static void _queue_pop_front( _queue_t* p_queue, void* p_msg )
 }
 
 
+//
+// SPSC ring; _spsc_push() is only ever called by the sending thread, _spsc_pop() by the receiving thread
+//
+
+// Copy in as many of count messages as fit, then publish them all with one store; wait-free
+static size_t _spsc_push( _queue_t* p_queue, const uint8_t* msgs, size_t count )
+{
+    _spsc_ring_t* ring   = &p_queue->ring;
+    uint32_t      length = p_queue->length;
+    uint32_t      tail   = ring->tail.load( std::memory_order_relaxed );
+
+    // A stale head only undercounts the free slots, so look at the real one only when it's needed
+    size_t space = ( ring->cachedHead + length - tail - 1 ) % length;
+    if ( space < count ) {
+        ring->cachedHead = ring->head.load( std::memory_order_acquire );
+        space            = ( ring->cachedHead + length - tail - 1 ) % length;
+    }
+
+    size_t n = std::min( count, space );
+    if ( n == 0 )
+        return 0;
+
+    // At most two copies: up to the end of the buffer, then from the start
+    size_t first = std::min<size_t>( n, length - tail );
+    memcpy( p_queue->msgs + tail * p_queue->msg_size, msgs, first * p_queue->msg_size );
+    memcpy( p_queue->msgs, msgs + first * p_queue->msg_size, ( n - first ) * p_queue->msg_size );
+
+    ring->tail.store( uint32_t( ( tail + n ) % length ), std::memory_order_release );
+
+    return n;
+}
+
+
+// Copy out up to count messages, then hand their slots back with one store; wait-free
+static size_t _spsc_pop( _queue_t* p_queue, uint8_t* p_msgs, size_t count )
+{
+    _spsc_ring_t* ring   = &p_queue->ring;
+    uint32_t      length = p_queue->length;
+    uint32_t      head   = ring->head.load( std::memory_order_relaxed );
+
+    size_t available = ( ring->cachedTail + length - head ) % length;
+    if ( available < count ) {
+        ring->cachedTail = ring->tail.load( std::memory_order_acquire );
+        available        = ( ring->cachedTail + length - head ) % length;
+    }
+
+    size_t n = std::min( count, available );
+    if ( n == 0 )
+        return 0;
+
+    size_t first = std::min<size_t>( n, length - head );
+    memcpy( p_msgs, p_queue->msgs + head * p_queue->msg_size, first * p_queue->msg_size );
+    memcpy( p_msgs + first * p_queue->msg_size, p_queue->msgs, ( n - first ) * p_queue->msg_size );
+
+    ring->head.store( uint32_t( ( head + n ) % length ), std::memory_order_release );
+
+    return n;
+}
+
+
+// Approximate unless called from the sending or receiving thread
+static size_t _spsc_used( _queue_t* p_queue )
+{
+    uint32_t head = p_queue->ring.head.load( std::memory_order_acquire );
+    uint32_t tail = p_queue->ring.tail.load( std::memory_order_acquire );
+
+    return ( tail + p_queue->length - head ) % p_queue->length;
+}
+
+
+// Wake the other side if it's asleep; pairs with the fence in the waits below, so either we see it waiting,
+// or it sees what we just sent or freed before it sleeps. Clearing the flag here means a burst of sends to a
+// sleeping receiver makes one futex call, not one per message.
+static void _spsc_wake( std::atomic<uint32_t>* waiting, std::atomic<uint32_t>* events )
+{
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if ( waiting->load( std::memory_order_relaxed ) == 0 || waiting->exchange( 0, std::memory_order_relaxed ) == 0 )
+        return;
+
+    events->fetch_add( 1, std::memory_order_release );
+    futexWakeOne( events );
+}
+
+
+static result _spsc_receive( _queue_t* p_queue, void* p_msg, unsigned int timeout_ms )
+{
+    _spsc_ring_t* ring = &p_queue->ring;
+    PerfTimer     timer;
+
+    while ( true ) {
+        for ( int i = 0; i < SPSC_SPIN_COUNT; i++ ) {
+            if ( _spsc_pop( p_queue, (uint8_t*)p_msg, 1 ) ) {
+                _spsc_wake( &ring->senderWaiting, &ring->spaceEvents );
+                return R_OK;
+            }
+        }
+
+        // Like the mutex queue, queue_notify() wakes the receiver with R_OK and no message
+        if ( p_queue->notified.exchange( false ) )
+            return R_OK;
+
+        double elapsed = timer.ElapsedMilliseconds();
+        if ( elapsed >= timeout_ms )
+            return R_TIMEOUT;
+
+        uint32_t events = ring->receiveEvents.load( std::memory_order_acquire );
+        ring->receiverWaiting.store( 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        bool received = _spsc_pop( p_queue, (uint8_t*)p_msg, 1 ) > 0;
+        if ( !received ) {
+            uint32_t remaining = timeout_ms == ( std::numeric_limits<unsigned int>::max )() ? FUTEX_INFINITE : uint32_t( timeout_ms - elapsed );
+            futexWait( &ring->receiveEvents, events, remaining );
+        }
+
+        ring->receiverWaiting.store( 0, std::memory_order_relaxed );
+
+        if ( received ) {
+            _spsc_wake( &ring->senderWaiting, &ring->spaceEvents );
+            return R_OK;
+        }
+    }
+}
+
+
+static result _spsc_send_blocking( queue_t queue, _queue_t* p_queue, const void* msg, uint32_t timeout_ms )
+{
+    _spsc_ring_t* ring = &p_queue->ring;
+    PerfTimer     timer;
+
+    while ( true ) {
+        for ( int i = 0; i < SPSC_SPIN_COUNT; i++ ) {
+            if ( _spsc_push( p_queue, (const uint8_t*)msg, 1 ) ) {
+                _spsc_wake( &ring->receiverWaiting, &ring->receiveEvents );
+                return R_OK;
+            }
+        }
+
+        double elapsed = timer.ElapsedMilliseconds();
+        if ( elapsed >= timeout_ms )
+            return R_TIMEOUT;
+
+        uint32_t events = ring->spaceEvents.load( std::memory_order_acquire );
+        ring->senderWaiting.store( 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        bool sent = _spsc_push( p_queue, (const uint8_t*)msg, 1 ) > 0;
+        if ( !sent ) {
+            // Wake at least once a second to report a hang
+            uint32_t slice_ms = (uint32_t)std::min<double>( timeout_ms - elapsed, 1000.0 );
+            if ( !futexWait( &ring->spaceEvents, events, slice_ms ) ) {
+                static unsigned int timeout_warning_ms = 1000;
+                if ( (unsigned int)timer.ElapsedMilliseconds() >= timeout_warning_ms ) {
+                    printf( "queue_send_blocking(%d) hung for %d seconds\n", queue, (unsigned)timer.ElapsedSeconds() );
+                    timeout_warning_ms *= 2;
+                }
+            }
+        }
+
+        ring->senderWaiting.store( 0, std::memory_order_relaxed );
+
+        if ( sent ) {
+            _spsc_wake( &ring->receiverWaiting, &ring->receiveEvents );
+            return R_OK;
+        }
+    }
+}
+
+
 static bool _valid( queue_t queue )
 {
     if ( queue == INVALID_QUEUE || queue >= ARRAY_SIZE( s_queues ) ) {
@@ -340,4 +671,90 @@ static bool _queue_is_empty( queue_t queue )
     return s_queues[ queue ].used == 0;
 }
 
+
+//
+// Tests
+//
+
+const uint32_t SPSC_TEST_LENGTH   = 1024;
+const uint64_t SPSC_TEST_MESSAGES = 1000000;
+const size_t   SPSC_TEST_BATCH    = 64;
+
+
+// Stream SPSC_TEST_MESSAGES counters from one thread to another, batch at a time, and check they arrive in order.
+// Returns messages per second.
+static double _spscStream( uint32_t flags, size_t batch, uint64_t* p_errors )
+{
+    uint64_t* buffer = new uint64_t[ SPSC_TEST_LENGTH ];
+    queue_t   queue  = queue_create( sizeof( uint64_t ), SPSC_TEST_LENGTH, buffer, flags );
+    assert( queue != INVALID_QUEUE );
+
+    PerfTimer timer;
+
+    std::thread sender( [ queue, batch ]() {
+        std::vector<uint64_t> msgs( batch );
+        for ( uint64_t next = 0; next < SPSC_TEST_MESSAGES; ) {
+            size_t count = (size_t)std::min<uint64_t>( batch, SPSC_TEST_MESSAGES - next );
+            for ( size_t i = 0; i < count; i++ ) {
+                msgs[ i ] = next + i;
+            }
+
+            size_t sent = 0;
+            queue_send_n( queue, msgs.data(), count, &sent );
+            if ( sent == 0 ) {
+                // Full; block for one so the receiver gets the CPU
+                queue_send_blocking( queue, &msgs[ 0 ] );
+                sent = 1;
+            }
+            next += sent;
+        }
+    } );
+
+    uint64_t              errors   = 0;
+    uint64_t              expected = 0;
+    std::vector<uint64_t> msgs( batch );
+    while ( expected < SPSC_TEST_MESSAGES ) {
+        size_t received = 0;
+        if ( queue_receive_n( queue, msgs.data(), sizeof( uint64_t ), batch, &received ) != R_OK ) {
+            // Empty; block for one
+            if ( queue_receive( queue, &msgs[ 0 ], sizeof( uint64_t ), 1000 ) != R_OK )
+                continue;
+            received = 1;
+        }
+
+        for ( size_t i = 0; i < received; i++ ) {
+            errors += msgs[ i ] != expected++;
+        }
+    }
+
+    sender.join();
+
+    double seconds = timer.ElapsedSeconds();
+
+    queue_destroy( queue );
+    delete[] buffer;
+
+    *p_errors += errors;
+    return SPSC_TEST_MESSAGES / seconds;
+}
+
+
+void testMsgQueueSPSC()
+{
+    uint64_t errors = 0;
+
+    printf( "testMsgQueueSPSC: %llu messages, queue length %u\n", (unsigned long long)SPSC_TEST_MESSAGES, SPSC_TEST_LENGTH );
+    printf( "%-8s %14s %14s\n", "batch", "mutex msg/s", "spsc msg/s" );
+
+    size_t batches[] = { 1, SPSC_TEST_BATCH };
+    for ( size_t batch : batches ) {
+        double mutex = _spscStream( QUEUE_FLAGS_NONE, batch, &errors );
+        double spsc  = _spscStream( QUEUE_FLAG_SPSC, batch, &errors );
+        printf( "%-8zu %14.0f %14.0f\n", batch, mutex, spsc );
+    }
+
+    printf( "testMsgQueueSPSC: %llu errors\n", (unsigned long long)errors );
+    assert( errors == 0 );
+}
+
 } // namespace pk
@@ -21,15 +21,35 @@ namespace pk
 typedef uint32_t queue_t;
 const queue_t    INVALID_QUEUE = ( queue_t )( -1 );
 
-queue_t queue_create( size_t msg_size, uint32_t queue_length, void* queue_mem );
+//
+// QUEUE_FLAGS_NONE: any number of senders and receivers; every call takes the queue's mutex.
+// QUEUE_FLAG_SPSC:  exactly one sending thread and one receiving thread, e.g. render thread to writer. Sends and
+//                   receives are wait-free and lock-free: each side owns one index, on its own cache line, and only
+//                   reads the other's when the queue looks full or empty. Only a blocking call on a full or empty
+//                   queue sleeps. Holds queue_length - 1 messages.
+//
+typedef enum {
+    QUEUE_FLAGS_NONE = 0,
+    QUEUE_FLAG_SPSC  = 1 << 0,
+} queue_flags_t;
+
+//
+// queue_send_n() queues as many of count messages as fit, and queue_receive_n() takes up to max_count; neither
+// blocks, and on an SPSC queue each is one index update for the whole batch. *p_sent / *p_received say how many.
+//
+queue_t queue_create( size_t msg_size, uint32_t queue_length, void* queue_mem, uint32_t flags = QUEUE_FLAGS_NONE );
 result  queue_destroy( queue_t queue );
 result  queue_send( queue_t queue, const void* msg );
 result  queue_send_blocking( queue_t queue, const void* msg, uint32_t timeout_ms = (std::numeric_limits<uint32_t>::max)() );
+result  queue_send_n( queue_t queue, const void* msgs, size_t count, size_t* p_sent );
 result  queue_send_and_wait_for_response( queue_t queue, const void* msg );
 result  queue_receive( queue_t queue, void* p_msg, size_t msg_size, unsigned int timeout_ms );
+result  queue_receive_n( queue_t queue, void* p_msgs, size_t msg_size, size_t max_count, size_t* p_received );
 result  queue_notify_sender( queue_t queue, result rval );
 result  queue_notify( queue_t queue );
 result  queue_notify_all( queue_t queue );
 size_t  queue_size( queue_t queue );
 
+void testMsgQueueSPSC();
+
 } // namespace pk
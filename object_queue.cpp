@@ -1,5 +1,8 @@
 #include "object_queue.h"
 
+#include <thread>
+#include <vector>
+
 
 namespace pk
 {
@@ -72,4 +75,184 @@ void testObjectQueues()
     Queue<Object>::destroy( queue );
 }
 
+
+//
+// Many senders and receivers on a small queue, so both sides keep hitting full and empty and sleeping on the
+// futexes. Every message must arrive exactly once, and close() must wake every receiver.
+//
+
+static const int MPMC_SENDERS   = 4;
+static const int MPMC_RECEIVERS = 4;
+static const int MPMC_MESSAGES  = 100000; // per sender
+static const int MPMC_DEPTH     = 7;      // not a power of two, and much smaller than the traffic
+
+
+void testObjectQueuesMPMC()
+{
+    uint64_t*   buffer = new uint64_t[ MPMC_DEPTH ];
+    obj_queue_t queue  = Queue<uint64_t>::create( MPMC_DEPTH, buffer );
+    assert( queue != INVALID_QUEUE );
+
+    std::vector<std::atomic<uint32_t>> seen( MPMC_SENDERS * MPMC_MESSAGES );
+    std::vector<std::thread>           receivers;
+    for ( int r = 0; r < MPMC_RECEIVERS; r++ ) {
+        receivers.push_back( std::thread( [ queue, &seen ]() {
+            uint64_t msg;
+            while ( Queue<uint64_t>::receive( queue, &msg, sizeof( msg ) ) == R_OK ) {
+                seen[ msg ]++;
+            }
+        } ) );
+    }
+
+    std::vector<std::thread> senders;
+    for ( int s = 0; s < MPMC_SENDERS; s++ ) {
+        senders.push_back( std::thread( [ queue, s ]() {
+            for ( uint64_t i = 0; i < MPMC_MESSAGES; i++ ) {
+                uint64_t msg = (uint64_t)s * MPMC_MESSAGES + i;
+                result   rval = Queue<uint64_t>::sendBlocking( queue, &msg );
+                assert( rval == R_OK );
+            }
+        } ) );
+    }
+
+    for ( std::thread& t : senders ) {
+        t.join();
+    }
+
+    // Let the receivers drain what's left, then wake them all
+    while ( Queue<uint64_t>::size( queue ) > 0 ) {
+        std::this_thread::yield();
+    }
+    Queue<uint64_t>::close( queue );
+    for ( std::thread& t : receivers ) {
+        t.join();
+    }
+
+    uint32_t errors = 0;
+    for ( size_t i = 0; i < seen.size(); i++ ) {
+        errors += seen[ i ] != 1;
+    }
+
+    printf( "testObjectQueuesMPMC: %d senders, %d receivers, %d messages, %u errors\n", MPMC_SENDERS, MPMC_RECEIVERS, MPMC_SENDERS * MPMC_MESSAGES, errors );
+    assert( errors == 0 );
+
+    Queue<uint64_t>::destroy( queue );
+    delete[] buffer;
+}
+
+
+//
+// sendN() and receiveN(): a batch that doesn't fit is partly sent, a batch arrives in order, and under MPMC traffic
+// every message still arrives exactly once.
+//
+
+static const int BATCH_DEPTH = 8;
+static const int BATCH_SIZE  = 16;
+
+
+void testObjectQueuesBatch()
+{
+    uint32_t errors = 0;
+
+    // Single thread: strings are moved in and out, and a full queue takes only what fits
+    {
+        std::string* buffer = new std::string[ BATCH_DEPTH ];
+        obj_queue_t  queue  = Queue<std::string>::create( BATCH_DEPTH, buffer );
+        assert( queue != INVALID_QUEUE );
+
+        std::string msgs[ BATCH_DEPTH + 2 ];
+        for ( int i = 0; i < BATCH_DEPTH + 2; i++ ) {
+            msgs[ i ] = "a string long enough to live on the heap " + std::to_string( i );
+        }
+
+        size_t sent = 0;
+        errors += Queue<std::string>::sendN( queue, msgs, BATCH_DEPTH + 2, &sent ) != R_FAIL;
+        errors += sent != BATCH_DEPTH;
+        errors += msgs[ BATCH_DEPTH ].empty(); // not sent, so not moved from
+
+        std::string received[ BATCH_DEPTH + 2 ];
+        size_t      count = 0;
+        errors += Queue<std::string>::receiveN( queue, received, 5, &count ) != R_OK;
+        errors += count != 5;
+        errors += Queue<std::string>::receiveN( queue, &received[ 5 ], BATCH_DEPTH, &count ) != R_OK;
+        errors += count != BATCH_DEPTH - 5;
+        errors += Queue<std::string>::receiveN( queue, received, BATCH_DEPTH, &count, 0 ) != R_TIMEOUT;
+
+        for ( int i = 0; i < BATCH_DEPTH; i++ ) {
+            errors += received[ i ] != "a string long enough to live on the heap " + std::to_string( i );
+        }
+
+        errors += Queue<std::string>::send( queue, std::move( msgs[ BATCH_DEPTH ] ) ) != R_OK;
+        errors += Queue<std::string>::receive( queue, received, sizeof( std::string ), 0 ) != R_OK;
+        errors += received[ 0 ] != "a string long enough to live on the heap " + std::to_string( BATCH_DEPTH );
+
+        Queue<std::string>::destroy( queue );
+        delete[] buffer;
+    }
+
+    // Many threads, batches bigger than the queue
+    {
+        uint64_t*   buffer = new uint64_t[ MPMC_DEPTH ];
+        obj_queue_t queue  = Queue<uint64_t>::create( MPMC_DEPTH, buffer );
+        assert( queue != INVALID_QUEUE );
+
+        std::vector<std::atomic<uint32_t>> seen( MPMC_SENDERS * MPMC_MESSAGES );
+        std::vector<std::thread>           receivers;
+        for ( int r = 0; r < MPMC_RECEIVERS; r++ ) {
+            receivers.push_back( std::thread( [ queue, &seen ]() {
+                uint64_t msgs[ BATCH_SIZE ];
+                size_t   count = 0;
+                while ( Queue<uint64_t>::receiveN( queue, msgs, BATCH_SIZE, &count ) == R_OK ) {
+                    for ( size_t i = 0; i < count; i++ ) {
+                        seen[ msgs[ i ] ]++;
+                    }
+                }
+            } ) );
+        }
+
+        std::vector<std::thread> senders;
+        for ( int s = 0; s < MPMC_SENDERS; s++ ) {
+            senders.push_back( std::thread( [ queue, s ]() {
+                uint64_t msgs[ BATCH_SIZE ];
+                for ( uint64_t i = 0; i < MPMC_MESSAGES; i += BATCH_SIZE ) {
+                    size_t count = std::min<size_t>( BATCH_SIZE, MPMC_MESSAGES - i );
+                    for ( size_t j = 0; j < count; j++ ) {
+                        msgs[ j ] = (uint64_t)s * MPMC_MESSAGES + i + j;
+                    }
+
+                    // Send what fits; block for the rest one at a time
+                    size_t sent = 0;
+                    Queue<uint64_t>::sendN( queue, msgs, count, &sent );
+                    for ( ; sent < count; sent++ ) {
+                        result rval = Queue<uint64_t>::sendBlocking( queue, std::move( msgs[ sent ] ) );
+                        assert( rval == R_OK );
+                    }
+                }
+            } ) );
+        }
+
+        for ( std::thread& t : senders ) {
+            t.join();
+        }
+
+        while ( Queue<uint64_t>::size( queue ) > 0 ) {
+            std::this_thread::yield();
+        }
+        Queue<uint64_t>::close( queue );
+        for ( std::thread& t : receivers ) {
+            t.join();
+        }
+
+        for ( size_t i = 0; i < seen.size(); i++ ) {
+            errors += seen[ i ] != 1;
+        }
+
+        Queue<uint64_t>::destroy( queue );
+        delete[] buffer;
+    }
+
+    printf( "testObjectQueuesBatch: %d senders, %d receivers, batches of %d, %u errors\n", MPMC_SENDERS, MPMC_RECEIVERS, BATCH_SIZE, errors );
+    assert( errors == 0 );
+}
+
 } // namespace pk
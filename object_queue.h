@@ -1,10 +1,11 @@
 #pragma once
 
+#include "futex.h"
 #include "perf_timer.h"
 #include "result.h"
-#include "spin_lock.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
@@ -13,14 +14,23 @@
 #include <limits>
 #include <mutex>
 #include <string>
+#include <utility>
 
 
 //
 // A simple thread-safe message queue for sending messages from a producer thread to a consumer thread.
-// Copy-on-send, copy-on-receive.
+// Copy-on-send (or move, for the TYPE&& overloads and sendN()), move-on-receive.
 //
 // Messages can be objects, structs, or primitives.
 //
+// Any number of threads may send and receive at once: the queue is a lock-free bounded MPMC ring (Dmitry Vyukov's),
+// where every slot carries a sequence number saying whether it's free for the sender claiming a position, or full for
+// the receiver claiming it. Senders and receivers claim positions with a CAS and never take a lock. A receiver only
+// sleeps (on a futex) once the queue is empty, and a blocking sender once it's full.
+//
+// sendN(), sendBlockingN() and receiveN() claim a run of consecutive slots with a single CAS and wake the other side
+// once for the whole batch, so moving N messages costs about as much synchronization as moving one.
+//
 // See also: msg_queue.h for a vanilla C version that only handles structs and primitives
 //
 
@@ -37,56 +47,98 @@ public:
     static obj_queue_t create( uint32_t queue_length, TYPE* queue_mem );
     static result      destroy( obj_queue_t queue );
     static result      send( obj_queue_t queue, const TYPE* msg );
+    static result      send( obj_queue_t queue, TYPE&& msg );
+    static result      sendN( obj_queue_t queue, TYPE* msgs, size_t count, size_t* p_sent = nullptr );
     static result      sendBlocking( obj_queue_t queue, const TYPE* msg, uint32_t timeout_ms = ( std::numeric_limits<uint32_t>::max )() );
+    static result      sendBlocking( obj_queue_t queue, TYPE&& msg, uint32_t timeout_ms = ( std::numeric_limits<uint32_t>::max )() );
+    static result      sendBlockingN( obj_queue_t queue, const TYPE* msgs, size_t count, size_t* p_sent = nullptr, uint32_t timeout_ms = ( std::numeric_limits<uint32_t>::max )() );
     static result      sendAndWaitForResponse( obj_queue_t queue, const TYPE* msg );
     static result      receive( obj_queue_t queue, TYPE* p_msg, size_t msg_size, unsigned int timeout_ms = ( std::numeric_limits<unsigned int>::max )() );
+    static result      receiveN( obj_queue_t queue, TYPE* p_msgs, size_t max_count, size_t* p_received, unsigned int timeout_ms = ( std::numeric_limits<unsigned int>::max )() );
     static result      notifySender( obj_queue_t queue, result rval );
     static result      notify( obj_queue_t queue );
     static result      notifyAll( obj_queue_t queue );
+    static result      close( obj_queue_t queue );
     static size_t      size( obj_queue_t queue );
 
 private:
+    // Senders and receivers each hammer their own position, so keep them, and the futex words each side sleeps on,
+    // on separate cache lines. Padded rather than alignas() so heap-allocated queues don't need C++17 aligned new.
     typedef struct _obj_queue {
-        SpinLock                spinLock; // used for fast lock during send/receive/query
-        std::mutex              mutex;    // used for blocking thread on receive when queue is empty
-        std::condition_variable notification;
-        std::atomic<bool>       notified;
-        size_t                  msg_size;
-        uint32_t                length;
-        std::atomic<uint32_t>   used;
-        TYPE*                   head;
-        TYPE*                   tail;
-        TYPE*                   msgs;
-        obj_queue_t             handle;
+        std::atomic<uint64_t> sendPos; // next position a sender claims
+        uint8_t               _pad0[ 64 - sizeof( std::atomic<uint64_t> ) ];
+        std::atomic<uint64_t> receivePos; // next position a receiver claims
+        uint8_t               _pad1[ 64 - sizeof( std::atomic<uint64_t> ) ];
+        std::atomic<uint32_t> receiveEvents; // futex word for sleeping receivers; bumped by sends and notifications
+        std::atomic<uint32_t> waitingReceivers;
+        uint8_t               _pad2[ 64 - 2 * sizeof( std::atomic<uint32_t> ) ];
+        std::atomic<uint32_t> spaceEvents; // futex word for senders sleeping on a full queue; bumped by receives
+        std::atomic<uint32_t> waitingSenders;
+        uint8_t               _pad3[ 64 - 2 * sizeof( std::atomic<uint32_t> ) ];
+
+        std::atomic<uint64_t>* sequences; // per slot: position p is free to send when == p, ready to receive when == p + 1
+        TYPE*                  msgs;
+        uint32_t               length;
+        uint32_t               mask; // length - 1 when length is a power of two, so finding a slot needn't divide
+        obj_queue_t            handle;
+        std::atomic<bool>      notified;     // notify(): the next receiver to find the queue empty returns R_FAIL
+        std::atomic<uint32_t>  wakeAllCount; // bumped by notifyAll(), so every waiting receiver wakes, not just the first
+        std::atomic<bool>      closed;
 
         // Some messages are blocking, and may return a result to the sender
         std::mutex              response_mutex;
         std::condition_variable response;
         result                  response_rval;
 
-        _obj_queue() :
-            head( nullptr ),
-            tail( nullptr ),
+        _obj_queue( uint32_t queue_length, TYPE* queue_mem, obj_queue_t h ) :
+            sendPos( 0 ),
+            receivePos( 0 ),
+            receiveEvents( 0 ),
+            waitingReceivers( 0 ),
+            spaceEvents( 0 ),
+            waitingSenders( 0 ),
+            sequences( new std::atomic<uint64_t>[ queue_length ] ),
+            msgs( queue_mem ),
+            length( queue_length ),
+            mask( ( queue_length & ( queue_length - 1 ) ) == 0 ? queue_length - 1 : 0 ),
+            handle( h ),
             notified( false ),
-            msg_size( 0 ),
-            length( 0 ),
-            used( 0 ),
-            msgs( nullptr ),
-            handle( INVALID_QUEUE ),
+            wakeAllCount( 0 ),
+            closed( false ),
             response_rval( R_FAIL )
         {
+            for ( uint32_t i = 0; i < queue_length; i++ ) {
+                sequences[ i ].store( i, std::memory_order_relaxed );
+            }
         }
-    } _obj_queue_t;
 
-    static const int    MAX_OBJECT_QUEUES = 5;
-    static std::mutex   s_queues_mutex;
-    static _obj_queue_t s_queues[ MAX_OBJECT_QUEUES ];
+        ~_obj_queue()
+        {
+            delete[] sequences;
+        }
+    } _obj_queue_t;
 
-    static bool _valid( obj_queue_t queue );
-    static bool _queue_is_empty( obj_queue_t queue );
-    static bool _queue_is_full( obj_queue_t queue );
-    static bool _queue_push_back( _obj_queue_t* p_queue, const TYPE* p_msg );
-    static bool _queue_pop_front( _obj_queue_t* p_queue, TYPE* p_msg );
+    // Queues are allocated on demand and found through a table of fixed-size chunks. A chunk never moves or goes
+    // away once allocated, so looking a handle up needs no lock; only create() and destroy() take s_queues_mutex.
+    static const uint32_t QUEUE_CHUNK_SIZE = 64;
+    static const uint32_t MAX_QUEUE_CHUNKS = 1024;
+    static const int      QUEUE_SPIN_COUNT = 64; // polls of an empty or full queue before sleeping on it
+
+    static std::mutex     s_queues_mutex;
+    static _obj_queue_t** s_chunks[ MAX_QUEUE_CHUNKS ];
+
+    static _obj_queue_t* _get( obj_queue_t queue );
+    static uint32_t      _slot( const _obj_queue_t* p_queue, uint64_t pos );
+    static size_t        _claim( _obj_queue_t* p_queue, std::atomic<uint64_t>* position, uint64_t ready, size_t max_count, uint64_t* p_pos );
+    static bool          _try_push( _obj_queue_t* p_queue, const TYPE* p_msg );
+    static bool          _try_push( _obj_queue_t* p_queue, TYPE&& msg );
+    static size_t        _try_push_n( _obj_queue_t* p_queue, const TYPE* msgs, size_t count );
+    static size_t        _try_move_n( _obj_queue_t* p_queue, TYPE* msgs, size_t count );
+    static bool          _try_pop( _obj_queue_t* p_queue, TYPE* p_msg );
+    static size_t        _try_pop_n( _obj_queue_t* p_queue, TYPE* p_msgs, size_t max_count );
+    static void          _wake_receivers( _obj_queue_t* p_queue, size_t count );
+    static void          _wake_senders( _obj_queue_t* p_queue, size_t count );
+    static bool          _wait_for_space( _obj_queue_t* p_queue, PerfTimer& timer, uint32_t timeout_ms );
 };
 
 
@@ -98,7 +150,7 @@ template<class TYPE>
 std::mutex Queue<TYPE>::s_queues_mutex;
 
 template<class TYPE>
-typename Queue<TYPE>::_obj_queue_t Queue<TYPE>::s_queues[ MAX_OBJECT_QUEUES ];
+typename Queue<TYPE>::_obj_queue_t** Queue<TYPE>::s_chunks[ MAX_QUEUE_CHUNKS ];
 
 
 template<class TYPE>
@@ -107,49 +159,38 @@ obj_queue_t Queue<TYPE>::create( uint32_t queue_length, TYPE* queue_mem )
     assert( queue_length );
     assert( queue_mem );
 
-    _obj_queue_t* p_queue = nullptr;
-    obj_queue_t   handle  = INVALID_QUEUE;
-
     std::lock_guard<std::mutex> lock( s_queues_mutex );
 
-    for ( int i = 0; i < ARRAY_SIZE( s_queues ); i++ ) {
-        SpinLockGuard lock( s_queues[ i ].spinLock );
-
-        if ( s_queues[ i ].msg_size == 0 ) {
-            handle = (obj_queue_t)i;
+    for ( uint32_t chunk = 0; chunk < MAX_QUEUE_CHUNKS; chunk++ ) {
+        if ( !s_chunks[ chunk ] ) {
+            s_chunks[ chunk ] = new _obj_queue_t*[ QUEUE_CHUNK_SIZE ]();
+        }
 
-            p_queue           = &s_queues[ i ];
-            p_queue->msg_size = sizeof( TYPE );
-            p_queue->length   = queue_length;
-            p_queue->used     = 0;
-            p_queue->msgs     = (TYPE*)queue_mem;
-            p_queue->handle   = handle;
-            p_queue->head = p_queue->tail = p_queue->msgs;
+        for ( uint32_t i = 0; i < QUEUE_CHUNK_SIZE; i++ ) {
+            if ( !s_chunks[ chunk ][ i ] ) {
+                obj_queue_t handle     = chunk * QUEUE_CHUNK_SIZE + i;
+                s_chunks[ chunk ][ i ] = new _obj_queue_t( queue_length, queue_mem, handle );
 
-            break;
+                return handle;
+            }
         }
     }
 
-    return handle;
+    return INVALID_QUEUE;
 }
 
 
 template<class TYPE>
 result Queue<TYPE>::destroy( obj_queue_t queue )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
-    SpinLockGuard lock( p_queue->spinLock );
+    std::lock_guard<std::mutex> lock( s_queues_mutex );
 
-    p_queue->head     = nullptr;
-    p_queue->tail     = nullptr;
-    p_queue->msg_size = 0;
-    p_queue->length   = 0;
-    p_queue->used     = 0;
-    p_queue->msgs     = nullptr;
-    p_queue->handle   = INVALID_QUEUE;
+    s_chunks[ queue / QUEUE_CHUNK_SIZE ][ queue % QUEUE_CHUNK_SIZE ] = nullptr;
+    delete p_queue;
 
     return R_OK;
 }
@@ -158,56 +199,148 @@ result Queue<TYPE>::destroy( obj_queue_t queue )
 template<class TYPE>
 result Queue<TYPE>::send( obj_queue_t queue, const TYPE* msg )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
-    SpinLockGuard lock( p_queue->spinLock );
+    if ( !_try_push( p_queue, msg ) )
+        return R_FAIL;
 
-    if ( _queue_is_full( queue ) )
+    _wake_receivers( p_queue, 1 );
+
+    return R_OK;
+}
+
+
+// msg is only moved from if it was queued
+template<class TYPE>
+result Queue<TYPE>::send( obj_queue_t queue, TYPE&& msg )
+{
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    bool rval = _queue_push_back( p_queue, msg );
+    if ( !_try_push( p_queue, std::move( msg ) ) )
+        return R_FAIL;
 
-    p_queue->notified = true;
-    p_queue->notification.notify_one();
+    _wake_receivers( p_queue, 1 );
 
-    return rval ? R_OK : R_FAIL;
+    return R_OK;
+}
+
+
+// Move as many of count messages as fit into the queue without blocking; R_FAIL unless all of them did.
+// *p_sent says how many were queued: msgs[ 0 .. *p_sent ) are moved from, the rest are untouched.
+template<class TYPE>
+result Queue<TYPE>::sendN( obj_queue_t queue, TYPE* msgs, size_t count, size_t* p_sent )
+{
+    if ( p_sent )
+        *p_sent = 0;
+
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
+        return R_FAIL;
+
+    size_t sent = 0;
+    while ( sent < count ) {
+        size_t batch = _try_move_n( p_queue, &msgs[ sent ], count - sent );
+        if ( batch == 0 )
+            break;
+
+        sent += batch;
+    }
+
+    _wake_receivers( p_queue, sent );
+
+    if ( p_sent )
+        *p_sent = sent;
+
+    return sent == count ? R_OK : R_FAIL;
 }
 
 
 template<class TYPE>
 result Queue<TYPE>::sendBlocking( obj_queue_t queue, const TYPE* msg, uint32_t timeout_ms )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
+        return R_FAIL;
+
+    PerfTimer timer;
+
+    while ( !_try_push( p_queue, msg ) ) {
+        // Block calling thread while queue is full
+        if ( !_wait_for_space( p_queue, timer, timeout_ms ) )
+            return R_TIMEOUT;
+    }
+
+    _wake_receivers( p_queue, 1 );
+
+    return R_OK;
+}
+
+
+template<class TYPE>
+result Queue<TYPE>::sendBlocking( obj_queue_t queue, TYPE&& msg, uint32_t timeout_ms )
+{
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
+    PerfTimer timer;
+
+    while ( !_try_push( p_queue, std::move( msg ) ) ) {
+        if ( !_wait_for_space( p_queue, timer, timeout_ms ) )
+            return R_TIMEOUT;
+    }
+
+    _wake_receivers( p_queue, 1 );
+
+    return R_OK;
+}
+
+
+// Send count messages, waking the receivers once for as many as fit rather than once per message.
+// On timeout, *p_sent says how many were queued.
+template<class TYPE>
+result Queue<TYPE>::sendBlockingN( obj_queue_t queue, const TYPE* msgs, size_t count, size_t* p_sent, uint32_t timeout_ms )
+{
+    if ( p_sent )
+        *p_sent = 0;
+
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
+        return R_FAIL;
 
     PerfTimer timer;
     result    rval = R_OK;
+    size_t    sent = 0;
 
-    p_queue->spinLock.lock();
-    while ( !_queue_push_back( p_queue, msg ) ) {
-        // Block calling thread while queue is full; release lock so receiver can receive
-        p_queue->spinLock.release();
-        delay( 1 ); // Gross hack
+    while ( true ) {
+        size_t batch = sent;
 
-        if ( timer.ElapsedMilliseconds() >= timeout_ms ) {
-            rval = R_TIMEOUT;
-            break;
+        while ( sent < count ) {
+            size_t claimed = _try_push_n( p_queue, &msgs[ sent ], count - sent );
+            if ( claimed == 0 )
+                break;
+
+            sent += claimed;
         }
 
-        static unsigned int timeout_warning_ms = 1000;
-        if ( (unsigned int)timer.ElapsedMilliseconds() >= timeout_warning_ms ) {
-            printf( "queue_sendBlocking(%d) hung for %d seconds\n", queue, (unsigned)timer.ElapsedSeconds() );
-            timeout_warning_ms *= 2;
+        _wake_receivers( p_queue, sent - batch );
+
+        if ( sent == count )
+            break;
+
+        // Queue is full; sleep until the receivers drain it
+        if ( !_wait_for_space( p_queue, timer, timeout_ms ) ) {
+            rval = R_TIMEOUT;
+            break;
         }
+    }
 
-        p_queue->spinLock.lock();
-    };
-    p_queue->notification.notify_one();
-    p_queue->spinLock.release();
+    if ( p_sent )
+        *p_sent = sent;
 
     return rval;
 }
@@ -217,22 +350,14 @@ result Queue<TYPE>::sendBlocking( obj_queue_t queue, const TYPE* msg, uint32_t t
 template<class TYPE>
 result Queue<TYPE>::sendAndWaitForResponse( obj_queue_t queue, const TYPE* msg )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
-
-    p_queue->spinLock.lock();
-
-    if ( _queue_is_full( queue ) ) {
-        p_queue->spinLock.release();
+    if ( !_try_push( p_queue, msg ) )
         return R_FAIL;
-    }
 
-    _queue_push_back( p_queue, msg );
-    p_queue->notified = true;
-    p_queue->notification.notify_one();
-    p_queue->spinLock.release();
+    _wake_receivers( p_queue, 1 );
 
     // Block on response
     std::unique_lock<std::mutex> response_lock( p_queue->response_mutex );
@@ -254,57 +379,103 @@ result Queue<TYPE>::receive( obj_queue_t queue, TYPE* p_msg, size_t msg_size, un
     assert( p_msg );
     assert( msg_size && msg_size == sizeof( TYPE ) );
 
-    if ( !_valid( queue ) ) {
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue ) {
         return R_FAIL;
     }
 
-    result                    rval    = R_FAIL;
-    _obj_queue_t*             p_queue = &s_queues[ queue ];
-    std::chrono::milliseconds ms( timeout_ms );
+    // Nearly always something's there; don't start the clock for it
+    if ( _try_pop( p_queue, p_msg ) ) {
+        _wake_senders( p_queue, 1 );
+        return R_OK;
+    }
+
+    PerfTimer timer;
+    uint32_t  wakeAll = p_queue->wakeAllCount.load( std::memory_order_acquire );
+
+    while ( true ) {
+        // Messages already queued come first, even after close()
+        for ( int i = 0; i < QUEUE_SPIN_COUNT; i++ ) {
+            if ( _try_pop( p_queue, p_msg ) ) {
+                _wake_senders( p_queue, 1 );
+                return R_OK;
+            }
+        }
 
-    p_queue->spinLock.lock();
+        // Woken without a message, e.g. to terminate
+        if ( p_queue->closed || p_queue->wakeAllCount.load( std::memory_order_acquire ) != wakeAll || p_queue->notified.exchange( false ) ) {
+            return R_FAIL;
+        }
 
-    while ( _queue_is_empty( queue ) && !p_queue->notified ) {
-        p_queue->spinLock.release();
-        std::unique_lock<std::mutex> queue_lock( p_queue->mutex );
-        std::cv_status               status = p_queue->notification.wait_for( queue_lock, ms );
-        p_queue->spinLock.lock();
+        double elapsed = timer.ElapsedMilliseconds();
+        if ( elapsed >= timeout_ms ) {
+            return R_TIMEOUT;
+        }
 
-        if ( status == std::cv_status::timeout ) {
-            rval = R_TIMEOUT;
-            goto Exit;
+        // Senders check waitingReceivers after pushing, and we check the queue after registering, so either they
+        // see us and bump receiveEvents, or we see their message; either way the futex won't sleep through it
+        uint32_t events = p_queue->receiveEvents.load( std::memory_order_acquire );
+        p_queue->waitingReceivers.fetch_add( 1, std::memory_order_seq_cst );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        bool received = _try_pop( p_queue, p_msg );
+        if ( !received ) {
+            uint32_t remaining = timeout_ms == ( std::numeric_limits<unsigned int>::max )() ? FUTEX_INFINITE : uint32_t( timeout_ms - elapsed );
+            futexWait( &p_queue->receiveEvents, events, remaining );
         }
 
-        break;
+        p_queue->waitingReceivers.fetch_sub( 1, std::memory_order_relaxed );
+
+        if ( received ) {
+            _wake_senders( p_queue, 1 );
+            return R_OK;
+        }
     }
+}
+
 
-    if ( _queue_is_empty( queue ) ) {
-        // Can happen if thread was notified (e.g. to terminate),
-        // but no message was pushed to queue
-        rval = R_FAIL;
-        goto Exit;
+// Like receive(), waiting as long for the first message, but then also takes up to max_count - 1 more that are
+// already queued, with one claim and one wake of the senders. *p_received says how many were moved into p_msgs.
+template<class TYPE>
+result Queue<TYPE>::receiveN( obj_queue_t queue, TYPE* p_msgs, size_t max_count, size_t* p_received, unsigned int timeout_ms )
+{
+    assert( p_msgs );
+    assert( p_received );
+    assert( max_count );
+
+    *p_received = 0;
+
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue ) {
+        return R_FAIL;
     }
 
-    if ( _queue_pop_front( p_queue, p_msg ) )
-        rval = R_OK;
+    size_t received = _try_pop_n( p_queue, p_msgs, max_count );
+    if ( received == 0 ) {
+        result rval = receive( queue, p_msgs, sizeof( TYPE ), timeout_ms );
+        if ( rval != R_OK )
+            return rval;
+
+        received = 1 + _try_pop_n( p_queue, &p_msgs[ 1 ], max_count - 1 );
+        _wake_senders( p_queue, received - 1 );
+    } else {
+        _wake_senders( p_queue, received );
+    }
 
-Exit:
-    p_queue->notified = false;
-    p_queue->spinLock.release();
+    *p_received = received;
 
-    return rval;
+    return R_OK;
 }
 
 
 template<class TYPE>
 result Queue<TYPE>::notifySender( obj_queue_t queue, result rval )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
-
-    SpinLockGuard lock( p_queue->spinLock );
+    std::lock_guard<std::mutex> lock( p_queue->response_mutex );
     p_queue->response_rval = rval;
     p_queue->response.notify_one();
 
@@ -315,14 +486,13 @@ result Queue<TYPE>::notifySender( obj_queue_t queue, result rval )
 template<class TYPE>
 result Queue<TYPE>::notify( obj_queue_t queue )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
-
-    SpinLockGuard lock( p_queue->spinLock );
     p_queue->notified = true;
-    p_queue->notification.notify_one();
+    p_queue->receiveEvents.fetch_add( 1, std::memory_order_seq_cst );
+    futexWakeOne( &p_queue->receiveEvents );
 
     return R_OK;
 }
@@ -331,96 +501,291 @@ result Queue<TYPE>::notify( obj_queue_t queue )
 template<class TYPE>
 result Queue<TYPE>::notifyAll( obj_queue_t queue )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
+    p_queue->wakeAllCount++;
+    p_queue->receiveEvents.fetch_add( 1, std::memory_order_seq_cst );
+    futexWakeAll( &p_queue->receiveEvents );
 
-    SpinLockGuard lock( p_queue->spinLock );
-    p_queue->notification.notify_all();
+    return R_OK;
+}
+
+
+// Unlike notifyAll(), a receiver that arrives after close() doesn't sleep either,
+// so a pool can shut down without racing its workers into the wait
+template<class TYPE>
+result Queue<TYPE>::close( obj_queue_t queue )
+{
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
+        return R_FAIL;
+
+    p_queue->closed = true;
+    p_queue->receiveEvents.fetch_add( 1, std::memory_order_seq_cst );
+    futexWakeAll( &p_queue->receiveEvents );
 
     return R_OK;
 }
 
 
+// Approximate while other threads are sending or receiving
 template<class TYPE>
 size_t Queue<TYPE>::size( obj_queue_t queue )
 {
-    if ( !_valid( queue ) )
+    _obj_queue_t* p_queue = _get( queue );
+    if ( !p_queue )
         return R_FAIL;
 
-    _obj_queue_t* p_queue = &s_queues[ queue ];
+    uint64_t received = p_queue->receivePos.load( std::memory_order_acquire );
+    uint64_t sent     = p_queue->sendPos.load( std::memory_order_acquire );
 
-    SpinLockGuard lock( p_queue->spinLock );
-    return p_queue->used;
+    return sent > received ? (size_t)std::min<uint64_t>( sent - received, p_queue->length ) : 0;
 }
 
 
 //
-// Private methods; these assume the queue lock is already held
+// Private methods
 //
 
 template<class TYPE>
-bool Queue<TYPE>::_queue_push_back( _obj_queue_t* p_queue, const TYPE* p_msg )
+typename Queue<TYPE>::_obj_queue_t* Queue<TYPE>::_get( obj_queue_t queue )
 {
-    if ( p_queue->used >= p_queue->length )
-        return false;
+    if ( queue == INVALID_QUEUE || queue >= MAX_QUEUE_CHUNKS * QUEUE_CHUNK_SIZE )
+        return nullptr;
+
+    _obj_queue_t** chunk = s_chunks[ queue / QUEUE_CHUNK_SIZE ];
+
+    return chunk ? chunk[ queue % QUEUE_CHUNK_SIZE ] : nullptr;
+}
 
-    *p_queue->tail = *p_msg;
-    p_queue->tail++;
-    p_queue->used++;
 
-    if ( p_queue->tail >= &p_queue->msgs[ p_queue->length - 1 ] ) {
-        p_queue->tail = p_queue->msgs;
+template<class TYPE>
+uint32_t Queue<TYPE>::_slot( const _obj_queue_t* p_queue, uint64_t pos )
+{
+    return p_queue->mask ? uint32_t( pos & p_queue->mask ) : uint32_t( pos % p_queue->length );
+}
+
+
+// Claim up to max_count consecutive positions from *position (sendPos or receivePos) whose slots are ready for us:
+// the slot for position p is ready when its sequence is p + ready (0 to send into, 1 to receive from). Only the
+// first slot decides whether to give up; the run stops at the first slot that isn't ready. One CAS claims the run.
+// Returns how many were claimed, starting at *p_pos.
+template<class TYPE>
+size_t Queue<TYPE>::_claim( _obj_queue_t* p_queue, std::atomic<uint64_t>* position, uint64_t ready, size_t max_count, uint64_t* p_pos )
+{
+    uint64_t pos = position->load( std::memory_order_relaxed );
+
+    while ( true ) {
+        int64_t diff = (int64_t)( p_queue->sequences[ _slot( p_queue, pos ) ].load( std::memory_order_acquire ) - ( pos + ready ) );
+
+        if ( diff == 0 ) {
+            size_t count = 1;
+            while ( count < max_count && p_queue->sequences[ _slot( p_queue, pos + count ) ].load( std::memory_order_acquire ) == pos + count + ready ) {
+                count++;
+            }
+
+            if ( position->compare_exchange_weak( pos, pos + count, std::memory_order_relaxed ) ) {
+                *p_pos = pos;
+                return count;
+            }
+        } else if ( diff < 0 ) {
+            // Sending: the receiver a lap behind hasn't freed this slot yet.
+            // Receiving: nothing sent here yet, or the sender that claimed it is still copying in.
+            return 0;
+        } else {
+            pos = position->load( std::memory_order_relaxed );
+        }
     }
+}
+
+
+// Claim the send position whose slot is free, copy in, then publish the slot to receivers; false if full
+template<class TYPE>
+bool Queue<TYPE>::_try_push( _obj_queue_t* p_queue, const TYPE* p_msg )
+{
+    uint64_t pos;
+    if ( !_claim( p_queue, &p_queue->sendPos, 0, 1, &pos ) )
+        return false;
+
+    uint32_t slot         = _slot( p_queue, pos );
+    p_queue->msgs[ slot ] = *p_msg;
+    p_queue->sequences[ slot ].store( pos + 1, std::memory_order_release );
 
     return true;
 }
 
 
 template<class TYPE>
-bool Queue<TYPE>::_queue_pop_front( _obj_queue_t* p_queue, TYPE* p_msg )
+bool Queue<TYPE>::_try_push( _obj_queue_t* p_queue, TYPE&& msg )
 {
-    if ( p_queue->used == 0 )
-        false;
+    uint64_t pos;
+    if ( !_claim( p_queue, &p_queue->sendPos, 0, 1, &pos ) )
+        return false;
 
-    *p_msg = *p_queue->head;
-    p_queue->head++;
-    p_queue->used--;
+    uint32_t slot         = _slot( p_queue, pos );
+    p_queue->msgs[ slot ] = std::move( msg );
+    p_queue->sequences[ slot ].store( pos + 1, std::memory_order_release );
 
-    if ( p_queue->head >= &p_queue->msgs[ p_queue->length - 1 ] ) {
-        p_queue->head = p_queue->msgs;
+    return true;
+}
+
+
+// Claim a run of free slots, copy a message into each and publish it; returns how many, 0 if full
+template<class TYPE>
+size_t Queue<TYPE>::_try_push_n( _obj_queue_t* p_queue, const TYPE* msgs, size_t count )
+{
+    uint64_t pos;
+    size_t   claimed = _claim( p_queue, &p_queue->sendPos, 0, count, &pos );
+
+    for ( size_t i = 0; i < claimed; i++ ) {
+        uint32_t slot         = _slot( p_queue, pos + i );
+        p_queue->msgs[ slot ] = msgs[ i ];
+        p_queue->sequences[ slot ].store( pos + i + 1, std::memory_order_release );
     }
 
-    return true;
+    return claimed;
 }
 
 
 template<class TYPE>
-bool Queue<TYPE>::_valid( obj_queue_t queue )
+size_t Queue<TYPE>::_try_move_n( _obj_queue_t* p_queue, TYPE* msgs, size_t count )
 {
-    if ( queue == INVALID_QUEUE || queue >= ARRAY_SIZE( s_queues ) ) {
-        return false;
+    uint64_t pos;
+    size_t   claimed = _claim( p_queue, &p_queue->sendPos, 0, count, &pos );
+
+    for ( size_t i = 0; i < claimed; i++ ) {
+        uint32_t slot         = _slot( p_queue, pos + i );
+        p_queue->msgs[ slot ] = std::move( msgs[ i ] );
+        p_queue->sequences[ slot ].store( pos + i + 1, std::memory_order_release );
     }
 
+    return claimed;
+}
+
+
+// Claim the receive position whose slot is full, move out, then free the slot for the sender a lap ahead; false if empty
+template<class TYPE>
+bool Queue<TYPE>::_try_pop( _obj_queue_t* p_queue, TYPE* p_msg )
+{
+    uint64_t pos;
+    if ( !_claim( p_queue, &p_queue->receivePos, 1, 1, &pos ) )
+        return false;
+
+    uint32_t slot = _slot( p_queue, pos );
+    *p_msg        = std::move( p_queue->msgs[ slot ] );
+    p_queue->sequences[ slot ].store( pos + p_queue->length, std::memory_order_release );
+
     return true;
 }
 
 
 template<class TYPE>
-bool Queue<TYPE>::_queue_is_full( obj_queue_t queue )
+size_t Queue<TYPE>::_try_pop_n( _obj_queue_t* p_queue, TYPE* p_msgs, size_t max_count )
+{
+    if ( max_count == 0 )
+        return 0;
+
+    uint64_t pos;
+    size_t   claimed = _claim( p_queue, &p_queue->receivePos, 1, max_count, &pos );
+
+    for ( size_t i = 0; i < claimed; i++ ) {
+        uint32_t slot = _slot( p_queue, pos + i );
+        p_msgs[ i ]   = std::move( p_queue->msgs[ slot ] );
+        p_queue->sequences[ slot ].store( pos + i + p_queue->length, std::memory_order_release );
+    }
+
+    return claimed;
+}
+
+
+// Only touch the futex when someone is actually asleep on it
+template<class TYPE>
+void Queue<TYPE>::_wake_receivers( _obj_queue_t* p_queue, size_t count )
+{
+    if ( count == 0 )
+        return;
+
+    // Pairs with the fence in receive(): either we see the waiter, or it sees our message
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if ( p_queue->waitingReceivers.load( std::memory_order_relaxed ) == 0 )
+        return;
+
+    p_queue->receiveEvents.fetch_add( 1, std::memory_order_release );
+    if ( count == 1 ) {
+        futexWakeOne( &p_queue->receiveEvents );
+    } else {
+        futexWakeAll( &p_queue->receiveEvents );
+    }
+}
+
+
+template<class TYPE>
+void Queue<TYPE>::_wake_senders( _obj_queue_t* p_queue, size_t count )
 {
-    return s_queues[ queue ].used >= s_queues[ queue ].length;
+    if ( count == 0 )
+        return;
+
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if ( p_queue->waitingSenders.load( std::memory_order_relaxed ) == 0 )
+        return;
+
+    p_queue->spaceEvents.fetch_add( 1, std::memory_order_release );
+    if ( count == 1 ) {
+        futexWakeOne( &p_queue->spaceEvents );
+    } else {
+        futexWakeAll( &p_queue->spaceEvents );
+    }
 }
 
 
+// Sleep until a receive frees a slot; false if timeout_ms (measured from timer) runs out first
 template<class TYPE>
-bool Queue<TYPE>::_queue_is_empty( obj_queue_t queue )
+bool Queue<TYPE>::_wait_for_space( _obj_queue_t* p_queue, PerfTimer& timer, uint32_t timeout_ms )
 {
-    return s_queues[ queue ].used == 0;
+    // A receiver is usually about to free a slot
+    for ( int i = 0; i < QUEUE_SPIN_COUNT; i++ ) {
+        uint64_t pos = p_queue->sendPos.load( std::memory_order_relaxed );
+        if ( (int64_t)( p_queue->sequences[ _slot( p_queue, pos ) ].load( std::memory_order_acquire ) - pos ) >= 0 )
+            return true;
+    }
+
+    double elapsed = timer.ElapsedMilliseconds();
+
+    if ( elapsed >= timeout_ms )
+        return false;
+
+    // Same handshake as receive(), mirrored: register, then re-check for space before sleeping
+    uint32_t events = p_queue->spaceEvents.load( std::memory_order_acquire );
+    p_queue->waitingSenders.fetch_add( 1, std::memory_order_seq_cst );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    uint64_t pos   = p_queue->sendPos.load( std::memory_order_relaxed );
+    bool     ready = (int64_t)( p_queue->sequences[ _slot( p_queue, pos ) ].load( std::memory_order_acquire ) - pos ) >= 0;
+
+    // Wake at least once a second to report a hang
+    if ( !ready ) {
+        uint32_t slice_ms = (uint32_t)std::min<double>( timeout_ms - elapsed, 1000.0 );
+        ready             = futexWait( &p_queue->spaceEvents, events, slice_ms );
+    }
+
+    p_queue->waitingSenders.fetch_sub( 1, std::memory_order_relaxed );
+
+    if ( !ready ) {
+        static unsigned int timeout_warning_ms = 1000;
+        if ( (unsigned int)timer.ElapsedMilliseconds() >= timeout_warning_ms ) {
+            printf( "queue_sendBlocking(%d) hung for %d seconds\n", p_queue->handle, (unsigned)timer.ElapsedSeconds() );
+            timeout_warning_ms *= 2;
+        }
+    }
+
+    return ready || timer.ElapsedMilliseconds() < timeout_ms;
 }
 
 
 void testObjectQueues();
+void testObjectQueuesMPMC();
+void testObjectQueuesBatch();
 
 } // namespace pk
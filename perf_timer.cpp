@@ -47,10 +47,7 @@ double PerfTimer::ElapsedSeconds()
         elapsedTicks = std::chrono::high_resolution_clock::now() - m_startTick;
     }
 
-    auto   duration = std::chrono::duration_cast<std::chrono::seconds>( elapsedTicks ).count();
-    double seconds  = std::chrono::duration<double>( duration ).count();
-
-    return seconds;
+    return std::chrono::duration<double>( elapsedTicks ).count();
 }
 
 
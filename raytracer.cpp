@@ -1,5 +1,8 @@
 #include "raytracer.h"
 
+#include "accumulation_buffer.h"
+#include "bvh.h"
+#include "bvh_simd.h"
 #include "material.h"
 #include "perf_timer.h"
 #include "ray.h"
@@ -10,132 +13,250 @@
 #include <assert.h>
 #include <atomic>
 #include <limits>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace pk
 {
 
 typedef struct _RenderThreadContext {
     const Camera*          camera;
-    const sphere_t*        scene;
-    uint32_t               sceneSize;
+    const bvh_t*           bvh;
+    const bvh_simd_t*      simd; // intrinsics traversal of bvh, or nullptr for scalar bvhHit()
+    const material_t*      materials;
     uint32_t*              framebuffer;
+    accumulation_buffer_t* accumulation;
     uint32_t               rows;
     uint32_t               cols;
-    uint32_t               num_aa_samples;
+    uint32_t               num_aa_samples; // samples per pixel this pass
+    uint32_t               target_samples; // no pixel goes past this many
+    float                  adaptive_threshold;
     uint32_t               max_ray_depth;
+    uint32_t               roulette_depth; // bounces before Russian roulette starts; 0 is off
+    uint32_t               seed;
     uint32_t               blockID;
     uint32_t               blockSize;
     uint32_t               xOffset;
     uint32_t               yOffset;
-    std::atomic<uint32_t>* blockCount;
     uint32_t               totalBlocks;
+    tile_writer_t*         tileWriter;
+    tone_map_t             toneMap;
+    std::atomic<uint64_t>* raysCast;
+    std::atomic<uint64_t>* samplesCast;
     bool                   debug;
     bool                   recursive;
+    bool                   active; // some pixel in the block still needs samples; written by the block's job
 
     _RenderThreadContext() :
-        scene( nullptr ),
         camera( nullptr ),
+        bvh( nullptr ),
+        simd( nullptr ),
+        materials( nullptr ),
         framebuffer( nullptr ),
+        accumulation( nullptr ),
+        target_samples( 0 ),
+        adaptive_threshold( 0.0f ),
+        roulette_depth( 0 ),
         blockSize( 0 ),
         xOffset( 0 ),
         yOffset( 0 ),
+        tileWriter( nullptr ),
+        toneMap( TONE_MAP_GAMMA ),
+        raysCast( nullptr ),
+        samplesCast( nullptr ),
         debug( false ),
-        recursive( false )
+        recursive( false ),
+        active( true )
     {
     }
 } RenderThreadContext;
 
 
-static bool    _sceneHit( const sphere_t* scene, uint32_t sceneSize, const ray& r, float min, float max, hit_info* p_hit );
-static vector3 _color_recursive( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned depth, unsigned max_depth );
-static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned depth, unsigned max_depth );
-static vector3 _background( const ray& r );
+static bool    _sceneHit( const bvh_t* bvh, const bvh_simd_t* simd, const ray& r, float min, float max, hit_info* p_hit );
+static vector3 _color_recursive( const ray& r, const bvh_t* bvh, const bvh_simd_t* simd, const material_t* materials, unsigned depth, unsigned max_depth, unsigned roulette_depth );
+static vector3 _color( const ray& r, const bvh_t* bvh, const bvh_simd_t* simd, const material_t* materials, unsigned depth, unsigned max_depth, unsigned roulette_depth );
 static bool    _renderJob( void* context, uint32_t tid );
+static bool    _pixelNoisy( const RenderThreadContext* ctx, uint32_t x, uint32_t y );
+static bool    _neighbourhoodNoisy( const std::vector<uint8_t>& noisy, uint32_t width, uint32_t height, uint32_t x, uint32_t y );
 
+// Adaptive sampling needs a few samples everywhere before the variance means anything
+static const uint32_t ADAPTIVE_MIN_SAMPLES = 8;
 
-int renderScene( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, unsigned num_aa_samples, unsigned max_ray_depth, unsigned numThreads, unsigned blockSize, bool debug, bool recursive )
+// Scene intersection queries made by the calling thread, for rays/s
+static thread_local uint64_t s_raysCast = 0;
+
+
+int renderScene( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, const render_options_t& options )
 {
+    if ( options.accumulation && ( options.accumulation->cols != cols || options.accumulation->rows != rows ||
+                                   ( options.adaptiveThreshold > 0.0f && !options.accumulation->luminanceSquares ) ) ) {
+        printf( "Error: the accumulation buffer must be %u x %u, with ACCUMULATION_VARIANCE for adaptive sampling\n", cols, rows );
+        return -1;
+    }
+
     PerfTimer t;
 
     // Spin up a pool of render threads
     // Allocate width+1 and height+1 blocks to handle case where image is not an even multiple of block size
-    uint32_t      widthBlocks  = uint32_t( float( cols / blockSize ) ) + 1;
-    uint32_t      heightBlocks = uint32_t( float( rows / blockSize ) ) + 1;
+    uint32_t      widthBlocks  = uint32_t( float( cols / options.blockSize ) ) + 1;
+    uint32_t      heightBlocks = uint32_t( float( rows / options.blockSize ) ) + 1;
     uint32_t      numBlocks    = heightBlocks * widthBlocks;
-    thread_pool_t tp           = threadPoolCreate( numThreads );
+    thread_pool_t tp           = threadPoolCreate( options.numThreads, options.poolMode );
 
-    printf( "Render %d x %d: blockSize %d x %d, %d blocks, [%d:%d] threads \n",
-        cols, rows, blockSize, blockSize, numBlocks, tp, numThreads );
+    printf( "Render %d x %d: blockSize %d x %d, %d blocks, [%d:%d] threads (%s)\n",
+        cols, rows, options.blockSize, options.blockSize, numBlocks, tp, options.numThreads, threadPoolModeName( options.poolMode ) );
 
 
     // Flatten the Scene object to an array of sphere_t, which is what Scene should've been in the first place
-    size_t    sceneSize = sizeof( sphere_t ) * scene.objects.size();
-    sphere_t* pScene    = (sphere_t*)new uint8_t[ sceneSize ];
-    //printf( "Allocated %zd bytes for %zd objects\n", sceneSize, scene.objects.size() );
-
-    sphere_t* p = pScene;
-    for ( IVisible* obj : scene.objects ) {
-        Sphere*   s1 = dynamic_cast<Sphere*>( obj );
-        sphere_t* s2 = (sphere_t*)p;
-        s2->center   = s1->center;
-        s2->radius   = s1->radius;
-        s2->material = *( s1->material );
-
-        p++;
+    sphere_t*   pScene       = new sphere_t[ scene.objects.size() ];
+    material_t* pMaterials   = new material_t[ scene.objects.size() ];
+    uint32_t    numMaterials = sceneFlatten( scene, pScene, pMaterials );
+    printf( "Flattened %zd scene objects (%zd bytes each, %zd byte hits) and %d unique materials to array\n",
+        scene.objects.size(), sizeof( sphere_t ), sizeof( hit_info ), numMaterials );
+
+    // Build the acceleration structure once; every ray traverses it instead of testing every sphere
+    PerfTimer bvhTimer;
+    bvh_t*    bvh = bvhCreate( pScene, (uint32_t)scene.objects.size(), options.builder, tp );
+    printf( "Built %s BVH: %d nodes, depth %d in %f ms\n", bvhBuilderName( options.builder ), bvh->numNodes, bvh->depth, bvhTimer.ElapsedNanoseconds() / 1000000.0 );
+
+    // Optionally trace the same tree with hand-written SSE4.2/AVX2/AVX-512 kernels instead of bvhHit()
+    bvh_simd_t* simd = nullptr;
+    if ( options.simdIsa != SIMD_ISA_NONE ) {
+        bvhTimer.Reset();
+        simd = bvhSimdCreate( bvh, options.simdIsa );
+        if ( simd ) {
+            printf( "SIMD traversal: %s, %u nodes, up to %u spheres per leaf in %f ms\n", simdIsaName( simd->isa ), simd->numNodes, simd->leafSize, bvhTimer.ElapsedNanoseconds() / 1000000.0 );
+        } else {
+            printf( "WARN: %s isn't supported on this host; using scalar traversal\n", simdIsaName( options.simdIsa ) );
+        }
     }
-    printf( "Flattened %zd scene objects to array\n", scene.objects.size() );
 
 
+    // Samples accumulate in float; each block resolves its own pixels into the 8-bit framebuffer when it's done
+    accumulation_buffer_t* accumulation = options.accumulation;
+    if ( !accumulation ) {
+        accumulation = accumulationBufferCreate( cols, rows, options.adaptiveThreshold > 0.0f ? ACCUMULATION_VARIANCE : 0 );
+    }
+    printf( "Tone map: %s\n", toneMapName( options.toneMap ) );
+
+    // num_aa_samples is the target; with a pass size the image is refined a pass at a time until it or the time budget is reached
+    uint32_t passSamples = options.passSamples;
+    if ( passSamples == 0 || passSamples > options.num_aa_samples ) {
+        passSamples = options.num_aa_samples;
+    }
+    if ( passSamples < options.num_aa_samples || options.timeBudgetMs ) {
+        printf( "Progressive: %u samples per pass, target %u spp, budget %u ms\n", passSamples, options.num_aa_samples, options.timeBudgetMs );
+    }
+
+    // Adaptive: after a first pass of at least ADAPTIVE_MIN_SAMPLES, later passes only sample pixels whose
+    // confidence interval is still wider than the threshold, and only blocks with such pixels are submitted
+    uint32_t firstPassSamples = passSamples;
+    if ( options.adaptiveThreshold > 0.0f ) {
+        firstPassSamples = passSamples > ADAPTIVE_MIN_SAMPLES ? passSamples : ADAPTIVE_MIN_SAMPLES;
+        firstPassSamples = firstPassSamples < options.num_aa_samples ? firstPassSamples : options.num_aa_samples;
+        printf( "Adaptive: relative error %.3f, %u samples first pass, then %u per pass up to %u spp\n", options.adaptiveThreshold, firstPassSamples, passSamples, options.num_aa_samples );
+    }
+
+    if ( options.rouletteDepth ) {
+        printf( "Russian roulette after %u bounces\n", options.rouletteDepth );
+    }
+
+    std::atomic<uint64_t> raysCast( 0 );
+    std::atomic<uint64_t> samplesCast( 0 );
+
     RenderThreadContext* contexts = new RenderThreadContext[ numBlocks ];
 
-    std::atomic<uint32_t> blockCount = 0;
-    uint32_t              blockID    = 0;
-    uint32_t              yOffset    = 0;
+    Invokable* jobs    = new Invokable[ numBlocks ];
+    uint32_t   blockID = 0;
+    uint32_t   yOffset = 0;
     for ( uint32_t y = 0; y < heightBlocks; y++ ) {
         uint32_t xOffset = 0;
         for ( uint32_t x = 0; x < widthBlocks; x++ ) {
             RenderThreadContext* ctx = &contexts[ blockID ];
-            ctx->scene               = pScene;
-            ctx->sceneSize           = (uint32_t)scene.objects.size();
+            ctx->bvh                 = bvh;
+            ctx->simd                = simd;
+            ctx->materials           = pMaterials;
             ctx->camera              = &camera;
             ctx->framebuffer         = framebuffer;
+            ctx->accumulation        = accumulation;
             ctx->blockID             = blockID;
-            ctx->blockSize           = blockSize;
+            ctx->blockSize           = options.blockSize;
             ctx->xOffset             = xOffset;
             ctx->yOffset             = yOffset;
             ctx->rows                = rows;
             ctx->cols                = cols;
-            ctx->num_aa_samples      = num_aa_samples;
-            ctx->max_ray_depth       = max_ray_depth;
-            ctx->blockCount          = &blockCount;
+            ctx->target_samples      = options.num_aa_samples;
+            ctx->adaptive_threshold  = options.adaptiveThreshold;
+            ctx->max_ray_depth       = options.max_ray_depth;
+            ctx->roulette_depth      = options.rouletteDepth;
+            ctx->seed                = options.seed;
             ctx->totalBlocks         = numBlocks;
-            ctx->debug               = debug;
-            ctx->recursive           = recursive;
-
-            threadPoolSubmitJob( Function(_renderJob, ctx) );
+            ctx->tileWriter          = options.tileWriter;
+            ctx->toneMap             = options.toneMap;
+            ctx->raysCast            = &raysCast;
+            ctx->samplesCast         = &samplesCast;
+            ctx->debug               = options.debug;
+            ctx->recursive           = options.recursive;
 
-            //printf( "Submit block %d of %d\n", blockID, numBlocks );
+            jobs[ blockID ] = Function( _renderJob, ctx );
 
             blockID++;
-            xOffset += blockSize;
+            xOffset += options.blockSize;
         }
-        yOffset += blockSize;
+        yOffset += options.blockSize;
     }
 
-    // Wait for threads to complete
-    while ( blockCount != numBlocks ) {
-        delay( 1000 );
-        printf( "." );
+    // Each pass submits every block that still needs samples as one group, and waits for the whole group rather than
+    // the last block. A pass isn't started unless, going by the last one, it will finish inside the budget; the first always runs.
+    Invokable* passJobs    = new Invokable[ numBlocks ];
+    uint32_t   numActive   = numBlocks;
+    uint32_t   passes      = 0;
+    double     passMs      = 0.0;
+    PerfTimer  renderTimer;
+    while ( numActive > 0 ) {
+        double elapsedMs = renderTimer.ElapsedNanoseconds() / 1000000.0;
+        if ( options.timeBudgetMs && passes > 0 && elapsedMs + passMs > options.timeBudgetMs )
+            break;
+
+        uint32_t numJobs = 0;
+        for ( uint32_t b = 0; b < numBlocks; b++ ) {
+            if ( contexts[ b ].active ) {
+                contexts[ b ].num_aa_samples = passes == 0 ? firstPassSamples : passSamples;
+                passJobs[ numJobs++ ]        = jobs[ b ];
+            }
+        }
+
+        job_group_t group = threadPoolSubmitJobs( passJobs, numJobs, tp );
+        threadPoolWaitForJobs( group, INFINITE_TIMEOUT, tp );
+
+        numActive = 0;
+        for ( uint32_t b = 0; b < numBlocks; b++ ) {
+            numActive += contexts[ b ].active ? 1 : 0;
+        }
+
+        passes++;
+        passMs = renderTimer.ElapsedNanoseconds() / 1000000.0 - elapsedMs;
     }
-    printf( "\n" );
 
+    double renderMs = renderTimer.ElapsedNanoseconds() / 1000000.0;
+    printf( "Rendered %.2f spp average (target %u) in %u passes, %f ms: %llu rays, %.2f Mrays/s\n",
+        (double)samplesCast.load() / ( (double)rows * cols ), options.num_aa_samples, passes, renderMs, (unsigned long long)raysCast.load(), raysCast.load() / renderMs / 1000.0 );
+
+    delete[] passJobs;
     threadPoolDestroy( tp );
+    delete[] jobs;
     delete[] contexts;
-    //delete[] pScene;
+    if ( accumulation != options.accumulation ) {
+        accumulationBufferDestroy( accumulation );
+    }
+    bvhSimdDestroy( simd );
+    bvhDestroy( bvh );
+    delete[] pScene;
+    delete[] pMaterials;
 
     printf( "renderScene: %f s\n", t.ElapsedSeconds() );
 
@@ -146,7 +267,10 @@ static bool _renderJob( void* context, uint32_t tid )
 {
     UNUSED( tid );
 
-    const RenderThreadContext* ctx = (const RenderThreadContext*)context;
+    RenderThreadContext* ctx     = (RenderThreadContext*)context;
+    uint64_t             rays    = s_raysCast;
+    uint64_t             samples = 0;
+    bool                 active  = false;
 
     //printf( "start %dx%d block %d of %d AA:%d MD:%d R:%d %d x %d x %d\n",
     //    ctx->cols, ctx->rows,
@@ -154,6 +278,21 @@ static bool _renderJob( void* context, uint32_t tid )
     //    ctx->xOffset, ctx->yOffset, ctx->blockSize
     //    );
 
+    // With adaptive sampling a pixel keeps sampling while it or a neighbour in the block is still noisy, so a pixel
+    // whose first few samples happened to agree isn't stopped by a lucky variance estimate. Decided up front from
+    // the previous passes, so the order pixels are sampled in doesn't matter.
+    uint32_t             width  = ctx->xOffset + ctx->blockSize < ctx->cols ? ctx->blockSize : ( ctx->xOffset < ctx->cols ? ctx->cols - ctx->xOffset : 0 );
+    uint32_t             height = ctx->yOffset + ctx->blockSize < ctx->rows ? ctx->blockSize : ( ctx->yOffset < ctx->rows ? ctx->rows - ctx->yOffset : 0 );
+    std::vector<uint8_t> noisy;
+    if ( ctx->adaptive_threshold > 0.0f ) {
+        noisy.resize( width * height );
+        for ( uint32_t y = 0; y < height; y++ ) {
+            for ( uint32_t x = 0; x < width; x++ ) {
+                noisy[ y * width + x ] = _pixelNoisy( ctx, ctx->xOffset + x, ctx->yOffset + y ) ? 1 : 0;
+            }
+        }
+    }
+
     for ( uint32_t y = ctx->yOffset; y < ctx->yOffset + ctx->blockSize; y++ ) {
         // Don't render out of bounds (in case where image is not an even multiple of block size)
         if ( y >= ctx->rows )
@@ -164,83 +303,133 @@ static bool _renderJob( void* context, uint32_t tid )
             if ( x >= ctx->cols )
                 break;
 
+            // Sample numbering continues from the pixel's previous passes, so every pass draws new random streams
+            uint32_t firstSample = accumulationBufferSampleCount( ctx->accumulation, x, y );
+            if ( firstSample >= ctx->target_samples || !_neighbourhoodNoisy( noisy, width, height, x - ctx->xOffset, y - ctx->yOffset ) )
+                continue;
+
+            uint32_t numSamples = ctx->target_samples - firstSample < ctx->num_aa_samples ? ctx->target_samples - firstSample : ctx->num_aa_samples;
+
             // TEST
             if ( ctx->debug && ( y == ctx->yOffset || y == ctx->yOffset + ctx->blockSize - 1 || x == ctx->xOffset || x == ctx->xOffset + ctx->blockSize - 1 ) ) {
-                ctx->framebuffer[ y * ctx->cols + x ] = 0xFF000000;
+                float red = luminance( 1.0f, 0.0f, 0.0f );
+                accumulationBufferAdd( ctx->accumulation, x, y, (float)numSamples, 0.0f, 0.0f, numSamples, numSamples * red * red );
                 continue;
             }
 
             // Sample each pixel in image space, with anti-aliasing
 
             vector3 color( 0, 0, 0 );
-            for ( uint32_t s = 0; s < ctx->num_aa_samples; s++ ) {
-                float u = float( x + random() ) / float( ctx->cols );
-                float v = float( y + random() ) / float( ctx->rows );
-                ray   r = ctx->camera->getRay( u, v );
+            float   luminanceSquares = 0.0f;
+            for ( uint32_t s = firstSample; s < firstSample + numSamples; s++ ) {
+                randomSeed( ctx->seed, y * ctx->cols + x, s );
+
+                float   u = float( x + random() ) / float( ctx->cols );
+                float   v = float( y + random() ) / float( ctx->rows );
+                ray     r = ctx->camera->getRay( u, v );
+                vector3 c;
 
                 if ( ctx->recursive ) {
-                    color += _color_recursive( r, ctx->scene, ctx->sceneSize, 0, ctx->max_ray_depth );
+                    c = _color_recursive( r, ctx->bvh, ctx->simd, ctx->materials, 0, ctx->max_ray_depth, ctx->roulette_depth );
                 } else {
-                    color += _color( r, ctx->scene, ctx->sceneSize, 0, ctx->max_ray_depth );
+                    c = _color( r, ctx->bvh, ctx->simd, ctx->materials, 0, ctx->max_ray_depth, ctx->roulette_depth );
                 }
-            }
-            color /= float( ctx->num_aa_samples );
 
-            // Apply 2.0 Gamma correction
-            color = vector3( sqrt( color.r() ), sqrt( color.g() ), sqrt( color.b() ) );
+                float l = luminance( c.x, c.y, c.z );
+                luminanceSquares += l * l;
+                color += c;
+            }
 
-            uint8_t  _r  = ( uint8_t )( 255.99 * color.x );
-            uint8_t  _g  = ( uint8_t )( 255.99 * color.y );
-            uint8_t  _b  = ( uint8_t )( 255.99 * color.z );
-            uint32_t rgb = ( (uint32_t)_r << 24 ) | ( (uint32_t)_g << 16 ) | ( (uint32_t)_b << 8 );
+            accumulationBufferAdd( ctx->accumulation, x, y, color.x, color.y, color.z, numSamples, luminanceSquares );
+            samples += numSamples;
 
-            ctx->framebuffer[ y * ctx->cols + x ] = rgb;
+            if ( firstSample + numSamples < ctx->target_samples && _pixelNoisy( ctx, x, y ) ) {
+                active = true;
+            }
         }
     }
 
-    // Notify main thread that we have completed the work
-    if ( ctx->blockID == ctx->totalBlocks - 1 ) {
-        std::atomic<uint32_t>* blockCount = ctx->blockCount;
-        blockCount->exchange( ctx->totalBlocks );
-    }
+    ctx->active = active;
+    ctx->raysCast->fetch_add( s_raysCast - rays, std::memory_order_relaxed );
+    ctx->samplesCast->fetch_add( samples, std::memory_order_relaxed );
+
+    //printf( "block %d of %d DONE\n", ctx->blockID, ctx->totalBlocks );
 
-    //printf( "block %d of %d (%d) DONE\n", ctx->blockID, ctx->totalBlocks, ctx->blockCount->load() );
+    if ( samples ) {
+        // Average, tone map and quantize the whole block at once
+        accumulationBufferResolve( ctx->accumulation, ctx->framebuffer, ctx->toneMap, ctx->xOffset, ctx->yOffset, ctx->blockSize, ctx->blockSize );
+        tileWriterSubmit( ctx->tileWriter, ctx->xOffset, ctx->yOffset, ctx->blockSize, ctx->blockSize );
+    }
 
     return true;
 }
 
+
+// Without adaptive sampling every pixel counts as noisy until it reaches the target
+static bool _pixelNoisy( const RenderThreadContext* ctx, uint32_t x, uint32_t y )
+{
+    return ctx->adaptive_threshold <= 0.0f || accumulationBufferRelativeError( ctx->accumulation, x, y ) > ctx->adaptive_threshold;
+}
+
+
+// Any noisy pixel in the 3 x 3 neighbourhood, clipped to the block; an empty map means not adaptive
+static bool _neighbourhoodNoisy( const std::vector<uint8_t>& noisy, uint32_t width, uint32_t height, uint32_t x, uint32_t y )
+{
+    if ( noisy.empty() )
+        return true;
+
+    uint32_t x0 = x > 0 ? x - 1 : 0;
+    uint32_t y0 = y > 0 ? y - 1 : 0;
+    uint32_t x1 = x + 1 < width ? x + 1 : x;
+    uint32_t y1 = y + 1 < height ? y + 1 : y;
+    for ( uint32_t ny = y0; ny <= y1; ny++ ) {
+        for ( uint32_t nx = x0; nx <= x1; nx++ ) {
+            if ( noisy[ ny * width + nx ] )
+                return true;
+        }
+    }
+
+    return false;
+}
+
 // Recursively trace each ray through objects/materials
-static vector3 _color_recursive( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned depth, unsigned max_depth )
+static vector3 _color_recursive( const ray& r, const bvh_t* bvh, const bvh_simd_t* simd, const material_t* materials, unsigned depth, unsigned max_depth, unsigned roulette_depth )
 {
     hit_info hit;
 
-    if ( _sceneHit( scene, sceneSize, r, 0.001f, ( std::numeric_limits<float>::max )(), &hit ) ) {
+    randomBounce( depth + 1 );
+
+    if ( _sceneHit( bvh, simd, r, 0.001f, ( std::numeric_limits<float>::max )(), &hit ) ) {
 #if defined( NORMAL_SHADE )
         vector3 normal = ( r.point( hit.distance ) - vector3( 0, 0, -1 ) ).normalized();
         return 0.5f * vector3( normal.x + 1, normal.y + 1, normal.z + 1 );
 #elif defined( DIFFUSE_SHADE )
         if ( depth < max_depth ) {
             vector3 target = hit.point + hit.normal + randomInUnitSphere();
-            return 0.5f * _color_recursive( ray( hit.point, target - hit.point ), scene, sceneSize, depth + 1, max_depth );
+            return 0.5f * _color_recursive( ray( hit.point, target - hit.point ), bvh, simd, materials, depth + 1, max_depth, roulette_depth );
         } else {
             return vector3( 0, 0, 0 );
         }
 #else
         ray     scattered;
         vector3 attenuation;
-        if ( depth < max_depth && materialScatter( hit.material, r, hit, &attenuation, &scattered ) ) {
-            return attenuation * _color_recursive( scattered, scene, sceneSize, depth + 1, max_depth );
+        if ( depth < max_depth && materialScatter( materials[ hit.materialID ], r, hit, &attenuation, &scattered ) ) {
+            // No path throughput is carried down the recursion, so this plays roulette on this bounce's attenuation
+            if ( roulette_depth && depth + 1 >= roulette_depth && !materialRoulette( &attenuation ) )
+                return vector3( 0, 0, 0 );
+
+            return attenuation * _color_recursive( scattered, bvh, simd, materials, depth + 1, max_depth, roulette_depth );
         } else {
             return vector3( 0, 0, 0 );
         }
 #endif
     }
 
-    return _background( r );
+    return materialBackground( r );
 }
 
 // Non-recursive version
-static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned depth, unsigned max_depth )
+static vector3 _color( const ray& r, const bvh_t* bvh, const bvh_simd_t* simd, const material_t* materials, unsigned depth, unsigned max_depth, unsigned roulette_depth )
 {
     hit_info hit;
     vector3  attenuation;
@@ -248,7 +437,9 @@ static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize,
     vector3  color( 1, 1, 1 );
 
     for ( unsigned i = 0; i < max_depth; i++ ) {
-        if ( _sceneHit( scene, sceneSize, scattered, 0.001f, ( std::numeric_limits<float>::max )(), &hit ) ) {
+        randomBounce( i + 1 );
+
+        if ( _sceneHit( bvh, simd, scattered, 0.001f, ( std::numeric_limits<float>::max )(), &hit ) ) {
 #if defined( NORMAL_SHADE )
             vector3 normal = ( r.point( hit.distance ) - vector3( 0, 0, -1 ) ).normalized();
             return 0.5f * vector3( normal.x + 1, normal.y + 1, normal.z + 1 );
@@ -257,14 +448,18 @@ static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize,
             scattered      = ray( hit.point, target - hit.point );
             color *= 0.5f;
 #else
-            if ( materialScatter( hit.material, scattered, hit, &attenuation, &scattered ) ) {
+            if ( materialScatter( materials[ hit.materialID ], scattered, hit, &attenuation, &scattered ) ) {
                 color *= attenuation;
             } else {
                 break;
             }
 #endif
+            if ( roulette_depth && i + 1 >= roulette_depth && !materialRoulette( &color ) ) {
+                color = vector3( 0, 0, 0 );
+                break;
+            }
         } else {
-            color *= _background( scattered );
+            color *= materialBackground( scattered );
             break;
         }
     }
@@ -273,34 +468,14 @@ static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize,
 }
 
 
-static vector3 _background( const ray& r )
-{
-    vector3 unitDirection = r.direction.normalized();
-    float   t             = 0.5f * ( unitDirection.y + 1.0f );
-
-    return ( 1.0f - t ) * vector3( 1.0f, 1.0f, 1.0f ) + t * vector3( 0.5f, 0.7f, 1.0f );
-}
-
-
-static bool _sceneHit( const sphere_t* scene, uint32_t sceneSize, const ray& r, float min, float max, hit_info* p_hit )
+static bool _sceneHit( const bvh_t* bvh, const bvh_simd_t* simd, const ray& r, float min, float max, hit_info* p_hit )
 {
-    bool     rval         = false;
-    float    closestSoFar = max;
-    hit_info hit;
-
-    for ( unsigned i = 0; i < sceneSize; i++ ) {
-        const sphere_t& sphere = scene[ i ];
+    s_raysCast++;
 
-        hit_info tmp;
-        if ( sphereHit( sphere, r, min, closestSoFar, &tmp ) ) {
-            rval         = true;
-            closestSoFar = tmp.distance;
-            hit          = tmp;
-        }
-    }
+    if ( simd )
+        return bvhSimdHit( simd, r, min, max, p_hit );
 
-    *p_hit = hit;
-    return rval;
+    return bvhHit( bvh, r, min, max, p_hit );
 }
 
 } // namespace pk
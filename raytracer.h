@@ -1,6 +1,10 @@
 #pragma once
 
+#include "accumulation_buffer.h"
+#include "bvh.h"
+#include "bvh_simd.h"
 #include "camera.h"
+#include "image_writer.h"
 #include "material.h"
 #include "sphere.h"
 
@@ -15,8 +19,59 @@ namespace pk
 //#define NORMAL_SHADE
 #define MATERIAL_SHADE
 
-int renderScene( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* frameBuffer, unsigned num_aa_samples = 4, unsigned max_ray_depth = 50, unsigned numThreads = 1, unsigned blockSize = 64, bool debug = false, bool recursive = true );
-int renderSceneCUDA( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* frameBuffer, unsigned num_aa_samples = 4, unsigned max_ray_depth = 50, unsigned numThreads = 1, unsigned blockSize = 64, bool debug = false, bool recursive = true );
-int renderSceneISPC( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* frameBuffer, unsigned num_aa_samples = 4, unsigned max_ray_depth = 50, unsigned numThreads = 1, unsigned blockSize = 64, bool debug = false, bool recursive = true );
+// Everything a render takes besides the scene, camera and output; each renderer reads the fields that apply to it
+typedef struct _render_options {
+    unsigned               num_aa_samples;    // samples per pixel; the target spp when rendering progressively
+    unsigned               max_ray_depth;
+    unsigned               numThreads;
+    unsigned               blockSize;
+    bool                   debug;
+    bool                   recursive;         // not the wavefront renderer
+    bvh_builder_t          builder;
+    uint32_t               seed;
+    thread_pool_mode_t     poolMode;
+    tile_writer_t*         tileWriter;        // optional; finished blocks are streamed to it
+    accumulation_buffer_t* accumulation;      // optional, empty; CPU and wavefront renderers add samples to it instead of a buffer of their own
+    tone_map_t             toneMap;           // CPU and wavefront renderers
+    uint32_t               timeBudgetMs;      // CPU renderer only
+    uint32_t               passSamples;       // CPU renderer only
+    float                  adaptiveThreshold; // CPU renderer only
+    uint32_t               rouletteDepth;
+    simd_isa_t             simdIsa;           // CPU renderer only
+    bool                   sortRays;          // wavefront renderer only
+    bool                   packets;           // ISPC renderer only
+    bool                   tasks;             // ISPC renderer only
+
+    _render_options() :
+        num_aa_samples( 4 ),
+        max_ray_depth( 50 ),
+        numThreads( 1 ),
+        blockSize( 64 ),
+        debug( false ),
+        recursive( true ),
+        builder( BVH_BUILDER_SAH ),
+        seed( 0 ),
+        poolMode( THREAD_POOL_SHARED_QUEUE ),
+        tileWriter( nullptr ),
+        accumulation( nullptr ),
+        toneMap( TONE_MAP_GAMMA ),
+        timeBudgetMs( 0 ),
+        passSamples( 0 ),
+        adaptiveThreshold( 0.0f ),
+        rouletteDepth( 0 ),
+        simdIsa( SIMD_ISA_NONE ),
+        sortRays( false ),
+        packets( false ),
+        tasks( false )
+    {
+    }
+} render_options_t;
+
+
+int renderScene( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* frameBuffer, const render_options_t& options );
+// Wavefront variant of the non-recursive CPU path tracer: same image, traced a bounce at a time over queues of rays
+int renderSceneWavefront( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* frameBuffer, const render_options_t& options );
+int renderSceneCUDA( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* frameBuffer, const render_options_t& options );
+int renderSceneISPC( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* frameBuffer, const render_options_t& options );
 
 } // namespace pk
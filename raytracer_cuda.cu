@@ -19,11 +19,14 @@ typedef struct _RenderThreadContext {
     const Camera*          camera;
     const sphere_t*        scene;
     uint32_t               sceneSize;
+    const material_t*      materials;
     uint32_t*              framebuffer;
     uint32_t               rows;
     uint32_t               cols;
     uint32_t               num_aa_samples;
     uint32_t               max_ray_depth;
+    uint32_t               roulette_depth; // bounces before Russian roulette starts; 0 is off
+    uint32_t               seed;
     uint32_t               blockID;
     uint32_t               blockSize;
     uint32_t               xOffset;
@@ -35,6 +38,7 @@ typedef struct _RenderThreadContext {
 
     _RenderThreadContext() :
         scene( nullptr ),
+        materials( nullptr ),
         camera( nullptr ),
         framebuffer( nullptr ),
         blockSize( 0 ),
@@ -49,18 +53,17 @@ typedef struct _RenderThreadContext {
 
 static __global__ void    _createCamera( Camera* pdCamera );
 static __global__ void    _render( RenderThreadContext* pdContext );
-static __device__ vector3 _background( const ray& r );
 static __device__ bool    _sphereHit( const sphere_t& sphere, const ray& r, float min, float max, hit_info* p_hit );
 static __device__ bool    _sceneHit( const sphere_t* scene, uint32_t sceneSize, const ray& r, float min, float max, hit_info* p_hit );
-static __device__ vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned max_depth );
+static __device__ vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, const material_t* materials, unsigned max_depth, unsigned roulette_depth );
 
-int renderSceneCUDA( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, unsigned num_aa_samples, unsigned max_ray_depth, unsigned numThreads, unsigned blockSize, bool debug, bool recursive )
+int renderSceneCUDA( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, const render_options_t& options )
 {
     PerfTimer t;
 
     // Add +1 to block dims in case image is not a multiple of blockSize
-    dim3 blocks( cols / blockSize + 1, rows / blockSize + 1 );
-    dim3 threads( blockSize, blockSize );
+    dim3 blocks( cols / options.blockSize + 1, rows / options.blockSize + 1 );
+    dim3 threads( options.blockSize, options.blockSize );
     printf( "renderSceneCUDA(): blocks %d,%d,%d threads %d,%d\n", blocks.x, blocks.y, blocks.z, threads.x, threads.y );
 
     // Create a copy of the Camera on the device [ gross hack because Camera is created in main() since before I refactored for CUDA ]
@@ -74,24 +77,18 @@ int renderSceneCUDA( const Scene& scene, const Camera& camera, unsigned rows, un
 
     // Copy the Scene to device
     // Flatten the Scene object to an array of sphere_t, which is what Scene should've been in the first place
-    sphere_t* pdScene   = nullptr;
-    size_t    sceneSize = sizeof( sphere_t ) * scene.objects.size();
+    sphere_t*   pdScene      = nullptr;
+    material_t* pdMaterials  = nullptr;
+    size_t      sceneSize    = sizeof( sphere_t ) * scene.objects.size();
+    size_t      materialSize = sizeof( material_t ) * scene.objects.size();
     CHECK_CUDA( cudaMallocManaged( &pdScene, sceneSize ) );
-    printf( "Allocated %zd device bytes / %zd objects\n", sceneSize, scene.objects.size() );
+    CHECK_CUDA( cudaMallocManaged( &pdMaterials, materialSize ) );
+    printf( "Allocated %zd device bytes / %zd objects\n", sceneSize + materialSize, scene.objects.size() );
 
-    sphere_t* p = pdScene;
-    for ( IVisible* obj : scene.objects ) {
-        Sphere*   s1 = dynamic_cast<Sphere*>( obj );
-        sphere_t* s2 = (sphere_t*)p;
-        s2->center   = s1->center;
-        s2->radius   = s1->radius;
-
-        // Deep copy material to the GPU
-        s2->material = *( s1->material );
-
-        p++;
-    }
-    printf( "Copied %zd objects to device\n", scene.objects.size() );
+    // Deep copy the unique materials to the GPU; spheres reference them by ID
+    uint32_t numMaterials = sceneFlatten( scene, pdScene, pdMaterials );
+    printf( "Copied %zd objects (%zd bytes each, %zd byte hits) and %d unique materials to device\n",
+        scene.objects.size(), sizeof( sphere_t ), sizeof( hit_info ), numMaterials );
 
 
     // Allocate a render context to pass information to the GPU
@@ -101,21 +98,34 @@ int renderSceneCUDA( const Scene& scene, const Camera& camera, unsigned rows, un
     pdContext->camera         = pdCamera;
     pdContext->scene          = pdScene;
     pdContext->sceneSize      = (uint32_t)scene.objects.size();
+    pdContext->materials      = pdMaterials;
     pdContext->framebuffer    = framebuffer;
     pdContext->rows           = rows;
     pdContext->cols           = cols;
-    pdContext->num_aa_samples = num_aa_samples;
-    pdContext->max_ray_depth  = max_ray_depth;
-    pdContext->debug          = debug;
+    pdContext->num_aa_samples = options.num_aa_samples;
+    pdContext->max_ray_depth  = options.max_ray_depth;
+    pdContext->roulette_depth = options.rouletteDepth;
+    pdContext->seed           = options.seed;
+    pdContext->debug          = options.debug;
+
+    // One RNG state per device thread; streams are keyed by pixel so the launch shape doesn't change the image
+    rng_t* pdRng = nullptr;
+    CHECK_CUDA( cudaMalloc( &pdRng, sizeof( rng_t ) * blocks.x * blocks.y * threads.x * threads.y ) );
+    randomSetDeviceStates( pdRng );
 
     // Render the scene
     _render<<<blocks, threads>>>( pdContext );
     CHECK_CUDA( cudaGetLastError() );
     CHECK_CUDA( cudaDeviceSynchronize() );
 
+    // The whole frame finishes at once, so it streams out as a single tile
+    tileWriterSubmit( options.tileWriter, 0, 0, cols, rows );
+
     CHECK_CUDA( cudaFree( pdCamera ) );
     CHECK_CUDA( cudaFree( pdScene ) );
+    CHECK_CUDA( cudaFree( pdMaterials ) );
     CHECK_CUDA( cudaFree( pdContext ) );
+    CHECK_CUDA( cudaFree( pdRng ) );
 
     printf( "renderSceneCUDA: %f s\n", t.ElapsedSeconds() );
 
@@ -143,10 +153,12 @@ static __global__ void _render( RenderThreadContext* ctx )
     vector3  color( 0, 0, 0 );
 
     for ( uint32_t s = 0; s < ctx->num_aa_samples; s++ ) {
+        randomSeed( ctx->seed, p, s );
+
         float u = float( x + random() ) / float( ctx->cols );
         float v = float( y + random() ) / float( ctx->rows );
         ray   r = ctx->camera->getRay( u, v );
-        color += _color( r, ctx->scene, ctx->sceneSize, ctx->max_ray_depth );
+        color += _color( r, ctx->scene, ctx->sceneSize, ctx->materials, ctx->max_ray_depth, ctx->roulette_depth );
     }
 
     color /= float( ctx->num_aa_samples );
@@ -159,7 +171,7 @@ static __global__ void _render( RenderThreadContext* ctx )
 
 
 // Non-recursive version
-static __device__ vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned max_depth )
+static __device__ vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, const material_t* materials, unsigned max_depth, unsigned roulette_depth )
 {
     hit_info hit;
     vector3  attenuation;
@@ -167,6 +179,8 @@ static __device__ vector3 _color( const ray& r, const sphere_t* scene, uint32_t
     vector3  color( 1, 1, 1 );
 
     for ( unsigned i = 0; i < max_depth; i++ ) {
+        randomBounce( i + 1 );
+
         if ( _sceneHit( scene, sceneSize, scattered, 0.001f, FLT_MAX, &hit ) ) {
 #if defined( NORMAL_SHADE )
             vector3 normal = ( r.point( hit.distance ) - vector3( 0, 0, -1 ) ).normalized();
@@ -176,14 +190,18 @@ static __device__ vector3 _color( const ray& r, const sphere_t* scene, uint32_t
             scattered      = ray( hit.point, target - hit.point );
             color *= 0.5f;
 #else
-            if ( materialScatter( hit.material, scattered, hit, &attenuation, &scattered ) ) {
+            if ( materialScatter( materials[ hit.materialID ], scattered, hit, &attenuation, &scattered ) ) {
                 color *= attenuation;
             } else {
                 break;
             }
 #endif
+            if ( roulette_depth && i + 1 >= roulette_depth && !materialRoulette( &color ) ) {
+                color = vector3( 0, 0, 0 );
+                break;
+            }
         } else {
-            color *= _background( scattered );
+            color *= materialBackground( scattered );
             break;
         }
     }
@@ -192,15 +210,6 @@ static __device__ vector3 _color( const ray& r, const sphere_t* scene, uint32_t
 }
 
 
-static __device__ vector3 _background( const ray& r )
-{
-    vector3 unitDirection = r.direction.normalized();
-    float   t             = 0.5f * ( unitDirection.y + 1.0f );
-
-    return ( 1.0f - t ) * vector3( 1.0f, 1.0f, 1.0f ) + t * vector3( 0.5f, 0.7f, 1.0f );
-}
-
-
 static __device__ bool _sphereHit( const sphere_t& sphere, const ray& r, float min, float max, hit_info* p_hit )
 {
     assert( p_hit );
@@ -215,19 +224,19 @@ static __device__ bool _sphereHit( const sphere_t& sphere, const ray& r, float m
     if ( discriminant > 0 ) {
         float t = ( -b - sqrt( discriminant ) ) / a;
         if ( t < max && t > min ) {
-            p_hit->distance = t;
-            p_hit->point    = r.point( t );
-            p_hit->normal   = ( p_hit->point - sphere.center ) / sphere.radius;
-            p_hit->material = sphere.material;
+            p_hit->distance   = t;
+            p_hit->point      = r.point( t );
+            p_hit->normal     = ( p_hit->point - sphere.center ) / sphere.radius;
+            p_hit->materialID = sphere.materialID;
             return true;
         }
 
         t = ( -b + sqrt( discriminant ) ) / a;
         if ( t < max && t > min ) {
-            p_hit->distance = t;
-            p_hit->point    = r.point( t );
-            p_hit->normal   = ( p_hit->point - sphere.center ) / sphere.radius;
-            p_hit->material = sphere.material;
+            p_hit->distance   = t;
+            p_hit->point      = r.point( t );
+            p_hit->normal     = ( p_hit->point - sphere.center ) / sphere.radius;
+            p_hit->materialID = sphere.materialID;
             return true;
         }
     }
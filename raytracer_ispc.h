@@ -26,6 +26,16 @@ enum material_type_t {
 };
 #endif
 
+#ifndef __ISPC_ENUM_ispc_target_t__
+#define __ISPC_ENUM_ispc_target_t__
+enum ispc_target_t {
+    TARGET_UNKNOWN = 0,
+    TARGET_SSE4 = 1,
+    TARGET_AVX2 = 2,
+    TARGET_AVX512SKX = 3 
+};
+#endif
+
 
 #ifndef __ISPC_ALIGN__
 #if defined(__clang__) || !defined(_MSC_VER)
@@ -50,18 +60,25 @@ struct RenderGangContext {
     float camera_focusDistance;
     const struct sphere_t * scene;
     const struct material_t * materials;
+    const struct bvh_wide_t * bvh;
     uint32_t sceneSize;
     uint32_t * framebuffer;
     uint32_t rows;
     uint32_t cols;
     uint32_t num_aa_samples;
     uint32_t max_ray_depth;
+    uint32_t roulette_depth;
+    uint32_t seed;
     uint32_t blockID;
     uint32_t blockSize;
     uint32_t totalBlocks;
     uint32_t xOffset;
     uint32_t yOffset;
     bool debug;
+    bool packets;
+    bool tasks;
+    uint64_t packetRays;
+    uint64_t singleRays;
 };
 #endif
 
@@ -88,6 +105,29 @@ struct material_t {
 };
 #endif
 
+#ifndef __ISPC_STRUCT_bvh_wide_t__
+#define __ISPC_STRUCT_bvh_wide_t__
+struct bvh_wide_t {
+    struct bvh_wide_node_t * nodes;
+    uint32_t numNodes;
+    uint32_t depth;
+};
+#endif
+
+#ifndef __ISPC_STRUCT_bvh_wide_node_t__
+#define __ISPC_STRUCT_bvh_wide_node_t__
+struct bvh_wide_node_t {
+    float min_x[8];
+    float min_y[8];
+    float min_z[8];
+    float max_x[8];
+    float max_y[8];
+    float max_z[8];
+    int32_t child[8];
+    uint32_t count[8];
+};
+#endif
+
 
 ///////////////////////////////////////////////////////////////////////////
 // Functions exported from ispc code
@@ -97,6 +137,7 @@ extern "C" {
 #endif // __cplusplus
     extern void cameraInitISPC(struct RenderGangContext * ctx);
     extern bool renderISPC(struct RenderGangContext * ctx);
+    extern enum ispc_target_t targetISPC(int32_t * lanes);
     extern void testISPC();
 #if defined(__cplusplus) && (! defined(__ISPC_NO_EXTERN_C) || !__ISPC_NO_EXTERN_C )
 } /* end extern C */
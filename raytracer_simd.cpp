@@ -1,3 +1,5 @@
+#include "bvh.h"
+#include "ispc_tasks.h"
 #include "material.h"
 #include "perf_timer.h"
 #include "ray.h"
@@ -7,6 +9,7 @@
 #include "thread_pool.h"
 
 #include <assert.h>
+#include <atomic>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -17,19 +20,26 @@ typedef struct _RenderThreadContext {
     const Camera*           camera;
     const ispc::sphere_t*   scene;
     const ispc::material_t* materials;
+    const ispc::bvh_wide_t* bvh;
     uint32_t                sceneSize;
     uint32_t*               framebuffer;
     uint32_t                rows;
     uint32_t                cols;
     uint32_t                num_aa_samples;
     uint32_t                max_ray_depth;
+    uint32_t                roulette_depth;
+    uint32_t                seed;
     uint32_t                blockID;
     uint32_t                blockSize;
     uint32_t                xOffset;
     uint32_t                yOffset;
-    std::atomic<uint32_t>*  blockCount;
     uint32_t                totalBlocks;
+    tile_writer_t*          tileWriter;
+    std::atomic<uint64_t>*  packetRays;
+    std::atomic<uint64_t>*  singleRays;
     bool                    debug;
+    bool                    packets;
+    bool                    tasks;
 
     _RenderThreadContext() :
         scene( nullptr ),
@@ -38,31 +48,65 @@ typedef struct _RenderThreadContext {
         blockSize( 0 ),
         xOffset( 0 ),
         yOffset( 0 ),
-        debug( false )
+        tileWriter( nullptr ),
+        packetRays( nullptr ),
+        singleRays( nullptr ),
+        debug( false ),
+        packets( false ),
+        tasks( false )
     {
     }
 } RenderThreadContext;
 
 
-static bool _renderJobISPC( void* context, uint32_t tid );
+static bool        _renderJobISPC( void* context, uint32_t tid );
+static const char* _targetName( ispc::ispc_target_t target );
 
 
-int renderSceneISPC( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, unsigned num_aa_samples, unsigned max_ray_depth, unsigned numThreads, unsigned blockSize, bool debug, bool recursive )
+int renderSceneISPC( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, const render_options_t& options )
 {
     PerfTimer t;
 
     // Spin up a pool of render threads
     // Allocate width+1 and height+1 blocks to handle case where image is not an even multiple of block size
-    uint32_t      widthBlocks  = uint32_t( float( cols / blockSize ) ) + 1;
-    uint32_t      heightBlocks = uint32_t( float( rows / blockSize ) ) + 1;
+    uint32_t      widthBlocks  = uint32_t( float( cols / options.blockSize ) ) + 1;
+    uint32_t      heightBlocks = uint32_t( float( rows / options.blockSize ) ) + 1;
     uint32_t      numBlocks    = heightBlocks * widthBlocks;
-    thread_pool_t tp           = threadPoolCreate( numThreads );
+    thread_pool_t tp           = threadPoolCreate( options.numThreads, options.poolMode );
 
-    printf( "Render %d x %d: blockSize %d x %d, %d blocks, [%d:%d] threads \n",
-        cols, rows, blockSize, blockSize, numBlocks, tp, numThreads );
+    printf( "Render %d x %d: blockSize %d x %d, %d blocks, [%d:%d] threads (%s)\n",
+        cols, rows, options.blockSize, options.blockSize, numBlocks, tp, options.numThreads, threadPoolModeName( options.poolMode ) );
 
-    // Flatten the Scene object to an SoA ispc::sphere_t
-    size_t sceneSize = scene.objects.size();
+    // raytracer.ispc is built for several targets; the first call into it dispatches to the widest this CPU runs
+    int32_t     lanes  = 0;
+    const char* target = _targetName( ispc::targetISPC( &lanes ) );
+    printf( "ISPC target: %s-i32x%d\n", target, lanes );
+
+    // launch statements in raytracer.ispc run their tasks on the same pool as the blocks
+    ispcTasksSetThreadPool( tp, options.numThreads );
+    if ( options.tasks ) {
+        printf( "ISPC tasks: per-scanline\n" );
+    }
+
+    // Flatten the Scene object to an array of sphere_t, and build the BVH over it.
+    // The BVH reorders the spheres, so the SoA copy below must be made afterwards.
+    size_t      sceneSize    = scene.objects.size();
+    sphere_t*   pScene       = new sphere_t[ sceneSize ];
+    material_t* pMaterials   = new material_t[ sceneSize ];
+    uint32_t    numMaterials = sceneFlatten( scene, pScene, pMaterials );
+
+    PerfTimer   bvhTimer;
+    bvh_t*      bvh  = bvhCreate( pScene, (uint32_t)sceneSize, options.builder, tp );
+    bvh_wide_t* wide = bvhCreateWide( bvh );
+    printf( "Built BVH%d: %d nodes, depth %d (from %d %s nodes) in %f ms\n", BVH_WIDTH, wide->numNodes, wide->depth, bvh->numNodes, bvhBuilderName( options.builder ), bvhTimer.ElapsedNanoseconds() / 1000000.0 );
+
+    static_assert( sizeof( ispc::bvh_wide_node_t ) == sizeof( bvh_wide_node_t ), "ISPC and C++ BVH node layouts differ" );
+    ispc::bvh_wide_t _bvh;
+    _bvh.nodes    = (ispc::bvh_wide_node_t*)wide->nodes;
+    _bvh.numNodes = wide->numNodes;
+    _bvh.depth    = wide->depth;
+
+    // Copy the reordered spheres to an SoA ispc::sphere_t
 
     ispc::sphere_t _scene;
     _scene.center_x   = new float[ sceneSize ];
@@ -72,39 +116,37 @@ int renderSceneISPC( const Scene& scene, const Camera& camera, unsigned rows, un
     _scene.materialID = new uint32_t[ sceneSize ];
 #ifdef MATERIAL_SHADE
     ispc::material_t _materials;
-    _materials.type            = new ispc::material_type_t[ sceneSize ];
-    _materials.albedo_r        = new float[ sceneSize ];
-    _materials.albedo_g        = new float[ sceneSize ];
-    _materials.albedo_b        = new float[ sceneSize ];
-    _materials.blur            = new float[ sceneSize ];
-    _materials.refractionIndex = new float[ sceneSize ];
+    _materials.type            = new ispc::material_type_t[ numMaterials ];
+    _materials.albedo_r        = new float[ numMaterials ];
+    _materials.albedo_g        = new float[ numMaterials ];
+    _materials.albedo_b        = new float[ numMaterials ];
+    _materials.blur            = new float[ numMaterials ];
+    _materials.refractionIndex = new float[ numMaterials ];
 #endif
 
-    uint32_t sphereID   = 0;
-    uint32_t materialID = 0;
-    for ( IVisible* obj : scene.objects ) {
-        Sphere* s1 = dynamic_cast<Sphere*>( obj );
+    for ( size_t i = 0; i < sceneSize; i++ ) {
+        const sphere_t* s1 = &pScene[ i ];
 
-        _scene.center_x[ sphereID ] = s1->center.x;
-        _scene.center_y[ sphereID ] = s1->center.y;
-        _scene.center_z[ sphereID ] = s1->center.z;
-        _scene.radius[ sphereID ]   = s1->radius;
+        _scene.center_x[ i ]   = s1->center.x;
+        _scene.center_y[ i ]   = s1->center.y;
+        _scene.center_z[ i ]   = s1->center.z;
+        _scene.radius[ i ]     = s1->radius;
+        _scene.materialID[ i ] = s1->materialID;
+    }
 
 #ifdef MATERIAL_SHADE
-        _scene.materialID[ sphereID ] = materialID;
-
-        _materials.type[ materialID ]            = (ispc::material_type_t)s1->material->type;
-        _materials.albedo_r[ materialID ]        = s1->material->albedo.r();
-        _materials.albedo_g[ materialID ]        = s1->material->albedo.g();
-        _materials.albedo_b[ materialID ]        = s1->material->albedo.b();
-        _materials.blur[ materialID ]            = s1->material->blur;
-        _materials.refractionIndex[ materialID ] = s1->material->refractionIndex;
-        materialID++;
-#endif
-
-        sphereID++;
+    for ( uint32_t i = 0; i < numMaterials; i++ ) {
+        const material_t* m1 = &pMaterials[ i ];
+
+        _materials.type[ i ]            = (ispc::material_type_t)m1->type;
+        _materials.albedo_r[ i ]        = m1->albedo.r();
+        _materials.albedo_g[ i ]        = m1->albedo.g();
+        _materials.albedo_b[ i ]        = m1->albedo.b();
+        _materials.blur[ i ]            = m1->blur;
+        _materials.refractionIndex[ i ] = m1->refractionIndex;
     }
-    printf( "Flattened %d scene objects and %d materials to ISPC array\n", sphereID, materialID );
+#endif
+    printf( "Flattened %zd scene objects and %d unique materials to ISPC array\n", sceneSize, numMaterials );
 
     // Initialize the camera
     ispc::RenderGangContext ispc_ctx;
@@ -123,66 +165,108 @@ int renderSceneISPC( const Scene& scene, const Camera& camera, unsigned rows, un
 
     memset( framebuffer, 0x00, rows * cols * sizeof( uint32_t ) );
 
+    // Camera rays are traced a gang at a time as packets when they share an octant; later bounces one ray at a time
+    std::atomic<uint64_t> packetRays( 0 );
+    std::atomic<uint64_t> singleRays( 0 );
+    if ( options.packets ) {
+        printf( "Packet traversal for camera rays\n" );
+    }
+
     // Allocate a render context to pass to each worker job
     RenderThreadContext* contexts = new RenderThreadContext[ numBlocks ];
 
-    std::atomic<uint32_t> blockCount = 0;
-    uint32_t              blockID    = 0;
-    uint32_t              yOffset    = 0;
+    Invokable* jobs    = new Invokable[ numBlocks ];
+    uint32_t   blockID = 0;
+    uint32_t   yOffset = 0;
     for ( uint32_t y = 0; y < heightBlocks; y++ ) {
         uint32_t xOffset = 0;
         for ( uint32_t x = 0; x < widthBlocks; x++ ) {
             RenderThreadContext* ctx = &contexts[ blockID ];
             ctx->scene               = &_scene;
             ctx->materials           = &_materials;
+            ctx->bvh                 = &_bvh;
             ctx->sceneSize           = (uint32_t)scene.objects.size();
             ctx->camera              = &camera;
             ctx->framebuffer         = framebuffer;
             ctx->blockID             = blockID;
-            ctx->blockSize           = blockSize;
+            ctx->blockSize           = options.blockSize;
             ctx->xOffset             = xOffset;
             ctx->yOffset             = yOffset;
             ctx->rows                = rows;
             ctx->cols                = cols;
-            ctx->num_aa_samples      = num_aa_samples;
-            ctx->max_ray_depth       = max_ray_depth;
-            ctx->blockCount          = &blockCount;
+            ctx->num_aa_samples      = options.num_aa_samples;
+            ctx->max_ray_depth       = options.max_ray_depth;
+            ctx->roulette_depth      = options.rouletteDepth;
+            ctx->seed                = options.seed;
             ctx->totalBlocks         = numBlocks;
-            ctx->debug               = debug;
+            ctx->tileWriter          = options.tileWriter;
+            ctx->packetRays          = &packetRays;
+            ctx->singleRays          = &singleRays;
+            ctx->debug               = options.debug;
+            ctx->packets             = options.packets;
+            ctx->tasks               = options.tasks;
 
-            threadPoolSubmitJob( Function(_renderJobISPC, ctx) );
-
-            //printf( "Submit block %d of %d\n", blockID, numBlocks );
+            jobs[ blockID ] = Function( _renderJobISPC, ctx );
 
             blockID++;
-            xOffset += blockSize;
+            xOffset += options.blockSize;
         }
-        yOffset += blockSize;
+        yOffset += options.blockSize;
     }
 
-    // Wait for threads to complete
-    while ( blockCount != numBlocks ) {
-        delay( 1000 );
-        printf( "." );
+    // Submit every block as one group, and wait for the whole group rather than the last block
+    job_group_t group = threadPoolSubmitJobs( jobs, numBlocks, tp );
+    threadPoolWaitForJobs( group, INFINITE_TIMEOUT, tp );
+
+    if ( options.packets ) {
+        uint64_t total = packetRays.load() + singleRays.load();
+        printf( "Packets: %llu of %llu camera rays (%.1f%%) traced as packets\n",
+            (unsigned long long)packetRays.load(), (unsigned long long)total, total ? 100.0 * packetRays.load() / total : 0.0 );
     }
-    printf( "\n" );
 
+    ispcTasksSetThreadPool( INVALID_THREAD_POOL, 0 );
     threadPoolDestroy( tp );
+    delete[] jobs;
     delete[] contexts;
+    bvhDestroyWide( wide );
+    bvhDestroy( bvh );
+    delete[] pScene;
+    delete[] pMaterials;
     delete[] _scene.center_x;
     delete[] _scene.center_y;
     delete[] _scene.center_z;
     delete[] _scene.radius;
-#ifdef MATERIAL_SHADE
     delete[] _scene.materialID;
+#ifdef MATERIAL_SHADE
+    delete[] _materials.type;
+    delete[] _materials.albedo_r;
+    delete[] _materials.albedo_g;
+    delete[] _materials.albedo_b;
+    delete[] _materials.blur;
+    delete[] _materials.refractionIndex;
 #endif
 
-    printf( "renderSceneISPC: %f s\n", t.ElapsedSeconds() );
+    printf( "renderSceneISPC: %f s (%s-i32x%d)\n", t.ElapsedSeconds(), target, lanes );
 
     return 0;
 }
 
 
+static const char* _targetName( ispc::ispc_target_t target )
+{
+    switch ( target ) {
+        case ispc::TARGET_SSE4:
+            return "sse4";
+        case ispc::TARGET_AVX2:
+            return "avx2";
+        case ispc::TARGET_AVX512SKX:
+            return "avx512skx";
+        default:
+            return "unknown";
+    }
+}
+
+
 static bool _renderJobISPC( void* context, uint32_t tid )
 {
     RenderThreadContext* ctx = (RenderThreadContext*)context;
@@ -194,6 +278,7 @@ static bool _renderJobISPC( void* context, uint32_t tid )
 
     ispc_ctx.scene          = ctx->scene;
     ispc_ctx.materials      = ctx->materials;
+    ispc_ctx.bvh            = ctx->bvh;
     ispc_ctx.sceneSize      = ctx->sceneSize;
     ispc_ctx.framebuffer    = ctx->framebuffer;
     ispc_ctx.blockID        = ctx->blockID;
@@ -205,15 +290,20 @@ static bool _renderJobISPC( void* context, uint32_t tid )
     ispc_ctx.cols           = ctx->cols;
     ispc_ctx.num_aa_samples = ctx->num_aa_samples;
     ispc_ctx.max_ray_depth  = ctx->max_ray_depth;
+    ispc_ctx.roulette_depth = ctx->roulette_depth;
+    ispc_ctx.seed           = ctx->seed;
     ispc_ctx.debug          = ctx->debug;
+    ispc_ctx.packets        = ctx->packets;
+    ispc_ctx.tasks          = ctx->tasks;
+    ispc_ctx.packetRays     = 0;
+    ispc_ctx.singleRays     = 0;
 
     bool rval = ispc::renderISPC( &ispc_ctx ); // blocking call
 
-    // Notify main thread that we have completed the work
-    if ( ctx->blockID == ctx->totalBlocks - 1 ) {
-        std::atomic<uint32_t>* blockCount = ctx->blockCount;
-        blockCount->exchange( ctx->totalBlocks );
-    }
+    ctx->packetRays->fetch_add( ispc_ctx.packetRays, std::memory_order_relaxed );
+    ctx->singleRays->fetch_add( ispc_ctx.singleRays, std::memory_order_relaxed );
+
+    tileWriterSubmit( ctx->tileWriter, ctx->xOffset, ctx->yOffset, ctx->blockSize, ctx->blockSize );
 
     return rval;
 }
@@ -21,6 +21,7 @@ typedef struct _RenderThreadContext {
     const Camera*          camera;
     const sphere_t*        scene;
     uint32_t               sceneSize;
+    const material_t*      materials;
     uint32_t*              framebuffer;
     uint32_t               rows;
     uint32_t               cols;
@@ -37,6 +38,7 @@ typedef struct _RenderThreadContext {
 
     _RenderThreadContext() :
         scene( nullptr ),
+        materials( nullptr ),
         camera( nullptr ),
         framebuffer( nullptr ),
         blockSize( 0 ),
@@ -56,7 +58,7 @@ static void    _render( RenderThreadContext* pdContext );
 static vector3 _background( const ray& r );
 static bool    _sphereHit( const sphere_t& sphere, const ray& r, float min, float max, hit_info* p_hit );
 static bool    _sceneHit( const sphere_t* scene, uint32_t sceneSize, const ray& r, float min, float max, hit_info* p_hit );
-static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned max_depth );
+static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, const material_t* materials, unsigned max_depth );
 
 
 int renderSceneVulkan( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, unsigned num_aa_samples, unsigned max_ray_depth, unsigned numThreads, unsigned blockSize, bool debug, bool recursive )
@@ -79,24 +81,17 @@ int renderSceneVulkan( const Scene& scene, const Camera& camera, unsigned rows,
 
     // Copy the Scene to device
     // Flatten the Scene object to an array of sphere_t, which is what Scene should've been in the first place
-    sphere_t* pdScene   = nullptr;
-    size_t    sceneSize = sizeof( sphere_t ) * scene.objects.size();
+    sphere_t*   pdScene      = nullptr;
+    material_t* pdMaterials  = nullptr;
+    size_t      sceneSize    = sizeof( sphere_t ) * scene.objects.size();
+    size_t      materialSize = sizeof( material_t ) * scene.objects.size();
     //CHECK_CUDA( cudaMallocManaged( &pdScene, sceneSize ) );
-    printf( "Allocated %zd device bytes / %zd objects\n", sceneSize, scene.objects.size() );
+    //CHECK_CUDA( cudaMallocManaged( &pdMaterials, materialSize ) );
+    printf( "Allocated %zd device bytes / %zd objects\n", sceneSize + materialSize, scene.objects.size() );
 
-    sphere_t* p = pdScene;
-    for ( IVisible* obj : scene.objects ) {
-        Sphere*   s1 = dynamic_cast<Sphere*>( obj );
-        sphere_t* s2 = (sphere_t*)p;
-        s2->center   = s1->center;
-        s2->radius   = s1->radius;
-
-        // Deep copy material to the GPU
-        s2->material = *( s1->material );
-
-        p++;
-    }
-    printf( "Copied %zd objects to device\n", scene.objects.size() );
+    // Deep copy the unique materials to the GPU; spheres reference them by ID
+    uint32_t numMaterials = sceneFlatten( scene, pdScene, pdMaterials );
+    printf( "Copied %zd objects and %d unique materials to device\n", scene.objects.size(), numMaterials );
 
 
     // Allocate a render context to pass information to the GPU
@@ -106,6 +101,7 @@ int renderSceneVulkan( const Scene& scene, const Camera& camera, unsigned rows,
     pdContext->camera         = pdCamera;
     pdContext->scene          = pdScene;
     pdContext->sceneSize      = (uint32_t)scene.objects.size();
+    pdContext->materials      = pdMaterials;
     pdContext->framebuffer    = framebuffer;
     pdContext->rows           = rows;
     pdContext->cols           = cols;
@@ -120,6 +116,7 @@ int renderSceneVulkan( const Scene& scene, const Camera& camera, unsigned rows,
 
     //CHECK_CUDA( cudaFree( pdCamera ) );
     //CHECK_CUDA( cudaFree( pdScene ) );
+    //CHECK_CUDA( cudaFree( pdMaterials ) );
     //CHECK_CUDA( cudaFree( pdContext ) );
 
     printf( "renderSceneVulkan: %f s\n", t.ElapsedSeconds() );
@@ -160,7 +157,7 @@ static void _render( RenderThreadContext* ctx )
         float u = float( x + random() ) / float( ctx->cols );
         float v = float( y + random() ) / float( ctx->rows );
         ray   r = ctx->camera->getRay( u, v );
-        color += _color( r, ctx->scene, ctx->sceneSize, ctx->max_ray_depth );
+        color += _color( r, ctx->scene, ctx->sceneSize, ctx->materials, ctx->max_ray_depth );
     }
 
     color /= float( ctx->num_aa_samples );
@@ -173,7 +170,7 @@ static void _render( RenderThreadContext* ctx )
 
 
 // Non-recursive version
-static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, unsigned max_depth )
+static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize, const material_t* materials, unsigned max_depth )
 {
     hit_info hit;
     vector3  attenuation;
@@ -190,7 +187,7 @@ static vector3 _color( const ray& r, const sphere_t* scene, uint32_t sceneSize,
             scattered      = ray( hit.point, target - hit.point );
             color *= 0.5f;
 #else
-            if ( materialScatter( hit.material, scattered, hit, &attenuation, &scattered ) ) {
+            if ( materialScatter( materials[ hit.materialID ], scattered, hit, &attenuation, &scattered ) ) {
                 color *= attenuation;
             } else {
                 break;
@@ -229,19 +226,19 @@ static bool _sphereHit( const sphere_t& sphere, const ray& r, float min, float m
     if ( discriminant > 0 ) {
         float t = ( -b - sqrt( discriminant ) ) / a;
         if ( t < max && t > min ) {
-            p_hit->distance = t;
-            p_hit->point    = r.point( t );
-            p_hit->normal   = ( p_hit->point - sphere.center ) / sphere.radius;
-            p_hit->material = sphere.material;
+            p_hit->distance   = t;
+            p_hit->point      = r.point( t );
+            p_hit->normal     = ( p_hit->point - sphere.center ) / sphere.radius;
+            p_hit->materialID = sphere.materialID;
             return true;
         }
 
         t = ( -b + sqrt( discriminant ) ) / a;
         if ( t < max && t > min ) {
-            p_hit->distance = t;
-            p_hit->point    = r.point( t );
-            p_hit->normal   = ( p_hit->point - sphere.center ) / sphere.radius;
-            p_hit->material = sphere.material;
+            p_hit->distance   = t;
+            p_hit->point      = r.point( t );
+            p_hit->normal     = ( p_hit->point - sphere.center ) / sphere.radius;
+            p_hit->materialID = sphere.materialID;
             return true;
         }
     }
@@ -0,0 +1,695 @@
+#include "raytracer.h"
+
+#include "accumulation_buffer.h"
+#include "bvh.h"
+#include "material.h"
+#include "perf_timer.h"
+#include "ray.h"
+#include "sphere.h"
+#include "thread_pool.h"
+#include "vector_cuda.h"
+
+#include <assert.h>
+#include <atomic>
+#include <limits>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+//
+// Wavefront (stream) path tracer.
+//
+// Instead of following one path to the end before starting the next, each tile generates a wave of camera rays
+// and advances the whole wave a bounce at a time through separate stages:
+//
+//   generate   camera rays for every sample of every pixel in the wave, into a structure-of-arrays queue
+//   bin        optionally, from the second bounce on, reorder the queue by direction octant and then by the
+//              Morton code of the origin, so rays that go the same way from nearby points traverse together
+//   intersect  closest hit for every ray in the queue
+//   sort       counting sort of the queue slots by the material that was hit (misses first)
+//   shade      scatter each material's rays together, terminating misses, absorbed and rouletted paths and
+//              compacting the survivors into the other queue for the next bounce
+//
+// Every path reseeds its own random stream before it's shaded, so the image matches renderScene's non-recursive
+// path tracer exactly; only the order the work is done in changes.
+//
+
+namespace pk
+{
+
+// Paths in flight per wave; a wave always holds whole pixels, so it can grow past this when -a does
+static const uint32_t WAVEFRONT_MAX_PATHS = 16384;
+
+// Ray binning key: 3 octant bits above a 27-bit Morton code of the origin, 9 bits per axis
+static const uint32_t BIN_MORTON_BITS = 9;
+static const uint32_t BIN_RADIX_BITS  = 10;
+static const uint32_t BIN_KEY_BITS    = 3 + 3 * BIN_MORTON_BITS;
+
+
+// Rays in flight, structure-of-arrays. Each bounce reads one queue and compacts the survivors into the other.
+typedef struct _path_queue {
+    std::vector<float>    origin_x;
+    std::vector<float>    origin_y;
+    std::vector<float>    origin_z;
+    std::vector<float>    direction_x;
+    std::vector<float>    direction_y;
+    std::vector<float>    direction_z;
+    std::vector<float>    throughput_r;
+    std::vector<float>    throughput_g;
+    std::vector<float>    throughput_b;
+    std::vector<uint32_t> path; // index into the wave's pixels and results: pixel * samples + sample
+    uint32_t              count;
+
+    _path_queue() :
+        count( 0 )
+    {
+    }
+} path_queue_t;
+
+
+// Per-thread working set, kept between tiles so waves don't allocate
+typedef struct _wavefront {
+    path_queue_t          queues[ 2 ];
+    std::vector<hit_info> hits;    // closest hit per queue slot
+    std::vector<uint8_t>  keys;    // material type per queue slot; MATERIAL_NONE for a miss
+    std::vector<uint32_t> order;   // queue slots sorted by key
+    std::vector<uint32_t> binKeys; // ray binning: octant and origin Morton code per queue slot
+    std::vector<uint32_t> binScratch;
+    std::vector<uint32_t> pixels;  // image index of each pixel in the wave
+    std::vector<vector3>  results; // final color of each path in the wave
+} wavefront_t;
+
+
+// Stage times are summed over every thread, so they're CPU time, not wall time.
+// Coherence counts compare each secondary ray with the one intersected just before it.
+typedef struct _wavefront_stats {
+    std::atomic<uint64_t> raysCast;
+    std::atomic<uint64_t> pathsTraced;
+    std::atomic<uint64_t> generateNs;
+    std::atomic<uint64_t> binNs;
+    std::atomic<uint64_t> intersectNs;
+    std::atomic<uint64_t> sortNs;
+    std::atomic<uint64_t> shadeNs;
+    std::atomic<uint64_t> secondaryRays;
+    std::atomic<uint64_t> secondaryIntersectNs;
+    std::atomic<uint64_t> sameOctant; // same direction octant as the previous ray
+    std::atomic<uint64_t> sameHit;    // same material hit as the previous ray, or both missed
+
+    _wavefront_stats() :
+        raysCast( 0 ),
+        pathsTraced( 0 ),
+        generateNs( 0 ),
+        binNs( 0 ),
+        intersectNs( 0 ),
+        sortNs( 0 ),
+        shadeNs( 0 ),
+        secondaryRays( 0 ),
+        secondaryIntersectNs( 0 ),
+        sameOctant( 0 ),
+        sameHit( 0 )
+    {
+    }
+} wavefront_stats_t;
+
+
+typedef struct _WavefrontThreadContext {
+    const Camera*          camera;
+    const bvh_t*           bvh;
+    const material_t*      materials;
+    uint32_t*              framebuffer;
+    accumulation_buffer_t* accumulation;
+    uint32_t               rows;
+    uint32_t               cols;
+    uint32_t               num_aa_samples;
+    uint32_t               max_ray_depth;
+    uint32_t               roulette_depth; // bounces before Russian roulette starts; 0 is off
+    uint32_t               seed;
+    uint32_t               blockID;
+    uint32_t               blockSize;
+    uint32_t               xOffset;
+    uint32_t               yOffset;
+    uint32_t               totalBlocks;
+    tile_writer_t*         tileWriter;
+    tone_map_t             toneMap;
+    wavefront_stats_t*     stats;
+    aabb_t                 bounds; // scene bounds, for quantizing ray origins when binning
+    bool                   debug;
+    bool                   sortRays;
+
+    _WavefrontThreadContext() :
+        camera( nullptr ),
+        bvh( nullptr ),
+        materials( nullptr ),
+        framebuffer( nullptr ),
+        accumulation( nullptr ),
+        roulette_depth( 0 ),
+        blockSize( 0 ),
+        xOffset( 0 ),
+        yOffset( 0 ),
+        tileWriter( nullptr ),
+        toneMap( TONE_MAP_GAMMA ),
+        stats( nullptr ),
+        debug( false ),
+        sortRays( false )
+    {
+    }
+} WavefrontThreadContext;
+
+
+static bool     _renderJobWavefront( void* context, uint32_t tid );
+static void     _traceWave( const WavefrontThreadContext* ctx, wavefront_t* wf, uint32_t numPixels );
+static void     _generate( const WavefrontThreadContext* ctx, wavefront_t* wf, uint32_t numPixels, path_queue_t* out );
+static void     _binRays( const WavefrontThreadContext* ctx, wavefront_t* wf, const path_queue_t* in, path_queue_t* out );
+static void     _intersect( const WavefrontThreadContext* ctx, wavefront_t* wf, const path_queue_t* in, uint64_t* p_sameOctant, uint64_t* p_sameHit );
+static void     _sortByMaterial( wavefront_t* wf, uint32_t count );
+static void     _shade( const WavefrontThreadContext* ctx, wavefront_t* wf, uint32_t bounce, const path_queue_t* in, path_queue_t* out );
+static void     _queueReserve( path_queue_t* queue, uint32_t count );
+static void     _queuePush( path_queue_t* queue, const ray& r, const vector3& throughput, uint32_t path );
+static void     _queueCopy( const path_queue_t* src, uint32_t from, path_queue_t* dst, uint32_t to );
+static uint32_t _octant( float x, float y, float z );
+static uint32_t _mortonExpand( uint32_t v );
+
+static thread_local wavefront_t s_wavefront;
+
+
+int renderSceneWavefront( const Scene& scene, const Camera& camera, unsigned rows, unsigned cols, uint32_t* framebuffer, const render_options_t& options )
+{
+    if ( options.accumulation && ( options.accumulation->cols != cols || options.accumulation->rows != rows ) ) {
+        printf( "Error: the accumulation buffer must be %u x %u\n", cols, rows );
+        return -1;
+    }
+
+    PerfTimer t;
+
+    // Spin up a pool of render threads
+    // Allocate width+1 and height+1 blocks to handle case where image is not an even multiple of block size
+    uint32_t      widthBlocks  = uint32_t( float( cols / options.blockSize ) ) + 1;
+    uint32_t      heightBlocks = uint32_t( float( rows / options.blockSize ) ) + 1;
+    uint32_t      numBlocks    = heightBlocks * widthBlocks;
+    thread_pool_t tp           = threadPoolCreate( options.numThreads, options.poolMode );
+
+    printf( "Render %d x %d (wavefront): blockSize %d x %d, %d blocks, [%d:%d] threads (%s)\n",
+        cols, rows, options.blockSize, options.blockSize, numBlocks, tp, options.numThreads, threadPoolModeName( options.poolMode ) );
+
+    sphere_t*   pScene       = new sphere_t[ scene.objects.size() ];
+    material_t* pMaterials   = new material_t[ scene.objects.size() ];
+    uint32_t    numMaterials = sceneFlatten( scene, pScene, pMaterials );
+    printf( "Flattened %zd scene objects and %d unique materials to array\n", scene.objects.size(), numMaterials );
+
+    PerfTimer bvhTimer;
+    bvh_t*    bvh = bvhCreate( pScene, (uint32_t)scene.objects.size(), options.builder, tp );
+    printf( "Built %s BVH: %d nodes, depth %d in %f ms\n", bvhBuilderName( options.builder ), bvh->numNodes, bvh->depth, bvhTimer.ElapsedNanoseconds() / 1000000.0 );
+
+    accumulation_buffer_t* accumulation = options.accumulation;
+    if ( !accumulation ) {
+        accumulation = accumulationBufferCreate( cols, rows );
+    }
+    printf( "Tone map: %s, up to %u paths per wave\n", toneMapName( options.toneMap ), WAVEFRONT_MAX_PATHS );
+
+    if ( options.rouletteDepth ) {
+        printf( "Russian roulette after %u bounces\n", options.rouletteDepth );
+    }
+    if ( options.sortRays ) {
+        printf( "Binning secondary rays by octant and %u-bit origin Morton code\n", 3 * BIN_MORTON_BITS );
+    }
+
+    wavefront_stats_t stats;
+
+    WavefrontThreadContext* contexts = new WavefrontThreadContext[ numBlocks ];
+    Invokable*              jobs     = new Invokable[ numBlocks ];
+    uint32_t                blockID  = 0;
+    uint32_t                yOffset  = 0;
+    for ( uint32_t y = 0; y < heightBlocks; y++ ) {
+        uint32_t xOffset = 0;
+        for ( uint32_t x = 0; x < widthBlocks; x++ ) {
+            WavefrontThreadContext* ctx = &contexts[ blockID ];
+            ctx->bvh                    = bvh;
+            ctx->materials              = pMaterials;
+            ctx->camera                 = &camera;
+            ctx->framebuffer            = framebuffer;
+            ctx->accumulation           = accumulation;
+            ctx->blockID                = blockID;
+            ctx->blockSize              = options.blockSize;
+            ctx->xOffset                = xOffset;
+            ctx->yOffset                = yOffset;
+            ctx->rows                   = rows;
+            ctx->cols                   = cols;
+            ctx->num_aa_samples         = options.num_aa_samples;
+            ctx->max_ray_depth          = options.max_ray_depth;
+            ctx->roulette_depth         = options.rouletteDepth;
+            ctx->seed                   = options.seed;
+            ctx->totalBlocks            = numBlocks;
+            ctx->tileWriter             = options.tileWriter;
+            ctx->toneMap                = options.toneMap;
+            ctx->stats                  = &stats;
+            ctx->bounds                 = bvh->nodes[ 0 ].bounds;
+            ctx->debug                  = options.debug;
+            ctx->sortRays               = options.sortRays;
+
+            jobs[ blockID ] = Function( _renderJobWavefront, ctx );
+
+            blockID++;
+            xOffset += options.blockSize;
+        }
+        yOffset += options.blockSize;
+    }
+
+    PerfTimer   renderTimer;
+    job_group_t group = threadPoolSubmitJobs( jobs, numBlocks, tp );
+    threadPoolWaitForJobs( group, INFINITE_TIMEOUT, tp );
+
+    double   renderMs = renderTimer.ElapsedNanoseconds() / 1000000.0;
+    uint64_t rays     = stats.raysCast.load();
+    uint64_t paths    = stats.pathsTraced.load();
+    printf( "Rendered %u spp in %f ms: %llu rays, %.2f Mrays/s, %.2f rays per path\n",
+        options.num_aa_samples, renderMs, (unsigned long long)rays, rays / renderMs / 1000.0, paths ? (double)rays / paths : 0.0 );
+    printf( "Wavefront stages (thread ms): generate %.1f, bin %.1f, intersect %.1f, sort %.1f, shade %.1f\n",
+        stats.generateNs.load() / 1000000.0, stats.binNs.load() / 1000000.0, stats.intersectNs.load() / 1000000.0, stats.sortNs.load() / 1000000.0, stats.shadeNs.load() / 1000000.0 );
+
+    uint64_t secondary = stats.secondaryRays.load();
+    if ( secondary ) {
+        printf( "Secondary rays%s: %llu, %.1f%% same octant and %.1f%% same hit as the previous ray, %.1f ns per intersection\n",
+            options.sortRays ? " (binned)" : "", (unsigned long long)secondary, 100.0 * stats.sameOctant.load() / secondary, 100.0 * stats.sameHit.load() / secondary,
+            (double)stats.secondaryIntersectNs.load() / secondary );
+    }
+
+    threadPoolDestroy( tp );
+    delete[] jobs;
+    delete[] contexts;
+    if ( accumulation != options.accumulation ) {
+        accumulationBufferDestroy( accumulation );
+    }
+    bvhDestroy( bvh );
+    delete[] pScene;
+    delete[] pMaterials;
+
+    printf( "renderSceneWavefront: %f s\n", t.ElapsedSeconds() );
+
+    return 0;
+}
+
+
+//
+// Private implementation
+//
+
+static bool _renderJobWavefront( void* context, uint32_t tid )
+{
+    UNUSED( tid );
+
+    const WavefrontThreadContext* ctx = (const WavefrontThreadContext*)context;
+    wavefront_t*                  wf  = &s_wavefront;
+
+    uint32_t samples       = ctx->num_aa_samples;
+    uint32_t pixelsPerWave = samples < WAVEFRONT_MAX_PATHS ? WAVEFRONT_MAX_PATHS / samples : 1;
+    uint32_t numPixels     = 0;
+
+    wf->pixels.resize( pixelsPerWave );
+
+    for ( uint32_t y = ctx->yOffset; y < ctx->yOffset + ctx->blockSize; y++ ) {
+        // Don't render out of bounds (in case where image is not an even multiple of block size)
+        if ( y >= ctx->rows )
+            break;
+
+        for ( uint32_t x = ctx->xOffset; x < ctx->xOffset + ctx->blockSize; x++ ) {
+            // Don't render out of bounds (in case where image is not an even multiple of block size)
+            if ( x >= ctx->cols )
+                break;
+
+            // TEST
+            if ( ctx->debug && ( y == ctx->yOffset || y == ctx->yOffset + ctx->blockSize - 1 || x == ctx->xOffset || x == ctx->xOffset + ctx->blockSize - 1 ) ) {
+                accumulationBufferAdd( ctx->accumulation, x, y, (float)samples, 0.0f, 0.0f, samples );
+                continue;
+            }
+
+            wf->pixels[ numPixels++ ] = y * ctx->cols + x;
+            if ( numPixels == pixelsPerWave ) {
+                _traceWave( ctx, wf, numPixels );
+                numPixels = 0;
+            }
+        }
+    }
+
+    if ( numPixels ) {
+        _traceWave( ctx, wf, numPixels );
+    }
+
+    // Average, tone map and quantize the whole block at once
+    accumulationBufferResolve( ctx->accumulation, ctx->framebuffer, ctx->toneMap, ctx->xOffset, ctx->yOffset, ctx->blockSize, ctx->blockSize );
+    tileWriterSubmit( ctx->tileWriter, ctx->xOffset, ctx->yOffset, ctx->blockSize, ctx->blockSize );
+
+    return true;
+}
+
+
+// Trace every sample of the first numPixels pixels in wf->pixels to completion, then accumulate them
+static void _traceWave( const WavefrontThreadContext* ctx, wavefront_t* wf, uint32_t numPixels )
+{
+    uint32_t samples  = ctx->num_aa_samples;
+    uint32_t numPaths = numPixels * samples;
+    uint64_t rays     = 0;
+
+    _queueReserve( &wf->queues[ 0 ], numPaths );
+    _queueReserve( &wf->queues[ 1 ], numPaths );
+    wf->hits.resize( numPaths );
+    wf->keys.resize( numPaths );
+    wf->order.resize( numPaths );
+    wf->binKeys.resize( numPaths );
+    wf->binScratch.resize( numPaths );
+    wf->results.resize( numPaths );
+
+    path_queue_t* in  = &wf->queues[ 0 ];
+    path_queue_t* out = &wf->queues[ 1 ];
+
+    PerfTimer generateTimer;
+    _generate( ctx, wf, numPixels, in );
+    ctx->stats->generateNs.fetch_add( generateTimer.ElapsedNanoseconds(), std::memory_order_relaxed );
+
+    uint64_t binNs                = 0;
+    uint64_t intersectNs          = 0;
+    uint64_t sortNs               = 0;
+    uint64_t shadeNs              = 0;
+    uint64_t secondaryRays        = 0;
+    uint64_t secondaryIntersectNs = 0;
+    uint64_t sameOctant           = 0;
+    uint64_t sameHit              = 0;
+    uint32_t bounce               = 0;
+    for ( ; bounce < ctx->max_ray_depth && in->count > 0; bounce++ ) {
+        // Camera rays are already coherent in pixel order; scattered rays are binned so neighbours traverse alike
+        if ( ctx->sortRays && bounce > 0 ) {
+            PerfTimer binTimer;
+            _binRays( ctx, wf, in, out );
+            binNs += binTimer.ElapsedNanoseconds();
+
+            path_queue_t* swap = in;
+            in                 = out;
+            out                = swap;
+        }
+
+        PerfTimer intersectTimer;
+        uint64_t  octants = 0;
+        uint64_t  hits    = 0;
+        _intersect( ctx, wf, in, &octants, &hits );
+        uint64_t ns = intersectTimer.ElapsedNanoseconds();
+        intersectNs += ns;
+        rays += in->count;
+
+        if ( bounce > 0 ) {
+            secondaryRays += in->count;
+            secondaryIntersectNs += ns;
+            sameOctant += octants;
+            sameHit += hits;
+        }
+
+        PerfTimer sortTimer;
+        _sortByMaterial( wf, in->count );
+        sortNs += sortTimer.ElapsedNanoseconds();
+
+        PerfTimer shadeTimer;
+        _shade( ctx, wf, bounce, in, out );
+        shadeNs += shadeTimer.ElapsedNanoseconds();
+
+        path_queue_t* swap = in;
+        in                 = out;
+        out                = swap;
+    }
+
+    // Paths still going at the depth limit keep their throughput, like _color's loop running out
+    for ( uint32_t k = 0; k < in->count; k++ ) {
+        wf->results[ in->path[ k ] ] = vector3( in->throughput_r[ k ], in->throughput_g[ k ], in->throughput_b[ k ] );
+    }
+
+    // Sum each pixel's samples in sample order, so the float sums match renderScene's
+    for ( uint32_t p = 0; p < numPixels; p++ ) {
+        vector3 color( 0, 0, 0 );
+        for ( uint32_t s = 0; s < samples; s++ ) {
+            color += wf->results[ p * samples + s ];
+        }
+
+        uint32_t pixel = wf->pixels[ p ];
+        accumulationBufferAdd( ctx->accumulation, pixel % ctx->cols, pixel / ctx->cols, color.x, color.y, color.z, samples );
+    }
+
+    ctx->stats->raysCast.fetch_add( rays, std::memory_order_relaxed );
+    ctx->stats->pathsTraced.fetch_add( numPaths, std::memory_order_relaxed );
+    ctx->stats->binNs.fetch_add( binNs, std::memory_order_relaxed );
+    ctx->stats->intersectNs.fetch_add( intersectNs, std::memory_order_relaxed );
+    ctx->stats->secondaryRays.fetch_add( secondaryRays, std::memory_order_relaxed );
+    ctx->stats->secondaryIntersectNs.fetch_add( secondaryIntersectNs, std::memory_order_relaxed );
+    ctx->stats->sameOctant.fetch_add( sameOctant, std::memory_order_relaxed );
+    ctx->stats->sameHit.fetch_add( sameHit, std::memory_order_relaxed );
+    ctx->stats->sortNs.fetch_add( sortNs, std::memory_order_relaxed );
+    ctx->stats->shadeNs.fetch_add( shadeNs, std::memory_order_relaxed );
+}
+
+
+// Camera rays for every sample of every pixel in the wave, with the same random streams as _renderJob
+static void _generate( const WavefrontThreadContext* ctx, wavefront_t* wf, uint32_t numPixels, path_queue_t* out )
+{
+    uint32_t samples = ctx->num_aa_samples;
+
+    out->count = 0;
+    for ( uint32_t p = 0; p < numPixels; p++ ) {
+        uint32_t pixel = wf->pixels[ p ];
+        uint32_t x     = pixel % ctx->cols;
+        uint32_t y     = pixel / ctx->cols;
+
+        for ( uint32_t s = 0; s < samples; s++ ) {
+            randomSeed( ctx->seed, pixel, s );
+
+            float u = float( x + random() ) / float( ctx->cols );
+            float v = float( y + random() ) / float( ctx->rows );
+            ray   r = ctx->camera->getRay( u, v );
+
+            _queuePush( out, r, vector3( 1, 1, 1 ), p * samples + s );
+        }
+    }
+}
+
+
+// Reorder the queue into out by octant, then origin Morton code: an LSD radix sort of the slots, then a gather
+static void _binRays( const WavefrontThreadContext* ctx, wavefront_t* wf, const path_queue_t* in, path_queue_t* out )
+{
+    const aabb_t& bounds = ctx->bounds;
+    float         scale[ 3 ];
+    for ( int axis = 0; axis < 3; axis++ ) {
+        float extent  = bounds.max[ axis ] - bounds.min[ axis ];
+        scale[ axis ] = extent > 0.0f ? float( ( 1u << BIN_MORTON_BITS ) - 1 ) / extent : 0.0f;
+    }
+
+    const float* origin[ 3 ] = { in->origin_x.data(), in->origin_y.data(), in->origin_z.data() };
+    for ( uint32_t k = 0; k < in->count; k++ ) {
+        uint32_t cell[ 3 ];
+        for ( int axis = 0; axis < 3; axis++ ) {
+            // Origins are hit points, so inside the scene bounds up to rounding; clamp anyway
+            float c      = ( origin[ axis ][ k ] - bounds.min[ axis ] ) * scale[ axis ];
+            c            = c < 0.0f ? 0.0f : c;
+            cell[ axis ] = (uint32_t)c < ( 1u << BIN_MORTON_BITS ) ? (uint32_t)c : ( 1u << BIN_MORTON_BITS ) - 1;
+        }
+
+        uint32_t octant    = _octant( in->direction_x[ k ], in->direction_y[ k ], in->direction_z[ k ] );
+        uint32_t morton    = ( _mortonExpand( cell[ 0 ] ) << 2 ) | ( _mortonExpand( cell[ 1 ] ) << 1 ) | _mortonExpand( cell[ 2 ] );
+        wf->binKeys[ k ] = octant << ( 3 * BIN_MORTON_BITS ) | morton;
+        wf->order[ k ]   = k;
+    }
+
+    uint32_t* src = wf->order.data();
+    uint32_t* dst = wf->binScratch.data();
+    for ( uint32_t shift = 0; shift < BIN_KEY_BITS; shift += BIN_RADIX_BITS ) {
+        uint32_t offsets[ 1 << BIN_RADIX_BITS ] = {};
+        uint32_t mask                           = ( 1u << BIN_RADIX_BITS ) - 1;
+
+        for ( uint32_t k = 0; k < in->count; k++ ) {
+            offsets[ ( wf->binKeys[ src[ k ] ] >> shift ) & mask ]++;
+        }
+
+        uint32_t start = 0;
+        for ( uint32_t d = 0; d <= mask; d++ ) {
+            uint32_t n    = offsets[ d ];
+            offsets[ d ]  = start;
+            start        += n;
+        }
+
+        for ( uint32_t k = 0; k < in->count; k++ ) {
+            dst[ offsets[ ( wf->binKeys[ src[ k ] ] >> shift ) & mask ]++ ] = src[ k ];
+        }
+
+        uint32_t* swap = src;
+        src            = dst;
+        dst            = swap;
+    }
+
+    for ( uint32_t k = 0; k < in->count; k++ ) {
+        _queueCopy( in, src[ k ], out, k );
+    }
+    out->count = in->count;
+}
+
+
+// Closest hit for every ray in the queue; the key is the material type that was hit, or MATERIAL_NONE for a miss.
+// Also counts rays whose octant, and whose hit material (or miss), match the ray before them.
+static void _intersect( const WavefrontThreadContext* ctx, wavefront_t* wf, const path_queue_t* in, uint64_t* p_sameOctant, uint64_t* p_sameHit )
+{
+    uint32_t lastOctant   = UINT32_MAX;
+    uint32_t lastMaterial = UINT32_MAX;
+    uint64_t sameOctant   = 0;
+    uint64_t sameHit      = 0;
+
+    for ( uint32_t k = 0; k < in->count; k++ ) {
+        ray r( vector3( in->origin_x[ k ], in->origin_y[ k ], in->origin_z[ k ] ), vector3( in->direction_x[ k ], in->direction_y[ k ], in->direction_z[ k ] ) );
+
+        uint32_t material = UINT32_MAX - 1; // a miss
+        if ( bvhHit( ctx->bvh, r, 0.001f, ( std::numeric_limits<float>::max )(), &wf->hits[ k ] ) ) {
+            material      = wf->hits[ k ].materialID;
+            wf->keys[ k ] = (uint8_t)ctx->materials[ material ].type;
+        } else {
+            wf->keys[ k ] = (uint8_t)MATERIAL_NONE;
+        }
+
+        uint32_t octant = _octant( r.direction.x, r.direction.y, r.direction.z );
+        sameOctant += octant == lastOctant ? 1 : 0;
+        sameHit += material == lastMaterial ? 1 : 0;
+        lastOctant   = octant;
+        lastMaterial = material;
+    }
+
+    *p_sameOctant = sameOctant;
+    *p_sameHit    = sameHit;
+}
+
+
+// Counting sort of the queue slots by key, stable so slots keep their pixel order within a material
+static void _sortByMaterial( wavefront_t* wf, uint32_t count )
+{
+    uint32_t offsets[ MATERIAL_GLASS + 1 ] = {};
+
+    for ( uint32_t k = 0; k < count; k++ ) {
+        offsets[ wf->keys[ k ] ]++;
+    }
+
+    uint32_t start = 0;
+    for ( uint32_t m = 0; m < ARRAY_SIZE( offsets ); m++ ) {
+        uint32_t n    = offsets[ m ];
+        offsets[ m ]  = start;
+        start        += n;
+    }
+
+    for ( uint32_t k = 0; k < count; k++ ) {
+        wf->order[ offsets[ wf->keys[ k ] ]++ ] = k;
+    }
+}
+
+
+// Shade the queue in material order. Misses pick up the background and absorbed paths keep their throughput,
+// like _color; the rest scatter, play roulette, and are compacted into out for the next bounce.
+static void _shade( const WavefrontThreadContext* ctx, wavefront_t* wf, uint32_t bounce, const path_queue_t* in, path_queue_t* out )
+{
+    uint32_t samples = ctx->num_aa_samples;
+
+    out->count = 0;
+    for ( uint32_t i = 0; i < in->count; i++ ) {
+        uint32_t k    = wf->order[ i ];
+        uint32_t path = in->path[ k ];
+        ray      r( vector3( in->origin_x[ k ], in->origin_y[ k ], in->origin_z[ k ] ), vector3( in->direction_x[ k ], in->direction_y[ k ], in->direction_z[ k ] ) );
+        vector3  throughput( in->throughput_r[ k ], in->throughput_g[ k ], in->throughput_b[ k ] );
+
+        if ( wf->keys[ k ] == MATERIAL_NONE ) {
+            wf->results[ path ] = throughput * materialBackground( r );
+            continue;
+        }
+
+        // Pick up this path's random stream where _color would be at this bounce
+        randomSeed( ctx->seed, wf->pixels[ path / samples ], path % samples );
+        randomBounce( bounce + 1 );
+
+        const hit_info& hit = wf->hits[ k ];
+        ray             scattered;
+        vector3         attenuation;
+        if ( !materialScatter( ctx->materials[ hit.materialID ], r, hit, &attenuation, &scattered ) ) {
+            wf->results[ path ] = throughput;
+            continue;
+        }
+
+        throughput *= attenuation;
+
+        if ( ctx->roulette_depth && bounce + 1 >= ctx->roulette_depth && !materialRoulette( &throughput ) ) {
+            wf->results[ path ] = vector3( 0, 0, 0 );
+            continue;
+        }
+
+        _queuePush( out, scattered, throughput, path );
+    }
+}
+
+
+static void _queueReserve( path_queue_t* queue, uint32_t count )
+{
+    if ( queue->path.size() >= count )
+        return;
+
+    queue->origin_x.resize( count );
+    queue->origin_y.resize( count );
+    queue->origin_z.resize( count );
+    queue->direction_x.resize( count );
+    queue->direction_y.resize( count );
+    queue->direction_z.resize( count );
+    queue->throughput_r.resize( count );
+    queue->throughput_g.resize( count );
+    queue->throughput_b.resize( count );
+    queue->path.resize( count );
+}
+
+
+static void _queuePush( path_queue_t* queue, const ray& r, const vector3& throughput, uint32_t path )
+{
+    uint32_t k = queue->count++;
+
+    queue->origin_x[ k ]     = r.origin.x;
+    queue->origin_y[ k ]     = r.origin.y;
+    queue->origin_z[ k ]     = r.origin.z;
+    queue->direction_x[ k ]  = r.direction.x;
+    queue->direction_y[ k ]  = r.direction.y;
+    queue->direction_z[ k ]  = r.direction.z;
+    queue->throughput_r[ k ] = throughput.x;
+    queue->throughput_g[ k ] = throughput.y;
+    queue->throughput_b[ k ] = throughput.z;
+    queue->path[ k ]         = path;
+}
+
+
+static void _queueCopy( const path_queue_t* src, uint32_t from, path_queue_t* dst, uint32_t to )
+{
+    dst->origin_x[ to ]     = src->origin_x[ from ];
+    dst->origin_y[ to ]     = src->origin_y[ from ];
+    dst->origin_z[ to ]     = src->origin_z[ from ];
+    dst->direction_x[ to ]  = src->direction_x[ from ];
+    dst->direction_y[ to ]  = src->direction_y[ from ];
+    dst->direction_z[ to ]  = src->direction_z[ from ];
+    dst->throughput_r[ to ] = src->throughput_r[ from ];
+    dst->throughput_g[ to ] = src->throughput_g[ from ];
+    dst->throughput_b[ to ] = src->throughput_b[ from ];
+    dst->path[ to ]         = src->path[ from ];
+}
+
+
+// Sign bits of the direction, x in bit 2
+static uint32_t _octant( float x, float y, float z )
+{
+    return ( x < 0.0f ? 4 : 0 ) | ( y < 0.0f ? 2 : 0 ) | ( z < 0.0f ? 1 : 0 );
+}
+
+
+// Spread the low BIN_MORTON_BITS bits of v so there are two zero bits between each
+static uint32_t _mortonExpand( uint32_t v )
+{
+    v &= ( 1u << BIN_MORTON_BITS ) - 1;
+    v = ( v | v << 16 ) & 0x030000ff;
+    v = ( v | v << 8 ) & 0x0300f00f;
+    v = ( v | v << 4 ) & 0x030c30c3;
+    v = ( v | v << 2 ) & 0x09249249;
+
+    return v;
+}
+
+} // namespace pk
@@ -0,0 +1,64 @@
+#pragma once
+
+//
+// Counter-based random numbers.
+// Every stream is keyed by ( seed, pixel, sample, bounce ) instead of carrying state from one sample to the next,
+// so a render is reproducible for a given seed regardless of thread count or scheduling, and threads share no RNG state.
+//
+// The generator is PCG-RXS-M-XS-32. raytracer.ispc implements the same functions, so the scalar, ISPC and CUDA paths
+// draw identical streams for the same key.
+//
+
+#include <cuda_runtime.h>
+#include <stdint.h>
+
+namespace pk
+{
+
+typedef struct _rng {
+    uint32_t key;   // hash of ( seed, pixel, sample )
+    uint32_t state; // PCG state of the current bounce's stream
+} rng_t;
+
+
+// One PCG round used as an integer hash (Jarzynski & Olano, "Hash Functions for GPU Rendering")
+__host__ __device__ inline uint32_t rngHash( uint32_t v )
+{
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word  = ( ( state >> ( ( state >> 28u ) + 4u ) ) ^ state ) * 277803737u;
+
+    return ( word >> 22u ) ^ word;
+}
+
+
+// Select the stream for one bounce of the current sample; bounce 0 is the camera ray
+__host__ __device__ inline void rngBounce( rng_t* rng, uint32_t bounce )
+{
+    rng->state = rngHash( rng->key + bounce );
+}
+
+
+__host__ __device__ inline void rngSeed( rng_t* rng, uint32_t seed, uint32_t pixel, uint32_t sample )
+{
+    rng->key = rngHash( rngHash( rngHash( seed ) + pixel ) + sample );
+    rngBounce( rng, 0 );
+}
+
+
+__host__ __device__ inline uint32_t rngNext( rng_t* rng )
+{
+    uint32_t state = rng->state;
+    rng->state     = state * 747796405u + 2891336453u;
+    uint32_t word  = ( ( state >> ( ( state >> 28u ) + 4u ) ) ^ state ) * 277803737u;
+
+    return ( word >> 22u ) ^ word;
+}
+
+
+// [0, 1) from the top 24 bits, which a float represents exactly on every backend
+__host__ __device__ inline float rngFloat( rng_t* rng )
+{
+    return ( rngNext( rng ) >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+} // namespace pk
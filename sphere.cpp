@@ -1,7 +1,9 @@
 #include "sphere.h"
 
 #include <assert.h>
+#include <map>
 #include <stdio.h>
+#include <string.h>
 
 
 namespace pk
@@ -42,9 +44,6 @@ __host__ __device__ bool Sphere::hit( const ray& r, float min, float max, hit_in
             p_hit->point    = r.point( t );
             p_hit->normal   = ( p_hit->point - center ) / radius;
 
-            if (material)
-                p_hit->material = *material;
-
             return true;
         }
 
@@ -54,9 +53,6 @@ __host__ __device__ bool Sphere::hit( const ray& r, float min, float max, hit_in
             p_hit->point    = r.point( t );
             p_hit->normal   = ( p_hit->point - center ) / radius;
 
-            if (material)
-                p_hit->material = *material;
-
             return true;
         }
     }
@@ -79,20 +75,20 @@ __host__ __device__ bool sphereHit( const sphere_t &sphere, const ray& r, float
     if ( discriminant > 0 ) {
         float t = ( -b - sqrt( discriminant ) ) / a;
         if ( t < max && t > min ) {
-            p_hit->distance = t;
-            p_hit->point    = r.point( t );
-            p_hit->normal   = ( p_hit->point - sphere.center ) / sphere.radius;
-            p_hit->material = sphere.material;
+            p_hit->distance   = t;
+            p_hit->point      = r.point( t );
+            p_hit->normal     = ( p_hit->point - sphere.center ) / sphere.radius;
+            p_hit->materialID = sphere.materialID;
 
             return true;
         }
 
         t = ( -b + sqrt( discriminant ) ) / a;
         if ( t < max && t > min ) {
-            p_hit->distance = t;
-            p_hit->point    = r.point( t );
-            p_hit->normal   = ( p_hit->point - sphere.center ) / sphere.radius;
-            p_hit->material = sphere.material;
+            p_hit->distance   = t;
+            p_hit->point      = r.point( t );
+            p_hit->normal     = ( p_hit->point - sphere.center ) / sphere.radius;
+            p_hit->materialID = sphere.materialID;
 
             return true;
         }
@@ -101,4 +97,37 @@ __host__ __device__ bool sphereHit( const sphere_t &sphere, const ray& r, float
     return false;
 }
 
+
+// material_t has no padding, so a bytewise compare is a valid ordering
+struct _materialLess {
+    bool operator()( const material_t& lhs, const material_t& rhs ) const { return memcmp( &lhs, &rhs, sizeof( material_t ) ) < 0; }
+};
+
+
+uint32_t sceneFlatten( const Scene& scene, sphere_t* spheres, material_t* materials )
+{
+    assert( spheres );
+    assert( materials );
+
+    std::map<material_t, uint32_t, _materialLess> ids;
+    uint32_t                                      numMaterials = 0;
+
+    for ( size_t i = 0; i < scene.objects.size(); i++ ) {
+        Sphere* s = dynamic_cast<Sphere*>( scene.objects[ i ] );
+        assert( s && s->material );
+
+        auto it = ids.find( *s->material );
+        if ( it == ids.end() ) {
+            materials[ numMaterials ] = *s->material;
+            it                        = ids.insert( { *s->material, numMaterials++ } ).first;
+        }
+
+        spheres[ i ].center     = s->center;
+        spheres[ i ].radius     = s->radius;
+        spheres[ i ].materialID = it->second;
+    }
+
+    return numMaterials;
+}
+
 } // namespace pk
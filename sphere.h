@@ -21,12 +21,17 @@ public:
 };
 
 
+// 20 bytes; materials live in a separate, deduplicated table
 typedef struct _sphere {
-    vector3    center;
-    float      radius;
-    material_t material; // TODO: should be an index into a materials array
+    vector3  center;
+    float    radius;
+    uint32_t materialID; // index into the scene's material table
 } sphere_t;
 
 bool sphereHit(const sphere_t &sphere, const ray& r, float min, float max, hit_info* p_hit);
 
+// Flatten the Scene to an array of sphere_t plus a table of its unique materials.
+// Both arrays must hold scene.objects.size() entries; returns the number of materials written.
+uint32_t sceneFlatten( const Scene& scene, sphere_t* spheres, material_t* materials );
+
 } // namespace pk
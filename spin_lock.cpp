@@ -0,0 +1,143 @@
+#include "spin_lock.h"
+
+#include "perf_timer.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#if defined( __x86_64__ ) || defined( __i386__ ) || defined( _M_X64 ) || defined( _M_IX86 )
+#include <immintrin.h>
+#define SPIN_PAUSE() _mm_pause()
+#else
+#define SPIN_PAUSE() std::this_thread::yield()
+#endif
+
+namespace pk
+{
+
+static const uint32_t SPIN_LOCK_SPIN_ROUNDS = 10; // looks at a held lock before sleeping on it
+static const uint32_t SPIN_LOCK_MAX_BACKOFF = 64; // most pauses between two looks
+
+
+//
+// Public
+//
+
+void SpinLock::printStats( const char* name ) const
+{
+#if defined( SPIN_LOCK_STATS )
+    uint64_t acquisitions = _stats.acquisitions.load( std::memory_order_relaxed );
+    uint64_t contended    = _stats.contended.load( std::memory_order_relaxed );
+    uint64_t parked       = _stats.parked.load( std::memory_order_relaxed );
+
+    printf( "SpinLock %s: %llu acquisitions, %llu contended (%.2f%%), %llu parked\n", name, (unsigned long long)acquisitions, (unsigned long long)contended,
+        acquisitions ? 100.0 * contended / acquisitions : 0.0, (unsigned long long)parked );
+
+    for ( int i = 0; i < SPIN_LOCK_HISTOGRAM_BUCKETS; i++ ) {
+        uint64_t count = _stats.waitHistogram[ i ].load( std::memory_order_relaxed );
+        if ( count ) {
+            printf( "    wait >= 2^%-2d ns: %llu\n", i, (unsigned long long)count );
+        }
+    }
+#else
+    UNUSED( name );
+#endif
+}
+
+
+//
+// Private implementation
+//
+
+void SpinLock::_lockContended()
+{
+#if defined( SPIN_LOCK_STATS )
+    std::chrono::steady_clock::time_point start  = std::chrono::steady_clock::now();
+    bool                                  parked = false;
+#endif
+
+    // Spin on a load, and only try the CAS once the lock looks free
+    uint32_t backoff = 1;
+    for ( uint32_t i = 0; i < SPIN_LOCK_SPIN_ROUNDS; i++ ) {
+        if ( _state.load( std::memory_order_relaxed ) == UNLOCKED ) {
+            uint32_t unlocked = UNLOCKED;
+            if ( _state.compare_exchange_weak( unlocked, LOCKED, std::memory_order_acquire, std::memory_order_relaxed ) )
+                goto Acquired;
+        }
+
+        for ( uint32_t p = 0; p < backoff; p++ ) {
+            SPIN_PAUSE();
+        }
+        backoff = std::min( backoff * 2, SPIN_LOCK_MAX_BACKOFF );
+    }
+
+    // Still held: sleep. Taking the lock as PARKED rather than LOCKED means we may make one needless wake when we
+    // release it, but never miss waking another sleeper.
+    while ( _state.exchange( PARKED, std::memory_order_acquire ) != UNLOCKED ) {
+        futexWait( &_state, PARKED );
+#if defined( SPIN_LOCK_STATS )
+        parked = true;
+#endif
+    }
+
+Acquired:
+#if defined( SPIN_LOCK_STATS )
+    uint64_t ns     = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+    int      bucket = 0;
+    while ( ns >>= 1 ) {
+        bucket++;
+    }
+
+    _stats.contended.fetch_add( 1, std::memory_order_relaxed );
+    _stats.parked.fetch_add( parked ? 1 : 0, std::memory_order_relaxed );
+    _stats.waitHistogram[ std::min( bucket, SPIN_LOCK_HISTOGRAM_BUCKETS - 1 ) ].fetch_add( 1, std::memory_order_relaxed );
+#endif
+    return;
+}
+
+
+//
+// Tests
+//
+
+static const int      SPIN_LOCK_TEST_THREADS = 4;
+static const uint64_t SPIN_LOCK_TEST_LOCKS   = 1000000; // per thread
+
+
+// Several threads bump one counter under the lock; none of the increments may be lost
+void testSpinLock()
+{
+    SpinLock                 lock;
+    uint64_t                 counter = 0;
+    std::vector<std::thread> threads;
+
+    PerfTimer timer;
+
+    for ( int t = 0; t < SPIN_LOCK_TEST_THREADS; t++ ) {
+        threads.push_back( std::thread( [ &lock, &counter ]() {
+            for ( uint64_t i = 0; i < SPIN_LOCK_TEST_LOCKS; i++ ) {
+                SpinLockGuard guard( lock );
+                counter++;
+            }
+        } ) );
+    }
+
+    for ( std::thread& t : threads ) {
+        t.join();
+    }
+
+    double seconds = timer.ElapsedSeconds();
+
+    printf( "testSpinLock: %d threads, %llu locks, %.0f locks/second, counter %llu\n", SPIN_LOCK_TEST_THREADS,
+        (unsigned long long)( SPIN_LOCK_TEST_THREADS * SPIN_LOCK_TEST_LOCKS ), SPIN_LOCK_TEST_THREADS * SPIN_LOCK_TEST_LOCKS / seconds, (unsigned long long)counter );
+    lock.printStats( "testSpinLock" );
+
+    assert( counter == SPIN_LOCK_TEST_THREADS * SPIN_LOCK_TEST_LOCKS );
+}
+
+} // namespace pk
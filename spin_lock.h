@@ -1,36 +1,93 @@
 #pragma once
 
+#include "futex.h"
+
 #include <atomic>
+#include <stdint.h>
 
 namespace pk
 {
 
 //
-// The simplest, laziest spin lock imaginable (thanks Stack Overflow)
+// A lock for short critical sections: a map lookup, a vector push.
+//
+// lock() is a single CAS when the lock is free. When it isn't, the waiter spins on a plain load (test-and-test-and-set),
+// so waiters share the cache line rather than bouncing it between cores with writes, and pauses between looks with
+// exponential backoff, which leaves a hyperthread sibling the core. If the lock is still held after a few microseconds
+// the waiter sleeps on a futex instead of burning its core, and release() wakes one sleeper.
+//
+// Define SPIN_LOCK_STATS to have every lock count its acquisitions, how many had to wait and how many slept, and keep
+// a histogram of wait times; printStats() reports them. Off by default: the counters cost an atomic add per lock().
 //
 
-class SpinLock {
-    std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+//#define SPIN_LOCK_STATS
+
+#define SPIN_LOCK_HISTOGRAM_BUCKETS 32 // bucket i counts waits of [ 2^i, 2^(i+1) ) ns; the last one everything longer
 
+#if defined( SPIN_LOCK_STATS )
+typedef struct _spin_lock_stats {
+    std::atomic<uint64_t> acquisitions;
+    std::atomic<uint64_t> contended; // found the lock held
+    std::atomic<uint64_t> parked;    // ...and slept on it
+    std::atomic<uint64_t> waitHistogram[ SPIN_LOCK_HISTOGRAM_BUCKETS ];
+} spin_lock_stats_t;
+#endif
+
+
+class SpinLock {
 public:
+    SpinLock() :
+        _state( UNLOCKED )
+#if defined( SPIN_LOCK_STATS )
+        ,
+        _stats()
+#endif
+    {
+    }
+
     void lock()
     {
-        while ( _lock.test_and_set( std::memory_order_acquire ) ) {
-            ; // spin
+        uint32_t unlocked = UNLOCKED;
+        if ( !_state.compare_exchange_strong( unlocked, LOCKED, std::memory_order_acquire, std::memory_order_relaxed ) ) {
+            _lockContended();
         }
+
+#if defined( SPIN_LOCK_STATS )
+        _stats.acquisitions.fetch_add( 1, std::memory_order_relaxed );
+#endif
     }
 
     void release()
     {
-        //assert(_lock);
-        _lock.clear( std::memory_order_release );
+        // Only touch the futex if someone may be asleep on it
+        if ( _state.exchange( UNLOCKED, std::memory_order_release ) == PARKED ) {
+            futexWakeOne( &_state );
+        }
     }
 
-    SpinLock& operator=( const SpinLock& rhs)
+    // Prints this lock's counters and wait histogram; does nothing unless SPIN_LOCK_STATS is defined
+    void printStats( const char* name ) const;
+
+    SpinLock& operator=( const SpinLock& rhs )
     {
-        // do nothing; cannot assign or copy std::atomic_flag
+        // do nothing; a lock's state can't be copied
         return *this;
     }
+
+private:
+    enum {
+        UNLOCKED = 0,
+        LOCKED   = 1,
+        PARKED   = 2, // locked, and a waiter may be asleep on _state
+    };
+
+    void _lockContended();
+
+    std::atomic<uint32_t> _state;
+
+#if defined( SPIN_LOCK_STATS )
+    spin_lock_stats_t _stats;
+#endif
 };
 
 
@@ -53,4 +110,6 @@ private:
 };
 
 
+void testSpinLock();
+
 } // namespace pk
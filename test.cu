@@ -108,7 +108,8 @@ void testCPUThreaded()
         ctx.y                 = &y[ ctx.start ];
         ctx.complete          = &complete;
 
-        threadPoolSubmitJob( Function(_cpu_add_thread, &ctx) );
+        // Nobody waits for the jobs; the last one sets complete instead
+        threadPoolReleaseJobs( threadPoolSubmitJob( Function(_cpu_add_thread, &ctx) ) );
     }
 
     // Wait for threads to complete
@@ -8,13 +8,16 @@
 #include "perf_timer.h"
 #include "spin_lock.h"
 #include "utils.h"
+#include "work_stealing_deque.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <stdio.h>
 #include <thread>
-#include <unordered_map>
 #include <vector>
 
 namespace pk
@@ -26,31 +29,57 @@ namespace pk
 
 static const int MAX_THREAD_POOLS = 4;
 static const int MAX_QUEUE_DEPTH  = 1024;
-
+static const int WAIT_SPIN_COUNT  = 4096; // polls of a job group before a waiter sleeps
+static const int JOBS_PER_RECEIVE = 8;    // most jobs a shared-queue worker takes from the queue at once
+
+
+// Completion state for a batch of jobs submitted together with threadPoolSubmitJobs(), or for a single job.
+// Groups live in the pool's slot table and are reused rather than freed, so submitting doesn't allocate.
+typedef struct _job_group {
+    std::atomic<uint32_t>   remaining; // jobs not yet finished; the worker that takes it to 0 signals done
+    std::mutex              mutex;
+    std::condition_variable done;
+    bool                    signaled; // guarded by mutex, so the waiter can't free the group while it's being signaled
+    bool                    released; // guarded by mutex; nobody will wait, so whoever sees the other flag set frees the group
+    bool                    freed;    // guarded by mutex; set by whoever frees the group, so concurrent waiters free it once
+    job_group_t             handle;   // slot index in the low 32 bits, reuse count above; INVALID_JOB_GROUP while free
+    uint32_t                slot;
+    uint32_t                reuses;
+
+    _job_group( uint32_t s ) :
+        remaining( 0 ),
+        signaled( false ),
+        released( false ),
+        freed( false ),
+        handle( INVALID_JOB_GROUP ),
+        slot( s ),
+        reuses( 0 ) {}
+} _job_group_t;
+
+
+// A queued job: the submitted Invokable plus its bookkeeping. Trivially copyable, so queuing one is a plain copy.
 class Job {
 public:
     Job() :
-        pFunction( nullptr ),
-        pContext( nullptr )
+        handle( INVALID_JOB ),
+        groupHandle( INVALID_JOB_GROUP ),
+        group( nullptr )
     {
     }
 
-    virtual bool invoke( uint32_t tid )
+    bool invoke( uint32_t tid )
     {
-        if ( pFunction )
-            return pFunction( pContext, tid );
-        else {
-            printf( "WARN: null Job.pFunction\n" );
-            return false;
-        }
+        return invokable.invoke( tid );
     }
 
-    std::function<bool( void*, uint32_t )> pFunction;
-    void*                                  pContext;
-    job_t                                  handle;
-    job_group_t                            groupHandle;
+    Invokable     invokable;
+    job_t         handle;
+    job_group_t   groupHandle;
+    _job_group_t* group;
 };
 
+static_assert( std::is_trivially_copyable<Job>::value, "Job must stay trivially copyable" );
+
 
 typedef struct _thread {
     uint32_t          tid;
@@ -62,13 +91,15 @@ typedef struct _thread {
     std::chrono::steady_clock::time_point startTick;
     std::chrono::steady_clock::time_point stopTick;
     uint64_t                              jobsExecuted;
+    uint64_t                              jobsStolen;
 
     _thread() :
         tid( -1 ),
         hPool( INVALID_THREAD_POOL ),
         thread( nullptr ),
         shouldExit( false ),
-        jobsExecuted( 0 )
+        jobsExecuted( 0 ),
+        jobsStolen( 0 )
     {
     }
 
@@ -79,45 +110,92 @@ typedef struct _thread {
         thread       = std::move( rhs.thread );
         shouldExit   = false;
         jobsExecuted = rhs.jobsExecuted;
+        jobsStolen   = rhs.jobsStolen;
     }
 } _thread_t;
 
 
+// Per-worker state for THREAD_POOL_WORK_STEALING
+typedef struct _worker_queue {
+    WorkStealingDeque<Job*> deque;      // pushed and popped by the owning worker only; stolen from by the others
+    SpinLock                inboxLock;  // guards inbox
+    std::deque<Job*>        inbox;      // jobs submitted from outside the pool, waiting to move to deque; oldest first
+    uint32_t                victimSeed; // xorshift state for picking victims; owner only
+
+    _worker_queue() :
+        victimSeed( 0 ) {}
+} _worker_queue_t;
+
+
 typedef struct _thread_pool {
     thread_pool_t                hPool;
+    thread_pool_mode_t           mode;
+    uint32_t                     numThreads; // set before any worker starts; workers read this, never threads.size()
     std::vector<_thread_t>       threads;
     std::vector<std::thread::id> threadIDs;
-    std::atomic<uint64_t>        nexthandle;
     Job*                         jobQueueBuffer;
     obj_queue_t                  jobQueue;
 
-    SpinLock                                        spinLock;
-    std::unordered_map<job_t, std::atomic_bool>     jobCompletion;
-    std::unordered_map<job_t, std::atomic_uint32_t> groupCompletion;
+    SpinLock                   spinLock;
+    std::vector<_job_group_t*> groups;     // by slot; a single job is tracked as a group of one
+    std::vector<uint32_t>      freeGroups; // slots whose group is done with, to hand out again
+
+    // THREAD_POOL_WORK_STEALING
+    _worker_queue_t*        workerQueues;
+    std::atomic<uint32_t>   nextInbox; // round-robin target for submissions from outside the pool
+    std::atomic<int64_t>    pending;   // jobs submitted but not yet picked up by a worker
+    std::atomic<uint32_t>   sleepers;  // workers parked on parkCondition
+    std::mutex              parkMutex;
+    std::condition_variable parkCondition;
+    SpinLock                jobLock;
+    std::vector<Job*>       freeJobs; // finished jobs, reused by the next submissions
 
     _thread_pool() :
         hPool( INVALID_THREAD_POOL ),
+        mode( THREAD_POOL_SHARED_QUEUE ),
+        numThreads( 0 ),
         jobQueueBuffer( nullptr ),
         jobQueue( INVALID_QUEUE ),
-        nexthandle( 0 ) {}
+        workerQueues( nullptr ),
+        nextInbox( 0 ),
+        pending( 0 ),
+        sleepers( 0 ) {}
 } _thread_pool_t;
 
 
 static std::mutex     s_pools_mutex;
 static _thread_pool_t s_pools[ MAX_THREAD_POOLS ];
 
+// Set on each worker thread, so submissions can tell whether they come from inside a pool
+static thread_local _thread_t* s_currentThread = nullptr;
+
 static bool _valid( thread_pool_t pool );
 static void _threadWorker( void* context );
 static bool _calledFromWorkerThread( thread_pool_t pool );
+static void _runJob( _thread_pool_t* tp, _thread_t* thread, Job* job );
+static _job_group_t* _allocJobGroup( _thread_pool_t* tp, uint32_t count );
+static _job_group_t* _findJobGroup( _thread_pool_t* tp, job_group_t handle );
+static void _signalJobGroup( _thread_pool_t* tp, _job_group_t* group, uint32_t count );
+static void _freeJobGroup( _thread_pool_t* tp, _job_group_t* group );
+static void _allocJobs( _thread_pool_t* tp, Job** jobs, size_t numJobs );
+static void _freeJob( _thread_pool_t* tp, Job* job );
+static result _waitForJobGroup( _thread_pool_t* tp, job_group_t handle, uint32_t timeout_ms );
+static void _pushStealingJob( _thread_pool_t* tp, Job* job );
+static void _pushStealingJobs( _thread_pool_t* tp, Job** jobs, size_t numJobs );
+static void _wakeStealingWorkers( _thread_pool_t* tp, size_t numJobs );
+static bool _findStealingJob( _thread_pool_t* tp, _thread_t* thread, Job** p_job );
+static void _parkStealingWorker( _thread_pool_t* tp, _thread_t* thread );
 
 
 //
 // Public
 //
 
-thread_pool_t threadPoolCreate( uint32_t numThreads )
+thread_pool_t threadPoolCreate( uint32_t numThreads, thread_pool_mode_t mode )
 {
     assert( numThreads );
+    if ( numThreads == 0 )
+        return INVALID_THREAD_POOL;
 
     _thread_pool_t* tp     = nullptr;
     thread_pool_t   handle = INVALID_THREAD_POOL;
@@ -138,10 +216,23 @@ thread_pool_t threadPoolCreate( uint32_t numThreads )
     if ( !tp )
         return INVALID_THREAD_POOL;
 
+    tp->mode       = mode;
+    tp->numThreads = numThreads;
     tp->threads.reserve( numThreads );
 
-    tp->jobQueueBuffer = new Job[ MAX_QUEUE_DEPTH ];
-    tp->jobQueue       = Queue<Job>::create( MAX_QUEUE_DEPTH, tp->jobQueueBuffer );
+    if ( mode == THREAD_POOL_WORK_STEALING ) {
+        tp->workerQueues = new _worker_queue_t[ numThreads ];
+        tp->nextInbox    = 0;
+        tp->pending      = 0;
+        tp->sleepers     = 0;
+
+        for ( uint32_t i = 0; i < numThreads; i++ ) {
+            tp->workerQueues[ i ].victimSeed = i * 2654435761u + 1;
+        }
+    } else {
+        tp->jobQueueBuffer = new Job[ MAX_QUEUE_DEPTH ];
+        tp->jobQueue       = Queue<Job>::create( MAX_QUEUE_DEPTH, tp->jobQueueBuffer );
+    }
 
     for ( uint32_t i = 0; i < numThreads; i++ ) {
         _thread_t t;
@@ -169,17 +260,23 @@ job_t threadPoolSubmitJob( const Invokable& i, thread_pool_t pool, thread_pool_b
     _thread_pool_t* tp = &s_pools[ pool ];
 
     Job job;
-    job.pFunction   = i.functor;
-    job.pContext    = i.context;
-    job.handle      = (job_t)tp->nexthandle++;
+    job.invokable   = i;
     job.groupHandle = INVALID_JOB_GROUP;
+    job.group       = _allocJobGroup( tp, 1 );
+    job.handle      = job.group->handle;
+
+    // The deques and inboxes grow on demand, so a work-stealing submit never blocks
+    if ( tp->mode == THREAD_POOL_WORK_STEALING ) {
+        Job* queued = nullptr;
+        _allocJobs( tp, &queued, 1 );
+        *queued = job;
+
+        _pushStealingJob( tp, queued );
+        return job.handle;
+    }
 
     // NOTE: do NOT hold the spinlock when calling queue_send_blocking();
     // you'll block the worker threads and deadlock.
-    tp->spinLock.lock();
-    tp->jobCompletion[ job.handle ] = false;
-    tp->spinLock.release();
-
     result rval = R_OK;
     if ( blocking == THREAD_POOL_SUBMIT_BLOCKING ) {
         rval = Queue<Job>::sendBlocking( tp->jobQueue, &job );
@@ -187,13 +284,59 @@ job_t threadPoolSubmitJob( const Invokable& i, thread_pool_t pool, thread_pool_b
         rval = Queue<Job>::send( tp->jobQueue, &job );
     }
 
+    if ( rval != R_OK ) {
+        // Never queued, so nobody will ever signal it
+        _freeJobGroup( tp, job.group );
+        return INVALID_JOB;
+    }
+
     return job.handle;
 }
 
 
 job_group_t threadPoolSubmitJobs( const Invokable* jobs, size_t numJobs, thread_pool_t pool, thread_pool_blocking_t blocking )
 {
-    return INVALID_JOB_GROUP;
+    if ( !_valid( pool ) || !jobs || numJobs == 0 )
+        return INVALID_JOB_GROUP;
+
+    _thread_pool_t* tp = &s_pools[ pool ];
+
+    _job_group_t* group  = _allocJobGroup( tp, (uint32_t)numJobs );
+    job_group_t   handle = group->handle;
+
+    // Every job in the batch points at the same group, so finishing one is a single atomic decrement
+    if ( tp->mode == THREAD_POOL_WORK_STEALING ) {
+        std::vector<Job*> batch( numJobs );
+        _allocJobs( tp, batch.data(), numJobs );
+        for ( size_t i = 0; i < numJobs; i++ ) {
+            batch[ i ]->invokable   = jobs[ i ];
+            batch[ i ]->groupHandle = handle;
+            batch[ i ]->group       = group;
+        }
+
+        _pushStealingJobs( tp, batch.data(), numJobs );
+        return handle;
+    }
+
+    std::vector<Job> batch( numJobs );
+    for ( size_t i = 0; i < numJobs; i++ ) {
+        batch[ i ].invokable   = jobs[ i ];
+        batch[ i ].groupHandle = handle;
+        batch[ i ].group       = group;
+    }
+
+    uint32_t timeout_ms = blocking == THREAD_POOL_SUBMIT_BLOCKING ? INFINITE_TIMEOUT : 0;
+    size_t   sent       = 0;
+    Queue<Job>::sendBlockingN( tp->jobQueue, batch.data(), numJobs, &sent, timeout_ms );
+
+    if ( sent < numJobs ) {
+        // Jobs that didn't fit will never run; don't let the group wait for them
+        printf( "WARN: threadPoolSubmitJobs: queue full, dropped %zd of %zd jobs\n", numJobs - sent, numJobs );
+
+        _signalJobGroup( tp, group, uint32_t( numJobs - sent ) );
+    }
+
+    return handle;
 }
 
 
@@ -206,55 +349,59 @@ result threadPoolWaitForJob( job_t job, uint32_t timeout_ms, thread_pool_t pool
     if ( _calledFromWorkerThread( pool ) )
         return R_FAIL;
 
-    _thread_pool_t* tp = &s_pools[ pool ];
-
-    PerfTimer timer;
-
-    while ( true ) {
+    return _waitForJobGroup( &s_pools[ pool ], job, timeout_ms );
+}
 
-        // TODO: should block on mutex and/or condition variable in case job is long-running
 
-        tp->spinLock.lock();
+result threadPoolWaitForJobs( job_group_t group, uint32_t timeout_ms, thread_pool_t pool )
+{
+    if ( !_valid( pool ) )
+        return R_INVALID_ARG;
 
-        if ( tp->jobCompletion[ job ] ) {
-            tp->jobCompletion.erase( job );
-            tp->spinLock.release();
-            return R_OK;
-        }
-        tp->spinLock.release();
+    // Don't allow jobs to block on other jobs; all the worker threads can grind to a halt.
+    if ( _calledFromWorkerThread( pool ) )
+        return R_FAIL;
 
-        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) ); // gross
-        if ( timer.ElapsedMilliseconds() >= timeout_ms )
-            return R_TIMEOUT;
-    }
+    return _waitForJobGroup( &s_pools[ pool ], group, timeout_ms );
 }
 
 
-result threadPoolWaitForJobs( job_group_t group, uint32_t timeout_ms, thread_pool_t pool )
+result threadPoolReleaseJobs( job_group_t handle, thread_pool_t pool )
 {
     if ( !_valid( pool ) )
         return R_INVALID_ARG;
 
-    _thread_pool_t* tp = &s_pools[ pool ];
+    _thread_pool_t* tp    = &s_pools[ pool ];
+    _job_group_t*   group = _findJobGroup( tp, handle );
 
-    PerfTimer timer;
+    if ( !group )
+        return R_INVALID_ARG;
 
-    while ( true ) {
+    // If the last job already finished, free the group now; otherwise the worker that finishes it will
+    bool freeGroup;
+    {
+        std::lock_guard<std::mutex> lock( group->mutex );
+        freeGroup       = group->signaled && !group->freed;
+        group->released = true;
+        group->freed   |= freeGroup;
+    }
 
-        // TODO: should block on mutex and/or condition variable in case job is long-running
+    if ( freeGroup ) {
+        _freeJobGroup( tp, group );
+    }
 
-        tp->spinLock.lock();
-        if ( tp->groupCompletion[ group ] ) {
-            tp->groupCompletion.erase( group );
-            tp->spinLock.release();
-            return R_OK;
-        }
-        tp->spinLock.release();
+    return R_OK;
+}
 
-        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) ); // gross
-        if ( timer.ElapsedMilliseconds() >= timeout_ms )
-            return R_TIMEOUT;
-    }
+
+uint32_t threadPoolWorkerIndex( thread_pool_t pool )
+{
+    _thread_t* self = s_currentThread;
+
+    if ( !self || self->hPool != pool )
+        return INVALID_WORKER;
+
+    return self->tid;
 }
 
 
@@ -272,15 +419,48 @@ bool threadPoolDestroy( thread_pool_t pool )
     }
     tp->spinLock.release();
 
-    Queue<Job>::notifyAll( tp->jobQueue );
+    if ( tp->mode == THREAD_POOL_WORK_STEALING ) {
+        std::lock_guard<std::mutex> lock( tp->parkMutex );
+        tp->parkCondition.notify_all();
+    } else {
+        Queue<Job>::close( tp->jobQueue );
+    }
 
     for ( int i = 0; i < tp->threads.size(); i++ ) {
         _thread_t& t = tp->threads[ i ];
         t.thread->join();
     }
 
-    Queue<Job>::destroy( tp->jobQueue );
-    delete[] tp->jobQueueBuffer;
+    if ( tp->mode == THREAD_POOL_WORK_STEALING ) {
+        // Discard jobs that never ran; the workers are gone, so stealing from the main thread is safe
+        for ( int i = 0; i < tp->threads.size(); i++ ) {
+            Job* job = nullptr;
+            while ( tp->workerQueues[ i ].deque.steal( &job ) ) {
+                delete job;
+            }
+            for ( Job* leftover : tp->workerQueues[ i ].inbox ) {
+                delete leftover;
+            }
+            tp->workerQueues[ i ].inboxLock.printStats( "inbox" );
+        }
+        delete[] tp->workerQueues;
+
+        for ( Job* job : tp->freeJobs ) {
+            delete job;
+        }
+        tp->freeJobs.clear();
+        tp->jobLock.printStats( "free jobs" );
+    } else {
+        Queue<Job>::destroy( tp->jobQueue );
+        delete[] tp->jobQueueBuffer;
+    }
+
+    // Every group, including ones nobody waited for
+    for ( _job_group_t* group : tp->groups ) {
+        delete group;
+    }
+    tp->groups.clear();
+    tp->freeGroups.clear();
 
     // Print perf metrics
     for ( int i = 0; i < tp->threads.size(); i++ ) {
@@ -290,13 +470,27 @@ bool threadPoolDestroy( thread_pool_t pool )
         auto                                duration     = std::chrono::duration_cast<std::chrono::seconds>( elapsedTicks ).count();
         double                              seconds      = std::chrono::duration<double>( duration ).count();
 
-        printf( "Thread [%d:%d] %zd jobs %f seconds %f jobs/second\n", t.hPool, t.tid, t.jobsExecuted, seconds, t.jobsExecuted / seconds );
+        printf( "Thread [%d:%d] %zd jobs (%zd stolen) %f seconds %f jobs/second\n", t.hPool, t.tid, t.jobsExecuted, t.jobsStolen, seconds, t.jobsExecuted / seconds );
     }
+    tp->spinLock.printStats( "pool" );
 
     return true;
 }
 
 
+const char* threadPoolModeName( thread_pool_mode_t mode )
+{
+    switch ( mode ) {
+        case THREAD_POOL_SHARED_QUEUE:
+            return "shared queue";
+        case THREAD_POOL_WORK_STEALING:
+            return "work stealing";
+        default:
+            return "unknown";
+    }
+}
+
+
 //
 // Private implementation
 //
@@ -331,6 +525,7 @@ static void _threadWorker( void* context )
     _thread_t*      thread = (_thread_t*)context;
     _thread_pool_t* tp     = &s_pools[ thread->hPool ];
 
+    s_currentThread   = thread;
     thread->startTick = std::chrono::steady_clock::now();
     //printf( "_threadWorker[%d:%d] started\n", thread->pool, thread->tid );
 
@@ -338,30 +533,316 @@ static void _threadWorker( void* context )
         if ( thread->shouldExit )
             goto Exit;
 
-        Job job;
-        if ( R_OK == Queue<Job>::receive( tp->jobQueue, &job, sizeof( Job ), ( std::numeric_limits<unsigned int>::max )() ) ) {
-            if ( thread->shouldExit )
-                goto Exit;
-
-            uint32_t tid = uint32_t( thread->hPool << 16 | thread->tid );
-            job.invoke( tid );
-            thread->jobsExecuted++;
-
-            // Signal that job has completed
-            SpinLockGuard lock( tp->spinLock );
-
-            if ( job.handle != INVALID_JOB ) {
-                tp->jobCompletion[ job.handle ] = true;
+        if ( tp->mode == THREAD_POOL_WORK_STEALING ) {
+            Job* job = nullptr;
+            if ( _findStealingJob( tp, thread, &job ) ) {
+                _runJob( tp, thread, job );
+                _freeJob( tp, job );
+            } else {
+                _parkStealingWorker( tp, thread );
             }
+            continue;
+        }
 
-            if ( job.groupHandle != INVALID_JOB_GROUP ) {
-                tp->groupCompletion[ job.groupHandle ]++;
+        // Take several small jobs per trip to the queue, but no more than our share of what's queued,
+        // so one worker doesn't sit on jobs the idle ones could be running
+        Job    jobs[ JOBS_PER_RECEIVE ];
+        size_t share    = Queue<Job>::size( tp->jobQueue ) / tp->numThreads + 1;
+        size_t received = 0;
+        if ( R_OK == Queue<Job>::receiveN( tp->jobQueue, jobs, std::min<size_t>( share, JOBS_PER_RECEIVE ), &received ) ) {
+            for ( size_t i = 0; i < received; i++ ) {
+                if ( thread->shouldExit )
+                    goto Exit;
+
+                _runJob( tp, thread, &jobs[ i ] );
             }
         }
     }
 
 Exit:
     thread->stopTick = std::chrono::steady_clock::now();
+    s_currentThread  = nullptr;
+}
+
+
+static void _runJob( _thread_pool_t* tp, _thread_t* thread, Job* job )
+{
+    uint32_t tid = uint32_t( thread->hPool << 16 | thread->tid );
+    job->invoke( tid );
+    thread->jobsExecuted++;
+
+    // Signal that job has completed
+    if ( job->group ) {
+        _signalJobGroup( tp, job->group, 1 );
+    }
+}
+
+
+// Hand out a group from the slot table, growing it only when every group is in use
+static _job_group_t* _allocJobGroup( _thread_pool_t* tp, uint32_t count )
+{
+    SpinLockGuard lock( tp->spinLock );
+
+    _job_group_t* group;
+    if ( tp->freeGroups.empty() ) {
+        group = new _job_group_t( (uint32_t)tp->groups.size() );
+        tp->groups.push_back( group );
+    } else {
+        group = tp->groups[ tp->freeGroups.back() ];
+        tp->freeGroups.pop_back();
+    }
+
+    // A fresh handle per use, so a stale handle can't find the group's next occupant
+    group->reuses++;
+    group->remaining.store( count, std::memory_order_relaxed );
+    group->signaled = false;
+    group->released = false;
+    group->freed    = false;
+    group->handle   = (job_group_t)group->reuses << 32 | group->slot;
+
+    return group;
+}
+
+
+static _job_group_t* _findJobGroup( _thread_pool_t* tp, job_group_t handle )
+{
+    uint32_t slot = uint32_t( handle & 0xFFFFFFFF );
+
+    SpinLockGuard lock( tp->spinLock );
+
+    if ( slot >= tp->groups.size() || tp->groups[ slot ]->handle != handle )
+        return nullptr;
+
+    return tp->groups[ slot ];
+}
+
+
+// Retire count jobs of the group; whoever retires the last one wakes the waiter.
+// Only that caller takes the lock, so finishing a job is normally a single atomic decrement.
+static void _signalJobGroup( _thread_pool_t* tp, _job_group_t* group, uint32_t count )
+{
+    if ( group->remaining.fetch_sub( count, std::memory_order_acq_rel ) == count ) {
+        bool freeGroup;
+        {
+            std::lock_guard<std::mutex> lock( group->mutex );
+            group->signaled = true;
+            group->done.notify_all();
+            freeGroup     = group->released && !group->freed;
+            group->freed |= freeGroup;
+        }
+
+        // Nobody is waiting for a released group, so its last job frees it
+        if ( freeGroup ) {
+            _freeJobGroup( tp, group );
+        }
+    }
+}
+
+
+static void _freeJobGroup( _thread_pool_t* tp, _job_group_t* group )
+{
+    SpinLockGuard lock( tp->spinLock );
+
+    group->handle = INVALID_JOB_GROUP;
+    tp->freeGroups.push_back( group->slot );
+}
+
+
+static result _waitForJobGroup( _thread_pool_t* tp, job_group_t handle, uint32_t timeout_ms )
+{
+    _job_group_t* group = _findJobGroup( tp, handle );
+
+    if ( !group )
+        return R_INVALID_ARG;
+
+    // Short jobs often finish within a few microseconds; catch those without a trip through the kernel
+    for ( uint32_t i = 0; i < WAIT_SPIN_COUNT && group->remaining.load( std::memory_order_acquire ) != 0; i++ ) {
+        ;
+    }
+
+    bool freeGroup;
+    {
+        // Always wait for signaled under the mutex, even if remaining is already 0:
+        // the worker that retired the last job may not have released the group yet
+        std::unique_lock<std::mutex> lock( group->mutex );
+
+        if ( timeout_ms == INFINITE_TIMEOUT ) {
+            group->done.wait( lock, [ group ]() { return group->signaled; } );
+        } else if ( !group->done.wait_for( lock, std::chrono::milliseconds( timeout_ms ), [ group ]() { return group->signaled; } ) ) {
+            return R_TIMEOUT;
+        }
+
+        // Several threads may wait for the same group; only the first to wake frees it
+        freeGroup    = !group->freed;
+        group->freed = true;
+    }
+
+    if ( freeGroup ) {
+        _freeJobGroup( tp, group );
+    }
+
+    return R_OK;
+}
+
+
+//
+// Work stealing
+//
+
+// Jobs are recycled through the pool's free list; only a submission that outruns every finished job allocates
+static void _allocJobs( _thread_pool_t* tp, Job** jobs, size_t numJobs )
+{
+    size_t reused = 0;
+    {
+        SpinLockGuard lock( tp->jobLock );
+
+        reused = std::min( numJobs, tp->freeJobs.size() );
+        std::copy( tp->freeJobs.end() - reused, tp->freeJobs.end(), jobs );
+        tp->freeJobs.resize( tp->freeJobs.size() - reused );
+    }
+
+    for ( size_t i = reused; i < numJobs; i++ ) {
+        jobs[ i ] = new Job;
+    }
+}
+
+
+static void _freeJob( _thread_pool_t* tp, Job* job )
+{
+    SpinLockGuard lock( tp->jobLock );
+    tp->freeJobs.push_back( job );
+}
+
+
+static void _pushStealingJob( _thread_pool_t* tp, Job* job )
+{
+    _thread_t* self = s_currentThread;
+
+    if ( self && self->hPool == tp->hPool ) {
+        // Submitted from one of our workers: keep it local, where it's likely to find a warm cache
+        tp->workerQueues[ self->tid ].deque.push( job );
+    } else {
+        // Only the owner may push to a deque, so hand it to a worker's inbox
+        uint32_t         target = tp->nextInbox++ % tp->numThreads;
+        _worker_queue_t* wq     = &tp->workerQueues[ target ];
+
+        SpinLockGuard lock( wq->inboxLock );
+        wq->inbox.push_back( job );
+    }
+
+    _wakeStealingWorkers( tp, 1 );
+}
+
+
+static void _pushStealingJobs( _thread_pool_t* tp, Job** jobs, size_t numJobs )
+{
+    _thread_t* self = s_currentThread;
+
+    if ( self && self->hPool == tp->hPool ) {
+        for ( size_t i = 0; i < numJobs; i++ ) {
+            tp->workerQueues[ self->tid ].deque.push( jobs[ i ] );
+        }
+    } else {
+        // Deal the batch out in contiguous slices, one inbox lock per worker rather than per job
+        uint32_t numThreads = tp->numThreads;
+        uint32_t first      = tp->nextInbox++;
+        size_t   sliceSize  = ( numJobs + numThreads - 1 ) / numThreads;
+
+        for ( size_t offset = 0, i = 0; offset < numJobs; offset += sliceSize, i++ ) {
+            _worker_queue_t* wq  = &tp->workerQueues[ ( first + i ) % numThreads ];
+            size_t           end = std::min( offset + sliceSize, numJobs );
+
+            SpinLockGuard lock( wq->inboxLock );
+            wq->inbox.insert( wq->inbox.end(), jobs + offset, jobs + end );
+        }
+    }
+
+    _wakeStealingWorkers( tp, numJobs );
+}
+
+
+static void _wakeStealingWorkers( _thread_pool_t* tp, size_t numJobs )
+{
+    // Pairs with the sleepers/pending handshake in _parkStealingWorker(): either we see the sleeper
+    // and wake it, or it sees these jobs before it waits
+    tp->pending.fetch_add( (int64_t)numJobs, std::memory_order_seq_cst );
+    if ( tp->sleepers.load( std::memory_order_seq_cst ) > 0 ) {
+        std::lock_guard<std::mutex> lock( tp->parkMutex );
+        if ( numJobs == 1 ) {
+            tp->parkCondition.notify_one();
+        } else {
+            tp->parkCondition.notify_all();
+        }
+    }
+}
+
+
+static bool _findStealingJob( _thread_pool_t* tp, _thread_t* thread, Job** p_job )
+{
+    uint32_t         numThreads = tp->numThreads;
+    _worker_queue_t* own        = &tp->workerQueues[ thread->tid ];
+
+    // Local work first
+    bool found = own->deque.pop( p_job );
+
+    // Then move our inbox into the deque, where the other workers can steal from it
+    if ( !found ) {
+        own->inboxLock.lock();
+        for ( Job* job : own->inbox ) {
+            own->deque.push( job );
+        }
+        own->inbox.clear();
+        own->inboxLock.release();
+
+        found = own->deque.pop( p_job );
+    }
+
+    // Then steal, sweeping every other worker starting from a random one
+    if ( !found && numThreads > 1 ) {
+        own->victimSeed ^= own->victimSeed << 13;
+        own->victimSeed ^= own->victimSeed >> 17;
+        own->victimSeed ^= own->victimSeed << 5;
+
+        uint32_t start = own->victimSeed % numThreads;
+        for ( uint32_t i = 0; i < numThreads && !found; i++ ) {
+            uint32_t victim = ( start + i ) % numThreads;
+            if ( victim == thread->tid )
+                continue;
+
+            _worker_queue_t* wq = &tp->workerQueues[ victim ];
+            found               = wq->deque.steal( p_job );
+
+            // A busy victim may not have drained its inbox yet
+            if ( !found ) {
+                SpinLockGuard lock( wq->inboxLock );
+                if ( !wq->inbox.empty() ) {
+                    *p_job = wq->inbox.front();
+                    wq->inbox.pop_front();
+                    found = true;
+                }
+            }
+        }
+
+        if ( found ) {
+            thread->jobsStolen++;
+        }
+    }
+
+    if ( found ) {
+        tp->pending.fetch_sub( 1, std::memory_order_relaxed );
+    }
+
+    return found;
+}
+
+
+static void _parkStealingWorker( _thread_pool_t* tp, _thread_t* thread )
+{
+    std::unique_lock<std::mutex> lock( tp->parkMutex );
+
+    tp->sleepers.fetch_add( 1, std::memory_order_seq_cst );
+    tp->parkCondition.wait( lock, [ tp, thread ]() { return tp->pending.load( std::memory_order_seq_cst ) > 0 || thread->shouldExit; } );
+    tp->sleepers.fetch_sub( 1, std::memory_order_relaxed );
 }
 
 
@@ -6,8 +6,10 @@
 
 #include "result.h"
 
-#include <functional>
+#include <new>
 #include <stdint.h>
+#include <stdio.h>
+#include <type_traits>
 
 namespace pk
 {
@@ -21,6 +23,7 @@ typedef uint64_t job_group_t;
 #define INVALID_JOB ( job_t( -1 ) )
 #define INVALID_JOB_GROUP ( job_group_t( -1 ) )
 #define INFINITE_TIMEOUT ( uint32_t( -1 ) )
+#define INVALID_WORKER ( uint32_t( -1 ) )
 
 //
 // All jobs, whether object methods or naked functions, must conform to this signature:
@@ -33,26 +36,53 @@ typedef bool ( *jobFunction )( void* context, uint32_t tid );
 //
 // threadPoolSubmitJob( Function( func, context ) );
 // threadPoolSubmitJOb( Method( this, method, context ) );
+// threadPoolSubmitJob( Lambda( [ = ]( uint32_t tid ) { ...; return true; } ) );
 //
+// An Invokable is the job record itself: a trampoline plus the callable, stored inline. It's trivially copyable
+// and never allocates, so building, submitting and queuing a job is a handful of plain copies. A lambda must be
+// trivially copyable too (capture pointers and values, not std::vector or std::string) and fit in
+// JOB_INLINE_SIZE bytes; capture a pointer to a bigger context instead.
+//
+#define JOB_INLINE_SIZE 48 // keeps an Invokable to one cache line
+
 class Invokable {
 public:
-    Invokable()
+    Invokable() :
+        trampoline( nullptr )
     {
-        functor = nullptr;
     }
 
     bool invoke( uint32_t tid )
     {
-        if ( functor )
-            return functor( context, tid );
+        if ( trampoline )
+            return trampoline( storage, tid );
         else {
-            printf( "WARN: null Job.functor\n" );
+            printf( "WARN: null Job.trampoline\n" );
             return false;
         }
     }
 
-    std::function<bool( void*, uint32_t )> functor;
-    void*                                  context;
+protected:
+    template<typename CALLABLE>
+    void store( const CALLABLE& callable )
+    {
+        static_assert( sizeof( CALLABLE ) <= JOB_INLINE_SIZE, "job callable is too big for Invokable; capture a pointer to its state" );
+        static_assert( alignof( CALLABLE ) <= 16, "job callable is over-aligned for Invokable" );
+        static_assert( std::is_trivially_copyable<CALLABLE>::value, "job callable must be trivially copyable" );
+
+        new ( storage ) CALLABLE( callable );
+        trampoline = &_call<CALLABLE>;
+    }
+
+private:
+    template<typename CALLABLE>
+    static bool _call( const void* storage, uint32_t tid )
+    {
+        return ( *(const CALLABLE*)storage )( tid );
+    }
+
+    bool ( *trampoline )( const void* storage, uint32_t tid );
+    alignas( 16 ) uint8_t storage[ JOB_INLINE_SIZE ];
 };
 
 
@@ -60,8 +90,7 @@ class Function : public Invokable {
 public:
     Function( jobFunction function, void* ctx )
     {
-        functor = std::bind( function, std::placeholders::_1, std::placeholders::_2 );
-        context = ctx;
+        store( [ function, ctx ]( uint32_t tid ) { return function( ctx, tid ); } );
     }
 };
 
@@ -71,8 +100,7 @@ class _Method : public Invokable {
 public:
     _Method( TYPE* object, bool ( TYPE::*method )( void*, uint32_t ), void* ctx )
     {
-        functor = std::bind( method, object, std::placeholders::_1, std::placeholders::_2 );
-        context = ctx;
+        store( [ object, method, ctx ]( uint32_t tid ) { return ( object->*method )( ctx, tid ); } );
     }
 };
 
@@ -85,19 +113,67 @@ _Method<TYPE> Method( TYPE* object, bool ( TYPE::*method )( void*, uint32_t ), v
 }
 
 
+// Any callable taking ( uint32_t tid ) and returning bool
+template<class CALLABLE>
+class _Lambda : public Invokable {
+public:
+    _Lambda( const CALLABLE& callable )
+    {
+        store( callable );
+    }
+};
+
+template<typename CALLABLE>
+_Lambda<CALLABLE> Lambda( const CALLABLE& callable )
+{
+    return _Lambda<CALLABLE>( callable );
+}
+
+
 typedef enum {
     THREAD_POOL_SUBMIT_BLOCKING    = 0,
     THREAD_POOL_SUBMIT_NONBLOCKING = 1,
 } thread_pool_blocking_t;
 
 
-thread_pool_t threadPoolCreate( uint32_t numThreads );
+//
+// THREAD_POOL_SHARED_QUEUE:  every worker receives from one shared queue. Simple, FIFO, but all workers contend on its lock.
+// THREAD_POOL_WORK_STEALING: every worker owns a Chase-Lev deque. Jobs submitted from a worker go to its own deque,
+//                            jobs submitted from outside are dealt round-robin to the workers, and idle workers steal
+//                            from random victims. Scales better with many threads and small jobs; no ordering guarantee.
+//
+typedef enum {
+    THREAD_POOL_SHARED_QUEUE  = 0,
+    THREAD_POOL_WORK_STEALING = 1,
+} thread_pool_mode_t;
+
+
+//
+// threadPoolSubmitJobs() queues a batch of jobs as one group, taking the queue lock once rather than once per job.
+// threadPoolWaitForJobs() blocks until every job in the group has finished, then releases the group.
+// threadPoolReleaseJobs() is for groups nobody will wait for: the jobs still run, and the last one frees the group.
+// Every job_t and job_group_t must be waited for or released; otherwise its group is never reused.
+// threadPoolWorkerIndex() is the calling thread's index among the pool's workers, or INVALID_WORKER from outside it.
+//
+thread_pool_t threadPoolCreate( uint32_t numThreads, thread_pool_mode_t mode = THREAD_POOL_SHARED_QUEUE );
 job_t         threadPoolSubmitJob( const Invokable& job, thread_pool_t pool = DEFAULT_THREAD_POOL, thread_pool_blocking_t blocking = THREAD_POOL_SUBMIT_BLOCKING );
 job_group_t   threadPoolSubmitJobs( const Invokable* jobs, size_t numJobs, thread_pool_t pool = DEFAULT_THREAD_POOL, thread_pool_blocking_t blocking = THREAD_POOL_SUBMIT_BLOCKING );
 result        threadPoolWaitForJob( job_t, uint32_t timeout_ms = INFINITE_TIMEOUT, thread_pool_t pool = DEFAULT_THREAD_POOL );
 result        threadPoolWaitForJobs( job_group_t, uint32_t timeout_ms = INFINITE_TIMEOUT, thread_pool_t pool = DEFAULT_THREAD_POOL );
+result        threadPoolReleaseJobs( job_group_t, thread_pool_t pool = DEFAULT_THREAD_POOL );
+uint32_t      threadPoolWorkerIndex( thread_pool_t pool = DEFAULT_THREAD_POOL );
 bool          threadPoolDestroy( thread_pool_t pool );
+const char*   threadPoolModeName( thread_pool_mode_t mode );
+
+// Submit a lambda without wrapping it first: threadPoolSubmit( [ = ]( uint32_t tid ) { ...; return true; }, pool );
+template<typename CALLABLE>
+job_t threadPoolSubmit( const CALLABLE& callable, thread_pool_t pool = DEFAULT_THREAD_POOL, thread_pool_blocking_t blocking = THREAD_POOL_SUBMIT_BLOCKING )
+{
+    return threadPoolSubmitJob( Lambda( callable ), pool, blocking );
+}
 
 void testThreadPool();
+void benchmarkThreadPoolLatency();
+void benchmarkThreadPoolThroughput();
 
 } // namespace pk
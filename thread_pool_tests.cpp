@@ -2,11 +2,16 @@
 #include "thread_pool.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <stdint.h>
 #include <stdio.h>
 #include <thread>
+#include <vector>
 
 
 namespace pk
@@ -21,7 +26,6 @@ struct TestContext {
     int*         array2;
     unsigned int offset;
     unsigned int blockSize;
-    job_t        handle;
 };
 
 
@@ -97,9 +101,9 @@ bool _job( void* context, uint32_t tid )
 }
 
 
-void testThreadPool()
+static void _testThreadPool( thread_pool_mode_t mode )
 {
-    std::cout << "test thread: " << std::this_thread::get_id() << std::endl;
+    std::cout << "test thread: " << std::this_thread::get_id() << " mode: " << threadPoolModeName( mode ) << std::endl;
 
     enum test_case_t : uint8_t {
         TEST_FUNCTION,
@@ -117,22 +121,24 @@ void testThreadPool()
     int        numBlocks   = numElements / blockSize;
     TestObject obj;
 
-    thread_pool_t tp = threadPoolCreate( numThreads );
+    thread_pool_t tp = threadPoolCreate( numThreads, mode );
 
     int* array1 = new int[ numElements ];
     int* array2 = new int[ numElements ];
 
-    for ( int i = 0; i < ARRAY_SIZE( array1 ); i++ ) {
+    for ( int i = 0; i < numElements; i++ ) {
         array1[ i ] = i;
     }
 
-    for ( int i = 0; i < ARRAY_SIZE( array2 ); i++ ) {
-        array2[ i ] = -1;
-    }
-
-    TestContext* jobs = (TestContext*)new uint8_t[ sizeof( TestContext ) * numBlocks ];
+    TestContext* jobs       = (TestContext*)new uint8_t[ sizeof( TestContext ) * numBlocks ];
+    Invokable*   invokables = new Invokable[ numBlocks ];
 
     for ( uint8_t test = TEST_FUNCTION; test < TEST_MAX; test++ ) {
+        // Every block must run, so reset the output between tests
+        for ( int i = 0; i < numElements; i++ ) {
+            array2[ i ] = -1;
+        }
+
         printf( "[%d] Submitting %d jobs\n", test, numBlocks );
 
         PerfTimer timer;
@@ -145,56 +151,306 @@ void testThreadPool()
 
             switch ( test ) {
                 case TEST_FUNCTION:
-                    jobs[ i ].handle = threadPoolSubmitJob( Function( _job, &jobs[ i ] ) );
+                    invokables[ i ] = Function( _job, &jobs[ i ] );
                     break;
 
                 case TEST_STATIC_METHOD:
-                    jobs[ i ].handle = threadPoolSubmitJob( Function( TestObject::static_method, &jobs[ i ] ) );
+                    invokables[ i ] = Function( TestObject::static_method, &jobs[ i ] );
                     break;
 
                 case TEST_METHOD_1:
-                    jobs[ i ].handle = threadPoolSubmitJob( Method( &obj, &TestObject::method1, &jobs[ i ]) );
+                    invokables[ i ] = Method( &obj, &TestObject::method1, &jobs[ i ] );
                     break;
 
                 case TEST_METHOD_2:
-                    jobs[ i ].handle = threadPoolSubmitJob( Method( &obj, &TestObject::method2, &jobs[ i ]) );
+                    invokables[ i ] = Method( &obj, &TestObject::method2, &jobs[ i ] );
                     break;
 
                 case TEST_METHOD_3:
-                    jobs[ i ].handle = threadPoolSubmitJob( Method( &obj, &TestObject::method3, &jobs[ i ]) );
+                    invokables[ i ] = Method( &obj, &TestObject::method3, &jobs[ i ] );
                     break;
 
                 default:
                     assert( 0 );
                     break;
             }
-
-            printf( "." );
         }
 
-        printf( "\nSubmitted %d jobs in %f msec\n", numBlocks, timer.ElapsedMilliseconds() );
+        job_group_t group = threadPoolSubmitJobs( invokables, numBlocks, tp );
+        printf( "Submitted %d jobs in %f msec\n", numBlocks, timer.ElapsedMilliseconds() );
+        assert( group != INVALID_JOB_GROUP );
 
         printf( "[%d] Waiting for %d jobs\n", test, numBlocks );
         timer.Reset();
-        for ( int i = 0; i < numBlocks; i++ ) {
-            threadPoolWaitForJob( jobs[ i ].handle, 5000, tp );
-            printf( "." );
-        }
+        result rval = threadPoolWaitForJobs( group, 5000, tp );
         printf( " %f msec\n", timer.ElapsedMilliseconds() );
+        assert( rval == R_OK );
 
         int error = 0;
-        for ( int i = 0; i < ARRAY_SIZE( array2 ); i++ ) {
+        for ( int i = 0; i < numElements; i++ ) {
             error += array2[ i ] - ( array1[ i ] * 2 );
         }
         assert( error == 0 );
     }
 
+    // Two threads waiting for one job must free its group once; freed twice, the next two groups would share its
+    // slot and waiting for the first would fail. The job holds off until both waiters are parked on it.
+    for ( int round = 0; round < 10; round++ ) {
+        std::atomic<bool> gate( false );
+        std::atomic<bool>* p_gate = &gate;
+
+        job_t  shared = threadPoolSubmit( [ = ]( uint32_t tid ) { while ( !p_gate->load() ) std::this_thread::yield(); return true; }, tp );
+        result rvals[ 2 ];
+
+        std::thread waiters[ 2 ];
+        for ( int w = 0; w < 2; w++ ) {
+            result* p_rval = &rvals[ w ];
+            waiters[ w ]   = std::thread( [ = ]() { *p_rval = threadPoolWaitForJob( shared, INFINITE_TIMEOUT, tp ); } );
+        }
+
+        PerfTimer::DelayMS( 10 );
+        gate = true;
+        for ( std::thread& w : waiters ) {
+            w.join();
+        }
+        assert( rvals[ 0 ] == R_OK && rvals[ 1 ] == R_OK );
+
+        job_group_t first  = threadPoolSubmitJobs( &invokables[ 0 ], 1, tp );
+        job_group_t second = threadPoolSubmitJobs( &invokables[ 1 ], 1, tp );
+        result      rval1  = threadPoolWaitForJobs( first, 5000, tp );
+        result      rval2  = threadPoolWaitForJobs( second, 5000, tp );
+        assert( rval1 == R_OK && rval2 == R_OK );
+    }
+
     threadPoolDestroy( tp );
 
+    delete[] invokables;
     delete[] jobs;
     delete[] array1;
     delete[] array2;
 }
 
 
+void testThreadPool()
+{
+    _testThreadPool( THREAD_POOL_SHARED_QUEUE );
+    _testThreadPool( THREAD_POOL_WORK_STEALING );
+}
+
+
+//
+// Wake latency: how long an idle pool takes to start a job (dispatch), and how long a waiter takes to notice
+// that it finished (wake). Every round sleeps first so the workers are parked, which is the worst case.
+//
+
+static const int    LATENCY_ROUNDS    = 1000;
+static const double LATENCY_TARGET_US = 100.0;
+
+struct LatencyContext {
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point finished;
+};
+
+
+static bool _latencyJob( void* context, uint32_t tid )
+{
+    LatencyContext* ctx = (LatencyContext*)context;
+
+    ctx->started  = std::chrono::steady_clock::now();
+    ctx->finished = std::chrono::steady_clock::now();
+
+    return true;
+}
+
+
+static double _percentile( std::vector<double>& samples, double p )
+{
+    std::sort( samples.begin(), samples.end() );
+    return samples[ size_t( p * ( samples.size() - 1 ) ) ];
+}
+
+
+static void _benchmarkLatency( thread_pool_mode_t mode )
+{
+    int           numThreads = std::max( 1, (int)std::thread::hardware_concurrency() - 1 );
+    thread_pool_t tp         = threadPoolCreate( numThreads, mode );
+
+    std::vector<double> dispatch;
+    std::vector<double> wake;
+
+    for ( int i = 0; i < LATENCY_ROUNDS; i++ ) {
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+
+        LatencyContext                        ctx;
+        std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+
+        job_t job = threadPoolSubmitJob( Function( _latencyJob, &ctx ), tp );
+        threadPoolWaitForJob( job, INFINITE_TIMEOUT, tp );
+
+        std::chrono::steady_clock::time_point woke = std::chrono::steady_clock::now();
+
+        dispatch.push_back( std::chrono::duration<double, std::micro>( ctx.started - submitted ).count() );
+        wake.push_back( std::chrono::duration<double, std::micro>( woke - ctx.finished ).count() );
+    }
+
+    threadPoolDestroy( tp );
+
+    double dispatchMedian = _percentile( dispatch, 0.5 );
+    double wakeMedian     = _percentile( wake, 0.5 );
+
+    printf( "%-14s %10s %10s %10s\n", threadPoolModeName( mode ), "median us", "p99 us", "max us" );
+    printf( "%-14s %10.1f %10.1f %10.1f\n", "dispatch", dispatchMedian, _percentile( dispatch, 0.99 ), dispatch.back() );
+    printf( "%-14s %10.1f %10.1f %10.1f\n", "wake", wakeMedian, _percentile( wake, 0.99 ), wake.back() );
+
+    if ( dispatchMedian > LATENCY_TARGET_US || wakeMedian > LATENCY_TARGET_US ) {
+        printf( "WARN: median latency exceeds %.0f us target\n", LATENCY_TARGET_US );
+    }
+}
+
+
+void benchmarkThreadPoolLatency()
+{
+    _benchmarkLatency( THREAD_POOL_SHARED_QUEUE );
+    _benchmarkLatency( THREAD_POOL_WORK_STEALING );
+}
+
+
+//
+// Job throughput: jobs per second for jobs that do next to nothing, so the cost is building, copying and dispatching
+// the job record. The record rows replay, on one thread, the copies a job goes through on its way to a worker
+// (Invokable, Job, into and out of the queue ring), once with the inline record and once with the std::bind-built
+// std::function the pool used before. The pool rows run the real thing end to end.
+//
+
+static const int THROUGHPUT_JOBS  = 1 << 20;
+static const int THROUGHPUT_BATCH = 256;
+
+// The job record before Invokable stored its callable inline
+struct LegacyJob {
+    std::function<bool( void*, uint32_t )> functor;
+    void*                                  context;
+};
+
+
+class CountObject {
+public:
+    bool count( void* context, uint32_t tid )
+    {
+        ( (std::atomic<uint32_t>*)context )->fetch_add( 1, std::memory_order_relaxed );
+        return true;
+    }
+};
+
+
+static bool _countJob( void* context, uint32_t tid )
+{
+    ( (std::atomic<uint32_t>*)context )->fetch_add( 1, std::memory_order_relaxed );
+    return true;
+}
+
+
+static double _recordThroughput( bool method, bool legacy )
+{
+    std::atomic<uint32_t>  count( 0 );
+    CountObject            obj;
+    std::vector<LegacyJob> legacyRing( THROUGHPUT_BATCH );
+    std::vector<Invokable> ring( THROUGHPUT_BATCH );
+
+    PerfTimer timer;
+
+    for ( int i = 0; i < THROUGHPUT_JOBS; i++ ) {
+        if ( legacy ) {
+            LegacyJob invokable;
+            if ( method ) {
+                invokable.functor = std::bind( &CountObject::count, &obj, std::placeholders::_1, std::placeholders::_2 );
+            } else {
+                invokable.functor = std::bind( _countJob, std::placeholders::_1, std::placeholders::_2 );
+            }
+            invokable.context = &count;
+
+            LegacyJob job                      = invokable;
+            legacyRing[ i % THROUGHPUT_BATCH ] = job;
+            LegacyJob received                 = legacyRing[ i % THROUGHPUT_BATCH ];
+            received.functor( received.context, 0 );
+        } else {
+            Invokable invokable;
+            if ( method ) {
+                invokable = Method( &obj, &CountObject::count, &count );
+            } else {
+                invokable = Function( _countJob, &count );
+            }
+
+            Invokable job                = invokable;
+            ring[ i % THROUGHPUT_BATCH ] = job;
+            Invokable received           = ring[ i % THROUGHPUT_BATCH ];
+            received.invoke( 0 );
+        }
+    }
+
+    double seconds = timer.ElapsedSeconds();
+    assert( count == THROUGHPUT_JOBS );
+
+    return THROUGHPUT_JOBS / seconds;
+}
+
+
+static double _poolThroughput( thread_pool_t tp, bool lambda )
+{
+    std::atomic<uint32_t>  count( 0 );
+    std::atomic<uint32_t>* counter = &count;
+    std::vector<Invokable> batch( THROUGHPUT_BATCH );
+
+    PerfTimer timer;
+
+    if ( lambda ) {
+        // One threadPoolSubmit() per job, released rather than waited for, so each job pays for its own group
+        for ( int i = 0; i < THROUGHPUT_JOBS; i++ ) {
+            auto countJob = [ counter ]( uint32_t tid ) {
+                counter->fetch_add( 1, std::memory_order_relaxed );
+                return true;
+            };
+
+            job_t job = threadPoolSubmit( countJob, tp );
+            threadPoolReleaseJobs( job, tp );
+        }
+        while ( count.load( std::memory_order_relaxed ) < THROUGHPUT_JOBS ) {
+            std::this_thread::yield();
+        }
+    } else {
+        for ( int i = 0; i < THROUGHPUT_JOBS; i += THROUGHPUT_BATCH ) {
+            for ( int j = 0; j < THROUGHPUT_BATCH; j++ ) {
+                batch[ j ] = Function( _countJob, &count );
+            }
+            job_group_t group = threadPoolSubmitJobs( batch.data(), THROUGHPUT_BATCH, tp );
+            threadPoolWaitForJobs( group, INFINITE_TIMEOUT, tp );
+        }
+    }
+
+    double seconds = timer.ElapsedSeconds();
+    assert( count == THROUGHPUT_JOBS );
+
+    return THROUGHPUT_JOBS / seconds;
+}
+
+
+void benchmarkThreadPoolThroughput()
+{
+    printf( "%-36s %14s %14s\n", "record copies (1 thread)", "inline jobs/s", "std::function" );
+    printf( "%-36s %14.0f %14.0f\n", "Function", _recordThroughput( false, false ), _recordThroughput( false, true ) );
+    printf( "%-36s %14.0f %14.0f\n", "Method", _recordThroughput( true, false ), _recordThroughput( true, true ) );
+
+    int numThreads = std::max( 1, (int)std::thread::hardware_concurrency() - 1 );
+
+    printf( "%-36s %14s\n", "pool", "jobs/s" );
+    for ( thread_pool_mode_t mode : { THREAD_POOL_SHARED_QUEUE, THREAD_POOL_WORK_STEALING } ) {
+        thread_pool_t tp = threadPoolCreate( numThreads, mode );
+
+        printf( "%-14s %-21s %14.0f\n", threadPoolModeName( mode ), "Function batches", _poolThroughput( tp, false ) );
+        printf( "%-14s %-21s %14.0f\n", threadPoolModeName( mode ), "threadPoolSubmit", _poolThroughput( tp, true ) );
+
+        threadPoolDestroy( tp );
+    }
+}
+
+
 } // namespace pk
@@ -3,7 +3,6 @@
 
 #include <chrono>
 #include <iostream>
-#include <random>
 #include <thread>
 
 #ifdef USE_CUDA
@@ -23,15 +22,12 @@
 
 namespace pk
 {
-static std::random_device                    _rd;
-static std::mt19937                          _gen( _rd() );
-static std::uniform_real_distribution<float> _random( 0.0f, 1.0f );
+static thread_local rng_t s_rng;       // host: one generator per render thread
+__device__ rng_t*         d_rngStates; // device: one generator per CUDA thread, see randomSetDeviceStates()
 
-__device__ float xorrand( uint32_t seed );
-__device__ uint32_t wanghash( uint32_t seed );
-__device__ float drand48( const vector3& v );
-__device__ float cudarand();
-__device__ float cudarand2();
+__device__ float  drand48( const vector3& v );
+__device__ float  cudarand2();
+__device__ rng_t* _deviceRng();
 
 
 bool delay( size_t ms )
@@ -62,15 +58,38 @@ result threadSetName(const char* name)
 
 
 
+__device__ __host__ void randomSeed( uint32_t seed, uint32_t pixel, uint32_t sample )
+{
+#ifdef __CUDA_ARCH__
+    rngSeed( _deviceRng(), seed, pixel, sample );
+#else
+    rngSeed( &s_rng, seed, pixel, sample );
+#endif
+}
+
+__device__ __host__ void randomBounce( uint32_t bounce )
+{
+#ifdef __CUDA_ARCH__
+    rngBounce( _deviceRng(), bounce );
+#else
+    rngBounce( &s_rng, bounce );
+#endif
+}
+
 __device__ __host__ float random()
 {
 #ifdef __CUDA_ARCH__
-    return cudarand();
+    return rngFloat( _deviceRng() );
 #else
-    return _random( _gen );
+    return rngFloat( &s_rng );
 #endif
 }
 
+void randomSetDeviceStates( rng_t* states )
+{
+    CHECK_CUDA( cudaMemcpyToSymbol( d_rngStates, &states, sizeof( states ) ) );
+}
+
 __device__ __host__ vector3 randomInUnitSphere()
 {
     vector3      point;
@@ -108,38 +127,13 @@ __device__ float         drand48( const vector3& v )
     return rval;
 }
 
-__device__ float xorrand( uint32_t seed )
+__device__ rng_t* _deviceRng()
 {
-    // Xorshift algorithm from George Marsaglia's paper
-    seed ^= ( seed << 13 );
-    seed ^= ( seed >> 17 );
-    seed ^= ( seed << 5 );
-
-    return seed;
-}
-
-__device__ uint32_t wanghash( uint32_t seed )
-{
-    seed = ( seed ^ 61 ) ^ ( seed >> 16 );
-    seed *= 9;
-    seed = seed ^ ( seed >> 4 );
-    seed *= 0x27d4eb2d;
-    seed = seed ^ ( seed >> 15 );
-    return seed;
-}
-
-__device__ float cudarand()
-{
-    unsigned x = blockIdx.x * blockDim.x + threadIdx.x;
-    unsigned y = blockIdx.y * blockDim.y + threadIdx.y;
-
-    uint32_t seed;
-    seed = wanghash( x + y * clock() );
-    seed = xorrand( seed );
+    // Linear index of this thread within the whole 2D launch
+    unsigned block  = blockIdx.y * gridDim.x + blockIdx.x;
+    unsigned thread = threadIdx.y * blockDim.x + threadIdx.x;
 
-    // Generate a random float in [0, 1)...
-    float f = float( seed ) * ( 1.0 / 4294967296.0 );
-    return f;
+    return &d_rngStates[ block * ( blockDim.x * blockDim.y ) + thread ];
 }
 
 __device__ float cudarand2()
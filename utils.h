@@ -1,6 +1,7 @@
 #pragma once
 
 #include "result.h"
+#include "rng.h"
 #include "vector_cuda.h"
 
 #include <cuda_runtime.h>
@@ -103,8 +104,14 @@ result threadSetName( const char* name );
     }
 
 
-__host__ __device__ float random();
+// random() draws from the calling thread's own rng_t; reseed it for every sample and bounce
+__host__ __device__ void    randomSeed( uint32_t seed, uint32_t pixel, uint32_t sample );
+__host__ __device__ void    randomBounce( uint32_t bounce );
+__host__ __device__ float   random();
 __host__ __device__ vector3 randomInUnitSphere();
 __host__ __device__ vector3 randomOnUnitDisk();
 
+// CUDA threads can't have thread_local state; give the device one rng_t per thread of the launch
+void randomSetDeviceStates( rng_t* states );
+
 } // namespace pk
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+#include <stdint.h>
+#include <type_traits>
+#include <vector>
+
+//
+// Chase-Lev work-stealing deque (Le, Pop, Cohen, Zappa Nardelli: "Correct and Efficient Work-Stealing for Weak Memory Models").
+//
+// The owning thread pushes and pops at the bottom without locking; any other thread may steal from the top.
+// Elements must be trivially copyable (e.g. pointers). The array grows on demand; retired arrays are kept
+// until the deque is destroyed, since a thief may still be reading from one.
+//
+
+namespace pk
+{
+
+template<class TYPE>
+class WorkStealingDeque {
+public:
+    WorkStealingDeque( uint32_t capacity = 256 );
+    ~WorkStealingDeque();
+
+    // Owner thread only
+    void push( TYPE item );
+    bool pop( TYPE* p_item );
+
+    // Any thread
+    bool   steal( TYPE* p_item );
+    size_t size() const;
+
+private:
+    typedef struct _array {
+        int64_t            capacity;
+        int64_t            mask;
+        std::atomic<TYPE>* items;
+
+        TYPE get( int64_t i ) const { return items[ i & mask ].load( std::memory_order_relaxed ); }
+        void put( int64_t i, TYPE item ) { items[ i & mask ].store( item, std::memory_order_relaxed ); }
+    } _array_t;
+
+    static_assert( std::is_trivially_copyable<TYPE>::value, "WorkStealingDeque elements must be trivially copyable" );
+
+    // Keep top and bottom on separate cache lines; thieves hammer top, the owner hammers bottom.
+    // Padded rather than alignas() so heap-allocated deques don't need C++17 aligned new.
+    std::atomic<int64_t>   _top;
+    uint8_t                _pad0[ 64 - sizeof( std::atomic<int64_t> ) ];
+    std::atomic<int64_t>   _bottom;
+    uint8_t                _pad1[ 64 - sizeof( std::atomic<int64_t> ) ];
+    std::atomic<_array_t*> _array;
+    std::vector<_array_t*> _retired;
+
+    static _array_t* _allocate( int64_t capacity );
+    _array_t*        _grow( _array_t* a, int64_t bottom, int64_t top );
+};
+
+
+//
+// Implementation
+//
+
+template<class TYPE>
+WorkStealingDeque<TYPE>::WorkStealingDeque( uint32_t capacity ) :
+    _top( 0 ),
+    _bottom( 0 )
+{
+    // Capacity must be a power of two so indices wrap with a mask
+    int64_t c = 1;
+    while ( c < capacity ) {
+        c <<= 1;
+    }
+
+    _array.store( _allocate( c ), std::memory_order_relaxed );
+}
+
+
+template<class TYPE>
+WorkStealingDeque<TYPE>::~WorkStealingDeque()
+{
+    _retired.push_back( _array.load( std::memory_order_relaxed ) );
+
+    for ( _array_t* a : _retired ) {
+        delete[] a->items;
+        delete a;
+    }
+}
+
+
+template<class TYPE>
+void WorkStealingDeque<TYPE>::push( TYPE item )
+{
+    int64_t   b = _bottom.load( std::memory_order_relaxed );
+    int64_t   t = _top.load( std::memory_order_acquire );
+    _array_t* a = _array.load( std::memory_order_relaxed );
+
+    if ( b - t > a->capacity - 1 ) {
+        a = _grow( a, b, t );
+    }
+
+    a->put( b, item );
+    std::atomic_thread_fence( std::memory_order_release );
+    _bottom.store( b + 1, std::memory_order_relaxed );
+}
+
+
+template<class TYPE>
+bool WorkStealingDeque<TYPE>::pop( TYPE* p_item )
+{
+    assert( p_item );
+
+    int64_t   b = _bottom.load( std::memory_order_relaxed ) - 1;
+    _array_t* a = _array.load( std::memory_order_relaxed );
+    _bottom.store( b, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    int64_t t = _top.load( std::memory_order_relaxed );
+
+    if ( t > b ) {
+        // Empty
+        _bottom.store( b + 1, std::memory_order_relaxed );
+        return false;
+    }
+
+    *p_item = a->get( b );
+    if ( t == b ) {
+        // Last item; race any thief for it
+        bool won = _top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed );
+        _bottom.store( b + 1, std::memory_order_relaxed );
+        return won;
+    }
+
+    return true;
+}
+
+
+template<class TYPE>
+bool WorkStealingDeque<TYPE>::steal( TYPE* p_item )
+{
+    assert( p_item );
+
+    int64_t t = _top.load( std::memory_order_acquire );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    int64_t b = _bottom.load( std::memory_order_acquire );
+
+    if ( t >= b )
+        return false;
+
+    _array_t* a    = _array.load( std::memory_order_acquire );
+    TYPE      item = a->get( t );
+    if ( !_top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed ) ) {
+        // Lost the race to the owner or another thief
+        return false;
+    }
+
+    *p_item = item;
+    return true;
+}
+
+
+template<class TYPE>
+size_t WorkStealingDeque<TYPE>::size() const
+{
+    int64_t b = _bottom.load( std::memory_order_relaxed );
+    int64_t t = _top.load( std::memory_order_relaxed );
+
+    return b > t ? size_t( b - t ) : 0;
+}
+
+
+template<class TYPE>
+typename WorkStealingDeque<TYPE>::_array_t* WorkStealingDeque<TYPE>::_allocate( int64_t capacity )
+{
+    _array_t* a = new _array_t;
+    a->capacity = capacity;
+    a->mask     = capacity - 1;
+    a->items    = new std::atomic<TYPE>[ capacity ];
+
+    return a;
+}
+
+
+template<class TYPE>
+typename WorkStealingDeque<TYPE>::_array_t* WorkStealingDeque<TYPE>::_grow( _array_t* a, int64_t bottom, int64_t top )
+{
+    _array_t* bigger = _allocate( a->capacity * 2 );
+    for ( int64_t i = top; i < bottom; i++ ) {
+        bigger->put( i, a->get( i ) );
+    }
+
+    _retired.push_back( a );
+    _array.store( bigger, std::memory_order_release );
+
+    return bigger;
+}
+
+} // namespace pk